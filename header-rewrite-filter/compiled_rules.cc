@@ -0,0 +1,92 @@
+#include "compiled_rules.h"
+
+#include "source/common/common/logger.h"
+#include "envoy/common/exception.h"
+
+#include "absl/strings/str_cat.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+CompiledRulesFilterConfig::CompiledRulesFilterConfig(
+    const envoy::extensions::filters::http::HeaderRewriteCompiled& proto_config, Stats::Scope& scope)
+    : rules_(findRules(proto_config.rules())),
+      stats_(generateStats(proto_config.stat_prefix().empty()
+                               ? "header_rewrite."
+                               : absl::StrCat("header_rewrite.", proto_config.stat_prefix(), "."),
+                           scope)),
+      log_errors_(proto_config.log_errors()) {
+  resolve(rules_.request(), true, request_);
+  resolve(rules_.response(), false, response_);
+}
+
+CompiledRulesFilterStats CompiledRulesFilterConfig::generateStats(const std::string& prefix, Stats::Scope& scope) {
+  return CompiledRulesFilterStats{ALL_COMPILED_RULES_FILTER_STATS(POOL_COUNTER_PREFIX(scope, prefix))};
+}
+
+const CompiledRulesFactory& CompiledRulesFilterConfig::findRules(const std::string& name) {
+  const CompiledRulesFactory* rules = Registry::FactoryRegistry<CompiledRulesFactory>::getFactory(name);
+  if (rules == nullptr) {
+    throw EnvoyException(absl::StrCat("invalid header rewrite config: no compiled rules named ", name,
+                                      " are linked into Envoy, see header_rewrite_compiled_rules()"));
+  }
+  return *rules;
+}
+
+void CompiledRulesFilterConfig::resolve(const CompiledDirection& compiled, bool is_request, Direction& direction) {
+  for (const std::string& name : compiled.header_slots) {
+    direction.header_slots.add(name);
+  }
+  if (compiled.track_presence) {
+    direction.header_slots.trackPresence();
+  }
+  // the registry is finalized by now, so that the handles are those the header maps use
+  for (const std::string& name : compiled.inline_headers) {
+    const absl::Status status = inline_headers_.add(name);
+    if (!status.ok()) {
+      throw EnvoyException(absl::StrCat("invalid header rewrite config: compiled rules ", rules_.name(), ": ",
+                                        status.message()));
+    }
+    const InlineHeaderHandle* handle = inline_headers_.find(name, is_request);
+    if (handle == nullptr) {
+      throw EnvoyException(absl::StrCat("invalid header rewrite config: compiled rules ", rules_.name(),
+                                        ": inline header \"", name, "\" is not registered for ",
+                                        is_request ? "requests" : "responses"));
+    }
+    direction.inline_headers.push_back(handle);
+  }
+  direction.value_slots = compiled.value_slots;
+}
+
+void CompiledRulesFilterConfig::onExecutionError(ExecutionError error, bool is_request) const {
+  (is_request ? stats_.request_errors_ : stats_.response_errors_).inc();
+  switch (error) {
+    case ExecutionError::HdrPositionOutOfRange:
+    case ExecutionError::HdrPositionNotANumber:
+      stats_.hdr_position_errors_.inc();
+      break;
+    case ExecutionError::UrlpOnResponse:
+      stats_.urlp_errors_.inc();
+      break;
+    case ExecutionError::StreamInfoMissing:
+    case ExecutionError::MetadataKeyEmpty:
+    case ExecutionError::MetadataValueEmpty:
+      stats_.metadata_errors_.inc();
+      break;
+    default:
+      stats_.invalid_function_errors_.inc();
+      break;
+  }
+
+  if (log_errors_) {
+    ENVOY_LOG_PERIODIC_MISC(warn, std::chrono::seconds(1), "error executing an operation on {} side, skipping filter -- {}",
+                            is_request ? "request" : "response", executionErrorMessage(error));
+  }
+}
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -0,0 +1,264 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "execution_context.h"
+#include "header_operations.h"
+#include "header_slots.h"
+#include "inline_headers.h"
+#include "utility.h"
+
+#include "source/extensions/filters/http/common/pass_through_filter.h"
+#include "envoy/config/typed_config.h"
+#include "envoy/registry/registry.h"
+#include "envoy/stats/scope.h"
+#include "envoy/stats/stats_macros.h"
+#include "header-rewrite-filter/header_rewrite.pb.h"
+
+#include "absl/strings/match.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/optional.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+// Runtime of the rules compiled ahead of time into C++ by header_rewrite_codegen, see
+// ProgramCodegen. The generated code executes the optimized program of each direction as straight
+// line code: literals are inlined, matchers are specialized per match type and header slots,
+// inline headers and value slots are indexed by constants, so a phase runs without an interpreter.
+// It reads and writes through header_operations.h like Program does, and returns the same errors.
+
+/**
+ * All compiled header rewrite filter stats. @see stats_macros.h
+ */
+#define ALL_COMPILED_RULES_FILTER_STATS(COUNTER)                                                   \
+  COUNTER(request_errors)                                                                          \
+  COUNTER(response_errors)                                                                         \
+  COUNTER(hdr_position_errors)                                                                     \
+  COUNTER(urlp_errors)                                                                             \
+  COUNTER(metadata_errors)                                                                         \
+  COUNTER(invalid_function_errors)
+
+/**
+ * Struct definition for all compiled header rewrite filter stats. @see stats_macros.h
+ */
+struct CompiledRulesFilterStats {
+  ALL_COMPILED_RULES_FILTER_STATS(GENERATE_COUNTER_STRUCT)
+};
+
+// What the generated code of a phase reads and writes: the header map, the stream, and the inline
+// header handles of its direction by the index the code refers to them with.
+struct CompiledPhase {
+  Http::RequestOrResponseHeaderMap& headers;
+  Envoy::StreamInfo::StreamInfo* stream_info;
+  ExecutionContext& context;
+  const InlineHeaderHandle* const* inline_headers;
+};
+
+// The names that the generated code of a direction refers to by index, and the size of its
+// per-stream state.
+struct CompiledDirection {
+  std::vector<std::string> header_slots;
+  bool track_presence;
+  std::vector<std::string> inline_headers;
+  size_t value_slots;
+  size_t rules;
+};
+
+// set-bool matchers, specialized for each match type of the rules
+template <Utility::MatchType Type> inline bool matches(absl::string_view source, absl::string_view compare) {
+  // every matcher requires a non-empty source, see SetBoolProcessor::parseOperation
+  if (source.empty()) {
+    return false;
+  }
+  if constexpr (Type == Utility::MatchType::Exact) {
+    return source == compare;
+  } else if constexpr (Type == Utility::MatchType::Prefix) {
+    return absl::StartsWith(source, compare);
+  } else if constexpr (Type == Utility::MatchType::Substr) {
+    return absl::StrContains(source, compare);
+  } else {
+    static_assert(Type == Utility::MatchType::Found, "no matcher for the match type");
+    return true;
+  }
+}
+
+// hdr(): the value at a position of a header, empty if the header is absent
+inline ExecutionError headerValueAt(absl::optional<absl::string_view> values, int32_t position,
+                                    absl::string_view& value) {
+  value = absl::string_view();
+  if (!values.has_value()) { // header does not exist
+    return ExecutionError::None;
+  }
+  return valueAtPosition(values.value(), position, value);
+}
+
+inline absl::optional<absl::string_view> inlineHeaderValue(const InlineHeaderHandle& handle,
+                                                           const Http::RequestOrResponseHeaderMap& headers) {
+  const Http::HeaderEntry* entry = handle.get(headers);
+  if (!entry) {
+    return absl::nullopt;
+  }
+  return entry->value().getStringView();
+}
+
+// A function value in a value slot, computed at most once per phase unless its input is written,
+// like Program::evaluateFunction. compute(buffer, value) computes it.
+template <class Compute>
+inline ExecutionError cachedValue(CompiledPhase& phase, int32_t value_slot, uint64_t input_written_at,
+                                  std::string& buffer, absl::string_view& value, const Compute& compute) {
+  ExecutionContext::CachedValue& cached_value = *phase.context.cachedValue(value_slot);
+  if (!phase.context.isFresh(cached_value, input_written_at)) {
+    absl::string_view computed;
+    const ExecutionError error = compute(buffer, computed);
+    cached_value.value.assign(computed.data(), computed.size());
+    phase.context.store(cached_value, error);
+  }
+  value = cached_value.value;
+  return cached_value.error;
+}
+
+// A bool in a value slot, like Program::evaluateBool. compute(result) computes it.
+template <class Compute>
+inline ExecutionError cachedBool(CompiledPhase& phase, int32_t value_slot, uint64_t input_written_at, bool& result,
+                                 const Compute& compute) {
+  ExecutionContext::CachedValue& cached_value = *phase.context.cachedValue(value_slot);
+  if (!phase.context.isFresh(cached_value, input_written_at)) {
+    bool computed = false;
+    const ExecutionError error = compute(computed);
+    phase.context.store(cached_value, error);
+    cached_value.bool_value = computed;
+  }
+  result = cached_value.error == ExecutionError::None && cached_value.bool_value;
+  return cached_value.error;
+}
+
+class CompiledRulesFilterConfig;
+using CompiledRulesFilterConfigSharedPtr = std::shared_ptr<const CompiledRulesFilterConfig>;
+
+// Compiled rules, registered under their name by the generated code and selected by the rules
+// field of the envoy.header_rewrite_compiled filter config.
+class CompiledRulesFactory : public Config::UntypedFactory {
+public:
+  std::string category() const override { return "envoy.header_rewrite.compiled_rules"; }
+
+  // the rules the code was generated from
+  virtual absl::string_view source() const = 0;
+  virtual const CompiledDirection& request() const = 0;
+  virtual const CompiledDirection& response() const = 0;
+  virtual ExecutionError executeRequest(CompiledPhase& phase) const = 0;
+  virtual ExecutionError executeResponse(CompiledPhase& phase) const = 0;
+  // adds a filter executing the rules to a stream, only for the directions that have rules
+  virtual void addFilter(const CompiledRulesFilterConfigSharedPtr& config,
+                         Http::FilterChainFactoryCallbacks& callbacks) const = 0;
+};
+
+// Config of the envoy.header_rewrite_compiled filter: the compiled rules it executes, with the
+// header slots and inline header handles of their directions resolved when the config is loaded.
+// Throws EnvoyException if no rules were compiled with the configured name, or if their inline
+// headers aren't registered in Envoy.
+class CompiledRulesFilterConfig {
+public:
+  struct Direction {
+    HeaderSlotTable header_slots;
+    std::vector<const InlineHeaderHandle*> inline_headers;
+    size_t value_slots;
+  };
+
+  CompiledRulesFilterConfig(const envoy::extensions::filters::http::HeaderRewriteCompiled& proto_config,
+                            Stats::Scope& scope);
+
+  const CompiledRulesFactory& rules() const { return rules_; }
+  const Direction& request() const { return request_; }
+  const Direction& response() const { return response_; }
+  const CompiledRulesFilterStats& stats() const { return stats_; }
+  // count a phase stopped by a failing rule, and log it if enabled
+  void onExecutionError(ExecutionError error, bool is_request) const;
+
+private:
+  static CompiledRulesFilterStats generateStats(const std::string& prefix, Stats::Scope& scope);
+  static const CompiledRulesFactory& findRules(const std::string& name);
+  void resolve(const CompiledDirection& compiled, bool is_request, Direction& direction);
+
+  const CompiledRulesFactory& rules_;
+  InlineHeaderTable inline_headers_;
+  Direction request_;
+  Direction response_;
+  CompiledRulesFilterStats stats_;
+  const bool log_errors_;
+};
+
+// Filter executing the generated code of Rules, called directly rather than through the factory.
+template <class Rules> class CompiledRulesFilter : public Http::PassThroughFilter {
+public:
+  explicit CompiledRulesFilter(CompiledRulesFilterConfigSharedPtr config) : config_(std::move(config)) {}
+
+  Http::FilterHeadersStatus decodeHeaders(Http::RequestHeaderMap& headers, bool) override {
+    executePhase<true>(headers, &decoder_callbacks_->streamInfo());
+    return Http::FilterHeadersStatus::Continue;
+  }
+  Http::FilterHeadersStatus encodeHeaders(Http::ResponseHeaderMap& headers, bool) override {
+    executePhase<false>(headers, &encoder_callbacks_->streamInfo());
+    return Http::FilterHeadersStatus::Continue;
+  }
+
+private:
+  template <bool IsRequest>
+  void executePhase(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* stream_info) {
+    const CompiledRulesFilterConfig::Direction& direction = IsRequest ? config_->request() : config_->response();
+    execution_context_.beginPhase(direction.header_slots, headers, direction.value_slots);
+    CompiledPhase phase{headers, stream_info, execution_context_, direction.inline_headers.data()};
+    const ExecutionError error = IsRequest ? Rules::request(phase) : Rules::response(phase);
+    if (error != ExecutionError::None) {
+      config_->onExecutionError(error, IsRequest);
+    }
+  }
+
+  const CompiledRulesFilterConfigSharedPtr config_;
+  ExecutionContext execution_context_;
+};
+
+// Factory of the rules generated as Rules, a class with the rules' Name and Source, their
+// requestDirection() and responseDirection(), and their request(phase) and response(phase) code.
+template <class Rules> class CompiledRulesFactoryImpl : public CompiledRulesFactory {
+public:
+  CompiledRulesFactoryImpl() : request_(Rules::requestDirection()), response_(Rules::responseDirection()) {}
+
+  std::string name() const override { return std::string(Rules::Name); }
+  absl::string_view source() const override { return Rules::Source; }
+  const CompiledDirection& request() const override { return request_; }
+  const CompiledDirection& response() const override { return response_; }
+  ExecutionError executeRequest(CompiledPhase& phase) const override { return Rules::request(phase); }
+  ExecutionError executeResponse(CompiledPhase& phase) const override { return Rules::response(phase); }
+
+  void addFilter(const CompiledRulesFilterConfigSharedPtr& config,
+                 Http::FilterChainFactoryCallbacks& callbacks) const override {
+    const bool decode = request_.rules > 0;
+    const bool encode = response_.rules > 0;
+    if (!decode && !encode) {
+      return;
+    }
+    auto filter = std::make_shared<CompiledRulesFilter<Rules>>(config);
+    if (decode && encode) {
+      callbacks.addStreamFilter(filter);
+    } else if (decode) {
+      callbacks.addStreamDecoderFilter(filter);
+    } else {
+      callbacks.addStreamEncoderFilter(filter);
+    }
+  }
+
+private:
+  const CompiledDirection request_;
+  const CompiledDirection response_;
+};
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -0,0 +1,50 @@
+#include <string>
+
+#include "envoy/registry/registry.h"
+#include "envoy/server/filter_config.h"
+
+#include "header-rewrite-filter/header_rewrite.pb.h"
+#include "header-rewrite-filter/header_rewrite.pb.validate.h"
+#include "compiled_rules.h"
+
+namespace Envoy {
+namespace Server {
+namespace Configuration {
+
+namespace HeaderRewrite = Extensions::HttpFilters::HeaderRewriteFilter;
+
+class HttpHeaderRewriteCompiledFilterConfigFactory : public NamedHttpFilterConfigFactory {
+public:
+  Http::FilterFactoryCb createFilterFactoryFromProto(const Protobuf::Message& proto_config,
+                                                     const std::string&,
+                                                     FactoryContext& context) override {
+    const HeaderRewrite::CompiledRulesFilterConfigSharedPtr config =
+        std::make_shared<const HeaderRewrite::CompiledRulesFilterConfig>(
+            Envoy::MessageUtil::downcastAndValidate<const envoy::extensions::filters::http::HeaderRewriteCompiled&>(
+                proto_config, context.messageValidationVisitor()),
+            context.scope());
+
+    return [config](Http::FilterChainFactoryCallbacks& callbacks) -> void {
+      config->rules().addFilter(config, callbacks);
+    };
+  }
+
+  /**
+   *  Return the Protobuf Message that represents your config incase you have config proto
+   */
+  ProtobufTypes::MessagePtr createEmptyConfigProto() override {
+    return ProtobufTypes::MessagePtr{new envoy::extensions::filters::http::HeaderRewriteCompiled()};
+  }
+
+  std::string name() const override { return "envoy.header_rewrite_compiled"; }
+};
+
+/**
+ * Static registration for the filter executing compiled rules. @see RegisterFactory.
+ */
+static Registry::RegisterFactory<HttpHeaderRewriteCompiledFilterConfigFactory, NamedHttpFilterConfigFactory>
+    register_;
+
+} // namespace Configuration
+} // namespace Server
+} // namespace Envoy
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <vector>
+
+#include "header_slots.h"
+
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+// Reason for a rule to fail while executing. Errors carry no per-request data, so that failing
+// costs no allocation even when most requests fail; see executionErrorMessage.
+enum class ExecutionError : uint8_t {
+  None,
+  HdrPositionOutOfRange, // hdr() position past the values of a present header
+  HdrPositionNotANumber,
+  UrlpOnResponse,
+  StreamInfoMissing, // metadata read or written without stream info
+  MetadataKeyEmpty, // set-metadata key evaluated to an empty string
+  MetadataValueEmpty,
+  InvalidFunction,
+};
+
+inline absl::string_view executionErrorMessage(ExecutionError error) {
+  switch (error) {
+    case ExecutionError::None:
+      return "no error";
+    case ExecutionError::HdrPositionOutOfRange:
+      return "invalid match syntax -- hdr position out of bounds";
+    case ExecutionError::HdrPositionNotANumber:
+      return "invalid match syntax -- hdr position is not a number";
+    case ExecutionError::UrlpOnResponse:
+      return "cannot call urlp function on response side";
+    case ExecutionError::StreamInfoMissing:
+      return "stream info is null";
+    case ExecutionError::MetadataKeyEmpty:
+    case ExecutionError::MetadataValueEmpty:
+      return "failed to get dynamic value to set metadata -- no value";
+    case ExecutionError::InvalidFunction:
+      return "failed to execute dynamic function -- invalid function type";
+  }
+  return "unknown error";
+}
+
+// What happened to a rule while a phase executed, counted per rule index when the phase is given
+// a counts array (see RuleCounts). Rules without a condition count neither condition outcome.
+enum RuleOutcome : size_t {
+  RuleEvaluated,
+  RuleConditionTrue,
+  RuleConditionFalse,
+  RuleApplied,
+  RuleFailed,
+  RuleOutcomes,
+};
+
+// Per-stream state used while the rules of one phase (request or response) execute. The rules
+// themselves are shared by every stream of a filter config and must not hold per-stream state.
+class ExecutionContext {
+public:
+  static constexpr int32_t NoValueSlot = -1;
+  static constexpr size_t ScratchBuffers = 4;
+
+  // Value of a dynamic function or bool shared by several rules, computed at most once per phase
+  // unless one of its inputs is written in between (see HeaderSlots write stamps).
+  struct CachedValue {
+    bool valid = false;
+    uint64_t computed_at = 0; // write count when the value was computed
+    absl::Status status; // set by the processors
+    ExecutionError error = ExecutionError::None; // set by a Program
+    std::string value; // dynamic function result
+    bool bool_value = false; // bool result, before negation
+  };
+
+  // prepare for executing the rules of a phase against its header map; rule_counts, if not null,
+  // holds RuleOutcomes counters per rule index, and bool_counts true and false counters per bool
+  // index of the program
+  void beginPhase(const HeaderSlotTable& header_slot_table, const Http::HeaderMap& headers, size_t value_slots = 0,
+                  uint64_t* rule_counts = nullptr, uint64_t* bool_counts = nullptr) {
+    header_slots_.gather(header_slot_table, headers);
+    rule_counts_ = rule_counts;
+    bool_counts_ = bool_counts;
+    metadata_written_at_ = 0;
+    cached_values_.clear();
+    cached_values_.resize(value_slots);
+  }
+
+  HeaderSlots& headerSlots() { return header_slots_; }
+
+  // returns the cached value of a slot, or null if the slot isn't part of this phase
+  CachedValue* cachedValue(int32_t value_slot) {
+    if (value_slot < 0 || static_cast<size_t>(value_slot) >= cached_values_.size()) {
+      return nullptr;
+    }
+    return &cached_values_[value_slot];
+  }
+  bool isFresh(const CachedValue& cached_value, uint64_t input_written_at) const {
+    return cached_value.valid && input_written_at <= cached_value.computed_at;
+  }
+  void store(CachedValue& cached_value, const absl::Status& status) {
+    cached_value.valid = true;
+    cached_value.computed_at = header_slots_.writeCount();
+    cached_value.status = status;
+  }
+  void store(CachedValue& cached_value, ExecutionError error) {
+    cached_value.valid = true;
+    cached_value.computed_at = header_slots_.writeCount();
+    cached_value.error = error;
+  }
+
+  bool countingRules() const { return rule_counts_ != nullptr; }
+  void countRule(uint32_t rule_index, RuleOutcome outcome) { rule_counts_[rule_index * RuleOutcomes + outcome]++; }
+  bool countingBools() const { return bool_counts_ != nullptr; }
+  void countBool(uint32_t bool_index, bool value) { bool_counts_[bool_index * 2 + (value ? 0 : 1)]++; }
+
+  // set-metadata writes, read back by metadata()
+  void markMetadataWritten() { metadata_written_at_ = header_slots_.recordWrite(); }
+  uint64_t metadataWrittenAt() const { return metadata_written_at_; }
+
+  // reusable buffers for values that a Program computes, kept across phases so that their
+  // capacity is only allocated once per stream
+  std::string& scratch(size_t index) { return scratch_[index]; }
+
+private:
+  HeaderSlots header_slots_;
+  uint64_t metadata_written_at_ = 0;
+  uint64_t* rule_counts_ = nullptr;
+  uint64_t* bool_counts_ = nullptr;
+  std::vector<CachedValue> cached_values_;
+  std::array<std::string, ScratchBuffers> scratch_;
+};
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -0,0 +1,147 @@
+#include "header_operations.h"
+
+#include "utility.h"
+
+#include "source/common/config/metadata.h"
+#include "source/common/http/header_utility.h"
+#include "source/common/http/utility.h"
+
+#include "absl/strings/ascii.h"
+#include "absl/strings/str_split.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+ExecutionError valueAtPosition(absl::string_view values, int32_t position, absl::string_view& value) {
+  if (position < 0) {
+    int32_t count = 0;
+    for (absl::string_view token : absl::StrSplit(values, ',', absl::SkipWhitespace())) {
+      static_cast<void>(token);
+      count++;
+    }
+    position += count;
+  }
+  if (position >= 0) {
+    int32_t index = 0;
+    for (absl::string_view token : absl::StrSplit(values, ',', absl::SkipWhitespace())) {
+      if (index++ == position) {
+        value = absl::StripAsciiWhitespace(token);
+        return ExecutionError::None;
+      }
+    }
+  }
+  return ExecutionError::HdrPositionOutOfRange;
+}
+
+void assignTo(std::string& buffer, absl::string_view value) {
+  if (value.data() >= buffer.data() && value.data() <= buffer.data() + buffer.size()) {
+    buffer.erase(0, value.data() - buffer.data());
+    buffer.resize(value.size());
+    return;
+  }
+  buffer.assign(value.data(), value.size());
+}
+
+absl::optional<absl::string_view> joinedHeaderValue(const Http::HeaderMap& headers, const Http::LowerCaseString& name,
+                                                    std::string& buffer) {
+  const Http::HeaderUtility::GetAllOfHeaderAsStringResult header = Http::HeaderUtility::getAllOfHeaderAsString(headers, name);
+  if (!header.result().has_value()) {
+    return absl::nullopt;
+  }
+  buffer.assign(header.result().value().data(), header.result().value().size());
+  return absl::string_view(buffer);
+}
+
+ExecutionError queryParameter(Http::RequestOrResponseHeaderMap& headers, absl::string_view name, std::string& buffer,
+                              absl::string_view& value) {
+  value = absl::string_view();
+  const Http::RequestHeaderMap* request_headers = dynamic_cast<Http::RequestHeaderMap*>(&headers);
+  if (!request_headers) {
+    return ExecutionError::UrlpOnResponse;
+  }
+  const auto query_parameters = Http::Utility::parseQueryString(request_headers->getPathValue());
+  const auto iter = query_parameters.find(std::string(name));
+  if (iter == query_parameters.end()) { // query param doesn't exist
+    return ExecutionError::None;
+  }
+  buffer.assign(iter->second);
+  value = buffer;
+  return ExecutionError::None;
+}
+
+ExecutionError dynamicMetadataValue(Envoy::StreamInfo::StreamInfo* stream_info, absl::string_view key,
+                                    std::string& buffer, absl::string_view& value) {
+  value = absl::string_view();
+  if (!stream_info) {
+    return ExecutionError::StreamInfoMissing;
+  }
+  const std::string path_key(key);
+  const std::vector<std::string> path{path_key, path_key};
+  const envoy::config::core::v3::Metadata& metadata = stream_info->dynamicMetadata();
+  buffer = Envoy::Config::Metadata::metadataValue(&metadata, std::string(Utility::HEADER_REWRITE_FILTER_NAME), path)
+               .string_value();
+  value = buffer;
+  return ExecutionError::None;
+}
+
+void setHeaderValue(Http::RequestOrResponseHeaderMap& headers, ExecutionContext& context,
+                    const Http::LowerCaseString& key, absl::string_view value, const InlineHeaderHandle* inline_header) {
+  if (inline_header) {
+    inline_header->set(headers, value);
+    context.headerSlots().markPresent(key.get());
+    return;
+  }
+  headers.setCopy(key, value);
+  context.headerSlots().set(key.get(), value);
+}
+
+void appendHeaderValue(Http::RequestOrResponseHeaderMap& headers, ExecutionContext& context,
+                       const Http::LowerCaseString& key, absl::string_view value,
+                       const InlineHeaderHandle* inline_header) {
+  if (inline_header) {
+    inline_header->append(headers, value);
+    context.headerSlots().markPresent(key.get());
+    return;
+  }
+  headers.appendCopy(key, value);
+  // the next value may read this header back
+  context.headerSlots().refresh(headers, key.get());
+}
+
+void setPathKeepingQuery(Http::RequestOrResponseHeaderMap& headers, ExecutionContext& context, std::string& new_path) {
+  // cast to RequestHeaderMap because setPath is only on request side, keep the query string
+  Http::RequestHeaderMap* request_headers = static_cast<Http::RequestHeaderMap*>(&headers);
+  const absl::string_view path = request_headers->getPathValue();
+  const size_t offset = path.find_first_of('?');
+  if (offset != absl::string_view::npos) {
+    new_path.append(path.data() + offset, path.size() - offset);
+  }
+  request_headers->setPath(new_path);
+  context.headerSlots().refresh(headers, ":path");
+}
+
+ExecutionError setDynamicMetadata(Envoy::StreamInfo::StreamInfo* stream_info, ExecutionContext& context,
+                                  const std::string& key, const std::string& value) {
+  // make sure metadata is not null
+  if (!stream_info) {
+    return ExecutionError::StreamInfoMissing;
+  }
+
+  envoy::config::core::v3::Metadata& dynamic_metadata = stream_info->dynamicMetadata();
+  ProtobufWkt::Struct filter_struct = // get metadata for header rewrite filter
+      (*dynamic_metadata.mutable_filter_metadata())[std::string(Utility::HEADER_REWRITE_FILTER_NAME)];
+  ProtobufWkt::Value val;
+  *val.mutable_struct_value() = MessageUtil::keyValueStruct(key, value);
+  (*filter_struct.mutable_fields())[key] = val;
+
+  stream_info->setDynamicMetadata(std::string(Utility::HEADER_REWRITE_FILTER_NAME), filter_struct);
+  context.markMetadataWritten();
+  return ExecutionError::None;
+}
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
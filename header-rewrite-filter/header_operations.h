@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "execution_context.h"
+#include "inline_headers.h"
+
+#include "envoy/http/header_map.h"
+#include "envoy/stream_info/stream_info.h"
+
+#include "absl/strings/string_view.h"
+#include "absl/types/optional.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+// Reads and writes of the rules, shared by Program and the code generated by
+// header_rewrite_codegen so that both produce the same header maps, metadata and errors. Writes
+// keep the phase's header slots up to date, see HeaderSlots.
+
+// value at a position of a comma separated list, split the way
+// StringUtil::splitToken(values, ",", false, true) splits it, without building the token vector
+ExecutionError valueAtPosition(absl::string_view values, int32_t position, absl::string_view& value);
+
+// copy a value into a buffer, the value may already be a part of that buffer
+void assignTo(std::string& buffer, absl::string_view value);
+
+// every value of a header joined with commas, copied into buffer; nullopt if the header is absent
+absl::optional<absl::string_view> joinedHeaderValue(const Http::HeaderMap& headers, const Http::LowerCaseString& name,
+                                                    std::string& buffer);
+
+// urlp(): a query parameter of the request path, empty if absent
+ExecutionError queryParameter(Http::RequestOrResponseHeaderMap& headers, absl::string_view name, std::string& buffer,
+                              absl::string_view& value);
+
+// metadata(): a string value of the filter's dynamic metadata, empty if absent
+ExecutionError dynamicMetadataValue(Envoy::StreamInfo::StreamInfo* stream_info, absl::string_view key,
+                                    std::string& buffer, absl::string_view& value);
+
+// set-header and append-header of one value, through the inline handle if not null
+void setHeaderValue(Http::RequestOrResponseHeaderMap& headers, ExecutionContext& context,
+                    const Http::LowerCaseString& key, absl::string_view value, const InlineHeaderHandle* inline_header);
+void appendHeaderValue(Http::RequestOrResponseHeaderMap& headers, ExecutionContext& context,
+                       const Http::LowerCaseString& key, absl::string_view value,
+                       const InlineHeaderHandle* inline_header);
+
+// set-path, keeping the query string of the current path; new_path is the value's buffer
+void setPathKeepingQuery(Http::RequestOrResponseHeaderMap& headers, ExecutionContext& context, std::string& new_path);
+
+// set-metadata of a non-empty key and value
+ExecutionError setDynamicMetadata(Envoy::StreamInfo::StreamInfo* stream_info, ExecutionContext& context,
+                                  const std::string& key, const std::string& value);
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -1,5 +1,7 @@
 #include "header_processor.h"
 
+#include <algorithm>
+
 #include "source/common/config/metadata.h"
 #include "source/common/common/logger.h" // TODO: remove debugging lib
 
@@ -12,7 +14,7 @@ namespace HeaderRewriteFilter {
         if (start == condition_expression.end()) {
             return absl::InvalidArgumentError("empty condition provided");
         }
-        setConditionProcessor(std::make_shared<ConditionProcessor>(bool_processors_, is_request_));
+        setConditionProcessor(std::make_shared<ConditionProcessor>(bool_processors_, is_request_, inline_headers_));
         return getConditionProcessor()->parseOperation(condition_expression, start); // pass everything after the "if"
     }
 
@@ -27,11 +29,14 @@ namespace HeaderRewriteFilter {
                 throw std::out_of_range("unexpected end of expression");
             }
             const absl::string_view key = *start;
-            header_key_ = std::make_shared<DynamicFunctionProcessor>(bool_processors_, is_request_);
+            header_key_ = std::make_shared<DynamicFunctionProcessor>(bool_processors_, is_request_, inline_headers_);
             const absl::Status header_key_parse_status = header_key_->parseOperation(key);
             if (header_key_parse_status != absl::OkStatus()) {
                 return header_key_parse_status;
             }
+            if (header_key_->functionType() == Utility::FunctionType::Static) {
+                inline_header_ = findInlineHeader(header_key_->functionArgument());
+            }
         } catch (const std::exception& e) {
             // should never happen, range is checked at the start
             return absl::UnknownError("error parsing header key -- " + std::string(e.what()));
@@ -43,7 +48,7 @@ namespace HeaderRewriteFilter {
                 throw std::out_of_range("unexpected end of expression");
             }
             const absl::string_view val = *(start + 1);
-            header_val_ = std::make_shared<DynamicFunctionProcessor>(bool_processors_, is_request_);
+            header_val_ = std::make_shared<DynamicFunctionProcessor>(bool_processors_, is_request_, inline_headers_);
             const absl::Status header_val_parse_status = header_val_->parseOperation(val);
             if (header_val_parse_status != absl::OkStatus()) {
                 return header_val_parse_status;
@@ -79,11 +84,14 @@ namespace HeaderRewriteFilter {
                 throw std::out_of_range("unexpected end of expression");
             }
             const absl::string_view key = *start;
-            header_key_ = std::make_shared<DynamicFunctionProcessor>(bool_processors_, is_request_);
+            header_key_ = std::make_shared<DynamicFunctionProcessor>(bool_processors_, is_request_, inline_headers_);
             const absl::Status header_key_parse_status = header_key_->parseOperation(key);
             if (header_key_parse_status != absl::OkStatus()) {
                 return header_key_parse_status;
             }
+            if (header_key_->functionType() == Utility::FunctionType::Static) {
+                inline_header_ = findInlineHeader(header_key_->functionArgument());
+            }
         } catch (const std::exception& e) {
             // should never happen, range is checked above
             return absl::UnknownError("error parsing header key -- " + std::string(e.what()));
@@ -104,7 +112,7 @@ namespace HeaderRewriteFilter {
                     break;
                 }
                 const absl::string_view val = *it;
-                const DynamicFunctionProcessorSharedPtr header_val = std::make_shared<DynamicFunctionProcessor>(bool_processors_, is_request_);
+                const DynamicFunctionProcessorSharedPtr header_val = std::make_shared<DynamicFunctionProcessor>(bool_processors_, is_request_, inline_headers_);
                 const absl::Status header_val_parse_status = header_val->parseOperation(val);
                 if (header_val_parse_status != absl::OkStatus()) {
                     return header_val_parse_status;
@@ -118,11 +126,15 @@ namespace HeaderRewriteFilter {
         return absl::OkStatus();
     }
 
-    std::tuple<absl::Status, bool> HeaderProcessor::evaluateCondition(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo) {
+    std::tuple<absl::Status, bool> HeaderProcessor::evaluateCondition(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext* context) {
         // call ConditionProcessor executeOperation; if it is null, return true
-        ConditionProcessorSharedPtr condition_processor = getConditionProcessor();
+        ConditionProcessor* condition_processor = condition_processor_.get();
         if (condition_processor) {
-            const std::tuple<absl::Status, bool> condition = condition_processor->executeOperation(headers, streamInfo);
+            // skip evaluation when the headers the condition needs are absent
+            if (context && condition_processor->provablyFalse(context->headerSlots().presence())) {
+                return std::make_tuple(absl::OkStatus(), false);
+            }
+            const std::tuple<absl::Status, bool> condition = condition_processor->executeOperation(headers, streamInfo, context);
             const absl::Status status = std::get<0>(condition);
             if (status != absl::OkStatus()) {
                 return std::make_tuple(status, false);
@@ -134,8 +146,8 @@ namespace HeaderRewriteFilter {
         return std::make_tuple(absl::OkStatus(), true); // no condition present
     }
 
-    absl::Status SetHeaderProcessor::executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo) {
-        const std::tuple<absl::Status, bool> condition_result = evaluateCondition(headers, streamInfo);
+    absl::Status SetHeaderProcessor::executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext* context) {
+        const std::tuple<absl::Status, bool> condition_result = evaluateCondition(headers, streamInfo, context);
         const absl::Status status = std::get<0>(condition_result);
         if (status != absl::OkStatus()) {
             return status;
@@ -146,10 +158,10 @@ namespace HeaderRewriteFilter {
         }
 
         // fetch dynamic values for header key and value
-        const std::tuple<absl::Status, std::string> key_result = header_key_->executeOperation(headers, streamInfo);
+        const std::tuple<absl::Status, std::string> key_result = header_key_->executeOperation(headers, streamInfo, context);
         const absl::Status key_status = std::get<0>(key_result);
         const std::string key = std::move(std::get<1>(key_result));
-        const std::tuple<absl::Status, std::string> value_result = header_val_->executeOperation(headers, streamInfo);
+        const std::tuple<absl::Status, std::string> value_result = header_val_->executeOperation(headers, streamInfo, context);
         const absl::Status value_status = std::get<0>(value_result);
         const std::string value = std::move(std::get<1>(value_result));
 
@@ -161,14 +173,30 @@ namespace HeaderRewriteFilter {
         }
         
         // set header
-        headers.setCopy(Http::LowerCaseString(key), value); // should never return an error
+        if (inline_header_) {
+            inline_header_->set(headers, value);
+            if (context) {
+                context->headerSlots().markPresent(key);
+            }
+            return absl::OkStatus();
+        }
+        const Http::LowerCaseString header_key(key);
+        headers.setCopy(header_key, value); // should never return an error
+        if (context) {
+            context->headerSlots().set(header_key.get(), value);
+        }
 
         return absl::OkStatus();
     }
 
+    void SetHeaderProcessor::forEachDynamicFunction(const std::function<void(DynamicFunctionProcessorSharedPtr&)>& cb) {
+        cb(header_key_);
+        cb(header_val_);
+    }
+
 
-    absl::Status AppendHeaderProcessor::executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo) {
-        const std::tuple<absl::Status, bool> condition_result = evaluateCondition(headers, streamInfo);
+    absl::Status AppendHeaderProcessor::executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext* context) {
+        const std::tuple<absl::Status, bool> condition_result = evaluateCondition(headers, streamInfo, context);
         const absl::Status status = std::get<0>(condition_result);
         if (status != absl::OkStatus()) {
             return status;
@@ -178,7 +206,7 @@ namespace HeaderRewriteFilter {
             return absl::OkStatus(); // do nothing because condition is false
         }
 
-        const std::tuple<absl::Status, std::string> key_result = header_key_->executeOperation(headers, streamInfo);
+        const std::tuple<absl::Status, std::string> key_result = header_key_->executeOperation(headers, streamInfo, context);
         const absl::Status key_status = std::get<0>(key_result);
         const std::string key = std::move(std::get<1>(key_result));
 
@@ -187,19 +215,38 @@ namespace HeaderRewriteFilter {
         }
 
         // append header
+        const Http::LowerCaseString header_key(key);
         for (auto const& header_val : header_vals_) {
-            const std::tuple<absl::Status, std::string> value_result = header_val->executeOperation(headers, streamInfo);
+            const std::tuple<absl::Status, std::string> value_result = header_val->executeOperation(headers, streamInfo, context);
             const absl::Status value_status = std::get<0>(value_result);
             const std::string value = std::move(std::get<1>(value_result));
             if (value_status != absl::OkStatus()) {
                 return value_status;
             }
-            headers.appendCopy(Http::LowerCaseString(key), value); // should never return an error
+            if (inline_header_) {
+                inline_header_->append(headers, value);
+                if (context) {
+                    context->headerSlots().markPresent(key);
+                }
+                continue;
+            }
+            headers.appendCopy(header_key, value); // should never return an error
+            // the next value may read this header back
+            if (context) {
+                context->headerSlots().refresh(headers, header_key.get());
+            }
         }
 
         return absl::OkStatus();
     }
 
+    void AppendHeaderProcessor::forEachDynamicFunction(const std::function<void(DynamicFunctionProcessorSharedPtr&)>& cb) {
+        cb(header_key_);
+        for (auto& header_val : header_vals_) {
+            cb(header_val);
+        }
+    }
+
     absl::Status SetPathProcessor::parseOperation(std::vector<absl::string_view>& operation_expression, std::vector<absl::string_view>::iterator start) {
         if (operation_expression.size() < Utility::SET_PATH_MIN_NUM_ARGUMENTS) {
             return absl::InvalidArgumentError("not enough arguments for set-path");
@@ -211,7 +258,7 @@ namespace HeaderRewriteFilter {
                 throw std::out_of_range("unexpected end of expression");
             }
             const absl::string_view request_path_string = *start;
-            request_path_ = std::make_shared<DynamicFunctionProcessor>(bool_processors_, is_request_);
+            request_path_ = std::make_shared<DynamicFunctionProcessor>(bool_processors_, is_request_, inline_headers_);
             const absl::Status path_parse_status = request_path_->parseOperation(request_path_string);
             if (path_parse_status != absl::OkStatus()) {
                 return path_parse_status;
@@ -240,14 +287,14 @@ namespace HeaderRewriteFilter {
         return absl::OkStatus();
     }
 
-    absl::Status SetPathProcessor::executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo) {
-        const std::tuple<absl::Status, bool> condition_result = evaluateCondition(headers, streamInfo);
+    absl::Status SetPathProcessor::executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext* context) {
+        const std::tuple<absl::Status, bool> condition_result = evaluateCondition(headers, streamInfo, context);
         const absl::Status status = std::get<0>(condition_result);
         if (status != absl::OkStatus()) {
             return status;
         }
 
-        const std::tuple<absl::Status, std::string> path_result = request_path_->executeOperation(headers, streamInfo);
+        const std::tuple<absl::Status, std::string> path_result = request_path_->executeOperation(headers, streamInfo, context);
         const absl::Status path_status = std::get<0>(path_result);
         const std::string new_path = std::move(std::get<1>(path_result));
 
@@ -265,19 +312,25 @@ namespace HeaderRewriteFilter {
 
         if (offset == absl::string_view::npos) { // no query string present
             request_headers->setPath(new_path); // should never return an error
-            return absl::OkStatus();
-        }
+        } else {
+            const absl::string_view query_string = path.substr(offset, path.length() - offset);
 
-        const absl::string_view query_string = path.substr(offset, path.length() - offset);
-
-        // set path, preserves query string
-        request_headers->setPath(new_path + std::string(query_string)); // should never return an error
+            // set path, preserves query string
+            request_headers->setPath(new_path + std::string(query_string)); // should never return an error
+        }
 
+        if (context) {
+            context->headerSlots().refresh(headers, ":path");
+        }
         return absl::OkStatus();
     }
 
+    void SetPathProcessor::forEachDynamicFunction(const std::function<void(DynamicFunctionProcessorSharedPtr&)>& cb) {
+        cb(request_path_);
+    }
+
     absl::Status SetBoolProcessor::stringToCompareSetup(absl::string_view string_to_compare) {
-        string_to_compare_function_processor_ = std::make_shared<DynamicFunctionProcessor>(bool_processors_, is_request_);
+        string_to_compare_function_processor_ = std::make_shared<DynamicFunctionProcessor>(bool_processors_, is_request_, inline_headers_);
         const absl::Status parse_status = string_to_compare_function_processor_->parseOperation(string_to_compare);
         if (parse_status != absl::OkStatus()) {
             return parse_status;
@@ -299,6 +352,7 @@ namespace HeaderRewriteFilter {
             }
 
             const Utility::MatchType match_type = Utility::StringToMatchType(*(start + 3));
+            match_type_ = match_type;
             if (start + 3 == operation_expression.end()) {
                 throw std::out_of_range("unexpected end of expression");
             }
@@ -316,7 +370,7 @@ namespace HeaderRewriteFilter {
             }
 
             // parse dynamic function
-            source_processor_ = std::make_shared<DynamicFunctionProcessor>(bool_processors_, is_request_);
+            source_processor_ = std::make_shared<DynamicFunctionProcessor>(bool_processors_, is_request_, inline_headers_);
             if (start + 1 == operation_expression.end()) {
                 throw std::out_of_range("unexpected end of expression");
             }
@@ -391,11 +445,42 @@ namespace HeaderRewriteFilter {
             return absl::UnknownError("error parsing boolean expression -- " + std::string(e.what()));
         }
 
+        computeDependencies();
         return absl::OkStatus();
     }
 
-    std::tuple<absl::Status, bool> SetBoolProcessor::executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo, bool negate) {
-        const std::tuple<absl::Status, std::string> source_result = source_processor_->executeOperation(headers, streamInfo);
+    void SetBoolProcessor::computeDependencies() {
+        dependency_headers_ = source_processor_->headerPresenceBit() | string_to_compare_function_processor_->headerPresenceBit();
+        may_fail_without_headers_ = source_processor_->mayFailWithoutHeader() || string_to_compare_function_processor_->mayFailWithoutHeader();
+        // hdr() of an absent header is empty and every matcher requires a non-empty source
+        requires_source_header_ = source_processor_->functionType() == Utility::FunctionType::GetHdr;
+    }
+
+    std::tuple<absl::Status, bool> SetBoolProcessor::executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo, bool negate,
+        ExecutionContext* context) {
+        ExecutionContext::CachedValue* cached_value = context ? context->cachedValue(value_slot_) : nullptr;
+        if (!cached_value) {
+            const std::tuple<absl::Status, bool> result = evaluate(headers, streamInfo, context);
+            return std::make_tuple(std::get<0>(result), std::get<0>(result).ok() && (negate ? !std::get<1>(result) : std::get<1>(result)));
+        }
+
+        // shared bool, reuse its result until one of its inputs is written
+        const uint64_t input_written_at = std::max(source_processor_->inputWrittenAt(*context),
+                                                   string_to_compare_function_processor_->inputWrittenAt(*context));
+        if (!context->isFresh(*cached_value, input_written_at)) {
+            const std::tuple<absl::Status, bool> result = evaluate(headers, streamInfo, context);
+            context->store(*cached_value, std::get<0>(result));
+            cached_value->bool_value = std::get<1>(result);
+        }
+        if (!cached_value->status.ok()) {
+            return std::make_tuple(cached_value->status, false);
+        }
+        return std::make_tuple(absl::OkStatus(), negate ? !cached_value->bool_value : cached_value->bool_value);
+    }
+
+    std::tuple<absl::Status, bool> SetBoolProcessor::evaluate(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo,
+        ExecutionContext* context) {
+        const std::tuple<absl::Status, std::string> source_result = source_processor_->executeOperation(headers, streamInfo, context);
         const absl::Status source_status = std::get<0>(source_result);
         const std::string source = std::move(std::get<1>(source_result));
 
@@ -403,7 +488,7 @@ namespace HeaderRewriteFilter {
             return std::make_tuple(source_status, false);
         }
 
-        const std::tuple<absl::Status, std::string> string_to_compare_result = string_to_compare_function_processor_->executeOperation(headers, streamInfo);
+        const std::tuple<absl::Status, std::string> string_to_compare_result = string_to_compare_function_processor_->executeOperation(headers, streamInfo, context);
         const absl::Status string_to_compare_status = std::get<0>(string_to_compare_result);
         const std::string string_to_compare = std::move(std::get<1>(string_to_compare_result));
 
@@ -412,9 +497,20 @@ namespace HeaderRewriteFilter {
         }
 
         const bool bool_result = matcher_(source, string_to_compare);
-        const bool apply_negation = negate ? !bool_result : bool_result;
+        return std::make_tuple(absl::OkStatus(), bool_result);
+    }
+
+    absl::optional<bool> SetBoolProcessor::constantValue() const {
+        if (source_processor_->functionType() != Utility::FunctionType::Static ||
+            string_to_compare_function_processor_->functionType() != Utility::FunctionType::Static) {
+            return absl::nullopt;
+        }
+        return matcher_(source_processor_->functionArgument(), string_to_compare_function_processor_->functionArgument());
+    }
 
-        return std::make_tuple(absl::OkStatus(), apply_negation);
+    void SetBoolProcessor::forEachDynamicFunction(const std::function<void(DynamicFunctionProcessorSharedPtr&)>& cb) {
+        cb(source_processor_);
+        cb(string_to_compare_function_processor_);
     }
 
     absl::Status ConditionProcessor::parseOperation(std::vector<absl::string_view>& operation_expression, std::vector<absl::string_view>::iterator start) {
@@ -437,15 +533,14 @@ namespace HeaderRewriteFilter {
             return absl::InvalidArgumentError("invalid condition -- condition must begin with 'not' or an operand");
         }
 
+        // each token is classified once, and an operand is copied once, into operands_
+        Utility::BooleanOperatorType prev_operator_type = Utility::BooleanOperatorType::None;
         for (auto it = start; it != operation_expression.end();) {
-            const Utility::BooleanOperatorType operator_type = Utility::StringToBooleanOperatorType(*it);
+            const Utility::BooleanOperatorType operator_type = it == start ? start_type : Utility::StringToBooleanOperatorType(*it);
 
             // condition can't have two binary operators in a row
-            if (it != start) {
-                const Utility::BooleanOperatorType prev_operator_type = Utility::StringToBooleanOperatorType(*(it-1));
-                if (Utility::isBinaryOperator(operator_type) && Utility::isBinaryOperator(prev_operator_type)) {
-                    return absl::InvalidArgumentError("invalid condition -- cannot have two binary operators in a row");
-                }
+            if (Utility::isBinaryOperator(operator_type) && Utility::isBinaryOperator(prev_operator_type)) {
+                return absl::InvalidArgumentError("invalid condition -- cannot have two binary operators in a row");
             }
 
             // condition can't end with an operator
@@ -456,58 +551,81 @@ namespace HeaderRewriteFilter {
             // parse operation type
             if (Utility::isBinaryOperator(operator_type)) {
                 operators_.push_back(operator_type);
+                prev_operator_type = operator_type;
                 it++;
-            } else if (operator_type == Utility::BooleanOperatorType::Not) {
-                if (it + 1 == operation_expression.end()) {
-                    return absl::InvalidArgumentError("invalid condition -- must have operand after 'not'");
-                } else if (Utility::isOperator(Utility::StringToBooleanOperatorType(*(it+1)))) {
-                    return absl::InvalidArgumentError("invalid condition -- can't have an operator after 'not'");
-                }
-
-                // make sure that all the boolean variables being referenced exist in the map
-                const auto operand = *(it+1);
-                if (bool_processors_->find(std::string(operand)) == bool_processors_->end()) {
-                    return absl::InvalidArgumentError("boolean variable \"" + std::string(operand) + "\" in conditional does not exist");
-                }
+                continue;
+            }
 
-                operands_.push_back(std::tuple<std::string, bool>(*(it+1), true));
-                it += 2;
-            } else {
-                // make sure that all the boolean variables being referenced exist in the map
-                const auto operand = *(it);
-                if (bool_processors_->find(std::string(operand)) == bool_processors_->end()) {
-                    return absl::InvalidArgumentError("boolean variable \"" + std::string(operand) + "\" in conditional does not exist");
-                }
+            const bool negated = operator_type == Utility::BooleanOperatorType::Not;
+            if (negated && Utility::isOperator(Utility::StringToBooleanOperatorType(*(it+1)))) {
+                return absl::InvalidArgumentError("invalid condition -- can't have an operator after 'not'");
+            }
 
-                operands_.push_back(std::tuple<std::string, bool>(*it, false));
-                it++;
+            // make sure that all the boolean variables being referenced exist in the map
+            std::string operand(negated ? *(it+1) : *it);
+            if (bool_processors_->find(operand) == bool_processors_->end()) {
+                return absl::InvalidArgumentError("boolean variable \"" + operand + "\" in conditional does not exist");
             }
+
+            operands_.emplace_back(std::move(operand), negated);
+            prev_operator_type = Utility::BooleanOperatorType::None;
+            it += negated ? 2 : 1;
         }
 
         // validate number of operands and operators
-        return (operators_.size() == (operands_.size() - 1)) ? absl::OkStatus() : absl::InvalidArgumentError("invalid condition");
+        if (operators_.size() != (operands_.size() - 1)) {
+            return absl::InvalidArgumentError("invalid condition");
+        }
+
+        computeDependencies();
+        return absl::OkStatus();
+    }
+
+    void ConditionProcessor::computeDependencies() {
+        // the condition is an OR of AND groups, it is false if every group has a false operand. It
+        // is only skipped when no operand can fail either, so skipping never hides an error.
+        dependency_headers_ = 0;
+        skippable_ = true;
+        bool group_has_required_header = false;
+        for (size_t i = 0; i < operands_.size(); i++) {
+            const SetBoolProcessorSharedPtr& bool_processor = bool_processors_->at(std::get<0>(operands_[i]));
+            dependency_headers_ |= bool_processor->dependencyHeaders();
+            if (bool_processor->mayFailWithoutHeaders()) {
+                skippable_ = false;
+            }
+            if (!std::get<1>(operands_[i]) && bool_processor->requiresSourceHeader()) {
+                group_has_required_header = true;
+            }
+
+            // end of an AND group
+            if (i == operators_.size() || operators_[i] == Utility::BooleanOperatorType::Or) {
+                skippable_ = skippable_ && group_has_required_header;
+                group_has_required_header = false;
+            }
+        }
     }
 
     // return status and condition result
-    std::tuple<absl::Status, bool> ConditionProcessor::executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo) {
-        return executeOperationRecursively(headers, streamInfo, operators_.begin(), operators_.end(), operands_.begin(), operands_.end());
+    std::tuple<absl::Status, bool> ConditionProcessor::executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext* context) {
+        return executeOperationRecursively(headers, streamInfo, operators_.begin(), operators_.end(), operands_.begin(), operands_.end(), context);
     }
 
     std::tuple<absl::Status, bool> ConditionProcessor::executeOperationRecursively(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo,
         std::vector<Utility::BooleanOperatorType>::iterator operators_start, std::vector<Utility::BooleanOperatorType>::iterator operators_end,
-        std::vector<std::tuple<std::string, bool>>::iterator operands_start, std::vector<std::tuple<std::string, bool>>::iterator operands_end
+        std::vector<std::tuple<std::string, bool>>::iterator operands_start, std::vector<std::tuple<std::string, bool>>::iterator operands_end,
+        ExecutionContext* context
     ) {
         // find first occurrence of OR operator -- we want to execute this last
         auto OR_iterator = std::find_if(operators_start, operators_end, Utility::isOR);
 
         // if all the operators left are ANDs (or there are no operators left), we can execute this in order
         if (OR_iterator == operators_end) {
-            return executeOperationLinearly(headers, streamInfo, operators_start, operators_end, operands_start, operands_end);
+            return executeOperationLinearly(headers, streamInfo, operators_start, operators_end, operands_start, operands_end, context);
         }
 
         // execute everything else first before doing the OR
-        const std::tuple<absl::Status, bool> left_result = executeOperationRecursively(headers, streamInfo, operators_start, OR_iterator, operands_start, operands_start + std::distance(operators_start, OR_iterator) + 1);
-        const std::tuple<absl::Status, bool> right_result = executeOperationRecursively(headers, streamInfo, OR_iterator + 1, operators_end, operands_start + std::distance(operators_start, OR_iterator) + 1, operands_end);
+        const std::tuple<absl::Status, bool> left_result = executeOperationRecursively(headers, streamInfo, operators_start, OR_iterator, operands_start, operands_start + std::distance(operators_start, OR_iterator) + 1, context);
+        const std::tuple<absl::Status, bool> right_result = executeOperationRecursively(headers, streamInfo, OR_iterator + 1, operators_end, operands_start + std::distance(operators_start, OR_iterator) + 1, operands_end, context);
         
         const absl::Status left_status = std::get<0>(left_result);
         const absl::Status right_status = std::get<0>(right_result);
@@ -526,12 +644,13 @@ namespace HeaderRewriteFilter {
 
     std::tuple<absl::Status, bool> ConditionProcessor::executeOperationLinearly(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo,
         std::vector<Utility::BooleanOperatorType>::iterator operators_start, std::vector<Utility::BooleanOperatorType>::iterator operators_end,
-        std::vector<std::tuple<std::string, bool>>::iterator operands_start, std::vector<std::tuple<std::string, bool>>::iterator operands_end
+        std::vector<std::tuple<std::string, bool>>::iterator operands_start, std::vector<std::tuple<std::string, bool>>::iterator operands_end,
+        ExecutionContext* context
     ) {
         try {
-            const SetBoolProcessorSharedPtr first_bool_processor = bool_processors_->at(std::string(std::get<0>(*operands_start)));
+            SetBoolProcessor& first_bool_processor = *bool_processors_->at(std::get<0>(*operands_start));
             // look up the bool in the map, evaluate the value of the bool, and store the result
-            const std::tuple<absl::Status, bool> bool_var_result = first_bool_processor->executeOperation(headers, streamInfo, std::get<1>(*operands_start));
+            const std::tuple<absl::Status, bool> bool_var_result = first_bool_processor.executeOperation(headers, streamInfo, std::get<1>(*operands_start), context);
             const absl::Status status = std::get<0>(bool_var_result);
             if (status != absl::OkStatus()) {
                 return std::make_tuple(status, false);
@@ -548,9 +667,9 @@ namespace HeaderRewriteFilter {
 
             // continue evaluating the condition from left to right
             while (operators_it != operators_end && operands_it != operands_end) {
-                const SetBoolProcessorSharedPtr next_bool_processor = bool_processors_->at(std::string(std::get<0>((*operands_it))));
+                SetBoolProcessor& next_bool_processor = *bool_processors_->at(std::get<0>(*operands_it));
 
-                const std::tuple<absl::Status, bool> bool_var_result = next_bool_processor->executeOperation(headers, streamInfo, std::get<1>(*operands_it));
+                const std::tuple<absl::Status, bool> bool_var_result = next_bool_processor.executeOperation(headers, streamInfo, std::get<1>(*operands_it), context);
                 const absl::Status status = std::get<0>(bool_var_result);
                 if (status != absl::OkStatus()) {
                     return std::make_tuple(status, false);
@@ -576,8 +695,7 @@ namespace HeaderRewriteFilter {
         if (end != (function_expression.size()-1)) {
             return std::make_tuple(absl::InvalidArgumentError("failed to get function argument -- invalid dynamic function syntax"), "");
         }
-        std::string argument = std::string(function_expression).substr(start+1, end-start-1);
-        return std::make_tuple(absl::OkStatus(), argument);
+        return std::make_tuple(absl::OkStatus(), std::string(function_expression.substr(start+1, end-start-1)));
     } catch (std::exception& e) {
         return std::make_tuple(absl::UnknownError("failed to get function argument"), "");
     }
@@ -599,19 +717,21 @@ namespace HeaderRewriteFilter {
         return absl::OkStatus();
     }
 
-    function_type_ = getFunctionType(function_expression.substr(2, function_expression.size() - Utility::DYNAMIC_FUNCTION_DELIMITER.size()));
+    // the function between the delimiters, e.g. hdr(x-a) in %[hdr(x-a)]
+    const absl::string_view function = function_expression.substr(2, function_expression.size() - Utility::DYNAMIC_FUNCTION_DELIMITER.size());
+    function_type_ = getFunctionType(function);
     if (function_type_ == Utility::FunctionType::InvalidFunctionType) {
         return absl::InvalidArgumentError("invalid function type for dynamic value");
     }
     if (function_type_ == Utility::FunctionType::Urlp && !is_request_) {
         return absl::InvalidArgumentError("cannot get url path parameter on response side");
     }
-    const std::tuple<absl::Status, std::string> get_function_argument_result = getFunctionArgument(function_expression.substr(2, function_expression.size() - Utility::DYNAMIC_FUNCTION_DELIMITER.size()));
+    std::tuple<absl::Status, std::string> get_function_argument_result = getFunctionArgument(function);
     const absl::Status status = std::get<0>(get_function_argument_result);
     if (status != absl::OkStatus()) {
         return status;
     }
-    function_argument_ = std::get<1>(get_function_argument_result);
+    function_argument_ = std::move(std::get<1>(get_function_argument_result));
 
     // validate dynamic function arguments
     const auto arguments = StringUtil::splitToken(function_argument_, ",", false, true);
@@ -620,6 +740,15 @@ namespace HeaderRewriteFilter {
             if (arguments.size() < 1 || arguments.size() > 2) {
                 return absl::InvalidArgumentError("wrong number of arguments to get header function, expected 1 or 2 but got " + std::to_string(arguments.size()));
             }
+            if (arguments.size() == 2) {
+                // the rules execute with the position as std::stoi reads it
+                try {
+                    std::stoi(std::string(arguments.at(1)));
+                } catch (const std::exception&) {
+                    return absl::InvalidArgumentError("header position \"" + std::string(arguments.at(1)) + "\" is not a number");
+                }
+            }
+            inline_header_ = findInlineHeader(arguments.at(0));
             break;
         case Utility::FunctionType::Urlp:
             if (arguments.size() != 1) {
@@ -638,15 +767,70 @@ namespace HeaderRewriteFilter {
     return absl::OkStatus();
   }
 
-  std::tuple<absl::Status, std::string> DynamicFunctionProcessor::getHeaderValue(Http::RequestOrResponseHeaderMap& headers, absl::string_view key, int position) {
-    try {
-        const Http::LowerCaseString header_key(key);
-        const Envoy::Http::HeaderUtility::GetAllOfHeaderAsStringResult header = Envoy::Http::HeaderUtility::getAllOfHeaderAsString(headers, header_key);
+  void DynamicFunctionProcessor::assignHeaderSlot(HeaderSlotTable& header_slot_table) {
+    // inline headers are already O(1) and don't need to be gathered
+    if (function_type_ != Utility::FunctionType::GetHdr || inline_header_) {
+        return;
+    }
+    const auto arguments = StringUtil::splitToken(function_argument_, ",", false, true);
+    header_slot_ = header_slot_table.add(Http::LowerCaseString(arguments.at(0)).get());
+  }
+
+  uint64_t DynamicFunctionProcessor::headerPresenceBit() const {
+    if (function_type_ != Utility::FunctionType::GetHdr) {
+        return 0;
+    }
+    const auto arguments = StringUtil::splitToken(function_argument_, ",", false, true);
+    return HeaderPresence::bit(arguments.at(0));
+  }
+
+  absl::optional<std::string> DynamicFunctionProcessor::inputHeader() const {
+    switch (function_type_) {
+        case Utility::FunctionType::GetHdr:
+        {
+            const auto arguments = StringUtil::splitToken(function_argument_, ",", false, true);
+            return Http::LowerCaseString(arguments.at(0)).get();
+        }
+        case Utility::FunctionType::Urlp:
+            return std::string(":path");
+        default:
+            return absl::nullopt;
+    }
+  }
+
+  bool DynamicFunctionProcessor::mayFailWithoutHeader() const {
+    switch (function_type_) {
+        case Utility::FunctionType::GetHdr: // hdr() of an absent header is empty at any (numeric) position
+        case Utility::FunctionType::Static:
+            return false;
+        case Utility::FunctionType::Urlp:
+            return !is_request_;
+        default: // metadata fails without stream info
+            return true;
+    }
+  }
 
-        if (header.result() == absl::nullopt) { // header does not exist
+  std::tuple<absl::Status, std::string> DynamicFunctionProcessor::getHeaderValue(Http::RequestOrResponseHeaderMap& headers, absl::string_view key, int position) {
+    // inline headers are stored as a single entry, so there is nothing to join
+    if (inline_header_) {
+        const Http::HeaderEntry* entry = inline_header_->get(headers);
+        if (!entry) { // header does not exist
             return std::make_tuple(absl::OkStatus(), "");
         }
-        const absl::string_view values_string_view = header.result().value();
+        return getHeaderValueAtPosition(entry->value().getStringView(), position);
+    }
+
+    const Http::LowerCaseString header_key(key);
+    const Envoy::Http::HeaderUtility::GetAllOfHeaderAsStringResult header = Envoy::Http::HeaderUtility::getAllOfHeaderAsString(headers, header_key);
+
+    if (header.result() == absl::nullopt) { // header does not exist
+        return std::make_tuple(absl::OkStatus(), "");
+    }
+    return getHeaderValueAtPosition(header.result().value(), position);
+  }
+
+  std::tuple<absl::Status, std::string> DynamicFunctionProcessor::getHeaderValueAtPosition(absl::string_view values_string_view, int position) {
+    try {
         const auto header_vals = StringUtil::splitToken(values_string_view, ",", false, true);
         const auto num_header_vals = header_vals.size();
 
@@ -703,12 +887,50 @@ std::tuple<absl::Status, std::string> DynamicFunctionProcessor::getDynamicMetada
     }
 }
 
-  std::tuple<absl::Status, std::string> DynamicFunctionProcessor::executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo) {
+  std::tuple<absl::Status, std::string> DynamicFunctionProcessor::executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo,
+    ExecutionContext* context) {
+    ExecutionContext::CachedValue* cached_value = context ? context->cachedValue(value_slot_) : nullptr;
+    if (!cached_value) {
+        return evaluate(headers, streamInfo, context);
+    }
+
+    // shared function, reuse its value until its input is written
+    if (!context->isFresh(*cached_value, inputWrittenAt(*context))) {
+        std::tuple<absl::Status, std::string> result = evaluate(headers, streamInfo, context);
+        context->store(*cached_value, std::get<0>(result));
+        cached_value->value = std::move(std::get<1>(result));
+    }
+    return std::make_tuple(cached_value->status, cached_value->value);
+  }
+
+  uint64_t DynamicFunctionProcessor::inputWrittenAt(ExecutionContext& context) const {
+    switch (function_type_) {
+        case Utility::FunctionType::GetHdr:
+            return header_slot_ != HeaderSlotTable::NoSlot ? context.headerSlots().slotWrittenAt(header_slot_)
+                                                           : context.headerSlots().unslottedWrittenAt();
+        case Utility::FunctionType::Urlp:
+            return context.headerSlots().pathWrittenAt();
+        case Utility::FunctionType::GetMetadata:
+            return context.metadataWrittenAt();
+        default:
+            return 0;
+    }
+  }
+
+  std::tuple<absl::Status, std::string> DynamicFunctionProcessor::evaluate(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo,
+    ExecutionContext* context) {
     const auto arguments = StringUtil::splitToken(function_argument_, ",", false, true);
     switch (function_type_) {
         case Utility::FunctionType::GetHdr:
         {
             const int position = (arguments.size() == 1) ? -1 : std::stoi(std::string(arguments.at(1))); // get last value if position not specified
+            if (context && header_slot_ != HeaderSlotTable::NoSlot) {
+                const absl::optional<absl::string_view> header_value = context->headerSlots().get(header_slot_);
+                if (!header_value.has_value()) { // header does not exist
+                    return std::make_tuple(absl::OkStatus(), "");
+                }
+                return getHeaderValueAtPosition(header_value.value(), position);
+            }
             const absl::string_view header_key = arguments.at(0);
             return getHeaderValue(headers, header_key, position);
         }
@@ -739,7 +961,7 @@ std::tuple<absl::Status, std::string> DynamicFunctionProcessor::getDynamicMetada
         if (start == operation_expression.end()) {
             throw std::out_of_range("unexpected end of expression");
         }
-        metadata_key_ = std::make_shared<DynamicFunctionProcessor>(bool_processors_, is_request_);
+        metadata_key_ = std::make_shared<DynamicFunctionProcessor>(bool_processors_, is_request_, inline_headers_);
         const absl::Status parse_metadata_key_status =  metadata_key_->parseOperation(*start);
         if (parse_metadata_key_status != absl::OkStatus()) {
             return parse_metadata_key_status;
@@ -749,7 +971,7 @@ std::tuple<absl::Status, std::string> DynamicFunctionProcessor::getDynamicMetada
             throw std::out_of_range("unexpected end of expression");
         }
         const absl::string_view value = *(start + 1);
-        metadata_value_ = std::make_shared<DynamicFunctionProcessor>(bool_processors_, is_request_);
+        metadata_value_ = std::make_shared<DynamicFunctionProcessor>(bool_processors_, is_request_, inline_headers_);
         const absl::Status parse_metadata_value_status = metadata_value_->parseOperation(value);
         if (parse_metadata_value_status != absl::OkStatus()) {
             return parse_metadata_value_status;
@@ -775,9 +997,9 @@ std::tuple<absl::Status, std::string> DynamicFunctionProcessor::getDynamicMetada
     return absl::OkStatus();
   }
 
-  absl::Status SetDynamicMetadataProcessor::executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo) {
+  absl::Status SetDynamicMetadataProcessor::executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext* context) {
     try {
-        const std::tuple<absl::Status, bool> condition_result = evaluateCondition(headers, streamInfo);
+        const std::tuple<absl::Status, bool> condition_result = evaluateCondition(headers, streamInfo, context);
         const absl::Status condition_status = std::get<0>(condition_result);
         if (condition_status != absl::OkStatus()) {
             return condition_status;
@@ -788,7 +1010,7 @@ std::tuple<absl::Status, std::string> DynamicFunctionProcessor::getDynamicMetada
         }
 
         // get key and value to set
-        const std::tuple<absl::Status, std::string> metadata_key_result = metadata_key_->executeOperation(headers, streamInfo);
+        const std::tuple<absl::Status, std::string> metadata_key_result = metadata_key_->executeOperation(headers, streamInfo, context);
         const absl::Status metadata_key_status = std::get<0>(metadata_key_result);
         const std::string key = std::get<1>(metadata_key_result);
         if (metadata_key_status != absl::OkStatus()) {
@@ -798,7 +1020,7 @@ std::tuple<absl::Status, std::string> DynamicFunctionProcessor::getDynamicMetada
             return absl::UnknownError("failed to get dynamic value to set metadata -- no value");
         }
 
-        const std::tuple<absl::Status, std::string> metadata_value_result = metadata_value_->executeOperation(headers, streamInfo);
+        const std::tuple<absl::Status, std::string> metadata_value_result = metadata_value_->executeOperation(headers, streamInfo, context);
         const absl::Status metadata_value_status = std::get<0>(metadata_value_result);
         const std::string value = std::get<1>(metadata_value_result);
         if (metadata_value_status != absl::OkStatus()) {
@@ -823,6 +1045,9 @@ std::tuple<absl::Status, std::string> DynamicFunctionProcessor::getDynamicMetada
         (*filter_struct.mutable_fields())[key] = val;
 
         streamInfo->setDynamicMetadata(std::string(Utility::HEADER_REWRITE_FILTER_NAME), filter_struct);
+        if (context) {
+            context->markMetadataWritten();
+        }
         
         return absl::OkStatus();
     } catch (std::exception& e) {
@@ -830,7 +1055,60 @@ std::tuple<absl::Status, std::string> DynamicFunctionProcessor::getDynamicMetada
     }
   }
 
+  void SetDynamicMetadataProcessor::forEachDynamicFunction(const std::function<void(DynamicFunctionProcessorSharedPtr&)>& cb) {
+    cb(metadata_key_);
+    cb(metadata_value_);
+  }
+
+  void ConstantBatchProcessor::addMutation(absl::string_view key, absl::string_view value, bool append) {
+    const Http::LowerCaseString header_key(key);
+    // mutations of different headers commute, so each header keeps a single merged mutation
+    const auto [index, inserted] = mutation_indices_.try_emplace(header_key.get(), mutations_.size());
+    if (inserted) {
+        mutations_.push_back({header_key, std::string(value), append, findInlineHeader(header_key.get())});
+        return;
+    }
+    Mutation& mutation = mutations_[index->second];
+    if (append) { // appending to a non-empty value adds a ',' delimiter either way
+        mutation.value.push_back(',');
+        mutation.value.append(value.data(), value.size());
+    } else { // the earlier write is overwritten
+        mutation.value = std::string(value);
+        mutation.append = false;
+    }
+  }
+
+  absl::Status ConstantBatchProcessor::executeOperation(Http::RequestOrResponseHeaderMap& headers, [[maybe_unused]] Envoy::StreamInfo::StreamInfo* streamInfo,
+    ExecutionContext* context) {
+    for (const auto& mutation : mutations_) {
+        if (mutation.inline_header) {
+            if (mutation.append) {
+                mutation.inline_header->append(headers, mutation.value);
+            } else {
+                mutation.inline_header->set(headers, mutation.value);
+            }
+            if (context) {
+                context->headerSlots().markPresent(mutation.key.get());
+            }
+            continue;
+        }
+
+        if (mutation.append) {
+            headers.appendCopy(mutation.key, mutation.value);
+            if (context) {
+                context->headerSlots().refresh(headers, mutation.key.get());
+            }
+        } else {
+            headers.setCopy(mutation.key, mutation.value);
+            if (context) {
+                context->headerSlots().set(mutation.key.get(), mutation.value);
+            }
+        }
+    }
+    return absl::OkStatus();
+  }
+
 } // namespace HeaderRewriteFilter
 } // namespace HttpFilters
 } // namespace Extensions
-} // namespace Envoy
\ No newline at end of file
+} // namespace Envoy
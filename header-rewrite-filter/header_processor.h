@@ -1,10 +1,14 @@
 #pragma once
 #include "utility.h"
+#include "inline_headers.h"
+#include "execution_context.h"
 
 #include "source/common/common/utility.h"
 #include "source/common/http/utility.h"
 #include "source/extensions/filters/http/common/pass_through_filter.h"
 
+#include "absl/container/flat_hash_map.h"
+
 #include <string>
 #include <vector>
 
@@ -19,21 +23,49 @@ using SetBoolProcessorMapSharedPtr = std::shared_ptr<std::unordered_map<std::str
 
 class Processor {
 public:
-  Processor(SetBoolProcessorMapSharedPtr bool_processors, bool isRequest) : bool_processors_(bool_processors), is_request_(isRequest)  { }
+  Processor(SetBoolProcessorMapSharedPtr bool_processors, bool isRequest, InlineHeaderTableSharedPtr inline_headers = nullptr)
+    : bool_processors_(bool_processors), is_request_(isRequest), inline_headers_(inline_headers)  { }
   virtual ~Processor() {}
   virtual absl::Status parseOperation([[maybe_unused]] std::vector<absl::string_view>& operation_expression, [[maybe_unused]] std::vector<absl::string_view>::iterator start) { return absl::OkStatus(); }
 
 protected:
   SetBoolProcessorMapSharedPtr bool_processors_;
   const bool is_request_; // header rewrite filter has already verified that the operation is always either http-request or http-response
+  InlineHeaderTableSharedPtr inline_headers_; // inline handles for hot headers, may be null
+
+  // returns the inline handle for a header name on this processor's side, or null if there is none
+  const InlineHeaderHandle* findInlineHeader(absl::string_view header_name) const {
+    return inline_headers_ ? inline_headers_->find(header_name, is_request_) : nullptr;
+  }
 };
 
 class DynamicFunctionProcessor : public Processor {
 public:
-  DynamicFunctionProcessor(SetBoolProcessorMapSharedPtr bool_processors, bool isRequest) : Processor(bool_processors, isRequest) {}
+  DynamicFunctionProcessor(SetBoolProcessorMapSharedPtr bool_processors, bool isRequest, InlineHeaderTableSharedPtr inline_headers = nullptr)
+    : Processor(bool_processors, isRequest, inline_headers) {}
   virtual ~DynamicFunctionProcessor() {}
   virtual absl::Status parseOperation(absl::string_view function_expression);
-  std::tuple<absl::Status, std::string> executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo);
+  std::tuple<absl::Status, std::string> executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo,
+    ExecutionContext* context = nullptr);
+  Utility::FunctionType functionType() const { return function_type_; }
+  const std::string& functionArgument() const { return function_argument_; }
+  // read hdr() through the per-stream header slots instead of the header map
+  void assignHeaderSlot(HeaderSlotTable& header_slot_table);
+  // HeaderPresence bit of the header read by hdr(), 0 for the other functions
+  uint64_t headerPresenceBit() const;
+  // true if the function can fail even when the header it reads (if any) is absent
+  bool mayFailWithoutHeader() const;
+  // true if the function can fail at all (hdr() fails on a bad position of a present header)
+  bool mayFail() const { return function_type_ == Utility::FunctionType::GetHdr || mayFailWithoutHeader(); }
+  // lowercase name of the header the function reads (:path for urlp()), nullopt if it reads none
+  absl::optional<std::string> inputHeader() const;
+  // cache the value in the per-stream ExecutionContext, for functions shared by several rules
+  void setValueSlot(int32_t value_slot) { value_slot_ = value_slot; }
+  int32_t valueSlot() const { return value_slot_; }
+  int32_t headerSlot() const { return header_slot_; }
+  const InlineHeaderHandle* inlineHeader() const { return inline_header_; }
+  // write stamp of the function's input in the current phase, 0 for static strings
+  uint64_t inputWrittenAt(ExecutionContext& context) const;
 
 private:
   using Processor::parseOperation;
@@ -41,23 +73,55 @@ private:
   Utility::FunctionType getFunctionType(absl::string_view function_expression);
   std::tuple<absl::Status, std::string> getUrlp(Http::RequestOrResponseHeaderMap& headers, absl::string_view param);
   std::tuple<absl::Status, std::string> getHeaderValue(Http::RequestOrResponseHeaderMap& headers, absl::string_view key, int position);
+  std::tuple<absl::Status, std::string> getHeaderValueAtPosition(absl::string_view values_string_view, int position);
   std::tuple<absl::Status, std::string> getDynamicMetadata(Envoy::StreamInfo::StreamInfo* streamInfo, absl::string_view key);
+  std::tuple<absl::Status, std::string> evaluate(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo,
+    ExecutionContext* context);
 
   Utility::FunctionType function_type_;
   std::string function_argument_;
+  const InlineHeaderHandle* inline_header_ = nullptr; // set for hdr() on a header with an inline handle
+  int32_t header_slot_ = HeaderSlotTable::NoSlot; // set for hdr() on a slotted header
+  int32_t value_slot_ = ExecutionContext::NoValueSlot;
 };
 
 using DynamicFunctionProcessorSharedPtr = std::shared_ptr<DynamicFunctionProcessor>;
 
 class SetBoolProcessor : public Processor {
 public:
-  SetBoolProcessor(SetBoolProcessorMapSharedPtr bool_processors, bool isRequest) : Processor(bool_processors, isRequest) {}
+  SetBoolProcessor(SetBoolProcessorMapSharedPtr bool_processors, bool isRequest, InlineHeaderTableSharedPtr inline_headers = nullptr)
+    : Processor(bool_processors, isRequest, inline_headers) {}
   virtual ~SetBoolProcessor() {}
   virtual absl::Status parseOperation(std::vector<absl::string_view>& operation_expression, std::vector<absl::string_view>::iterator start);
-  virtual std::tuple<absl::Status, bool> executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo, bool negate); // return status and bool result
+  virtual std::tuple<absl::Status, bool> executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo, bool negate,
+    ExecutionContext* context = nullptr); // return status and bool result
+  void forEachDynamicFunction(const std::function<void(DynamicFunctionProcessorSharedPtr&)>& cb);
+  // HeaderPresence bits of the headers read by the bool; it can't fail while all of them are absent
+  // unless mayFailWithoutHeaders()
+  uint64_t dependencyHeaders() const { return dependency_headers_; }
+  bool mayFailWithoutHeaders() const { return may_fail_without_headers_; }
+  // true if the (non negated) bool is false whenever the header of its hdr() source is absent
+  bool requiresSourceHeader() const { return requires_source_header_; }
+  // value of a bool comparing two static strings, nullopt if the bool depends on the request
+  absl::optional<bool> constantValue() const;
+  const DynamicFunctionProcessorSharedPtr& sourceProcessor() const { return source_processor_; }
+  const DynamicFunctionProcessorSharedPtr& stringToCompareProcessor() const { return string_to_compare_function_processor_; }
+  Utility::MatchType matchType() const { return match_type_; }
+  // cache the result in the per-stream ExecutionContext, for bools referenced by several rules
+  void setValueSlot(int32_t value_slot) { value_slot_ = value_slot; }
+  int32_t valueSlot() const { return value_slot_; }
 
 private:
   absl::Status stringToCompareSetup(absl::string_view string_to_compare);
+  void computeDependencies();
+  // result before negation
+  std::tuple<absl::Status, bool> evaluate(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo,
+    ExecutionContext* context);
+  Utility::MatchType match_type_ = Utility::MatchType::InvalidMatchType;
+  int32_t value_slot_ = ExecutionContext::NoValueSlot;
+  uint64_t dependency_headers_ = 0;
+  bool may_fail_without_headers_ = true;
+  bool requires_source_header_ = false;
   std::function<bool(const std::string, const std::string)> matcher_ = []([[maybe_unused]] const std::string& source, [[maybe_unused]] const std::string& string_to_compare) -> bool { return false; };
   DynamicFunctionProcessorSharedPtr source_processor_ = nullptr;
   DynamicFunctionProcessorSharedPtr string_to_compare_function_processor_ = nullptr;
@@ -65,68 +129,114 @@ private:
 
 class ConditionProcessor : public Processor {
 public:
-  ConditionProcessor(SetBoolProcessorMapSharedPtr bool_processors, bool isRequest) : Processor(bool_processors, isRequest) {}
+  ConditionProcessor(SetBoolProcessorMapSharedPtr bool_processors, bool isRequest, InlineHeaderTableSharedPtr inline_headers = nullptr)
+    : Processor(bool_processors, isRequest, inline_headers) {}
   virtual ~ConditionProcessor() {}
   virtual absl::Status parseOperation(std::vector<absl::string_view>& operation_expression, std::vector<absl::string_view>::iterator start);
-  virtual std::tuple<absl::Status, bool> executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo); // return status and condition result
+  virtual std::tuple<absl::Status, bool> executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo,
+    ExecutionContext* context = nullptr); // return status and condition result
   virtual std::tuple<absl::Status, bool> executeOperationRecursively(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo,
     std::vector<Utility::BooleanOperatorType>::iterator operators_start, std::vector<Utility::BooleanOperatorType>::iterator operators_end,
-    std::vector<std::tuple<std::string, bool>>::iterator operands_start, std::vector<std::tuple<std::string, bool>>::iterator operands_end);
+    std::vector<std::tuple<std::string, bool>>::iterator operands_start, std::vector<std::tuple<std::string, bool>>::iterator operands_end,
+    ExecutionContext* context);
   virtual std::tuple<absl::Status, bool> executeOperationLinearly(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo, 
     std::vector<Utility::BooleanOperatorType>::iterator operators_start, std::vector<Utility::BooleanOperatorType>::iterator operators_end,
-    std::vector<std::tuple<std::string, bool>>::iterator operands_start, std::vector<std::tuple<std::string, bool>>::iterator operands_end);
+    std::vector<std::tuple<std::string, bool>>::iterator operands_start, std::vector<std::tuple<std::string, bool>>::iterator operands_end,
+    ExecutionContext* context);
+  // true if the condition is false (without error) for every header map with the given presence,
+  // so that the rule can be skipped without evaluating it
+  bool provablyFalse(const HeaderPresence& presence) const { return skippable_ && presence.noneOf(dependency_headers_); }
+  bool skippableByPresence() const { return skippable_; }
+  uint64_t dependencyHeaders() const { return dependency_headers_; }
+  const std::vector<Utility::BooleanOperatorType>& operators() const { return operators_; }
+  const std::vector<std::tuple<std::string, bool>>& operands() const { return operands_; }
 
 private:
+  void computeDependencies();
+
   std::vector<Utility::BooleanOperatorType> operators_;
   std::vector<std::tuple<std::string, bool>> operands_; // operand and whether that operand is negated
+  uint64_t dependency_headers_ = 0; // HeaderPresence bits of every header read by the operands
+  bool skippable_ = false; // every AND group has an operand that is false when its header is absent
 };
 
 using ConditionProcessorSharedPtr = std::shared_ptr<ConditionProcessor>;
 
 class HeaderProcessor : public Processor {
 public:
-  HeaderProcessor(SetBoolProcessorMapSharedPtr bool_processors, bool isRequest) : Processor(bool_processors, isRequest) {}
+  HeaderProcessor(SetBoolProcessorMapSharedPtr bool_processors, bool isRequest, InlineHeaderTableSharedPtr inline_headers = nullptr)
+    : Processor(bool_processors, isRequest, inline_headers) {}
   virtual ~HeaderProcessor() {}
-  virtual absl::Status executeOperation([[maybe_unused]] Http::RequestOrResponseHeaderMap& headers, [[maybe_unused]] Envoy::StreamInfo::StreamInfo* streamInfo) { return absl::OkStatus(); }
-  virtual std::tuple<absl::Status, bool> evaluateCondition(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo); // return status and condition result
+  virtual absl::Status executeOperation([[maybe_unused]] Http::RequestOrResponseHeaderMap& headers, [[maybe_unused]] Envoy::StreamInfo::StreamInfo* streamInfo,
+    [[maybe_unused]] ExecutionContext* context = nullptr) { return absl::OkStatus(); }
+  virtual std::tuple<absl::Status, bool> evaluateCondition(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo,
+    ExecutionContext* context = nullptr); // return status and condition result
+  // visit the dynamic functions of the operation (not of its condition), used by config load passes
+  virtual void forEachDynamicFunction([[maybe_unused]] const std::function<void(DynamicFunctionProcessorSharedPtr&)>& cb) {}
+  // true if the rule's condition can be proven false from header presence alone
+  bool skippableByPresence() const { return condition_processor_ && condition_processor_->skippableByPresence(); }
   void setConditionProcessor(ConditionProcessorSharedPtr condition_processor) { condition_processor_ = condition_processor; }
-  ConditionProcessorSharedPtr getConditionProcessor() { return condition_processor_; }
+  const ConditionProcessorSharedPtr& getConditionProcessor() const { return condition_processor_; }
+  // position of the rule among the header rules of its direction, identifies its stats
+  void setRuleIndex(uint32_t rule_index) { rule_index_ = rule_index; }
+  uint32_t ruleIndex() const { return rule_index_; }
 
 protected:
   ConditionProcessorSharedPtr condition_processor_ = nullptr;
+  uint32_t rule_index_ = 0;
   absl::Status ConditionProcessorSetup(std::vector<absl::string_view>& condition_expression, std::vector<absl::string_view>::iterator start);
 };
 
+using HeaderProcessorUniquePtr = std::unique_ptr<HeaderProcessor>;
+
 class SetHeaderProcessor : public HeaderProcessor {
 public:
-  SetHeaderProcessor(SetBoolProcessorMapSharedPtr bool_processors, bool isRequest) : HeaderProcessor(bool_processors, isRequest) {}
+  SetHeaderProcessor(SetBoolProcessorMapSharedPtr bool_processors, bool isRequest, InlineHeaderTableSharedPtr inline_headers = nullptr)
+    : HeaderProcessor(bool_processors, isRequest, inline_headers) {}
   virtual ~SetHeaderProcessor() {}
   virtual absl::Status parseOperation(std::vector<absl::string_view>& operation_expression, std::vector<absl::string_view>::iterator start);
-  virtual absl::Status executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo);
+  virtual absl::Status executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo,
+    ExecutionContext* context = nullptr);
+  virtual void forEachDynamicFunction(const std::function<void(DynamicFunctionProcessorSharedPtr&)>& cb);
+  const DynamicFunctionProcessorSharedPtr& headerKey() const { return header_key_; }
+  const DynamicFunctionProcessorSharedPtr& headerValue() const { return header_val_; }
+  const InlineHeaderHandle* inlineHeader() const { return inline_header_; }
 private:
   DynamicFunctionProcessorSharedPtr header_key_ = nullptr; // header key to set
   DynamicFunctionProcessorSharedPtr header_val_ = nullptr; // header value to set
+  const InlineHeaderHandle* inline_header_ = nullptr; // set when the key is static and has an inline handle
 };
 
 class AppendHeaderProcessor : public HeaderProcessor {
 public:
-  AppendHeaderProcessor(SetBoolProcessorMapSharedPtr bool_processors, bool isRequest) : HeaderProcessor(bool_processors, isRequest) {}
+  AppendHeaderProcessor(SetBoolProcessorMapSharedPtr bool_processors, bool isRequest, InlineHeaderTableSharedPtr inline_headers = nullptr)
+    : HeaderProcessor(bool_processors, isRequest, inline_headers) {}
   virtual ~AppendHeaderProcessor() {}
   virtual absl::Status parseOperation(std::vector<absl::string_view>& operation_expression, std::vector<absl::string_view>::iterator start);
-  virtual absl::Status executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo);
+  virtual absl::Status executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo,
+    ExecutionContext* context = nullptr);
+  virtual void forEachDynamicFunction(const std::function<void(DynamicFunctionProcessorSharedPtr&)>& cb);
+  const DynamicFunctionProcessorSharedPtr& headerKey() const { return header_key_; }
+  const std::vector<DynamicFunctionProcessorSharedPtr>& headerValues() const { return header_vals_; }
+  const InlineHeaderHandle* inlineHeader() const { return inline_header_; }
   
 private:
   DynamicFunctionProcessorSharedPtr header_key_ = nullptr; // header key to set
   std::vector<DynamicFunctionProcessorSharedPtr> header_vals_; // header values to append
+  const InlineHeaderHandle* inline_header_ = nullptr; // set when the key is static and has an inline handle
 };
 
 // Note: path being set here includes the query string
 class SetPathProcessor : public HeaderProcessor {
 public:
-  SetPathProcessor(SetBoolProcessorMapSharedPtr bool_processors, bool isRequest) : HeaderProcessor(bool_processors, isRequest) {}
+  SetPathProcessor(SetBoolProcessorMapSharedPtr bool_processors, bool isRequest, InlineHeaderTableSharedPtr inline_headers = nullptr)
+    : HeaderProcessor(bool_processors, isRequest, inline_headers) {}
   virtual ~SetPathProcessor() {}
   virtual absl::Status parseOperation(std::vector<absl::string_view>& operation_expression, std::vector<absl::string_view>::iterator start);
-  virtual absl::Status executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo);
+  virtual absl::Status executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo,
+    ExecutionContext* context = nullptr);
+  virtual void forEachDynamicFunction(const std::function<void(DynamicFunctionProcessorSharedPtr&)>& cb);
+  const DynamicFunctionProcessorSharedPtr& requestPath() const { return request_path_; }
 
 private:
   DynamicFunctionProcessorSharedPtr request_path_; // path to set
@@ -134,10 +244,15 @@ private:
 
 class SetDynamicMetadataProcessor : public HeaderProcessor {
 public:
-  SetDynamicMetadataProcessor(SetBoolProcessorMapSharedPtr bool_processors, bool isRequest) : HeaderProcessor(bool_processors, isRequest) {}
+  SetDynamicMetadataProcessor(SetBoolProcessorMapSharedPtr bool_processors, bool isRequest, InlineHeaderTableSharedPtr inline_headers = nullptr)
+    : HeaderProcessor(bool_processors, isRequest, inline_headers) {}
   virtual ~SetDynamicMetadataProcessor() {}
   virtual absl::Status parseOperation(std::vector<absl::string_view>& operation_expression, std::vector<absl::string_view>::iterator start);
-  virtual absl::Status executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo);
+  virtual absl::Status executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo,
+    ExecutionContext* context = nullptr);
+  virtual void forEachDynamicFunction(const std::function<void(DynamicFunctionProcessorSharedPtr&)>& cb);
+  const DynamicFunctionProcessorSharedPtr& metadataKey() const { return metadata_key_; }
+  const DynamicFunctionProcessorSharedPtr& metadataValue() const { return metadata_value_; }
 
 private:
   // Note: the values returned by these functions must not outlive the SetDynamicMetadataProcessor object
@@ -145,6 +260,36 @@ private:
   DynamicFunctionProcessorSharedPtr metadata_value_ = nullptr;
 };
 
+// Unconditional set-header/append-header operations with static keys and values, merged by the
+// rule optimizer into one batch with at most one mutation per header.
+class ConstantBatchProcessor : public HeaderProcessor {
+public:
+  ConstantBatchProcessor(bool isRequest, InlineHeaderTableSharedPtr inline_headers = nullptr)
+    : HeaderProcessor(nullptr, isRequest, inline_headers) {}
+  virtual ~ConstantBatchProcessor() {}
+  virtual absl::Status executeOperation(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo,
+    ExecutionContext* context = nullptr);
+  // merge a constant set (append = false) or append into the batch, values must not be empty
+  void addMutation(absl::string_view key, absl::string_view value, bool append);
+  size_t size() const { return mutations_.size(); }
+  // indices of the rules merged into the batch
+  void addRuleIndex(uint32_t rule_index) { rule_indices_.push_back(rule_index); }
+  const std::vector<uint32_t>& ruleIndices() const { return rule_indices_; }
+
+  struct Mutation {
+    Http::LowerCaseString key;
+    std::string value;
+    bool append;
+    const InlineHeaderHandle* inline_header;
+  };
+  const std::vector<Mutation>& mutations() const { return mutations_; }
+
+private:
+  std::vector<Mutation> mutations_;
+  absl::flat_hash_map<std::string, size_t> mutation_indices_; // index in mutations_ by header key
+  std::vector<uint32_t> rule_indices_;
+};
+
 } // namespace HeaderRewriteFilter
 } // namespace HttpFilters
 } // namespace Extensions
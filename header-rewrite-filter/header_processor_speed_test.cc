@@ -0,0 +1,257 @@
+// Note: this should be run with --compilation_mode=opt, and would benefit from a
+// quiescent system with disabled cstate power management.
+//
+// Measures each processor in isolation, without the program, its caches or its header slots, on
+// request headers with header_count other headers of value_size bytes. The allocs_per_request
+// counters count the allocations of the measured call only; they need the binary built without
+// tcmalloc (--define tcmalloc=disabled), whose operator new can't be replaced, and are left out
+// otherwise.
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "header_processor.h"
+#include "source/common/common/utility.h"
+#include "test/mocks/stream_info/mocks.h"
+#include "test/test_common/utility.h"
+
+#include "absl/strings/str_cat.h"
+
+#if !defined(TCMALLOC) && !defined(GPERFTOOLS_TCMALLOC)
+#define HEADER_REWRITE_COUNT_ALLOCATIONS
+
+namespace {
+std::atomic<uint64_t> allocations{0};
+} // namespace
+
+void* operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+#endif
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+namespace {
+
+using testing::NiceMock;
+using testing::ReturnRef;
+
+// Counts the allocations of the measured calls, and reports them per iteration.
+class AllocationCounter {
+public:
+  // runs f, counting its allocations
+  template <class F> void count(F&& f) {
+#ifdef HEADER_REWRITE_COUNT_ALLOCATIONS
+    const uint64_t before = allocations.load(std::memory_order_relaxed);
+    f();
+    counted_ += allocations.load(std::memory_order_relaxed) - before;
+#else
+    f();
+#endif
+  }
+
+  void report(benchmark::State& state) const {
+#ifdef HEADER_REWRITE_COUNT_ALLOCATIONS
+    state.counters["allocs_per_request"] =
+        benchmark::Counter(static_cast<double>(counted_), benchmark::Counter::kAvgIterations);
+#else
+    (void)state;
+#endif
+  }
+
+private:
+  uint64_t counted_ = 0;
+};
+
+// Request headers read by the processors: x-target and x-list among header_count others, every value
+// value_size bytes long.
+Http::TestRequestHeaderMapImpl requestHeaders(int64_t header_count, int64_t value_size) {
+  const std::string value(value_size, 'v');
+  Http::TestRequestHeaderMapImpl headers{{":method", "GET"},
+                                         {":path", "/api/items?page=1&version=" + value},
+                                         {":authority", "host"}};
+  for (int64_t i = 0; i < header_count; i++) {
+    headers.addCopy(Http::LowerCaseString("x-other-" + std::to_string(i)), value);
+  }
+  headers.addCopy(Http::LowerCaseString("x-target"), "target-" + value);
+  headers.addCopy(Http::LowerCaseString("x-list"), "first," + value + ",last");
+  return headers;
+}
+
+// Stream info with the dynamic metadata read by metadata()
+class BenchmarkStreamInfo {
+public:
+  explicit BenchmarkStreamInfo(int64_t value_size) {
+    ProtobufWkt::Struct values;
+    (*values.mutable_fields())["key"].set_string_value(std::string(value_size, 'v'));
+    ProtobufWkt::Struct keys;
+    *(*keys.mutable_fields())["key"].mutable_struct_value() = values;
+    (*metadata_.mutable_filter_metadata())["envoy.extensions.filters.http.HeaderRewrite"] = keys;
+    ON_CALL(stream_info_, dynamicMetadata()).WillByDefault(ReturnRef(metadata_));
+    ON_CALL(testing::Const(stream_info_), dynamicMetadata()).WillByDefault(ReturnRef(metadata_));
+  }
+
+  StreamInfo::StreamInfo* get() { return &stream_info_; }
+
+private:
+  envoy::config::core::v3::Metadata metadata_;
+  NiceMock<StreamInfo::MockStreamInfo> stream_info_;
+};
+
+// parses a rule's operation into processor, aborting the benchmark on an invalid rule
+template <class P> void parseRule(P& processor, const std::string& rule, benchmark::State& state) {
+  std::vector<absl::string_view> tokens = StringUtil::splitToken(rule, " ", false, true);
+  const absl::Status status = processor.parseOperation(tokens, tokens.begin() + 2);
+  if (!status.ok()) {
+    state.SkipWithError(std::string(status.message()).c_str());
+  }
+}
+
+const std::vector<int64_t> HeaderCounts = {4, 32};
+const std::vector<int64_t> ValueSizes = {16, 256};
+
+// Evaluates one dynamic function per type: hdr(), hdr() at a position, urlp(), metadata() and a
+// static string.
+void bmDynamicFunction(benchmark::State& state) {
+  static const std::vector<std::string> functions = {"%[hdr(x-target)]", "%[hdr(x-list,1)]", "%[urlp(version)]",
+                                                     "%[metadata(key)]", "static-value"};
+  const std::string& function = functions[state.range(0)];
+  state.SetLabel(function);
+  Http::TestRequestHeaderMapImpl headers = requestHeaders(state.range(1), state.range(2));
+  BenchmarkStreamInfo stream_info(state.range(2));
+  DynamicFunctionProcessor processor(nullptr, true);
+  if (!processor.parseOperation(function).ok()) {
+    state.SkipWithError("invalid function");
+  }
+  AllocationCounter allocation_counter;
+  for (auto _ : state) { // NOLINT
+    allocation_counter.count([&]() { benchmark::DoNotOptimize(processor.executeOperation(headers, stream_info.get())); });
+  }
+  allocation_counter.report(state);
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(bmDynamicFunction)->ArgsProduct({{0, 1, 2, 3, 4}, HeaderCounts, ValueSizes});
+
+// Evaluates a set-bool of each match type on hdr(x-target), true on the benchmark headers: -m str,
+// -m beg, -m sub and -m found.
+void bmSetBool(benchmark::State& state) {
+  const std::string value(state.range(2), 'v');
+  const std::vector<std::string> arguments = {"target-" + value, "target-", value.substr(1), ""};
+  static const std::vector<std::string> matches = {"-m str", "-m beg", "-m sub", "-m found"};
+  const std::string rule = absl::StrCat("http-request set-bool is_target %[hdr(x-target)] ", matches[state.range(0)],
+                                        " ", arguments[state.range(0)]);
+  state.SetLabel(matches[state.range(0)]);
+  Http::TestRequestHeaderMapImpl headers = requestHeaders(state.range(1), state.range(2));
+  SetBoolProcessor processor(nullptr, true);
+  parseRule(processor, rule, state);
+  AllocationCounter allocation_counter;
+  for (auto _ : state) { // NOLINT
+    allocation_counter.count([&]() { benchmark::DoNotOptimize(processor.executeOperation(headers, nullptr, false)); });
+  }
+  allocation_counter.report(state);
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(bmSetBool)->ArgsProduct({{0, 1, 2, 3}, HeaderCounts, ValueSizes});
+
+// Evaluates a condition over operand_count bools, half of them true, joined by and (0), or (1), or
+// alternating and / or with every other operand negated (2).
+void bmCondition(benchmark::State& state) {
+  static const std::vector<std::string> mixes = {"and", "or", "and/or/not"};
+  const int64_t mix = state.range(0);
+  const int64_t operand_count = state.range(1);
+  state.SetLabel(mixes[mix]);
+  auto bool_processors = std::make_shared<std::unordered_map<std::string, SetBoolProcessorSharedPtr>>();
+  std::string condition;
+  for (int64_t i = 0; i < operand_count; i++) {
+    const std::string name = "b" + std::to_string(i);
+    auto bool_processor = std::make_shared<SetBoolProcessor>(bool_processors, true);
+    parseRule(*bool_processor,
+              "http-request set-bool " + name + " %[hdr(" + (i % 2 == 0 ? "x-target" : "x-absent") + ")] -m found",
+              state);
+    bool_processors->insert({name, bool_processor});
+    if (i > 0) {
+      condition += mix == 0 || (mix == 2 && i % 2 == 0) ? " and " : " or ";
+    }
+    condition += mix == 2 && i % 2 == 1 ? "not " + name : name;
+  }
+  Http::TestRequestHeaderMapImpl headers = requestHeaders(state.range(2), state.range(3));
+  ConditionProcessor processor(bool_processors, true);
+  std::vector<absl::string_view> tokens = StringUtil::splitToken(condition, " ", false, true);
+  if (!processor.parseOperation(tokens, tokens.begin()).ok()) {
+    state.SkipWithError("invalid condition");
+  }
+  AllocationCounter allocation_counter;
+  for (auto _ : state) { // NOLINT
+    allocation_counter.count([&]() { benchmark::DoNotOptimize(processor.executeOperation(headers, nullptr)); });
+  }
+  allocation_counter.report(state);
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(bmCondition)->ArgsProduct({{0, 1, 2}, {2, 8}, HeaderCounts, ValueSizes});
+
+// Executes rule_count rules of one header operation, each writing hdr(x-target) to its own header
+// or metadata key: set-header, append-header, set-path and set-metadata. The headers are copied
+// before every request, as the operations modify them; only the rules' allocations are counted.
+void bmHeaderOperation(benchmark::State& state) {
+  static const std::vector<std::string> operations = {"set-header", "append-header", "set-path", "set-metadata"};
+  const std::string& operation = operations[state.range(0)];
+  state.SetLabel(operation);
+  std::vector<std::unique_ptr<HeaderProcessor>> processors;
+  for (int64_t i = 0; i < state.range(1); i++) {
+    const std::string key = "x-out-" + std::to_string(i);
+    std::unique_ptr<HeaderProcessor> processor;
+    std::string rule;
+    switch (state.range(0)) {
+    case 0:
+      processor = std::make_unique<SetHeaderProcessor>(nullptr, true);
+      rule = "http-request set-header " + key + " %[hdr(x-target)]";
+      break;
+    case 1:
+      processor = std::make_unique<AppendHeaderProcessor>(nullptr, true);
+      rule = "http-request append-header " + key + " %[hdr(x-target)] static-value";
+      break;
+    case 2:
+      processor = std::make_unique<SetPathProcessor>(nullptr, true);
+      rule = "http-request set-path /rewritten/%[hdr(x-target)]";
+      break;
+    default:
+      processor = std::make_unique<SetDynamicMetadataProcessor>(nullptr, true);
+      rule = "http-request set-metadata " + key + " %[hdr(x-target)]";
+      break;
+    }
+    parseRule(*processor, rule, state);
+    processors.push_back(std::move(processor));
+  }
+  const Http::TestRequestHeaderMapImpl request_headers = requestHeaders(state.range(2), state.range(3));
+  NiceMock<StreamInfo::MockStreamInfo> stream_info;
+  AllocationCounter allocation_counter;
+  for (auto _ : state) { // NOLINT
+    Http::TestRequestHeaderMapImpl headers = request_headers;
+    allocation_counter.count([&]() {
+      for (const auto& processor : processors) {
+        benchmark::DoNotOptimize(processor->executeOperation(headers, &stream_info));
+      }
+    });
+  }
+  allocation_counter.report(state);
+  state.SetItemsProcessed(state.iterations() * state.range(1));
+}
+BENCHMARK(bmHeaderOperation)->ArgsProduct({{0, 1, 2, 3}, {1, 16}, HeaderCounts, ValueSizes});
+
+} // namespace
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -1,24 +1,52 @@
+#include <map>
+#include <random>
+#include <thread>
+
 #include "gtest/gtest.h"
 #include "gmock/gmock.h"
+#include "compiled_rules.h"
 #include "header_processor.h"
+#include "header_rewrite.h"
+#include "program.h"
+#include "program_codegen.h"
+#include "program_file.h"
+#include "program_registry.h"
+#include "rule_optimizer.h"
 #include "source/common/common/utility.h"
 #include "source/common/config/metadata.h"
 #include "source/extensions/filters/http/common/pass_through_filter.h"
 #include "test/integration/http_integration.h"
+#include "test/mocks/filesystem/mocks.h"
+#include "test/mocks/http/mocks.h"
+#include "test/mocks/server/admin.h"
+#include "test/mocks/server/admin_stream.h"
+#include "test/mocks/server/factory_context.h"
+#include "test/mocks/server/server_factory_context.h"
+#include "test/test_common/environment.h"
 
 namespace Envoy {
 namespace Extensions {
 namespace HttpFilters {
 namespace HeaderRewriteFilter {
 
+using ::testing::_;
+using ::testing::Return;
 using ::testing::ReturnRef;
 using ::testing::Invoke;
+using ::testing::DoAll;
+using ::testing::SaveArg;
 
 class ProcessorTest : public ::testing::Test {
 protected:
     void SetUp() override { }
 };
 
+// registered at static initialization, before Envoy finalizes the inline header registry
+Http::RegisterCustomInlineHeader<Http::CustomInlineHeaderRegistry::Type::RequestHeaders>
+    inline_test_header(Http::LowerCaseString("x-inline-test"));
+Http::RegisterCustomInlineHeader<Http::CustomInlineHeaderRegistry::Type::RequestHeaders>
+    inline_cookie_header(Http::LowerCaseString("cookie"));
+
 using SetBoolProcessorSharedPtr = std::shared_ptr<SetBoolProcessor>;
 using SetBoolProcessorMapSharedPtr = std::shared_ptr<std::unordered_map<std::string, SetBoolProcessorSharedPtr>>;
 
@@ -362,6 +390,1584 @@ TEST_F(ProcessorTest, DynamicMetadataTest) {
     }
 }
 
+TEST_F(ProcessorTest, InlineHeaderTest) {
+    Envoy::StreamInfo::MockStreamInfo* stream_info;
+    std::shared_ptr<InlineHeaderTable> inline_headers = std::make_shared<InlineHeaderTable>();
+    EXPECT_TRUE(inline_headers->add("X-Inline-Test") == absl::OkStatus()); // custom inline header, names are case insensitive
+    EXPECT_TRUE(inline_headers->add("user-agent") == absl::OkStatus()); // built in inline header
+    EXPECT_TRUE(inline_headers->add("not-registered").code() == absl::StatusCode::kInvalidArgument);
+    EXPECT_NE(inline_headers->find("x-inline-test", true), nullptr);
+    EXPECT_EQ(inline_headers->find("x-inline-test", false), nullptr); // only registered for requests
+    EXPECT_EQ(inline_headers->find("not-registered", true), nullptr);
+
+    Http::TestRequestHeaderMapImpl headers{
+        {":method", "GET"}, {":path", "/"}, {":authority", "host"}, {"user-agent", "agent1,agent2"}};
+
+    // set-header and append-header through the inline handle
+    std::vector<absl::string_view> operation_expression = {"http-request", "set-header", "x-inline-test", "value1"};
+    SetHeaderProcessor set_header_processor = SetHeaderProcessor(nullptr, true, inline_headers);
+    absl::Status status = set_header_processor.parseOperation(operation_expression, operation_expression.begin() + 2);
+    EXPECT_TRUE(status == absl::OkStatus());
+    status = set_header_processor.executeOperation(headers, stream_info);
+    EXPECT_TRUE(status == absl::OkStatus());
+    EXPECT_EQ("value1", headers.get(Http::LowerCaseString("x-inline-test"))[0]->value().getStringView());
+
+    operation_expression = {"http-request", "append-header", "x-inline-test", "value2", "value3"};
+    AppendHeaderProcessor append_header_processor = AppendHeaderProcessor(nullptr, true, inline_headers);
+    status = append_header_processor.parseOperation(operation_expression, operation_expression.begin() + 2);
+    EXPECT_TRUE(status == absl::OkStatus());
+    status = append_header_processor.executeOperation(headers, stream_info);
+    EXPECT_TRUE(status == absl::OkStatus());
+    EXPECT_EQ("value1,value2,value3", headers.get(Http::LowerCaseString("x-inline-test"))[0]->value().getStringView());
+
+    // cookies are joined with "; " whether appended inline or not
+    EXPECT_TRUE(inline_headers->add("cookie") == absl::OkStatus());
+    operation_expression = {"http-request", "append-header", "cookie", "b=2"};
+    for (const auto& table : {std::shared_ptr<InlineHeaderTable>(), inline_headers}) {
+        Http::TestRequestHeaderMapImpl cookie_headers{{":method", "GET"}, {":path", "/"}, {":authority", "host"}, {"cookie", "a=1"}};
+        AppendHeaderProcessor append_cookie_processor = AppendHeaderProcessor(nullptr, true, table);
+        EXPECT_TRUE(append_cookie_processor.parseOperation(operation_expression, operation_expression.begin() + 2) == absl::OkStatus());
+        EXPECT_TRUE(append_cookie_processor.executeOperation(cookie_headers, stream_info) == absl::OkStatus());
+        EXPECT_EQ("a=1; b=2", cookie_headers.get_("cookie"));
+    }
+
+    // hdr() reads through the inline handle, positions behave as for any other header
+    std::vector<std::tuple<absl::string_view, bool>> bool_test_cases = {
+        {"http-request set-bool mock_bool %[hdr(x-inline-test,1)] -m str value2", true},
+        {"http-request set-bool mock_bool %[hdr(x-inline-test)] -m str value3", true},
+        {"http-request set-bool mock_bool %[hdr(user-agent,0)] -m str agent1", true},
+        {"http-request set-bool mock_bool %[hdr(user-agent)] -m beg agent", true},
+        {"http-request set-bool mock_bool %[hdr(x-inline-test)] -m str value1", false}
+    };
+    for (const auto& test_case : bool_test_cases) {
+        std::vector<absl::string_view> tokens = StringUtil::splitToken(std::get<0>(test_case), " ", false, true);
+        SetBoolProcessor set_bool_processor = SetBoolProcessor(nullptr, true, inline_headers);
+        status = set_bool_processor.parseOperation(tokens, tokens.begin() + 2);
+        EXPECT_TRUE(status == absl::OkStatus());
+        std::tuple<absl::Status, bool> result = set_bool_processor.executeOperation(headers, stream_info, false);
+        EXPECT_TRUE(std::get<0>(result) == absl::OkStatus());
+        EXPECT_EQ(std::get<1>(test_case), std::get<1>(result));
+    }
+}
+
+TEST_F(ProcessorTest, HeaderSlotsTest) {
+    Envoy::StreamInfo::MockStreamInfo* stream_info;
+    HeaderSlotTable header_slot_table;
+    const uint32_t multi_slot = header_slot_table.add("x-multi");
+    const uint32_t missing_slot = header_slot_table.add("x-missing");
+    EXPECT_EQ(multi_slot, header_slot_table.add("x-multi")); // names are deduplicated
+    EXPECT_EQ(HeaderSlotTable::NoSlot, header_slot_table.find("x-other"));
+
+    // entries of a header are joined like getAllOfHeaderAsString
+    Http::TestRequestHeaderMapImpl headers{
+        {":method", "GET"}, {":path", "/"}, {":authority", "host"}, {"x-multi", "a"}, {"x-multi", "b"}};
+    ExecutionContext context;
+    context.beginPhase(header_slot_table, headers);
+    EXPECT_EQ("a,b", context.headerSlots().get(multi_slot).value());
+    EXPECT_FALSE(context.headerSlots().get(missing_slot).has_value());
+
+    // hdr() reads from the slots and sees values written by earlier operations
+    std::vector<absl::string_view> operation_expression = {"http-request", "set-header", "x-missing", "written"};
+    SetHeaderProcessor set_header_processor = SetHeaderProcessor(nullptr, true);
+    absl::Status status = set_header_processor.parseOperation(operation_expression, operation_expression.begin() + 2);
+    EXPECT_TRUE(status == absl::OkStatus());
+    status = set_header_processor.executeOperation(headers, stream_info, &context);
+    EXPECT_TRUE(status == absl::OkStatus());
+    EXPECT_EQ("written", context.headerSlots().get(missing_slot).value());
+
+    operation_expression = {"http-request", "append-header", "x-multi", "c"};
+    AppendHeaderProcessor append_header_processor = AppendHeaderProcessor(nullptr, true);
+    status = append_header_processor.parseOperation(operation_expression, operation_expression.begin() + 2);
+    EXPECT_TRUE(status == absl::OkStatus());
+    status = append_header_processor.executeOperation(headers, stream_info, &context);
+    EXPECT_TRUE(status == absl::OkStatus());
+    // appendCopy appends to the first entry of the header
+    EXPECT_EQ("a,c,b", context.headerSlots().get(multi_slot).value());
+
+    std::vector<std::tuple<absl::string_view, bool>> bool_test_cases = {
+        {"http-request set-bool mock_bool %[hdr(x-multi,1)] -m str c", true},
+        {"http-request set-bool mock_bool %[hdr(x-multi)] -m str b", true},
+        {"http-request set-bool mock_bool %[hdr(x-missing)] -m str written", true},
+        {"http-request set-bool mock_bool %[hdr(x-multi,0)] -m str b", false}
+    };
+    for (const auto& test_case : bool_test_cases) {
+        std::vector<absl::string_view> tokens = StringUtil::splitToken(std::get<0>(test_case), " ", false, true);
+        SetBoolProcessor set_bool_processor = SetBoolProcessor(nullptr, true);
+        status = set_bool_processor.parseOperation(tokens, tokens.begin() + 2);
+        EXPECT_TRUE(status == absl::OkStatus());
+        set_bool_processor.forEachDynamicFunction([&header_slot_table](DynamicFunctionProcessorSharedPtr& function_processor) {
+            function_processor->assignHeaderSlot(header_slot_table);
+        });
+        // reading through the slots matches reading the header map
+        std::tuple<absl::Status, bool> slot_result = set_bool_processor.executeOperation(headers, stream_info, false, &context);
+        std::tuple<absl::Status, bool> map_result = set_bool_processor.executeOperation(headers, stream_info, false);
+        EXPECT_TRUE(std::get<0>(slot_result) == absl::OkStatus());
+        EXPECT_EQ(std::get<1>(test_case), std::get<1>(slot_result));
+        EXPECT_EQ(std::get<1>(map_result), std::get<1>(slot_result));
+    }
+}
+
+TEST_F(ProcessorTest, PresenceSkipTest) {
+    Envoy::StreamInfo::MockStreamInfo* stream_info;
+    SetBoolProcessorMapSharedPtr bool_processors = std::make_shared<std::unordered_map<std::string, SetBoolProcessorSharedPtr>>();
+    std::vector<absl::string_view> bool_definitions = {
+        "http-request set-bool has_tenant %[hdr(x-tenant)] -m found",
+        "http-request set-bool is_beta %[hdr(x-channel)] -m str beta",
+        "http-request set-bool is_static static -m str static",
+        "http-request set-bool by_metadata %[metadata(key)] -m found"
+    };
+    for (const auto definition : bool_definitions) {
+        std::vector<absl::string_view> tokens = StringUtil::splitToken(definition, " ", false, true);
+        SetBoolProcessorSharedPtr bool_processor = std::make_shared<SetBoolProcessor>(bool_processors, true);
+        EXPECT_TRUE(bool_processor->parseOperation(tokens, tokens.begin() + 2) == absl::OkStatus());
+        bool_processors->insert({std::string(tokens.at(2)), bool_processor});
+    }
+
+    // only conditions that are false whenever their headers are absent can be skipped
+    std::vector<std::tuple<absl::string_view, bool>> condition_test_cases = {
+        {"has_tenant", true},
+        {"has_tenant and is_static", true},
+        {"has_tenant or is_beta", true},
+        {"is_static and has_tenant or is_beta and not is_static", true},
+        {"not has_tenant", false},
+        {"has_tenant or is_static", false},
+        {"is_static", false},
+        {"has_tenant and by_metadata", false} // metadata can fail whether or not x-tenant is present
+    };
+
+    HeaderSlotTable header_slot_table;
+    header_slot_table.trackPresence();
+    Http::TestRequestHeaderMapImpl headers{
+        {":method", "GET"}, {":path", "/"}, {":authority", "host"}, {"x-other", "value"}};
+    ExecutionContext context;
+    context.beginPhase(header_slot_table, headers);
+    EXPECT_FALSE(context.headerSlots().presence().noneOf(HeaderPresence::bit("X-Other")));
+
+    for (const auto& test_case : condition_test_cases) {
+        std::vector<absl::string_view> tokens = StringUtil::splitToken(std::get<0>(test_case), " ", false, true);
+        ConditionProcessor condition_processor = ConditionProcessor(bool_processors, true);
+        EXPECT_TRUE(condition_processor.parseOperation(tokens, tokens.begin()) == absl::OkStatus());
+        EXPECT_EQ(std::get<1>(test_case), condition_processor.skippableByPresence());
+        EXPECT_EQ(std::get<1>(test_case), condition_processor.provablyFalse(context.headerSlots().presence()));
+        if (std::get<1>(test_case)) {
+            // the skipped condition evaluates to false
+            std::tuple<absl::Status, bool> result = condition_processor.executeOperation(headers, stream_info);
+            EXPECT_TRUE(std::get<0>(result) == absl::OkStatus());
+            EXPECT_FALSE(std::get<1>(result));
+        }
+    }
+
+    // a rule is no longer skipped once an earlier rule writes the header it depends on
+    std::vector<absl::string_view> operation_expression = {"http-request", "set-header", "x-tenant", "acme", "if", "has_tenant"};
+    SetHeaderProcessor conditional_processor = SetHeaderProcessor(bool_processors, true);
+    EXPECT_TRUE(conditional_processor.parseOperation(operation_expression, operation_expression.begin() + 2) == absl::OkStatus());
+    EXPECT_TRUE(conditional_processor.skippableByPresence());
+    std::tuple<absl::Status, bool> condition_result = conditional_processor.evaluateCondition(headers, stream_info, &context);
+    EXPECT_TRUE(std::get<0>(condition_result) == absl::OkStatus());
+    EXPECT_FALSE(std::get<1>(condition_result));
+
+    operation_expression = {"http-request", "set-header", "x-tenant", "acme"};
+    SetHeaderProcessor set_header_processor = SetHeaderProcessor(bool_processors, true);
+    EXPECT_TRUE(set_header_processor.parseOperation(operation_expression, operation_expression.begin() + 2) == absl::OkStatus());
+    EXPECT_TRUE(set_header_processor.executeOperation(headers, stream_info, &context) == absl::OkStatus());
+    EXPECT_FALSE(context.headerSlots().presence().noneOf(HeaderPresence::bit("x-tenant")));
+    condition_result = conditional_processor.evaluateCondition(headers, stream_info, &context);
+    EXPECT_TRUE(std::get<0>(condition_result) == absl::OkStatus());
+    EXPECT_TRUE(std::get<1>(condition_result));
+}
+
+// parse request rules the way the filter config does
+void parseRequestRules(const std::vector<absl::string_view>& rules, std::vector<HeaderProcessorUniquePtr>& header_processors,
+                       SetBoolProcessorMapSharedPtr bool_processors) {
+    for (const auto rule : rules) {
+        std::vector<absl::string_view> tokens = StringUtil::splitToken(rule, " ", false, true);
+        const Utility::OperationType operation_type = Utility::StringToOperationType(tokens.at(1));
+        if (operation_type == Utility::OperationType::SetBool) {
+            SetBoolProcessorSharedPtr bool_processor = std::make_shared<SetBoolProcessor>(bool_processors, true);
+            ASSERT_TRUE(bool_processor->parseOperation(tokens, tokens.begin() + 2) == absl::OkStatus());
+            bool_processors->insert({std::string(tokens.at(2)), bool_processor});
+            continue;
+        }
+        HeaderProcessorUniquePtr processor;
+        if (operation_type == Utility::OperationType::SetHeader) {
+            processor = std::make_unique<SetHeaderProcessor>(bool_processors, true);
+        } else if (operation_type == Utility::OperationType::AppendHeader) {
+            processor = std::make_unique<AppendHeaderProcessor>(bool_processors, true);
+        } else {
+            processor = std::make_unique<SetPathProcessor>(bool_processors, true);
+        }
+        ASSERT_TRUE(processor->parseOperation(tokens, tokens.begin() + 2) == absl::OkStatus());
+        header_processors.push_back(std::move(processor));
+    }
+}
+
+// Request rules parsed as written, the reference, and parsed, optimized and compiled the way the
+// filter config does
+struct CompiledRequestRules {
+    CompiledRequestRules(const std::vector<absl::string_view>& rules, const BoolTrueRates* true_rates = nullptr,
+                         bool decision_dag = false)
+        : reference_bools(std::make_shared<std::unordered_map<std::string, SetBoolProcessorSharedPtr>>()),
+          bools(std::make_shared<std::unordered_map<std::string, SetBoolProcessorSharedPtr>>()) {
+        parseRequestRules(rules, reference_processors, reference_bools);
+        parseRequestRules(rules, processors, bools);
+        value_slots = RuleOptimizer::optimize(processors, *bools, true, nullptr).value_slots;
+        HttpHeaderRewriteFilterConfig::assignHeaderSlots(processors, bools, header_slot_table);
+        program = Program::compile(processors, *bools, true_rates, decision_dag);
+    }
+
+    // executes the reference processors and compiled on copies of headers, expecting the same
+    // headers and error; returns false if the reference failed
+    bool expectSameAsReference(const Program& compiled, const Http::TestRequestHeaderMapImpl& headers,
+                               ExecutionContext& context, uint64_t* bool_counts = nullptr) const {
+        Envoy::StreamInfo::MockStreamInfo* stream_info = nullptr;
+        Http::TestRequestHeaderMapImpl reference_headers = headers;
+        absl::Status reference_status;
+        for (const auto& processor : reference_processors) {
+            reference_status = processor->executeOperation(reference_headers, stream_info);
+            if (!reference_status.ok()) {
+                break;
+            }
+        }
+
+        Http::TestRequestHeaderMapImpl program_headers = headers;
+        context.beginPhase(header_slot_table, program_headers, value_slots, nullptr, bool_counts);
+        const ExecutionError program_error = compiled.execute(program_headers, stream_info, context);
+        EXPECT_EQ(reference_status.ok(), program_error == ExecutionError::None);
+        // the processors prefix the errors of header values with the operation, and report an
+        // exception a condition caught by its what() rather than by the error the program detects
+        if (!reference_status.ok() && !absl::StartsWith(reference_status.message(), "failed to process condition -- ")) {
+            EXPECT_THAT(std::string(reference_status.message()),
+                        testing::EndsWith(std::string(executionErrorMessage(program_error))));
+        }
+        EXPECT_EQ(reference_headers, program_headers);
+        return reference_status.ok();
+    }
+
+    std::vector<HeaderProcessorUniquePtr> reference_processors;
+    SetBoolProcessorMapSharedPtr reference_bools;
+    std::vector<HeaderProcessorUniquePtr> processors;
+    SetBoolProcessorMapSharedPtr bools;
+    HeaderSlotTable header_slot_table;
+    size_t value_slots = 0;
+    std::unique_ptr<const Program> program;
+};
+
+TEST_F(ProcessorTest, RuleOptimizerTest) {
+    Envoy::StreamInfo::MockStreamInfo* stream_info;
+    const std::vector<absl::string_view> rules = {
+        "http-request set-bool always static -m str static",
+        "http-request set-bool never static -m str other",
+        "http-request set-bool unused %[hdr(x-a)] -m found",
+        "http-request set-bool has_a %[hdr(x-a)] -m found",
+        "http-request set-header x-const one",
+        "http-request set-header x-copy %[hdr(x-a)] if has_a", // can fail, constant rules can't move above it
+        "http-request append-header x-const two three",
+        "http-request set-header x-dead first if always", // overwritten below
+        "http-request set-header x-never value if never",
+        "http-request set-path /new if always",
+        "http-request set-header x-dead second"
+    };
+
+    std::vector<HeaderProcessorUniquePtr> reference_processors;
+    SetBoolProcessorMapSharedPtr reference_bools = std::make_shared<std::unordered_map<std::string, SetBoolProcessorSharedPtr>>();
+    parseRequestRules(rules, reference_processors, reference_bools);
+    std::vector<HeaderProcessorUniquePtr> optimized_processors;
+    SetBoolProcessorMapSharedPtr optimized_bools = std::make_shared<std::unordered_map<std::string, SetBoolProcessorSharedPtr>>();
+    parseRequestRules(rules, optimized_processors, optimized_bools);
+
+    const RuleOptimizer::Result result = RuleOptimizer::optimize(optimized_processors, *optimized_bools, true, nullptr);
+    EXPECT_EQ(7, result.rules_before);
+    // batch(x-const), x-copy, batch(x-const, x-dead) moved above set-path, set-path
+    ASSERT_EQ(4, result.rules_after);
+    EXPECT_EQ(4, result.bools_before);
+    EXPECT_EQ(1, result.bools_after);
+    EXPECT_NE(nullptr, dynamic_cast<ConstantBatchProcessor*>(optimized_processors.at(0).get()));
+    const ConstantBatchProcessor* batch = dynamic_cast<ConstantBatchProcessor*>(optimized_processors.at(2).get());
+    ASSERT_NE(nullptr, batch);
+    EXPECT_EQ(2, batch->size());
+
+    // the optimized rules leave the headers in the same state
+    std::vector<Http::TestRequestHeaderMapImpl> test_headers = {
+        {{":method", "GET"}, {":path", "/?q=1"}, {":authority", "host"}},
+        {{":method", "GET"}, {":path", "/"}, {":authority", "host"}, {"x-a", "value"}, {"x-const", "zero"}}
+    };
+    for (const auto& headers : test_headers) {
+        Http::TestRequestHeaderMapImpl reference_headers = headers;
+        Http::TestRequestHeaderMapImpl optimized_headers = headers;
+        for (const auto& processor : reference_processors) {
+            EXPECT_TRUE(processor->executeOperation(reference_headers, stream_info) == absl::OkStatus());
+        }
+        for (const auto& processor : optimized_processors) {
+            EXPECT_TRUE(processor->executeOperation(optimized_headers, stream_info) == absl::OkStatus());
+        }
+        EXPECT_EQ(reference_headers, optimized_headers);
+        EXPECT_EQ("one,two,three", optimized_headers.get(Http::LowerCaseString("x-const"))[0]->value().getStringView());
+        EXPECT_EQ("second", optimized_headers.get(Http::LowerCaseString("x-dead"))[0]->value().getStringView());
+        EXPECT_TRUE(optimized_headers.get(Http::LowerCaseString("x-never")).empty());
+    }
+}
+
+TEST_F(ProcessorTest, ConstantBatchOrderTest) {
+    Envoy::StreamInfo::MockStreamInfo* stream_info = nullptr;
+    const std::vector<absl::string_view> rules = {
+        "http-request set-header x-const-a a",
+        "http-request set-header x-dynamic %[urlp(v)]", // can't fail, x-const-b moves above it
+        "http-request set-header x-const-b b"
+    };
+
+    std::vector<HeaderProcessorUniquePtr> reference_processors;
+    SetBoolProcessorMapSharedPtr reference_bools = std::make_shared<std::unordered_map<std::string, SetBoolProcessorSharedPtr>>();
+    parseRequestRules(rules, reference_processors, reference_bools);
+    std::vector<HeaderProcessorUniquePtr> optimized_processors;
+    SetBoolProcessorMapSharedPtr optimized_bools = std::make_shared<std::unordered_map<std::string, SetBoolProcessorSharedPtr>>();
+    parseRequestRules(rules, optimized_processors, optimized_bools);
+
+    RuleOptimizer::optimize(optimized_processors, *optimized_bools, true, nullptr);
+    // batch(x-const-a, x-const-b), x-dynamic
+    ASSERT_EQ(2, optimized_processors.size());
+    const ConstantBatchProcessor* batch = dynamic_cast<ConstantBatchProcessor*>(optimized_processors.at(0).get());
+    ASSERT_NE(nullptr, batch);
+    EXPECT_EQ(2, batch->size());
+
+    Http::TestRequestHeaderMapImpl reference_headers{{":method", "GET"}, {":path", "/?v=1"}, {":authority", "host"}};
+    Http::TestRequestHeaderMapImpl optimized_headers = reference_headers;
+    for (const auto& processor : reference_processors) {
+        EXPECT_TRUE(processor->executeOperation(reference_headers, stream_info) == absl::OkStatus());
+    }
+    for (const auto& processor : optimized_processors) {
+        EXPECT_TRUE(processor->executeOperation(optimized_headers, stream_info) == absl::OkStatus());
+    }
+    // every header has the same values, but x-const-b is now added before x-dynamic
+    for (const std::string name : {"x-const-a", "x-dynamic", "x-const-b"}) {
+        const auto reference_values = reference_headers.get(Http::LowerCaseString(name));
+        const auto optimized_values = optimized_headers.get(Http::LowerCaseString(name));
+        ASSERT_EQ(1, reference_values.size()) << name;
+        ASSERT_EQ(1, optimized_values.size()) << name;
+        EXPECT_EQ(reference_values[0]->value().getStringView(), optimized_values[0]->value().getStringView()) << name;
+    }
+    EXPECT_FALSE(reference_headers == optimized_headers);
+}
+
+TEST_F(ProcessorTest, CommonSubexpressionTest) {
+    Envoy::StreamInfo::MockStreamInfo* stream_info;
+    const std::vector<absl::string_view> rules = {
+        "http-request set-bool is_acme %[hdr(x-tenant)] -m str acme",
+        "http-request set-bool tenant_is_acme %[hdr(x-tenant)] -m str acme", // same definition
+        "http-request set-header x-first %[hdr(x-tenant)] if is_acme",
+        "http-request set-header x-tenant other if tenant_is_acme",
+        "http-request set-header x-second %[hdr(x-tenant)] if is_acme" // cached values are stale after the write
+    };
+
+    std::vector<HeaderProcessorUniquePtr> reference_processors;
+    SetBoolProcessorMapSharedPtr reference_bools = std::make_shared<std::unordered_map<std::string, SetBoolProcessorSharedPtr>>();
+    parseRequestRules(rules, reference_processors, reference_bools);
+    std::vector<HeaderProcessorUniquePtr> optimized_processors;
+    SetBoolProcessorMapSharedPtr optimized_bools = std::make_shared<std::unordered_map<std::string, SetBoolProcessorSharedPtr>>();
+    parseRequestRules(rules, optimized_processors, optimized_bools);
+
+    const RuleOptimizer::Result result = RuleOptimizer::optimize(optimized_processors, *optimized_bools, true, nullptr);
+    EXPECT_EQ(optimized_bools->at("is_acme"), optimized_bools->at("tenant_is_acme"));
+    EXPECT_EQ(2, result.value_slots); // hdr(x-tenant) and the shared bool
+
+    for (const bool use_header_slots : {false, true}) {
+        HeaderSlotTable header_slot_table;
+        if (use_header_slots) {
+            for (auto& processor : optimized_processors) {
+                processor->forEachDynamicFunction([&header_slot_table](DynamicFunctionProcessorSharedPtr& function_processor) {
+                    function_processor->assignHeaderSlot(header_slot_table);
+                });
+            }
+        }
+        Http::TestRequestHeaderMapImpl reference_headers{
+            {":method", "GET"}, {":path", "/"}, {":authority", "host"}, {"x-tenant", "acme"}};
+        Http::TestRequestHeaderMapImpl optimized_headers = reference_headers;
+        for (const auto& processor : reference_processors) {
+            EXPECT_TRUE(processor->executeOperation(reference_headers, stream_info) == absl::OkStatus());
+        }
+        ExecutionContext context;
+        context.beginPhase(header_slot_table, optimized_headers, result.value_slots);
+        for (const auto& processor : optimized_processors) {
+            EXPECT_TRUE(processor->executeOperation(optimized_headers, stream_info, &context) == absl::OkStatus());
+        }
+        EXPECT_EQ(reference_headers, optimized_headers);
+        EXPECT_EQ("acme", optimized_headers.get(Http::LowerCaseString("x-first"))[0]->value().getStringView());
+        EXPECT_EQ("other", optimized_headers.get(Http::LowerCaseString("x-tenant"))[0]->value().getStringView());
+        EXPECT_TRUE(optimized_headers.get(Http::LowerCaseString("x-second")).empty());
+    }
+}
+
+TEST_F(ProcessorTest, ProgramTest) {
+    const std::vector<absl::string_view> rules = {
+        "http-request set-bool has_a %[hdr(x-a)] -m found",
+        "http-request set-bool a_is_one %[hdr(x-a)] -m str one",
+        "http-request set-bool b_prefix %[hdr(x-b,0)] -m beg ab",
+        "http-request set-bool b_second %[hdr(x-b,1)] -m sub c", // fails when x-b has a single value
+        "http-request set-bool q_set %[urlp(q)] -m found",
+        "http-request set-header x-const one",
+        "http-request set-header x-copy %[hdr(x-a)] if has_a and not a_is_one or b_prefix",
+        "http-request append-header x-const %[hdr(x-b,-1)] %[urlp(q)] if q_set",
+        "http-request set-header x-tenant %[hdr(x-a)] if a_is_one or b_second", // b_second fails even when a_is_one
+        "http-request set-path %[hdr(x-a)] if has_a",
+        "http-request set-path %[hdr(x-b,5)] if b_prefix", // a failing path is set as empty
+        "http-request set-header %[hdr(x-key)] %[hdr(x-a)] if has_a"
+    };
+
+    const CompiledRequestRules compiled(rules);
+    EXPECT_EQ(compiled.processors.size(), compiled.program->ruleCount());
+
+    std::vector<Http::TestRequestHeaderMapImpl> test_headers = {
+        {{":method", "GET"}, {":path", "/"}, {":authority", "host"}},
+        {{":method", "GET"}, {":path", "/?q=1"}, {":authority", "host"}, {"x-a", "two"}, {"x-key", "x-dyn"}},
+        {{":method", "GET"}, {":path", "/p?q=1"}, {":authority", "host"}, {"x-a", "one"}, {"x-b", "abc,c"}},
+        {{":method", "GET"}, {":path", "/p"}, {":authority", "host"}, {"x-a", "one"}, {"x-b", "abc"}},
+        {{":method", "GET"}, {":path", "/p"}, {":authority", "host"}, {"x-b", "ab , d"}, {"x-b", "ef"}, {"x-a", " , "}}
+    };
+    ExecutionContext context; // reused across phases like a stream's context
+    for (const auto& headers : test_headers) {
+        compiled.expectSameAsReference(*compiled.program, headers, context);
+    }
+
+    // the base HeaderProcessor adds no rule, nor the operands of its condition
+    std::vector<HeaderProcessorUniquePtr> processors;
+    SetBoolProcessorMapSharedPtr bools = std::make_shared<std::unordered_map<std::string, SetBoolProcessorSharedPtr>>();
+    parseRequestRules({"http-request set-bool has_a %[hdr(x-a)] -m found", "http-request set-header x-r r if has_a"},
+                      processors, bools);
+    const std::unique_ptr<const Program> without_base = Program::compile(processors, *bools);
+    auto base = std::make_unique<HeaderProcessor>(bools, true);
+    base->setConditionProcessor(processors.front()->getConditionProcessor());
+    processors.insert(processors.begin(), std::move(base));
+    const std::unique_ptr<const Program> with_base = Program::compile(processors, *bools);
+    EXPECT_EQ(1, with_base->ruleCount());
+    ProgramWriter without_base_data;
+    ProgramWriter with_base_data;
+    without_base->serialize(without_base_data);
+    with_base->serialize(with_base_data);
+    EXPECT_EQ(without_base_data.data(), with_base_data.data());
+}
+
+TEST_F(ProcessorTest, ConditionOrderTest) {
+    const std::vector<absl::string_view> rules = {
+        "http-request set-bool q_set %[urlp(q)] -m found",
+        "http-request set-bool has_a %[hdr(x-a)] -m found",
+        "http-request set-bool b_second %[hdr(x-b,1)] -m found",
+        "http-request set-bool c_named %[hdr(x-c,2)] -m found",
+        "http-request set-header x-r r if q_set and has_a",
+        "http-request set-header x-s s if q_set or b_second",
+        "http-request set-header x-t t if b_second or c_named or q_set" // the first failing bool decides the error
+    };
+
+    const CompiledRequestRules compiled(rules);
+
+    // without rates the cheaper operands go first when all of them can only fail with the same error
+    const Program& program = *compiled.program;
+    std::string description;
+    program.describe([](uint32_t, std::string&) {}, description);
+    EXPECT_THAT(description, testing::HasSubstr("if bool1 and bool0"));
+    EXPECT_THAT(description, testing::HasSubstr("if bool2 or bool0"));
+    EXPECT_THAT(description, testing::HasSubstr("if bool2 or bool3 or bool0"));
+
+    // x-a is rarely present and q rarely set: urlp(q) decides the condition more often
+    const BoolTrueRates true_rates = {0.01, 0.99, 0.5, 0.5};
+    const std::unique_ptr<const Program> profiled = Program::compile(compiled.processors, *compiled.bools, &true_rates);
+    EXPECT_FALSE(profiled->sameConditionOrder(program));
+    description.clear();
+    profiled->describe([](uint32_t, std::string&) {}, description);
+    EXPECT_THAT(description, testing::HasSubstr("if bool0 and bool1"));
+    EXPECT_TRUE(Program::compile(compiled.processors, *compiled.bools)->sameConditionOrder(program));
+
+    std::vector<Http::TestRequestHeaderMapImpl> test_headers = {
+        {{":method", "GET"}, {":path", "/"}, {":authority", "host"}},
+        {{":method", "GET"}, {":path", "/?q=1"}, {":authority", "host"}, {"x-a", "a"}},
+        {{":method", "GET"}, {":path", "/?q=1"}, {":authority", "host"}, {"x-a", " , "}, {"x-b", "b"}},
+        {{":method", "GET"}, {":path", "/"}, {":authority", "host"}, {"x-b", "b,c"}},
+        {{":method", "GET"}, {":path", "/?q=1"}, {":authority", "host"}, {"x-b", "b"}, {"x-c", "c"}}
+    };
+    ExecutionContext context;
+    for (const auto& headers : test_headers) {
+        for (const Program* ordered : {&program, profiled.get()}) {
+            compiled.expectSameAsReference(*ordered, headers, context);
+        }
+    }
+}
+
+TEST_F(ProcessorTest, DecisionDagTest) {
+    const std::vector<absl::string_view> rules = {
+        "http-request set-bool is_api %[hdr(x-api)] -m found",
+        "http-request set-bool tenant_a %[hdr(x-tenant)] -m str a",
+        "http-request set-bool tenant_b %[hdr(x-tenant)] -m str b",
+        "http-request set-bool q_set %[urlp(q)] -m found",
+        "http-request set-bool routed %[hdr(x-route)] -m found",
+        "http-request set-header x-1 1 if is_api and tenant_a",
+        "http-request set-header x-2 2 if is_api and tenant_b",
+        "http-request set-header x-3 3 if is_api and tenant_a and q_set",
+        "http-request set-header x-4 4 if not is_api or q_set",
+        "http-request set-header x-route r if tenant_b",
+        "http-request set-header x-5 5 if routed", // x-route is written above, evaluated in place
+        "http-request set-header x-6 %[hdr(x-api,1)] if tenant_a"
+    };
+
+    const CompiledRequestRules compiled(rules, nullptr, true);
+    const Program& program = *compiled.program;
+    EXPECT_EQ(7, program.ruleCount());
+    EXPECT_EQ(6, program.decidedRuleCount());
+    EXPECT_EQ(0, Program::compile(compiled.processors, *compiled.bools)->decidedRuleCount());
+    std::string description;
+    program.describe([](uint32_t, std::string&) {}, description);
+    EXPECT_THAT(description, testing::HasSubstr("if bool4 (skipped when its headers are absent)"));
+
+    std::vector<Http::TestRequestHeaderMapImpl> test_headers = {
+        {{":method", "GET"}, {":path", "/"}, {":authority", "host"}},
+        {{":method", "GET"}, {":path", "/?q=1"}, {":authority", "host"}, {"x-api", "v1"}, {"x-tenant", "a"}},
+        {{":method", "GET"}, {":path", "/"}, {":authority", "host"}, {"x-api", "v1,v2"}, {"x-tenant", "a"}},
+        {{":method", "GET"}, {":path", "/"}, {":authority", "host"}, {"x-api", "v1"}, {"x-tenant", "b"}},
+        {{":method", "GET"}, {":path", "/?q=1"}, {":authority", "host"}, {"x-tenant", "b"}},
+        // hdr(x-api) fails: the conditions are evaluated rule by rule, and x-1 fails as before
+        {{":method", "GET"}, {":path", "/"}, {":authority", "host"}, {"x-api", " , "}, {"x-tenant", "b"}}
+    };
+    ExecutionContext context;
+    for (const auto& headers : test_headers) {
+        std::vector<uint64_t> bool_counts(program.boolCount() * 2);
+        const bool succeeded = compiled.expectSameAsReference(program, headers, context, bool_counts.data());
+        // each bool of the decided rules is tested at most once
+        for (size_t b = 0; succeeded && b < program.boolCount(); b++) {
+            EXPECT_GE(1, bool_counts[b * 2] + bool_counts[b * 2 + 1]) << "bool" << b;
+        }
+    }
+}
+
+TEST_F(ProcessorTest, ConfigLoadTest) {
+    NiceMock<Server::Configuration::MockFactoryContext> context;
+    envoy::extensions::filters::http::HeaderRewrite proto_config;
+
+    // invalid configs are rejected when loaded
+    const std::vector<std::string> invalid_configs = {
+        "http-request set-header",
+        "http-other set-header x-a b",
+        "http-response set-path /",
+        "http-request set-bool b %[hdr(x-a)] -m found\nhttp-request set-bool b %[hdr(x-b)] -m found",
+        "http-request set-header x-a b if undefined_bool"
+    };
+    for (const auto& config : invalid_configs) {
+        proto_config.set_config(config);
+        EXPECT_THROW(HttpHeaderRewriteFilterConfig(proto_config, context), EnvoyException);
+    }
+
+    // the compile result of a valid config is exposed as gauges
+    proto_config.set_config("http-request set-bool has_a %[hdr(x-a)] -m found\n"
+                            "http-request set-header x-b %[hdr(x-a)] if has_a\n"
+                            "http-response set-header x-c c");
+    HttpHeaderRewriteFilterConfig config(proto_config, context);
+    EXPECT_EQ(1, config.stats().request_rules_.value());
+    EXPECT_EQ(1, config.stats().response_rules_.value());
+    EXPECT_LT(0, config.stats().program_bytes_.value());
+}
+
+TEST_F(ProcessorTest, ConfigErrorLocationTest) {
+    const auto parse_error = [](const std::string& config) -> std::string {
+        try {
+            HttpHeaderRewriteFilterConfig::parseRules(config);
+        } catch (const EnvoyException& e) {
+            return e.what();
+        }
+        return "";
+    };
+
+    // errors are located by line, blank lines included, and by column in the untrimmed line
+    EXPECT_EQ("invalid header rewrite config: line 3, column 3: first argument must be <http-response/http-request>",
+              parse_error("http-request set-header x-a a\n\n  http-other set-header x-b b"));
+    EXPECT_EQ("invalid header rewrite config: line 1, column 15: invalid operation type",
+              parse_error("http-request  set-heder x-a a"));
+    EXPECT_EQ("invalid header rewrite config: line 1, column 15: set-path can only be on request",
+              parse_error("http-response set-path /"));
+    EXPECT_EQ("invalid header rewrite config: line 2, column 23: redefinition of boolean variable",
+              parse_error("http-request set-bool b %[hdr(x-a)] -m found\n"
+                          "http-request set-bool b %[hdr(x-b)] -m found"));
+    // errors of an operation's arguments are located at its first argument
+    EXPECT_EQ("invalid header rewrite config: line 1, column 25: boolean variable \"undefined_bool\" in conditional does not exist",
+              parse_error("http-request set-header x-a b if undefined_bool"));
+    EXPECT_EQ("invalid header rewrite config: line 1, column 22: not enough arguments for set-bool",
+              parse_error("http-request set-bool"));
+    EXPECT_EQ("invalid header rewrite config: line 1, column 13: too few arguments provided",
+              parse_error("http-request"));
+    EXPECT_EQ("invalid header rewrite config: line 1, column 25: header position \"z\" is not a number",
+              parse_error("http-request set-header x-a %[hdr(x-b,z)]"));
+
+    // rules are still numbered by non-empty line, for their stats
+    const CompiledRulesSharedPtr rules =
+        HttpHeaderRewriteFilterConfig::parseRules("\nhttp-request set-header x-a a\n \t\r\nhttp-request set-header x-b b\r\n");
+    EXPECT_EQ(std::vector<uint32_t>({1, 2}), rules->request_rule_positions);
+}
+
+TEST_F(ProcessorTest, RuleStatsTest) {
+    NiceMock<Server::Configuration::MockFactoryContext> context;
+    envoy::extensions::filters::http::HeaderRewrite proto_config;
+    proto_config.set_stat_prefix("edge");
+    proto_config.set_config("http-request set-bool has_a %[hdr(x-a)] -m found\n"
+                            "http-request set-header x-b %[hdr(x-a)] if has_a\n"
+                            "http-request set-header x-c c\n"
+                            "http-request append-header x-d d\n"
+                            "http-request set-header x-e %[hdr(x-a,3)]");
+    HttpHeaderRewriteFilterConfig config(proto_config, context);
+
+    ExecutionContext execution_context;
+    RuleCounts& rule_counts = config.ruleCounts();
+    std::vector<Http::TestRequestHeaderMapImpl> test_headers = {
+        {{":method", "GET"}, {":path", "/"}, {":authority", "host"}},
+        {{":method", "GET"}, {":path", "/"}, {":authority", "host"}, {"x-a", "a"}}
+    };
+    for (auto& headers : test_headers) {
+        execution_context.beginPhase(config.requestHeaderSlots(), headers, config.requestValueSlots(), rule_counts.request());
+        config.requestProgram()->execute(headers, nullptr, execution_context);
+    }
+    // counts reach the counters when the worker flushes them
+    EXPECT_EQ(0, context.scope().counterFromString("header_rewrite.edge.request.evaluated").value());
+    rule_counts.flush();
+
+    const auto counter = [&context](const std::string& name) {
+        return context.scope().counterFromString("header_rewrite.edge.request." + name).value();
+    };
+    EXPECT_EQ(2, counter("rule.2.evaluated"));
+    EXPECT_EQ(1, counter("rule.2.condition_true"));
+    EXPECT_EQ(1, counter("rule.2.condition_false"));
+    EXPECT_EQ(1, counter("rule.2.applied"));
+    // the constant rules are batched, each is counted
+    EXPECT_EQ(2, counter("rule.3.applied"));
+    EXPECT_EQ(2, counter("rule.4.applied"));
+    EXPECT_EQ(0, counter("rule.3.condition_true"));
+    // hdr(x-a,3) fails when x-a is present
+    EXPECT_EQ(2, counter("rule.5.evaluated"));
+    EXPECT_EQ(1, counter("rule.5.errors"));
+    EXPECT_EQ(1, counter("rule.5.applied"));
+    std::string description;
+    config.describe(description);
+    EXPECT_THAT(description, testing::HasSubstr("rule 2: evaluated 2, condition_true 1, condition_false 1, applied 1, errors 0"));
+    EXPECT_THAT(description, testing::HasSubstr("bool0: hdr(x-a)[header slot 0][value slot 0] -m found"));
+    EXPECT_EQ(8, counter("evaluated"));
+    EXPECT_EQ(6, counter("applied"));
+    EXPECT_EQ(1, counter("errors"));
+}
+
+TEST_F(ProcessorTest, ProgramRegistryTest) {
+    NiceMock<Server::Configuration::MockFactoryContext> context;
+    envoy::extensions::filters::http::HeaderRewrite proto_config;
+    proto_config.set_config("http-request set-header x-a a");
+    auto config = std::make_shared<HttpHeaderRewriteFilterConfig>(proto_config, context);
+
+    NiceMock<Server::MockAdmin> admin;
+    Server::Admin::HandlerCb handler;
+    EXPECT_CALL(admin, addHandler(std::string(ProgramRegistry::AdminPath), _, _, true, false, _))
+        .WillOnce(DoAll(SaveArg<2>(&handler), Return(true)));
+    auto registry = std::make_unique<ProgramRegistry>(makeOptRef<Server::Admin>(admin));
+    registry->add(config);
+
+    const auto handle = [&handler]() {
+        Http::TestResponseHeaderMapImpl response_headers;
+        Buffer::OwnedImpl response;
+        NiceMock<Server::MockAdminStream> admin_stream;
+        EXPECT_EQ(Http::Code::OK, handler(response_headers, response, admin_stream));
+        return response.toString();
+    };
+    std::string description;
+    config->describe(description);
+    EXPECT_EQ(description, handle());
+    EXPECT_THAT(handle(), testing::HasSubstr("x-a"));
+
+    // the registry doesn't keep configs alive, and drops them once released
+    config.reset();
+    EXPECT_EQ("no header rewrite filter configs\n", handle());
+
+    EXPECT_CALL(admin, removeHandler(std::string(ProgramRegistry::AdminPath))).WillOnce(Return(true));
+    registry.reset();
+
+    // a handler that can't be added isn't removed
+    EXPECT_CALL(admin, addHandler(_, _, _, _, _, _)).WillOnce(Return(false));
+    EXPECT_CALL(admin, removeHandler(_)).Times(0);
+    ProgramRegistry unregistered(makeOptRef<Server::Admin>(admin));
+}
+
+TEST_F(ProcessorTest, RouteConfigTest) {
+    NiceMock<Server::Configuration::MockFactoryContext> context;
+    NiceMock<Server::Configuration::MockServerFactoryContext> server_context;
+    envoy::extensions::filters::http::HeaderRewrite proto_config;
+    proto_config.set_config("http-request set-header x-listener l");
+    auto config = std::make_shared<HttpHeaderRewriteFilterConfig>(proto_config, context);
+    EXPECT_TRUE(config->hasRequestRules());
+    EXPECT_FALSE(config->hasResponseRules());
+
+    auto directions = std::make_shared<RouteDirections>();
+    std::vector<HttpHeaderRewriteFilterConfigSharedPtr> compiled;
+    const OnCompiledCb on_compiled = [&compiled](const HttpHeaderRewriteFilterConfigSharedPtr& route_rules) {
+        compiled.push_back(route_rules);
+    };
+    envoy::extensions::filters::http::HeaderRewritePerRoute route_proto;
+    route_proto.mutable_header_rewrite()->set_config("http-response set-header x-route r");
+    // a route's rules need stats of their own
+    EXPECT_THROW(HeaderRewriteRouteConfig(route_proto, server_context, directions, on_compiled), EnvoyException);
+    EXPECT_EQ(0, directions->response_routes.load());
+    route_proto.mutable_header_rewrite()->set_stat_prefix("route");
+    auto route_config = std::make_unique<HeaderRewriteRouteConfig>(route_proto, server_context, directions, on_compiled);
+    envoy::extensions::filters::http::HeaderRewritePerRoute disabled_proto;
+    disabled_proto.set_disabled(true);
+    const HeaderRewriteRouteConfig disabled_config(disabled_proto, server_context, directions, on_compiled);
+    EXPECT_EQ(nullptr, disabled_config.rules());
+    // only rules compiled when the route is loaded are passed on
+    ASSERT_EQ(1, compiled.size());
+    EXPECT_EQ(route_config->rules(), compiled[0]);
+    // routes with response rules make filter chains install the encoder half
+    EXPECT_EQ(0, directions->request_routes.load());
+    EXPECT_EQ(1, directions->response_routes.load());
+
+    const std::vector<const Router::RouteSpecificFilterConfig*> routes = {nullptr, route_config.get(), &disabled_config};
+    const std::vector<std::pair<std::string, std::string>> expected = {{"l", ""}, {"", "r"}, {"", ""}};
+    for (size_t i = 0; i < routes.size(); i++) {
+        NiceMock<Http::MockStreamDecoderFilterCallbacks> decoder_callbacks;
+        NiceMock<Http::MockStreamEncoderFilterCallbacks> encoder_callbacks;
+        ON_CALL(decoder_callbacks, mostSpecificPerFilterConfig()).WillByDefault(Return(routes[i]));
+        ON_CALL(encoder_callbacks, mostSpecificPerFilterConfig()).WillByDefault(Return(routes[i]));
+        HttpHeaderRewriteFilter filter(config);
+        filter.setDecoderFilterCallbacks(decoder_callbacks);
+        filter.setEncoderFilterCallbacks(encoder_callbacks);
+
+        Http::TestRequestHeaderMapImpl request_headers{{":method", "GET"}, {":path", "/"}, {":authority", "host"}};
+        Http::TestResponseHeaderMapImpl response_headers{{":status", "200"}};
+        EXPECT_EQ(Http::FilterHeadersStatus::Continue, filter.decodeHeaders(request_headers, true));
+        EXPECT_EQ(Http::FilterHeadersStatus::Continue, filter.encodeHeaders(response_headers, true));
+        EXPECT_EQ(expected[i].first, request_headers.get_("x-listener")) << "route " << i;
+        EXPECT_EQ(expected[i].second, response_headers.get_("x-route")) << "route " << i;
+    }
+
+    // released on a worker, the route's rules are destroyed on the main thread
+    const std::weak_ptr<HttpHeaderRewriteFilterConfig> route_rules = route_config->rules();
+    compiled.clear();
+    std::function<void()> release;
+    EXPECT_CALL(server_context.dispatcher_, post(_))
+        .WillOnce(SaveArg<0>(&release))
+        .WillRepeatedly(Invoke([](std::function<void()> cb) { cb(); }));
+    route_config.reset();
+    EXPECT_EQ(0, directions->response_routes.load());
+    EXPECT_FALSE(route_rules.expired());
+    release();
+    EXPECT_TRUE(route_rules.expired());
+}
+
+TEST_F(ProcessorTest, LazyRouteConfigTest) {
+    NiceMock<Server::Configuration::MockFactoryContext> context;
+    NiceMock<Server::Configuration::MockServerFactoryContext> server_context;
+    envoy::extensions::filters::http::HeaderRewrite proto_config;
+    proto_config.set_config("http-request set-header x-listener l");
+    auto config = std::make_shared<HttpHeaderRewriteFilterConfig>(proto_config, context);
+    const auto counter = [&server_context](const std::string& name) {
+        return server_context.scope().counterFromString("header_rewrite.lazy." + name).value();
+    };
+
+    auto directions = std::make_shared<RouteDirections>();
+    envoy::extensions::filters::http::HeaderRewritePerRoute route_proto;
+    route_proto.set_lazy_compile(true);
+    route_proto.mutable_header_rewrite()->set_stat_prefix("lazy");
+    route_proto.mutable_header_rewrite()->set_config("http-request set-header x-route r");
+    std::vector<std::weak_ptr<HttpHeaderRewriteFilterConfig>> compiled;
+    const OnCompiledCb on_compiled = [&compiled](const HttpHeaderRewriteFilterConfigSharedPtr& route_rules) {
+        compiled.push_back(route_rules);
+    };
+    auto route_config = std::make_unique<HeaderRewriteRouteConfig>(route_proto, server_context, directions, on_compiled);
+    // not compiled when loaded, so both halves of the filter are installed
+    EXPECT_EQ(nullptr, route_config->rules());
+    EXPECT_TRUE(compiled.empty());
+    EXPECT_EQ(0, counter("lazy_compiles"));
+    EXPECT_EQ(1, directions->request_routes.load());
+    EXPECT_EQ(1, directions->response_routes.load());
+
+    // concurrent first requests compile the rules once and all see the same config
+    std::vector<const HttpHeaderRewriteFilterConfig*> seen(4);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < seen.size(); i++) {
+        threads.emplace_back([&route_config, &seen, i]() { seen[i] = route_config->config(); });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    ASSERT_NE(nullptr, seen[0]);
+    for (const HttpHeaderRewriteFilterConfig* rules : seen) {
+        EXPECT_EQ(seen[0], rules);
+    }
+    EXPECT_EQ(1, counter("lazy_compiles"));
+    // and are passed on from the main thread once compiled, e.g. to the admin handler
+    ASSERT_EQ(1, compiled.size());
+    EXPECT_EQ(seen[0], compiled[0].lock().get());
+
+    NiceMock<Http::MockStreamDecoderFilterCallbacks> decoder_callbacks;
+    ON_CALL(decoder_callbacks, mostSpecificPerFilterConfig()).WillByDefault(Return(route_config.get()));
+    HttpHeaderRewriteFilter filter(config);
+    filter.setDecoderFilterCallbacks(decoder_callbacks);
+    Http::TestRequestHeaderMapImpl request_headers{{":method", "GET"}, {":path", "/"}, {":authority", "host"}};
+    EXPECT_EQ(Http::FilterHeadersStatus::Continue, filter.decodeHeaders(request_headers, true));
+    EXPECT_EQ("r", request_headers.get_("x-route"));
+    EXPECT_EQ("", request_headers.get_("x-listener"));
+    // the worker's counts were set up on its first use of the lazily compiled rules
+    seen[0]->ruleCounts().flush();
+    EXPECT_EQ(1, counter("request.rule.1.applied"));
+    EXPECT_EQ(1, counter("lazy_compiles"));
+
+    // invalid rules are only found when compiled, and skip the filter on the route
+    envoy::extensions::filters::http::HeaderRewritePerRoute invalid_proto = route_proto;
+    invalid_proto.mutable_header_rewrite()->set_config("http-request set-header");
+    const HeaderRewriteRouteConfig invalid_config(invalid_proto, server_context, directions, on_compiled);
+    EXPECT_EQ(nullptr, invalid_config.config());
+    EXPECT_EQ(nullptr, invalid_config.config());
+    EXPECT_EQ(1, counter("lazy_compile_errors"));
+    EXPECT_EQ(1, compiled.size());
+
+    envoy::extensions::filters::http::HeaderRewritePerRoute reorder_proto = route_proto;
+    reorder_proto.mutable_header_rewrite()->set_condition_reorder_interval_ms(1000);
+    EXPECT_THROW(HeaderRewriteRouteConfig(reorder_proto, server_context, directions,
+                                          [](const HttpHeaderRewriteFilterConfigSharedPtr&) {}),
+                 EnvoyException);
+
+    // the worker state slot is released on the main thread with the compiled rules
+    std::function<void()> release;
+    EXPECT_CALL(server_context.dispatcher_, post(_))
+        .WillOnce(SaveArg<0>(&release))
+        .WillRepeatedly(Invoke([](std::function<void()> cb) { cb(); }));
+    route_config.reset();
+    EXPECT_EQ(1, directions->request_routes.load());
+    EXPECT_EQ(1, directions->response_routes.load());
+    ASSERT_TRUE(release != nullptr);
+    release();
+}
+
+TEST_F(ProcessorTest, RulesFileTest) {
+    NiceMock<Server::Configuration::MockFactoryContext> context;
+    const std::string path = TestEnvironment::writeStringToFileForTest("rules", "http-request set-header x-version 1");
+    auto* watcher = new NiceMock<Filesystem::MockWatcher>();
+    Filesystem::Watcher::OnChangedCb on_changed;
+    EXPECT_CALL(context.server_factory_context_.dispatcher_, createFilesystemWatcher_()).WillOnce(Return(watcher));
+    EXPECT_CALL(*watcher, addWatch(absl::string_view(path), Filesystem::Watcher::Events::MovedTo | Filesystem::Watcher::Events::Modified, _))
+        .WillOnce(DoAll(SaveArg<2>(&on_changed), Return(absl::OkStatus())));
+    envoy::extensions::filters::http::HeaderRewrite proto_config;
+    proto_config.set_stat_prefix("file");
+    proto_config.set_rules_file(path);
+    std::vector<HttpHeaderRewriteFilterConfigSharedPtr> compiled;
+    RulesFileConfig rules_file(proto_config, context,
+                               [&compiled](const HttpHeaderRewriteFilterConfigSharedPtr& config) { compiled.push_back(config); });
+    ASSERT_EQ(1, compiled.size());
+    EXPECT_EQ(compiled[0], rules_file.current());
+    const auto counter = [&context](const std::string& name) {
+        return context.scope().counterFromString("header_rewrite.file." + name).value();
+    };
+    const auto version = [](HttpHeaderRewriteFilter& filter) {
+        Http::TestRequestHeaderMapImpl headers{{":method", "GET"}, {":path", "/"}, {":authority", "host"}};
+        filter.decodeHeaders(headers, true);
+        return headers.get_("x-version");
+    };
+    NiceMock<Http::MockStreamDecoderFilterCallbacks> decoder_callbacks;
+    auto started_filter = std::make_unique<HttpHeaderRewriteFilter>(rules_file.current());
+    started_filter->setDecoderFilterCallbacks(decoder_callbacks);
+
+    // streams started before the reload finish on the old rules, new streams execute the new ones
+    TestEnvironment::writeStringToFileForTest("rules", "http-request set-header x-version 2");
+    EXPECT_TRUE(on_changed(Filesystem::Watcher::Events::Modified).ok());
+    ASSERT_EQ(2, compiled.size());
+    EXPECT_EQ(compiled[1], rules_file.current());
+    EXPECT_EQ(1, counter("rules_file_reloads"));
+    HttpHeaderRewriteFilter new_filter(rules_file.current());
+    new_filter.setDecoderFilterCallbacks(decoder_callbacks);
+    EXPECT_EQ("1", version(*started_filter));
+    EXPECT_EQ("2", version(new_filter));
+
+    // the old config is destroyed on the main thread once its last stream ends
+    const std::weak_ptr<HttpHeaderRewriteFilterConfig> old_config = compiled[0];
+    compiled[0].reset();
+    std::function<void()> release;
+    EXPECT_CALL(context.server_factory_context_.dispatcher_, post(_)).WillOnce(SaveArg<0>(&release));
+    started_filter.reset();
+    EXPECT_TRUE(old_config.expired());
+    ASSERT_TRUE(release != nullptr);
+    release();
+    testing::Mock::VerifyAndClearExpectations(&context.server_factory_context_.dispatcher_);
+
+    // rules that fail to compile leave the current ones in effect
+    TestEnvironment::writeStringToFileForTest("rules", "http-request set-header");
+    EXPECT_TRUE(on_changed(Filesystem::Watcher::Events::MovedTo).ok());
+    EXPECT_EQ(2, compiled.size());
+    EXPECT_EQ(compiled[1], rules_file.current());
+    EXPECT_EQ(1, counter("rules_file_errors"));
+
+    proto_config.set_config("http-request set-header x-version 0");
+    EXPECT_THROW(RulesFileConfig(proto_config, context, [](const HttpHeaderRewriteFilterConfigSharedPtr&) {}),
+                 EnvoyException);
+    // a route's rules can't be watched
+    envoy::extensions::filters::http::HeaderRewrite route_config;
+    route_config.set_rules_file(path);
+    EXPECT_THROW(HttpHeaderRewriteFilterConfig(route_config, context), EnvoyException);
+}
+
+TEST_F(ProcessorTest, TenantTest) {
+    NiceMock<Server::Configuration::MockFactoryContext> context;
+    envoy::extensions::filters::http::HeaderRewrite proto_config;
+    proto_config.set_config("http-request set-header x-tenant default");
+    auto* api = proto_config.add_tenants();
+    api->set_name("api");
+    api->add_authorities("api.example.com");
+    api->set_config("http-request set-header x-tenant api\nhttp-response set-header x-served api");
+    auto* wildcard = proto_config.add_tenants();
+    wildcard->set_name("example");
+    wildcard->add_authorities("*.example.com");
+    wildcard->set_config("http-request set-header x-tenant example");
+    // a tenant file serves the authority it is named after
+    TestEnvironment::writeStringToFileForTest("tenants/*.cdn.example.com", "http-request set-header x-tenant cdn");
+    TestEnvironment::writeStringToFileForTest("tenants/static.test", "http-request set-header x-tenant static");
+    proto_config.set_tenant_directory(TestEnvironment::temporaryPath("tenants"));
+    auto config = std::make_shared<HttpHeaderRewriteFilterConfig>(proto_config, context);
+    EXPECT_TRUE(config->needsRequestPhase());
+    EXPECT_FALSE(config->hasResponseRules());
+    EXPECT_TRUE(config->needsResponsePhase());
+
+    // exact hosts win over wildcards, and longer wildcards over shorter ones; ports and case are ignored
+    const std::vector<std::pair<std::string, std::string>> expected = {
+        {"api.example.com", "api"},         {"API.Example.com:8443", "api"}, {"www.example.com", "example"},
+        {"img.cdn.example.com", "cdn"},     {"example.com", "default"},      {"static.test", "static"},
+        {"other.test", "default"},          {"", "default"}};
+    for (const auto& [authority, tenant] : expected) {
+        NiceMock<Http::MockStreamDecoderFilterCallbacks> decoder_callbacks;
+        NiceMock<Http::MockStreamEncoderFilterCallbacks> encoder_callbacks;
+        HttpHeaderRewriteFilter filter(config);
+        filter.setDecoderFilterCallbacks(decoder_callbacks);
+        filter.setEncoderFilterCallbacks(encoder_callbacks);
+
+        Http::TestRequestHeaderMapImpl request_headers{{":method", "GET"}, {":path", "/"}, {":authority", authority}};
+        Http::TestResponseHeaderMapImpl response_headers{{":status", "200"}};
+        filter.decodeHeaders(request_headers, true);
+        filter.encodeHeaders(response_headers, true);
+        EXPECT_EQ(tenant, request_headers.get_("x-tenant")) << authority;
+        // the response phase executes the request's tenant's rules
+        EXPECT_EQ(tenant == "api" ? "api" : "", response_headers.get_("x-served")) << authority;
+    }
+    EXPECT_EQ(1, context.scope().gaugeFromString("header_rewrite.tenant.api.response_rules", Stats::Gauge::ImportMode::NeverImport).value());
+
+    // each tenant's programs and rule counts on a worker are in the config's slots
+    const HttpHeaderRewriteFilterConfig& api_config = config->tenantConfig("api.example.com");
+    EXPECT_EQ(config->requestProgram(), config->activePrograms().request.get());
+    EXPECT_EQ(api_config.requestProgram(), api_config.activePrograms().request.get());
+    EXPECT_NE(&config->ruleCounts(), &api_config.ruleCounts());
+    api_config.ruleCounts().flush();
+    EXPECT_EQ(2, context.scope().counterFromString("header_rewrite.tenant.api.request.applied").value());
+    std::string description;
+    config->describe(description);
+    EXPECT_THAT(description, testing::HasSubstr("header_rewrite.tenant.__cdn_example_com.: "));
+
+    // an authority served by two tenants, or an invalid pattern, rejects the config
+    proto_config.clear_tenant_directory();
+    wildcard->add_authorities("api.example.com");
+    EXPECT_THROW(HttpHeaderRewriteFilterConfig(proto_config, context), EnvoyException);
+    wildcard->set_authorities(1, "api.*.com");
+    EXPECT_THROW(HttpHeaderRewriteFilterConfig(proto_config, context), EnvoyException);
+    // as do two tenants whose stats would have the same name, the file static.test and static_test
+    envoy::extensions::filters::http::HeaderRewrite same_stats_config;
+    same_stats_config.set_tenant_directory(TestEnvironment::temporaryPath("tenants"));
+    auto* static_tenant = same_stats_config.add_tenants();
+    static_tenant->set_name("static_test");
+    static_tenant->add_authorities("static.example.org");
+    static_tenant->set_config("http-request set-header x-tenant static");
+    EXPECT_THROW(HttpHeaderRewriteFilterConfig(same_stats_config, context), EnvoyException);
+    static_tenant->set_name("static_org");
+    EXPECT_NO_THROW(HttpHeaderRewriteFilterConfig(same_stats_config, context));
+    proto_config.clear_tenants();
+    proto_config.clear_config();
+    EXPECT_THROW(HttpHeaderRewriteFilterConfig(proto_config, context), EnvoyException);
+}
+
+TEST_F(ProcessorTest, ProgramCacheTest) {
+    NiceMock<Server::Configuration::MockFactoryContext> context;
+    envoy::extensions::filters::http::HeaderRewrite proto_config;
+    proto_config.set_config("http-request set-bool has_a %[hdr(x-a)] -m found\n"
+                            "http-request set-header x-b b if has_a");
+    proto_config.set_stat_prefix("first");
+    auto first = std::make_shared<HttpHeaderRewriteFilterConfig>(proto_config, context);
+
+    // configs with the same rules share them, whatever their stats and error handling
+    proto_config.set_stat_prefix("second");
+    proto_config.set_log_errors(true);
+    auto second = std::make_shared<HttpHeaderRewriteFilterConfig>(proto_config, context);
+    EXPECT_EQ(first->compiledRules(), second->compiledRules());
+    EXPECT_EQ(first->requestProgram(), second->requestProgram());
+    std::string description;
+    second->describe(description);
+    EXPECT_THAT(description, testing::HasSubstr("shared by 2 configs"));
+
+    // options that change the compiled programs don't
+    proto_config.set_decision_dag(true);
+    const HttpHeaderRewriteFilterConfig dag(proto_config, context);
+    EXPECT_NE(first->compiledRules(), dag.compiledRules());
+    proto_config.set_decision_dag(false);
+    proto_config.set_config(proto_config.config() + "\nhttp-response set-header x-c c");
+    const HttpHeaderRewriteFilterConfig other(proto_config, context);
+    EXPECT_NE(first->compiledRules(), other.compiledRules());
+
+    // the rules are freed with the last config using them
+    const std::weak_ptr<const CompiledRules> rules = first->compiledRules();
+    first.reset();
+    EXPECT_FALSE(rules.expired());
+    second.reset();
+    EXPECT_TRUE(rules.expired());
+
+    // and compiled again when looked up after that
+    ProgramCache cache;
+    int compiles = 0;
+    const auto compile = [&compiles]() {
+        compiles++;
+        return std::make_shared<const CompiledRules>();
+    };
+    CompiledRulesSharedPtr cached = cache.getOrCompile("rules", compile);
+    EXPECT_EQ(cached, cache.getOrCompile("rules", compile));
+    EXPECT_EQ(1, compiles);
+    cached.reset();
+    EXPECT_EQ(0, cache.size());
+    cached = cache.getOrCompile("rules", compile);
+    EXPECT_NE(nullptr, cached);
+    EXPECT_EQ(2, compiles);
+    EXPECT_EQ(1, cache.size());
+}
+
+TEST_F(ProcessorTest, ProgramFileTest) {
+    NiceMock<Server::Configuration::MockFactoryContext> context;
+    envoy::extensions::filters::http::HeaderRewrite proto_config;
+    proto_config.add_inline_headers("x-inline-test");
+    proto_config.set_decision_dag(true);
+    proto_config.set_config("http-request set-bool has_a %[hdr(x-a)] -m found\n"
+                            "http-request set-bool api %[hdr(:path)] -m beg /api\n"
+                            "http-request set-header x-b %[hdr(x-a,1)] if has_a\n"
+                            "http-request set-header x-inline-test %[urlp(q)] if api and has_a\n"
+                            "http-request append-header x-c c\n"
+                            "http-request set-header x-d d\n"
+                            "http-request set-path /rewritten if api\n"
+                            "http-request set-header x-f %[hdr(x-inline-test)] if has_a\n"
+                            "http-response set-header x-e e");
+    const HttpHeaderRewriteFilterConfig text_config(proto_config, context);
+    const CompiledRulesSharedPtr compiled = HttpHeaderRewriteFilterConfig::compileRules(proto_config);
+    const std::string content = ProgramFile::write(*compiled, {"x-inline-test"});
+    const std::string path = TestEnvironment::writeStringToFileForTest("program.hrp", content);
+
+    envoy::extensions::filters::http::HeaderRewrite file_proto_config;
+    file_proto_config.set_program_file(path);
+    const HttpHeaderRewriteFilterConfig file_config(file_proto_config, context);
+    // the loaded programs are the compiled ones, down to their inline headers and decision DAG
+    const auto describe = [](const Program& program) {
+        std::string out;
+        program.describe([](uint32_t rule_index, std::string& source) { absl::StrAppend(&source, rule_index); }, out);
+        return out;
+    };
+    EXPECT_EQ(describe(*compiled->request_program), describe(*file_config.requestProgram()));
+    EXPECT_EQ(describe(*compiled->response_program), describe(*file_config.responseProgram()));
+    EXPECT_THAT(describe(*file_config.requestProgram()), testing::HasSubstr("[inline]"));
+
+    ExecutionContext execution_context;
+    std::vector<Http::TestRequestHeaderMapImpl> test_headers = {
+        {{":method", "GET"}, {":path", "/api?q=1"}, {":authority", "host"}, {"x-a", "a"}},
+        {{":method", "GET"}, {":path", "/other"}, {":authority", "host"}, {"x-a", "a,b"}},
+        {{":method", "GET"}, {":path", "/api"}, {":authority", "host"}}
+    };
+    for (const auto& headers : test_headers) {
+        Http::TestRequestHeaderMapImpl text_headers = headers;
+        execution_context.beginPhase(text_config.requestHeaderSlots(), text_headers, text_config.requestValueSlots());
+        const ExecutionError text_error = text_config.requestProgram()->execute(text_headers, nullptr, execution_context);
+        Http::TestRequestHeaderMapImpl file_headers = headers;
+        execution_context.beginPhase(file_config.requestHeaderSlots(), file_headers, file_config.requestValueSlots());
+        EXPECT_EQ(text_error, file_config.requestProgram()->execute(file_headers, nullptr, execution_context));
+        EXPECT_EQ(text_headers, file_headers);
+    }
+
+    // a corrupt, truncated or unsupported program is rejected when loaded
+    std::string corrupt = content;
+    corrupt[content.size() / 2] ^= 1;
+    std::string version = content;
+    version[4] = 2;
+    for (const std::string& bad : {corrupt, content.substr(0, content.size() - 1), version}) {
+        TestEnvironment::writeStringToFileForTest("program.hrp", bad);
+        EXPECT_THROW(HttpHeaderRewriteFilterConfig(file_proto_config, context), EnvoyException);
+    }
+    // so is a program whose indices are out of range, even with a valid checksum
+    CompiledRules rules;
+    rules.inline_headers = std::make_shared<InlineHeaderTable>();
+    rules.request_program = HttpHeaderRewriteFilterConfig::compileRules(proto_config)->request_program;
+    rules.response_program = rules.request_program;
+    TestEnvironment::writeStringToFileForTest("program.hrp", ProgramFile::write(rules, {}));
+    EXPECT_THROW(HttpHeaderRewriteFilterConfig(file_proto_config, context), EnvoyException);
+    // and a response program with a request-only rule
+    envoy::extensions::filters::http::HeaderRewrite set_path_config;
+    set_path_config.set_config("http-request set-path /p");
+    const CompiledRulesSharedPtr set_path = HttpHeaderRewriteFilterConfig::compileRules(set_path_config);
+    rules.request_program = set_path->request_program;
+    rules.response_program = set_path->request_program;
+    rules.request_rule_positions = set_path->request_rule_positions;
+    rules.response_rule_positions = set_path->request_rule_positions;
+    const std::string set_path_content = ProgramFile::write(rules, {});
+    absl::string_view payload;
+    ASSERT_TRUE(ProgramFile::check(set_path_content, payload).ok());
+    CompiledRulesSharedPtr read_rules;
+    EXPECT_THAT(std::string(ProgramFile::read(payload, read_rules).message()),
+                testing::HasSubstr("sets the path in a response program"));
+}
+
+TEST_F(ProcessorTest, ProgramFileSharedDagNodeTest) {
+    NiceMock<Server::Configuration::MockFactoryContext> context;
+    envoy::extensions::filters::http::HeaderRewrite proto_config;
+    proto_config.set_decision_dag(true);
+    // x-2 is decided by the same c node whether a is false, or a is true and b false: that node has
+    // a parent on each of the first two levels
+    proto_config.set_config("http-request set-bool a %[hdr(x-a)] -m found\n"
+                            "http-request set-bool b %[hdr(x-b)] -m found\n"
+                            "http-request set-bool c %[hdr(x-c)] -m found\n"
+                            "http-request set-header x-1 1 if a and b\n"
+                            "http-request set-header x-2 2 if c");
+    const HttpHeaderRewriteFilterConfig text_config(proto_config, context);
+    EXPECT_EQ(2, text_config.requestProgram()->decidedRuleCount());
+    const CompiledRulesSharedPtr compiled = HttpHeaderRewriteFilterConfig::compileRules(proto_config);
+    const std::string path = TestEnvironment::writeStringToFileForTest("dag.hrp", ProgramFile::write(*compiled, {}));
+
+    envoy::extensions::filters::http::HeaderRewrite file_proto_config;
+    file_proto_config.set_program_file(path);
+    const HttpHeaderRewriteFilterConfig file_config(file_proto_config, context);
+    EXPECT_EQ(2, file_config.requestProgram()->decidedRuleCount());
+
+    ExecutionContext execution_context;
+    for (int present = 0; present < 8; present++) {
+        Http::TestRequestHeaderMapImpl headers{{":method", "GET"}, {":path", "/"}, {":authority", "host"}};
+        for (int i = 0; i < 3; i++) {
+            if (present & (1 << i)) {
+                headers.addCopy(Http::LowerCaseString(std::string("x-") + static_cast<char>('a' + i)), "1");
+            }
+        }
+        Http::TestRequestHeaderMapImpl text_headers = headers;
+        execution_context.beginPhase(text_config.requestHeaderSlots(), text_headers, text_config.requestValueSlots());
+        const ExecutionError text_error = text_config.requestProgram()->execute(text_headers, nullptr, execution_context);
+        Http::TestRequestHeaderMapImpl file_headers = headers;
+        execution_context.beginPhase(file_config.requestHeaderSlots(), file_headers, file_config.requestValueSlots());
+        EXPECT_EQ(text_error, file_config.requestProgram()->execute(file_headers, nullptr, execution_context));
+        EXPECT_EQ(text_headers, file_headers) << "headers present " << present;
+        EXPECT_EQ((present & 3) == 3 ? "1" : "", file_headers.get_("x-1"));
+        EXPECT_EQ((present & 4) ? "2" : "", file_headers.get_("x-2"));
+    }
+}
+
+TEST_F(ProcessorTest, CompiledRulesTest) {
+    // compiled_rules_example, generated from compiled_rules_example.txt and linked into the test
+    const CompiledRulesFactory* factory = Registry::FactoryRegistry<CompiledRulesFactory>::getFactory("example");
+    ASSERT_NE(nullptr, factory);
+    NiceMock<Server::Configuration::MockFactoryContext> context;
+    envoy::extensions::filters::http::HeaderRewrite proto_config;
+    proto_config.add_inline_headers("user-agent");
+    proto_config.set_config(std::string(factory->source()));
+    const HttpHeaderRewriteFilterConfig interpreted_config(proto_config, context);
+    envoy::extensions::filters::http::HeaderRewriteCompiled compiled_proto_config;
+    compiled_proto_config.set_rules("example");
+    const CompiledRulesFilterConfig compiled_config(compiled_proto_config, context.scope());
+
+    // the generated code applies the same rules as the interpreted program, and fails the same way
+    const auto run = [](const std::function<ExecutionError(Http::TestRequestHeaderMapImpl&, StreamInfo::StreamInfo*)>& execute,
+                        Http::TestRequestHeaderMapImpl& headers, envoy::config::core::v3::Metadata& dynamic_metadata) {
+        NiceMock<StreamInfo::MockStreamInfo> stream_info;
+        ON_CALL(stream_info, dynamicMetadata()).WillByDefault(ReturnRef(dynamic_metadata));
+        ON_CALL(Const(stream_info), dynamicMetadata()).WillByDefault(ReturnRef(dynamic_metadata));
+        ON_CALL(stream_info, setDynamicMetadata(_,_)).WillByDefault(Invoke([&dynamic_metadata](const std::string& name, const ProtobufWkt::Struct& value) {
+            return (*dynamic_metadata.mutable_filter_metadata())[name].MergeFrom(value);
+        }));
+        return execute(headers, &stream_info);
+    };
+    ExecutionContext execution_context;
+    std::vector<Http::TestRequestHeaderMapImpl> test_headers = {
+        {{":method", "GET"}, {":path", "/v1/items?version=2"}, {":authority", "host"}, {"x-api", "1"}, {"x-tenant", "t1"}},
+        {{":method", "GET"}, {":path", "/"}, {":authority", "host"}, {"user-agent", "Mobile Safari"}, {"x-forwarded-for", "10.0.0.1, 10.0.0.2"}},
+        {{":method", "GET"}, {":path", "/"}, {":authority", "host"}, {"x-api", "1"}, {"x-canary", "true"}, {"x-via", "cdn"}},
+        {{":method", "GET"}, {":path", "/"}, {":authority", "host"}, {"x-forwarded-for", ""}}
+    };
+    for (const auto& headers : test_headers) {
+        Http::TestRequestHeaderMapImpl interpreted_headers = headers;
+        envoy::config::core::v3::Metadata interpreted_metadata;
+        const ExecutionError interpreted_error = run(
+            [&](Http::TestRequestHeaderMapImpl& headers, StreamInfo::StreamInfo* stream_info) {
+                execution_context.beginPhase(interpreted_config.requestHeaderSlots(), headers, interpreted_config.requestValueSlots());
+                return interpreted_config.requestProgram()->execute(headers, stream_info, execution_context);
+            }, interpreted_headers, interpreted_metadata);
+        Http::TestRequestHeaderMapImpl compiled_headers = headers;
+        envoy::config::core::v3::Metadata compiled_metadata;
+        const ExecutionError compiled_error = run(
+            [&](Http::TestRequestHeaderMapImpl& headers, StreamInfo::StreamInfo* stream_info) {
+                const CompiledRulesFilterConfig::Direction& direction = compiled_config.request();
+                execution_context.beginPhase(direction.header_slots, headers, direction.value_slots);
+                CompiledPhase phase{headers, stream_info, execution_context, direction.inline_headers.data()};
+                return factory->executeRequest(phase);
+            }, compiled_headers, compiled_metadata);
+        EXPECT_EQ(interpreted_error, compiled_error);
+        EXPECT_EQ(interpreted_headers, compiled_headers);
+        EXPECT_EQ(interpreted_metadata.DebugString(), compiled_metadata.DebugString());
+    }
+
+    // rules that aren't linked in fail the config
+    compiled_proto_config.set_rules("missing");
+    EXPECT_THROW(CompiledRulesFilterConfig(compiled_proto_config, context.scope()), EnvoyException);
+
+    // a decision DAG can't be generated
+    proto_config.set_decision_dag(true);
+    std::string generated;
+    EXPECT_EQ(absl::StatusCode::kInvalidArgument,
+              ProgramCodegen::generate(*HttpHeaderRewriteFilterConfig::compileRules(proto_config), "dag", "", generated).code());
+}
+
+// Generates random rules and requests for DifferentialTest. Rules read and write a few headers, so
+// that they depend on each other, with values and bool arguments from small pools, so that
+// conditions go both ways; the generated requests include values that make hdr() fail, and the
+// rules positions that are not numbers, which make the config invalid.
+class DifferentialGenerator {
+public:
+    explicit DifferentialGenerator(uint32_t seed) : random_(seed) {}
+
+    // set-bool rules first, then header rules gated on the bools defined so far
+    std::string rules() {
+        std::string rules;
+        for (const bool is_request : {true, false}) {
+            const std::string direction = is_request ? "http-request " : "http-response ";
+            std::vector<std::string> bools;
+            const size_t bool_count = 1 + next(4);
+            for (size_t i = 0; i < bool_count; i++) {
+                const std::string name = absl::StrCat(is_request ? "req" : "resp", i);
+                absl::StrAppend(&rules, direction, "set-bool ", name, " ", function(is_request), " ", match(), "\n");
+                bools.push_back(name);
+            }
+            const size_t rule_count = 2 + next(7);
+            for (size_t i = 0; i < rule_count; i++) {
+                absl::StrAppend(&rules, direction, operation(is_request), condition(bools), "\n");
+            }
+        }
+        return rules;
+    }
+
+    Http::TestRequestHeaderMapImpl requestHeaders() {
+        static const std::vector<std::string> paths = {"/", "/api?q=v1", "/?q=v1&r=v2", "/p?r=", "/api/v1"};
+        Http::TestRequestHeaderMapImpl headers{{":method", "GET"}, {":path", pick(paths)}, {":authority", "host"}};
+        addHeaders(headers);
+        if (next(2) == 0) {
+            headers.addCopy(Http::LowerCaseString("x-key"), next(2) == 0 ? "x-b" : "x-e");
+        }
+        return headers;
+    }
+
+    Http::TestResponseHeaderMapImpl responseHeaders() {
+        Http::TestResponseHeaderMapImpl headers{{":status", next(3) == 0 ? "503" : "200"}};
+        addHeaders(headers);
+        return headers;
+    }
+
+    // a true rate per bool, to order conditions as if profiled
+    BoolTrueRates trueRates(size_t bool_count) {
+        BoolTrueRates true_rates;
+        for (size_t i = 0; i < bool_count; i++) {
+            true_rates.push_back(next(101) / 100.0);
+        }
+        return true_rates;
+    }
+
+private:
+    size_t next(size_t bound) { return std::uniform_int_distribution<size_t>(0, bound - 1)(random_); }
+    const std::string& pick(const std::vector<std::string>& values) { return values[next(values.size())]; }
+
+    std::string function(bool is_request) {
+        static const std::vector<std::string> read_headers = {"x-a", "x-b", "x-c", "x-inline-test", "user-agent"};
+        static const std::vector<std::string> positions = {"-1", "0", "1", "2"};
+        switch (next(is_request ? 6 : 5)) {
+        case 0:
+            return absl::StrCat("%[hdr(", pick(read_headers), ")]");
+        case 1:
+            // rarely not a number, or few configs would be valid
+            return absl::StrCat("%[hdr(", pick(read_headers), ",", next(10) == 0 ? "x" : pick(positions), ")]");
+        case 2:
+            return absl::StrCat("%[metadata(", next(2) == 0 ? "m1" : "m2", ")]");
+        case 3:
+            return is_request ? "%[hdr(:path)]" : "%[hdr(:status)]";
+        case 4:
+            return absl::StrCat("v", next(3));
+        default:
+            return absl::StrCat("%[urlp(", next(2) == 0 ? "q" : "r", ")]");
+        }
+    }
+
+    std::string match() {
+        static const std::vector<std::string> arguments = {"v1", "v", "1", "/api", "5", "v1,v2"};
+        static const std::vector<std::string> types = {"str", "beg", "sub"};
+        return next(4) == 0 ? "-m found" : absl::StrCat("-m ", pick(types), " ", pick(arguments));
+    }
+
+    std::string operation(bool is_request) {
+        static const std::vector<std::string> written_headers = {"x-a", "x-b", "x-d", "x-inline-test", "user-agent"};
+        switch (next(is_request ? 5 : 4)) {
+        case 0:
+            return absl::StrCat("set-header ", next(6) == 0 ? "%[hdr(x-key)]" : pick(written_headers), " ",
+                                function(is_request));
+        case 1:
+            return absl::StrCat("append-header ", pick(written_headers), " ", function(is_request),
+                                next(2) == 0 ? absl::StrCat(" ", function(is_request)) : "");
+        case 2:
+            return absl::StrCat("set-metadata ", next(2) == 0 ? "m1" : "m2", " ", function(is_request));
+        case 3:
+            return absl::StrCat("set-header ", pick(written_headers), " v", next(3));
+        default:
+            return absl::StrCat("set-path ", next(2) == 0 ? absl::StrCat("/v", next(3)) : function(is_request));
+        }
+    }
+
+    std::string condition(const std::vector<std::string>& bools) {
+        if (next(3) == 0) {
+            return "";
+        }
+        std::string condition = " if";
+        const size_t operand_count = 1 + next(4);
+        for (size_t i = 0; i < operand_count; i++) {
+            if (i > 0) {
+                condition += next(2) == 0 ? " and" : " or";
+            }
+            absl::StrAppend(&condition, next(4) == 0 ? " not " : " ", pick(bools));
+        }
+        return condition;
+    }
+
+    template <class HeaderMap> void addHeaders(HeaderMap& headers) {
+        static const std::vector<std::string> names = {"x-a", "x-b", "x-c", "x-inline-test", "user-agent"};
+        static const std::vector<std::string> values = {"v1", "v1,v2", "v2, v1", " , ", "", "v", "1,/api"};
+        for (const std::string& name : names) {
+            // an inline header has a single entry, that a repeated header is appended to
+            const bool repeatable = name != "x-inline-test" && name != "user-agent";
+            for (size_t count = next(3) == 0 ? 0 : 1 + (repeatable ? next(2) : 0); count > 0; count--) {
+                headers.addCopy(Http::LowerCaseString(name), pick(values));
+            }
+        }
+    }
+
+    std::mt19937 random_;
+};
+
+// Result of executing both phases of a stream's rules, as the filter does: whether each phase
+// failed and with which error, the headers and the dynamic metadata.
+struct DifferentialOutcome {
+    std::string request_error;
+    std::string response_error;
+    Http::TestRequestHeaderMapImpl request_headers;
+    Http::TestResponseHeaderMapImpl response_headers;
+    std::string metadata;
+};
+
+// executes a stream through execute_phase(headers, is_request, stream_info), with stream info
+// holding its dynamic metadata
+DifferentialOutcome runDifferential(
+    const Http::TestRequestHeaderMapImpl& request_headers, const Http::TestResponseHeaderMapImpl& response_headers,
+    const std::function<std::string(Http::RequestOrResponseHeaderMap&, bool, StreamInfo::StreamInfo*)>& execute_phase) {
+    DifferentialOutcome outcome{"", "", request_headers, response_headers, ""};
+    envoy::config::core::v3::Metadata dynamic_metadata;
+    NiceMock<StreamInfo::MockStreamInfo> stream_info;
+    ON_CALL(stream_info, dynamicMetadata()).WillByDefault(ReturnRef(dynamic_metadata));
+    ON_CALL(Const(stream_info), dynamicMetadata()).WillByDefault(ReturnRef(dynamic_metadata));
+    ON_CALL(stream_info, setDynamicMetadata(_,_)).WillByDefault(Invoke([&dynamic_metadata](const std::string& name, const ProtobufWkt::Struct& value) {
+        return (*dynamic_metadata.mutable_filter_metadata())[name].MergeFrom(value);
+    }));
+    outcome.request_error = execute_phase(outcome.request_headers, true, &stream_info);
+    outcome.response_error = execute_phase(outcome.response_headers, false, &stream_info);
+    outcome.metadata = dynamic_metadata.DebugString();
+    return outcome;
+}
+
+// the values of each header, in order: the optimizer moves constant writes above other rules,
+// which only changes the order of headers of different names
+std::map<std::string, std::vector<std::string>> headerFields(const Http::HeaderMap& headers) {
+    std::map<std::string, std::vector<std::string>> fields;
+    headers.iterate([&fields](const Http::HeaderEntry& header) {
+        fields[std::string(header.key().getStringView())].emplace_back(header.value().getStringView());
+        return Http::HeaderMap::Iterate::Continue;
+    });
+    return fields;
+}
+
+// The reference prefixes the error of some rules with their operation, e.g. "failed to get dynamic
+// value to set metadata -- ", where the engines only return the cause.
+void expectSameOutcome(const DifferentialOutcome& expected, const DifferentialOutcome& actual) {
+    EXPECT_EQ(expected.request_error.empty(), actual.request_error.empty());
+    EXPECT_THAT(expected.request_error, testing::EndsWith(actual.request_error));
+    EXPECT_EQ(expected.response_error.empty(), actual.response_error.empty());
+    EXPECT_THAT(expected.response_error, testing::EndsWith(actual.response_error));
+    EXPECT_EQ(headerFields(expected.request_headers), headerFields(actual.request_headers));
+    EXPECT_EQ(headerFields(expected.response_headers), headerFields(actual.response_headers));
+    EXPECT_EQ(expected.metadata, actual.metadata);
+}
+
+// executes processors one by one, stopping at the first that fails, and returns its error
+std::string executeProcessors(const std::vector<HeaderProcessorUniquePtr>& processors, Http::RequestOrResponseHeaderMap& headers,
+                              StreamInfo::StreamInfo* stream_info, ExecutionContext* context) {
+    for (const auto& processor : processors) {
+        const absl::Status status = processor->executeOperation(headers, stream_info, context);
+        if (!status.ok()) {
+            return std::string(status.message());
+        }
+    }
+    return "";
+}
+
+// An engine executing the rules of a stream, named for the failure messages.
+struct DifferentialEngine {
+    std::string name;
+    std::function<std::string(Http::RequestOrResponseHeaderMap&, bool, StreamInfo::StreamInfo*)> execute_phase;
+};
+
+// executes the programs of rules, with the context shared by both phases like a stream's
+DifferentialEngine programEngine(const std::string& name, CompiledRulesSharedPtr rules,
+                                 std::shared_ptr<const Program> request_program, std::shared_ptr<const Program> response_program) {
+    auto context = std::make_shared<ExecutionContext>();
+    return {name, [rules, request_program, response_program, context](Http::RequestOrResponseHeaderMap& headers, bool is_request,
+                                                                      StreamInfo::StreamInfo* stream_info) {
+        context->beginPhase(is_request ? rules->request_header_slots : rules->response_header_slots, headers,
+                            is_request ? rules->request_value_slots : rules->response_value_slots);
+        const Program& program = is_request ? *request_program : *response_program;
+        const ExecutionError error = program.execute(headers, stream_info, *context);
+        return error == ExecutionError::None ? std::string() : std::string(executionErrorMessage(error));
+    }};
+}
+
+TEST_F(ProcessorTest, DifferentialTest) {
+    // the processors executing the rules as written are the reference; every optimization and
+    // compilation must leave a stream exactly as they do. A failure reports the seed of its config,
+    // to reproduce it by running the test with DifferentialSeed set to it.
+    constexpr uint32_t DifferentialSeed = 0;
+    constexpr uint32_t ConfigCount = 300;
+    constexpr uint32_t RequestsPerConfig = 20;
+    const std::vector<std::string> inline_header_names = {"x-inline-test", "user-agent"};
+
+    uint32_t valid_configs = 0;
+    uint32_t invalid_configs = 0;
+    for (uint32_t seed = DifferentialSeed; seed < DifferentialSeed + ConfigCount; seed++) {
+        DifferentialGenerator generator(seed);
+        const std::string rules = generator.rules();
+        SCOPED_TRACE(absl::StrCat("seed ", seed, ", rules:\n", rules));
+        CompiledRulesSharedPtr reference;
+        try {
+            reference = HttpHeaderRewriteFilterConfig::parseRules(rules);
+        } catch (const EnvoyException&) {
+            // a config invalid as written is invalid however it's compiled
+            envoy::extensions::filters::http::HeaderRewrite proto_config;
+            proto_config.set_config(rules);
+            EXPECT_THROW(HttpHeaderRewriteFilterConfig::compileRules(proto_config), EnvoyException);
+            invalid_configs++;
+            continue;
+        }
+        valid_configs++;
+
+        std::vector<DifferentialEngine> engines;
+        for (const bool inline_headers : {false, true}) {
+            for (const bool decision_dag : {false, true}) {
+                envoy::extensions::filters::http::HeaderRewrite proto_config;
+                proto_config.set_config(rules);
+                proto_config.set_decision_dag(decision_dag);
+                if (inline_headers) {
+                    for (const std::string& name : inline_header_names) {
+                        proto_config.add_inline_headers(name);
+                    }
+                }
+                const std::string mode = absl::StrCat(inline_headers ? "inline headers, " : "", decision_dag ? "decision DAG, " : "");
+                const CompiledRulesSharedPtr compiled = HttpHeaderRewriteFilterConfig::compileRules(proto_config);
+                engines.push_back(programEngine(absl::StrCat(mode, "program"), compiled, compiled->request_program,
+                                                compiled->response_program));
+
+                // conditions ordered by random true rates, as reordered from a profile
+                const BoolTrueRates request_rates = generator.trueRates(compiled->request_program->boolCount());
+                const BoolTrueRates response_rates = generator.trueRates(compiled->response_program->boolCount());
+                engines.push_back(programEngine(
+                    absl::StrCat(mode, "profiled program"), compiled,
+                    Program::compile(compiled->request_header_processors, *compiled->request_set_bool_processors, &request_rates, decision_dag),
+                    Program::compile(compiled->response_header_processors, *compiled->response_set_bool_processors, &response_rates, decision_dag)));
+
+                // the programs through a program file
+                const std::string content = ProgramFile::write(*compiled, inline_headers ? inline_header_names : std::vector<std::string>());
+                absl::string_view payload;
+                ASSERT_TRUE(ProgramFile::check(content, payload).ok());
+                CompiledRulesSharedPtr loaded;
+                const absl::Status read_status = ProgramFile::read(payload, loaded);
+                ASSERT_TRUE(read_status.ok()) << read_status.message();
+                engines.push_back(programEngine(absl::StrCat(mode, "program file"), loaded, loaded->request_program,
+                                                loaded->response_program));
+
+                // the optimized processors, before they're compiled, with the value and header slots of the program
+                if (!decision_dag) {
+                    auto context = std::make_shared<ExecutionContext>();
+                    engines.push_back({absl::StrCat(mode, "optimized processors"), [compiled, context](Http::RequestOrResponseHeaderMap& headers, bool is_request,
+                                                                                                     StreamInfo::StreamInfo* stream_info) {
+                        context->beginPhase(is_request ? compiled->request_header_slots : compiled->response_header_slots, headers,
+                                            is_request ? compiled->request_value_slots : compiled->response_value_slots);
+                        return executeProcessors(is_request ? compiled->request_header_processors : compiled->response_header_processors,
+                                                 headers, stream_info, context.get());
+                    }});
+                }
+            }
+        }
+
+        for (uint32_t request = 0; request < RequestsPerConfig; request++) {
+            const Http::TestRequestHeaderMapImpl request_headers = generator.requestHeaders();
+            const Http::TestResponseHeaderMapImpl response_headers = generator.responseHeaders();
+            const DifferentialOutcome expected = runDifferential(request_headers, response_headers,
+                [&reference](Http::RequestOrResponseHeaderMap& headers, bool is_request, StreamInfo::StreamInfo* stream_info) {
+                    return executeProcessors(is_request ? reference->request_header_processors : reference->response_header_processors,
+                                             headers, stream_info, nullptr);
+                });
+            for (const DifferentialEngine& engine : engines) {
+                SCOPED_TRACE(absl::StrCat(engine.name, ", request ", request, ":\n", testing::PrintToString(request_headers),
+                                          testing::PrintToString(response_headers)));
+                expectSameOutcome(expected, runDifferential(request_headers, response_headers, engine.execute_phase));
+            }
+        }
+    }
+    // most generated configs are valid, or the test would compare little, but not all
+    EXPECT_LT(ConfigCount / 2, valid_configs);
+    EXPECT_LT(0, invalid_configs);
+}
+
+// The generated code of compiled_rules_example against its rules as written, on random requests.
+TEST_F(ProcessorTest, CompiledRulesDifferentialTest) {
+    const CompiledRulesFactory* factory = Registry::FactoryRegistry<CompiledRulesFactory>::getFactory("example");
+    ASSERT_NE(nullptr, factory);
+    NiceMock<Server::Configuration::MockFactoryContext> context;
+    envoy::extensions::filters::http::HeaderRewriteCompiled compiled_proto_config;
+    compiled_proto_config.set_rules("example");
+    const CompiledRulesFilterConfig compiled_config(compiled_proto_config, context.scope());
+    const CompiledRulesSharedPtr reference = HttpHeaderRewriteFilterConfig::parseRules(std::string(factory->source()));
+
+    auto execution_context = std::make_shared<ExecutionContext>();
+    const DifferentialEngine engine{"generated code", [&](Http::RequestOrResponseHeaderMap& headers, bool is_request,
+                                                          StreamInfo::StreamInfo* stream_info) {
+        const CompiledRulesFilterConfig::Direction& direction = is_request ? compiled_config.request() : compiled_config.response();
+        execution_context->beginPhase(direction.header_slots, headers, direction.value_slots);
+        CompiledPhase phase{headers, stream_info, *execution_context, direction.inline_headers.data()};
+        const ExecutionError error = is_request ? factory->executeRequest(phase) : factory->executeResponse(phase);
+        return error == ExecutionError::None ? std::string() : std::string(executionErrorMessage(error));
+    }};
+    // the example's rules read these headers
+    const std::vector<std::pair<std::string, std::vector<std::string>>> request_values = {
+        {"x-api", {"1", ""}}, {"x-canary", {"true", "false", " , "}}, {"user-agent", {"Mobile Safari", "curl"}},
+        {"x-forwarded-for", {"10.0.0.1, 10.0.0.2", "", " , "}}, {"x-tenant", {"t1", "t1,t2"}}};
+    const std::vector<std::string> paths = {"/", "/v1/items?version=2", "/v1/?version=", "/v2?a=b"};
+    std::mt19937 random(0);
+    const auto next = [&random](size_t bound) { return std::uniform_int_distribution<size_t>(0, bound - 1)(random); };
+    for (int request = 0; request < 500; request++) {
+        Http::TestRequestHeaderMapImpl request_headers{{":method", "GET"}, {":path", paths[next(paths.size())]}, {":authority", "host"}};
+        for (const auto& header : request_values) {
+            if (next(2) == 0) {
+                request_headers.addCopy(Http::LowerCaseString(header.first), header.second[next(header.second.size())]);
+            }
+        }
+        const Http::TestResponseHeaderMapImpl response_headers{{":status", next(2) == 0 ? "200" : "503"}};
+        SCOPED_TRACE(absl::StrCat("request ", request, ":\n", testing::PrintToString(request_headers)));
+        const DifferentialOutcome expected = runDifferential(request_headers, response_headers,
+            [&reference](Http::RequestOrResponseHeaderMap& headers, bool is_request, StreamInfo::StreamInfo* stream_info) {
+                return executeProcessors(is_request ? reference->request_header_processors : reference->response_header_processors,
+                                         headers, stream_info, nullptr);
+            });
+        expectSameOutcome(expected, runDifferential(request_headers, response_headers, engine.execute_phase));
+    }
+}
+
 } // namespace HeaderRewriteFilter
 } // namespace HttpFilters
 } // namespace Extensions
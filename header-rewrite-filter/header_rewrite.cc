@@ -1,12 +1,23 @@
+#include <algorithm>
+#include <chrono>
 #include <string>
 #include <unordered_map>
 #include <sstream>
 #include <vector>
 
 #include "header_rewrite.h"
+#include "program_file.h"
 
 #include "source/common/common/utility.h"
+#include "source/common/filesystem/directory.h"
+#include "source/common/http/utility.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "absl/strings/str_replace.h"
 #include "source/common/common/logger.h"
+#include "envoy/event/dispatcher.h"
 #include "envoy/server/filter_config.h"
 
 namespace Envoy {
@@ -14,166 +25,767 @@ namespace Extensions {
 namespace HttpFilters {
 namespace HeaderRewriteFilter {
 
-void fail(absl::string_view msg) {
-  auto& logger = Logger::Registry::getLog(Logger::Id::tracing);
-  ENVOY_LOG_TO_LOGGER(logger, error, "Failed to parse config - {}", msg);
+SINGLETON_MANAGER_REGISTRATION(header_rewrite_program_cache);
+
+namespace {
+
+ProgramCacheSharedPtr programCache(Singleton::Manager& singleton_manager) {
+  return singleton_manager.getTyped<ProgramCache>(SINGLETON_MANAGER_REGISTERED_NAME(header_rewrite_program_cache),
+                                                  [] { return std::make_shared<ProgramCache>(); });
 }
 
+} // namespace
+
 HttpHeaderRewriteFilterConfig::HttpHeaderRewriteFilterConfig(
-    const envoy::extensions::filters::http::HeaderRewrite& proto_config)
-    : config_(proto_config.config()) {}
+    const envoy::extensions::filters::http::HeaderRewrite& proto_config, Server::Configuration::FactoryContext& context)
+    : HttpHeaderRewriteFilterConfig(proto_config, context.scope(), context.timeSource(), context.threadLocal(),
+                                    context.mainThreadDispatcher(), context.api(),
+                                    programCache(context.singletonManager())) {
+  logOptimization();
+}
 
-HttpHeaderRewriteFilter::HttpHeaderRewriteFilter(HttpHeaderRewriteFilterConfigSharedPtr config)
-    : config_(config) {
+HttpHeaderRewriteFilterConfig::HttpHeaderRewriteFilterConfig(
+    const envoy::extensions::filters::http::HeaderRewrite& proto_config,
+    Server::Configuration::ServerFactoryContext& context)
+    : HttpHeaderRewriteFilterConfig(proto_config, context.scope(), context.timeSource(), context.threadLocal(),
+                                    context.mainThreadDispatcher(), context.api(),
+                                    programCache(context.singletonManager())) {
+  logOptimization();
+}
+
+HttpHeaderRewriteFilterConfig::HttpHeaderRewriteFilterConfig(
+    const envoy::extensions::filters::http::HeaderRewrite& proto_config, Stats::Scope& scope, TimeSource& time_source,
+    ThreadLocal::SlotAllocator& tls, Event::Dispatcher& main_thread_dispatcher, Api::Api& api,
+    ProgramCacheSharedPtr program_cache, ThreadLocal::TypedSlot<LazyWorkerState>* lazy_worker_state,
+    const HttpHeaderRewriteFilterConfig* parent)
+    : config_(proto_config.config()), stat_prefix_(statPrefix(proto_config)),
+      stats_(generateStats(stat_prefix_, scope)), log_errors_(proto_config.log_errors()),
+      program_cache_(std::move(program_cache)), decision_dag_(proto_config.decision_dag()),
+      condition_reorder_interval_(proto_config.condition_reorder_interval_ms()),
+      timing_sample_rate_(proto_config.timing_sample_rate()), lazy_worker_state_(lazy_worker_state),
+      worker_owner_(parent != nullptr ? parent : this),
+      worker_index_(parent != nullptr ? parent->tenants_.size() + 1 : 0) {
+  if (config_.empty() && proto_config.program_file().empty() && proto_config.tenants().empty() &&
+      proto_config.tenant_directory().empty()) {
+    throw EnvoyException("invalid header rewrite config: no rules and no tenants");
+  }
+  if (!proto_config.rules_file().empty()) {
+    throw EnvoyException("invalid header rewrite config: rules_file is only supported in the filter config");
+  }
+  if (!proto_config.program_file().empty() && (!config_.empty() || condition_reorder_interval_.count() > 0)) {
+    throw EnvoyException("invalid header rewrite config: program_file can't be used with config or "
+                         "condition_reorder_interval_ms");
+  }
+
+  const MonotonicTime start = time_source.monotonicTime();
+  if (proto_config.program_file().empty()) {
+    rules_ = program_cache_->getOrCompile(programCacheKey(proto_config),
+                                          [&proto_config]() { return compileRules(proto_config); });
+  } else {
+    rules_ = loadProgramFile(proto_config.program_file());
+  }
+  request_program_ = rules_->request_program;
+  response_program_ = rules_->response_program;
+
+  has_request_rules_ = request_program_->ruleCount() > 0;
+  has_response_rules_ = response_program_->ruleCount() > 0;
+  stats_.request_rules_.set(request_program_->ruleCount());
+  stats_.response_rules_.set(response_program_->ruleCount());
+  stats_.program_bytes_.set(request_program_->byteSize() + response_program_->byteSize());
+  stats_.compile_time_us_.set(
+      std::chrono::duration_cast<std::chrono::microseconds>(time_source.monotonicTime() - start).count());
+
+  request_rule_stats_ =
+      std::make_shared<const RuleStats>(scope, stat_prefix_ + "request.", rules_->request_rule_positions);
+  response_rule_stats_ =
+      std::make_shared<const RuleStats>(scope, stat_prefix_ + "response.", rules_->response_rule_positions);
+  if (lazy_worker_state_ != nullptr) {
+    // compiled on a worker: slots can only be allocated on the main thread, so the workers' state
+    // lives in the slot allocated for the route, and such a config has no tenants
+    needs_response_phase_ = has_response_rules_;
+    return;
+  }
+
+  if (condition_reorder_interval_.count() > 0) {
+    request_profile_ = std::make_shared<BoolProfile>(request_program_->boolCount());
+    response_profile_ = std::make_shared<BoolProfile>(response_program_->boolCount());
+    reorder_timer_ = main_thread_dispatcher.createTimer([this]() { reorderConditions(); });
+    reorder_timer_->enableTimer(condition_reorder_interval_);
+  }
+  if (parent != nullptr) {
+    // a tenant: its parent allocates the slots once all of its tenants are loaded
+    needs_response_phase_ = has_response_rules_;
+    return;
+  }
+
+  loadTenants(proto_config, scope, time_source, tls, main_thread_dispatcher, api);
+  needs_response_phase_ =
+      has_response_rules_ || std::any_of(tenants_.begin(), tenants_.end(),
+                                         [](const auto& tenant) { return tenant->hasResponseRules(); });
+
+  // one pair of slots for this config and every tenant, rather than a pair per tenant, so that
+  // loading thousands of tenants posts to the workers twice
+  std::vector<ActivePrograms> programs{{request_program_, response_program_}};
+  std::vector<RuleCounts::Targets> rule_count_targets{ruleCountTargets()};
+  for (const auto& tenant : tenants_) {
+    programs.push_back({tenant->request_program_, tenant->response_program_});
+    rule_count_targets.push_back(tenant->ruleCountTargets());
+  }
+  active_programs_ = ThreadLocal::TypedSlot<WorkerPrograms>::makeUnique(tls);
+  active_programs_->set([programs = std::move(programs)](Event::Dispatcher&) {
+    auto worker_programs = std::make_shared<WorkerPrograms>();
+    worker_programs->configs = programs;
+    return worker_programs;
+  });
+  rule_counts_ = ThreadLocal::TypedSlot<WorkerRuleCounts>::makeUnique(tls);
+  rule_counts_->set([rule_count_targets = std::move(rule_count_targets),
+                     timing_sample_rate = timing_sample_rate_](Event::Dispatcher& dispatcher) {
+    return std::make_shared<WorkerRuleCounts>(dispatcher, rule_count_targets, timing_sample_rate);
+  });
+}
+
+void HttpHeaderRewriteFilterConfig::loadTenants(const envoy::extensions::filters::http::HeaderRewrite& proto_config,
+                                                Stats::Scope& scope, TimeSource& time_source,
+                                                ThreadLocal::SlotAllocator& tls,
+                                                Event::Dispatcher& main_thread_dispatcher, Api::Api& api) {
+  // a tenant's stats are named after it, so no two tenants can have the same name, e.g. the files
+  // a.b and a_b
+  absl::flat_hash_set<std::string> names;
+  const auto add = [&](const std::string& name, const std::string& config, const std::vector<std::string>& authorities) {
+    if (!names.insert(name).second) {
+      throw EnvoyException(absl::StrCat("invalid header rewrite config: more than one tenant named ", name));
+    }
+    addTenant(proto_config, name, config, authorities, scope, time_source, tls, main_thread_dispatcher, api);
+  };
+
+  for (const auto& tenant : proto_config.tenants()) {
+    add(tenant.name(), tenant.config(), {tenant.authorities().begin(), tenant.authorities().end()});
+  }
+  if (proto_config.tenant_directory().empty()) {
+    return;
+  }
+
+  // sorted, so that tenants are numbered and described in the same order on every load
+  std::vector<std::string> file_names;
+  for (const Filesystem::DirectoryEntry& entry : Filesystem::Directory(proto_config.tenant_directory())) {
+    if (entry.type_ == Filesystem::FileType::Regular) {
+      file_names.push_back(entry.name_);
+    }
+  }
+  std::sort(file_names.begin(), file_names.end());
+  for (const std::string& file_name : file_names) {
+    const std::string path = absl::StrCat(proto_config.tenant_directory(), "/", file_name);
+    const absl::StatusOr<std::string> config = api.fileSystem().fileReadToEnd(path);
+    if (!config.ok()) {
+      throw EnvoyException(absl::StrCat("invalid header rewrite tenant file ", path, ": ", config.status().message()));
+    }
+    // dots would split the name into several stat name segments
+    add(absl::StrReplaceAll(file_name, {{".", "_"}, {"*", "_"}}), *config, {file_name});
+  }
+}
 
+void HttpHeaderRewriteFilterConfig::addTenant(const envoy::extensions::filters::http::HeaderRewrite& proto_config,
+                                              const std::string& name, const std::string& config,
+                                              const std::vector<std::string>& authorities, Stats::Scope& scope,
+                                              TimeSource& time_source, ThreadLocal::SlotAllocator& tls,
+                                              Event::Dispatcher& main_thread_dispatcher, Api::Api& api) {
+  envoy::extensions::filters::http::HeaderRewrite tenant_config = proto_config;
+  tenant_config.clear_tenants();
+  tenant_config.clear_tenant_directory();
+  tenant_config.set_config(config);
+  tenant_config.set_stat_prefix(proto_config.stat_prefix().empty()
+                                    ? absl::StrCat("tenant.", name)
+                                    : absl::StrCat(proto_config.stat_prefix(), ".tenant.", name));
+
+  const uint32_t tenant = tenants_.size();
+  try {
+    tenants_.emplace_back(new HttpHeaderRewriteFilterConfig(tenant_config, scope, time_source, tls,
+                                                            main_thread_dispatcher, api, program_cache_, nullptr,
+                                                            this));
+  } catch (const EnvoyException& e) {
+    throw EnvoyException(absl::StrCat("tenant ", name, ": ", e.what()));
+  }
+  for (const std::string& authority : authorities) {
+    const absl::Status status = tenant_table_.add(authority, tenant);
+    if (!status.ok()) {
+      throw EnvoyException(absl::StrCat("invalid header rewrite config: ", status.message()));
+    }
+  }
+}
+
+LazyWorkerState& HttpHeaderRewriteFilterConfig::lazyWorkerState() const {
+  LazyWorkerState& state = lazy_worker_state_->get().ref();
+  if (state.rule_counts == nullptr) {
+    state.programs.request = request_program_;
+    state.programs.response = response_program_;
+    state.rule_counts = std::make_unique<WorkerRuleCounts>(
+        state.dispatcher, std::vector<RuleCounts::Targets>{ruleCountTargets()}, timing_sample_rate_);
+  }
+  return state;
+}
+
+const HttpHeaderRewriteFilterConfig& HttpHeaderRewriteFilterConfig::tenantConfig(absl::string_view authority) const {
+  const absl::optional<uint32_t> tenant = tenant_table_.find(authority);
+  return tenant ? *tenants_[*tenant] : *this;
+}
+
+std::string HttpHeaderRewriteFilterConfig::statPrefix(const envoy::extensions::filters::http::HeaderRewrite& proto_config) {
+  return proto_config.stat_prefix().empty() ? "header_rewrite." : absl::StrCat("header_rewrite.", proto_config.stat_prefix(), ".");
+}
+
+HeaderRewriteFilterStats HttpHeaderRewriteFilterConfig::generateStats(const std::string& prefix, Stats::Scope& scope) {
+  return HeaderRewriteFilterStats{
+      ALL_HEADER_REWRITE_FILTER_STATS(POOL_COUNTER_PREFIX(scope, prefix), POOL_GAUGE_PREFIX(scope, prefix),
+                                      POOL_HISTOGRAM_PREFIX(scope, prefix))};
+}
+
+CompiledRulesSharedPtr
+HttpHeaderRewriteFilterConfig::compileRules(const envoy::extensions::filters::http::HeaderRewrite& proto_config) {
+  // not make_shared, so that the rules are freed with their last config rather than with the
+  // cache's weak reference
+  std::shared_ptr<CompiledRules> rules(new CompiledRules());
+  auto inline_headers = std::make_shared<InlineHeaderTable>();
+  for (const auto& header_name : proto_config.inline_headers()) {
+    const absl::Status status = inline_headers->add(header_name);
+    if (!status.ok()) {
+      throw EnvoyException(std::string(status.message()));
+    }
+  }
+  rules->inline_headers = std::move(inline_headers);
+
+  const absl::Status status = parseConfig(proto_config.config(), *rules);
+  if (!status.ok()) {
+    throw EnvoyException(absl::StrCat("invalid header rewrite config: ", status.message()));
+  }
+  rules->request_optimization = RuleOptimizer::optimize(
+      rules->request_header_processors, *rules->request_set_bool_processors, true, rules->inline_headers);
+  rules->response_optimization = RuleOptimizer::optimize(
+      rules->response_header_processors, *rules->response_set_bool_processors, false, rules->inline_headers);
+  rules->request_value_slots = rules->request_optimization.value_slots;
+  rules->response_value_slots = rules->response_optimization.value_slots;
+  assignHeaderSlots(rules->request_header_processors, rules->request_set_bool_processors, rules->request_header_slots);
+  assignHeaderSlots(rules->response_header_processors, rules->response_set_bool_processors,
+                    rules->response_header_slots);
+  rules->request_program = Program::compile(rules->request_header_processors, *rules->request_set_bool_processors,
+                                            nullptr, proto_config.decision_dag());
+  rules->response_program = Program::compile(rules->response_header_processors, *rules->response_set_bool_processors,
+                                             nullptr, proto_config.decision_dag());
+  return rules;
+}
+
+CompiledRulesSharedPtr HttpHeaderRewriteFilterConfig::parseRules(const std::string& config) {
+  auto rules = std::make_shared<CompiledRules>();
+  rules->inline_headers = std::make_shared<InlineHeaderTable>();
+  const absl::Status status = parseConfig(config, *rules);
+  if (!status.ok()) {
+    throw EnvoyException(absl::StrCat("invalid header rewrite config: ", status.message()));
+  }
+  return rules;
+}
+
+std::string
+HttpHeaderRewriteFilterConfig::programCacheKey(const envoy::extensions::filters::http::HeaderRewrite& proto_config) {
+  return absl::StrCat(proto_config.decision_dag() ? "dag" : "", "\n", absl::StrJoin(proto_config.inline_headers(), ","),
+                      "\n", proto_config.config());
+}
+
+CompiledRulesSharedPtr HttpHeaderRewriteFilterConfig::loadProgramFile(const std::string& path) {
+  std::unique_ptr<ProgramFile> file;
+  const absl::Status status = ProgramFile::open(path, file);
+  if (!status.ok()) {
+    throw EnvoyException(absl::StrCat("invalid header rewrite config: ", status.message()));
+  }
+  // keyed by the checked payload, which can't be mistaken for the text rules' keys
+  return program_cache_->getOrCompile(absl::StrCat("program\n", file->payload()), [&file, &path]() {
+    CompiledRulesSharedPtr rules;
+    const absl::Status read_status = ProgramFile::read(file->payload(), rules);
+    if (!read_status.ok()) {
+      throw EnvoyException(
+          absl::StrCat("invalid header rewrite config: program file ", path, ": ", read_status.message()));
+    }
+    return rules;
+  });
+}
+
+absl::Status HttpHeaderRewriteFilterConfig::parseConfig(const std::string& config, CompiledRules& rules) {
   // make bool processor map
-  request_set_bool_processors_ = std::make_shared<std::unordered_map<std::string, SetBoolProcessorSharedPtr>>();
-  response_set_bool_processors_ = std::make_shared<std::unordered_map<std::string, SetBoolProcessorSharedPtr>>();
-  
-  const std::string header_config = headerConfig();
+  rules.request_set_bool_processors = std::make_shared<std::unordered_map<std::string, SetBoolProcessorSharedPtr>>();
+  rules.response_set_bool_processors = std::make_shared<std::unordered_map<std::string, SetBoolProcessorSharedPtr>>();
 
-  // split by operation (newline delimited config)
-  auto operations = StringUtil::splitToken(header_config, "\n", false, true);
+  // A single pass over the config: each line is split in place into tokens that point into the
+  // config, so that the config is never copied and an error is located by the token's offset in
+  // its line. The tokens vector is reused from line to line.
+  const absl::string_view config_view(config);
+  std::vector<absl::string_view> tokens;
+  uint32_t line_number = 0;
+  uint32_t position = 0; // rules are numbered by non-empty line, as their stats are
+  for (size_t line_start = 0; line_start < config_view.size();) {
+    const size_t line_end = std::min(config_view.find('\n', line_start), config_view.size());
+    const absl::string_view line = config_view.substr(line_start, line_end - line_start);
+    line_start = line_end + 1;
+    line_number++;
+    // blank lines are skipped like StringUtil::splitToken(config, "\n", false, true) does
+    const absl::string_view rule = absl::StripAsciiWhitespace(line);
+    if (rule.empty()) {
+      continue;
+    }
+    position++;
+    tokenizeRule(rule, tokens);
 
-  // process each operation
-  for (auto const& operation : operations) {
-    auto tokens = StringUtil::splitToken(operation, " ");
+    // columns are counted from the start of the untrimmed line, from 1
+    const absl::string_view end_of_line = rule.substr(rule.size());
+    const auto error = [line_number, line](absl::string_view token, const absl::Status& status) {
+      return absl::Status(status.code(), absl::StrCat("line ", line_number, ", column ", token.data() - line.data() + 1,
+                                                      ": ", status.message()));
+    };
     if (tokens.size() < Utility::MIN_NUM_ARGUMENTS) {
-      fail("too few arguments provided");
-      setError();
-      return;
+      return error(end_of_line, absl::InvalidArgumentError("too few arguments provided"));
     }
+    // errors of the processors are located at the operation's arguments
+    const absl::string_view arguments = tokens.size() > 2 ? tokens[2] : end_of_line;
 
     // determine if it's request/response
-    if (tokens.at(0) != Utility::HTTP_REQUEST && tokens.at(0) != Utility::HTTP_RESPONSE) {
-      fail("first argument must be <http-response/http-request>");
-      setError();
-      return;
+    const bool isRequest = (tokens[0] == Utility::HTTP_REQUEST);
+    if (!isRequest && tokens[0] != Utility::HTTP_RESPONSE) {
+      return error(tokens[0], absl::InvalidArgumentError("first argument must be <http-response/http-request>"));
     }
-    const bool isRequest = (tokens.at(0) == Utility::HTTP_REQUEST);
 
-    const Utility::OperationType operation_type = Utility::StringToOperationType(absl::string_view(tokens.at(1)));
+    const Utility::OperationType operation_type = Utility::StringToOperationType(tokens[1]);
     HeaderProcessorUniquePtr processor = nullptr;
 
-    auto bool_processors = isRequest ? request_set_bool_processors_ : response_set_bool_processors_;
+    auto& bool_processors = isRequest ? rules.request_set_bool_processors : rules.response_set_bool_processors;
 
     switch(operation_type) {
       case Utility::OperationType::SetHeader:
       {
-        processor = std::make_unique<SetHeaderProcessor>(bool_processors, isRequest);
+        processor = std::make_unique<SetHeaderProcessor>(bool_processors, isRequest, rules.inline_headers);
         break;
       }
       case Utility::OperationType::AppendHeader:
       {
-        processor = std::make_unique<AppendHeaderProcessor>(bool_processors, isRequest);
+        processor = std::make_unique<AppendHeaderProcessor>(bool_processors, isRequest, rules.inline_headers);
         break;
       }
       case Utility::OperationType::SetDynMetadata:
       {
-        processor = std::make_unique<SetDynamicMetadataProcessor>(bool_processors, isRequest);
+        processor = std::make_unique<SetDynamicMetadataProcessor>(bool_processors, isRequest, rules.inline_headers);
         break;
       }
       case Utility::OperationType::SetPath:
       {
         if (!isRequest) {
-          fail("set-path can only be on request");
-          setError();
-          return;
+          return error(tokens[1], absl::InvalidArgumentError("set-path can only be on request"));
         }
         // path being set here includes the query string
-        processor = std::make_unique<SetPathProcessor>(bool_processors, isRequest);
+        processor = std::make_unique<SetPathProcessor>(bool_processors, isRequest, rules.inline_headers);
         break;
       }
       case Utility::OperationType::SetBool:
        {
-          SetBoolProcessorSharedPtr processor = std::make_unique<SetBoolProcessor>(bool_processors, isRequest);
-          const std::string boolName(tokens.at(2));
+          SetBoolProcessorSharedPtr processor = std::make_unique<SetBoolProcessor>(bool_processors, isRequest, rules.inline_headers);
           const absl::Status status = processor->parseOperation(tokens, tokens.begin() + 2);
-
           if (!status.ok()) {
-            fail(status.message());
-            setError();
-            return;
+            return error(arguments, status);
           }
           // make sure this boolean variable doesn't already exist in the map
-          if (isRequest && request_set_bool_processors_->find(boolName) == request_set_bool_processors_->end()) {
-            request_set_bool_processors_->insert({boolName, std::move(processor)});
-          } else if (!isRequest && response_set_bool_processors_->find(boolName) == response_set_bool_processors_->end()) {
-            response_set_bool_processors_->insert({boolName, std::move(processor)});
-          } else {
-            fail("redefinition of boolean variable");
-            setError();
-            return;
+          if (!bool_processors->emplace(std::string(tokens[2]), std::move(processor)).second) {
+            return error(tokens[2], absl::InvalidArgumentError("redefinition of boolean variable"));
           }
           break;
         }
       default:
-        fail("invalid operation type");
-        setError();
-        return;
+        return error(tokens[1], absl::InvalidArgumentError("invalid operation type"));
     }
 
     // parse operation
     if (processor) {
       const absl::Status status = processor->parseOperation(tokens, tokens.begin() + 2);
       if (!status.ok()) {
-        fail(status.message());
-        setError();
-        return;
+        return error(arguments, status);
       }
 
       // keep track of request/response operations to be executed
       if (isRequest) {
-        request_header_processors_.push_back(std::move(processor));
+        processor->setRuleIndex(rules.request_header_processors.size());
+        rules.request_rule_positions.push_back(position);
+        rules.request_header_processors.push_back(std::move(processor));
       } else {
-        response_header_processors_.push_back(std::move(processor));
+        processor->setRuleIndex(rules.response_header_processors.size());
+        rules.response_rule_positions.push_back(position);
+        rules.response_header_processors.push_back(std::move(processor));
       }
     }
   }
+  return absl::OkStatus();
+}
+
+void HttpHeaderRewriteFilterConfig::tokenizeRule(absl::string_view line, std::vector<absl::string_view>& tokens) {
+  // split on spaces like StringUtil::splitToken(line, " "), without a vector per line
+  tokens.clear();
+  size_t token_start = 0;
+  while (token_start < line.size()) {
+    const size_t token_end = std::min(line.find(' ', token_start), line.size());
+    if (token_end > token_start) {
+      tokens.push_back(line.substr(token_start, token_end - token_start));
+    }
+    token_start = token_end + 1;
+  }
 }
 
-const std::string HttpHeaderRewriteFilter::headerConfig() const {
-  return config_->config();
+void HttpHeaderRewriteFilterConfig::logOptimization() const {
+  RuleOptimizer::Result total{};
+  const auto add = [&total](const RuleOptimizer::Result& result) {
+    total.rules_before += result.rules_before;
+    total.rules_after += result.rules_after;
+    total.bools_before += result.bools_before;
+    total.bools_after += result.bools_after;
+    total.value_slots += result.value_slots;
+  };
+  add(rules_->request_optimization);
+  add(rules_->response_optimization);
+  for (const auto& tenant : tenants_) {
+    add(tenant->rules_->request_optimization);
+    add(tenant->rules_->response_optimization);
+  }
+  ENVOY_LOG_MISC(info, "optimized rules from {} to {} operations and {} to {} booleans, {} shared values{}",
+                 total.rules_before, total.rules_after, total.bools_before, total.bools_after, total.value_slots,
+                 tenants_.empty() ? "" : absl::StrCat(", with ", tenants_.size(), " tenants"));
 }
 
-Http::FilterHeadersStatus HttpHeaderRewriteFilter::decodeHeaders(Http::RequestHeaderMap& headers, bool) {
-  if (getError()) {
-    ENVOY_LOG_MISC(info, "invalid config, skipping filter (request side)");
-    return Http::FilterHeadersStatus::Continue;
-  }
-
-  // execute each operation
-  Envoy::StreamInfo::StreamInfo* streamInfo = &decoder_callbacks_->streamInfo();
-  for (auto const& processor : request_header_processors_) {
-    const absl::Status status = processor->executeOperation(headers, streamInfo);
-    if (status != absl::OkStatus()) {
-      ENVOY_LOG_MISC(info, "error executing an operation on request side, skipping filter -- " + std::string(status.message()));
-      return Http::FilterHeadersStatus::Continue;
+void HttpHeaderRewriteFilterConfig::assignHeaderSlots(std::vector<HeaderProcessorUniquePtr>& header_processors,
+                                                      const SetBoolProcessorMapSharedPtr& set_bool_processors,
+                                                      HeaderSlotTable& header_slot_table) {
+  const auto assign = [&header_slot_table](DynamicFunctionProcessorSharedPtr& function_processor) {
+    function_processor->assignHeaderSlot(header_slot_table);
+  };
+  for (auto& processor : header_processors) {
+    processor->forEachDynamicFunction(assign);
+    if (processor->skippableByPresence()) {
+      header_slot_table.trackPresence();
     }
   }
+  for (auto& set_bool_processor : *set_bool_processors) {
+    set_bool_processor.second->forEachDynamicFunction(assign);
+  }
+}
 
-  return Http::FilterHeadersStatus::Continue;
+void HttpHeaderRewriteFilterConfig::onExecutionError(ExecutionError error, bool is_request) const {
+  (is_request ? stats_.request_errors_ : stats_.response_errors_).inc();
+  switch (error) {
+    case ExecutionError::HdrPositionOutOfRange:
+    case ExecutionError::HdrPositionNotANumber:
+      stats_.hdr_position_errors_.inc();
+      break;
+    case ExecutionError::UrlpOnResponse:
+      stats_.urlp_errors_.inc();
+      break;
+    case ExecutionError::StreamInfoMissing:
+    case ExecutionError::MetadataKeyEmpty:
+    case ExecutionError::MetadataValueEmpty:
+      stats_.metadata_errors_.inc();
+      break;
+    default:
+      stats_.invalid_function_errors_.inc();
+      break;
+  }
+
+  if (log_errors_) {
+    ENVOY_LOG_PERIODIC_MISC(warn, std::chrono::seconds(1), "error executing an operation on {} side, skipping filter -- {}",
+                            is_request ? "request" : "response", executionErrorMessage(error));
+  }
 }
 
-Http::FilterHeadersStatus HttpHeaderRewriteFilter::encodeHeaders(Http::ResponseHeaderMap& headers, bool) {
-  if (getError()) {
-    ENVOY_LOG_MISC(info, "invalid config, skipping filter (response side)");
-    return Http::FilterHeadersStatus::Continue;
-  }
-
-  // execute each operation
-  Envoy::StreamInfo::StreamInfo* streamInfo = &encoder_callbacks_->streamInfo();
-  for (auto const& processor : response_header_processors_) {
-    const absl::Status status = processor->executeOperation(headers, streamInfo);
-    if (status != absl::OkStatus()) {
-      ENVOY_LOG_MISC(info, "error executing an operation on response side, skipping filter -- " + std::string(status.message()));
-      return Http::FilterHeadersStatus::Continue;
+void HttpHeaderRewriteFilterConfig::reorderConditions() {
+  const bool request_changed =
+      reorderConditions(rules_->request_header_processors, rules_->request_set_bool_processors, *request_profile_,
+                        request_true_rates_, request_program_);
+  const bool response_changed =
+      reorderConditions(rules_->response_header_processors, rules_->response_set_bool_processors, *response_profile_,
+                        response_true_rates_, response_program_);
+  if (request_changed || response_changed) {
+    stats_.condition_reorders_.inc();
+    // a tenant's programs are in its parent's slot
+    worker_owner_->active_programs_->runOnAllThreads(
+        [index = worker_index_, request = request_program_,
+         response = response_program_](OptRef<WorkerPrograms> programs) {
+          programs->configs[index].request = request;
+          programs->configs[index].response = response;
+        });
+  }
+  reorder_timer_->enableTimer(condition_reorder_interval_);
+}
+
+bool HttpHeaderRewriteFilterConfig::reorderConditions(const std::vector<HeaderProcessorUniquePtr>& header_processors,
+                                                      const SetBoolProcessorMapSharedPtr& set_bool_processors,
+                                                      BoolProfile& profile, BoolTrueRates& true_rates,
+                                                      std::shared_ptr<const Program>& program) {
+  // a rate is only updated from enough evaluations to not follow noise
+  static constexpr uint64_t MinEvaluations = 100;
+  true_rates = profile.takeTrueRates(true_rates, MinEvaluations);
+  std::shared_ptr<const Program> reordered =
+      Program::compile(header_processors, *set_bool_processors, &true_rates, decision_dag_);
+  if (reordered->sameConditionOrder(*program)) {
+    return false;
+  }
+  program = std::move(reordered);
+  return true;
+}
+
+void HttpHeaderRewriteFilterConfig::describe(std::string& out) const {
+  absl::StrAppend(&out, stat_prefix_, ": ", stats_.program_bytes_.value(), " program bytes, compiled in ",
+                  stats_.compile_time_us_.value(), "us, shared by ", rules_.use_count(), " configs\n");
+  absl::StrAppend(&out, Utility::HTTP_REQUEST, ": ", request_program_->ruleCount(), " rules (",
+                  request_program_->decidedRuleCount(), " decided by the dag), ", rules_->request_value_slots,
+                  " value slots, ", rules_->request_header_slots.size(), " header slots\n");
+  describeProgram(*request_program_, rules_->request_rule_positions, *request_rule_stats_, out);
+  absl::StrAppend(&out, Utility::HTTP_RESPONSE, ": ", response_program_->ruleCount(), " rules (",
+                  response_program_->decidedRuleCount(), " decided by the dag), ", rules_->response_value_slots,
+                  " value slots, ", rules_->response_header_slots.size(), " header slots\n");
+  describeProgram(*response_program_, rules_->response_rule_positions, *response_rule_stats_, out);
+  for (const auto& tenant : tenants_) {
+    tenant->describe(out);
+  }
+}
+
+void HttpHeaderRewriteFilterConfig::describeProgram(const Program& program, const std::vector<uint32_t>& rule_positions,
+                                                    const RuleStats& rule_stats, std::string& out) const {
+  program.describe(
+      [&rule_positions, &rule_stats](uint32_t rule_index, std::string& source) {
+        const HeaderRewriteRuleStats& stats = rule_stats.rule(rule_index);
+        absl::StrAppend(&source, "rule ", rule_positions[rule_index], ": evaluated ", stats.evaluated_.value(),
+                        ", condition_true ", stats.condition_true_.value(), ", condition_false ",
+                        stats.condition_false_.value(), ", applied ", stats.applied_.value(), ", errors ",
+                        stats.errors_.value());
+      },
+      out);
+}
+
+LazyRouteRules::LazyRouteRules(const envoy::extensions::filters::http::HeaderRewrite& proto_config,
+                               Server::Configuration::ServerFactoryContext& context, OnCompiledCb on_compiled)
+    : proto_config_(proto_config), context_(context),
+      stats_(generateStats(HttpHeaderRewriteFilterConfig::statPrefix(proto_config), context.scope())),
+      program_cache_(programCache(context.singletonManager())), on_compiled_(std::move(on_compiled)) {
+  if (proto_config.config().empty()) {
+    throw EnvoyException("invalid header rewrite config: no rules");
+  }
+  if (!proto_config.tenants().empty() || !proto_config.tenant_directory().empty() ||
+      !proto_config.program_file().empty() || proto_config.condition_reorder_interval_ms() > 0) {
+    throw EnvoyException("invalid header rewrite config: lazy_compile can't be used with tenants, tenant_directory, "
+                         "program_file or condition_reorder_interval_ms");
+  }
+  worker_state_ = ThreadLocal::TypedSlot<LazyWorkerState>::makeUnique(context.threadLocal());
+  worker_state_->set(
+      [](Event::Dispatcher& dispatcher) { return std::make_shared<LazyWorkerState>(dispatcher); });
+}
+
+LazyCompileStats LazyRouteRules::generateStats(const std::string& prefix, Stats::Scope& scope) {
+  return LazyCompileStats{
+      ALL_LAZY_COMPILE_STATS(POOL_COUNTER_PREFIX(scope, prefix), POOL_HISTOGRAM_PREFIX(scope, prefix))};
+}
+
+const HttpHeaderRewriteFilterConfig* LazyRouteRules::compile() const {
+  // the first caller compiles while any other waits for it, so the rules compile once
+  absl::call_once(compile_once_, [this]() {
+    TimeSource& time_source = context_.timeSource();
+    const MonotonicTime start = time_source.monotonicTime();
+    try {
+      config_.reset(new HttpHeaderRewriteFilterConfig(proto_config_, context_.scope(), time_source,
+                                                      context_.threadLocal(), context_.mainThreadDispatcher(),
+                                                      context_.api(), program_cache_, worker_state_.get()));
+      stats_.lazy_compiles_.inc();
+      // e.g. to list the rules in the admin handler, which is only used on the main thread
+      context_.mainThreadDispatcher().post([on_compiled = on_compiled_, config = config_]() { on_compiled(config); });
+    } catch (const EnvoyException& e) {
+      stats_.lazy_compile_errors_.inc();
+      ENVOY_LOG_MISC(error, "header rewrite rules of a route failed to compile, skipping filter on the route -- {}",
+                     e.what());
     }
+    stats_.lazy_compile_time_.recordValue(
+        std::chrono::duration_cast<std::chrono::microseconds>(time_source.monotonicTime() - start).count());
+    compiled_.store(true, std::memory_order_release);
+  });
+  return config_.get();
+}
+
+RulesFileConfig::RulesFileConfig(const envoy::extensions::filters::http::HeaderRewrite& proto_config,
+                                 Server::Configuration::FactoryContext& context, OnCompiledCb on_compiled)
+    : proto_config_(proto_config), path_(proto_config.rules_file()), scope_(context.scope()),
+      time_source_(context.timeSource()), tls_(context.threadLocal()),
+      main_thread_dispatcher_(context.mainThreadDispatcher()), api_(context.api()),
+      program_cache_(programCache(context.singletonManager())), on_compiled_(std::move(on_compiled)),
+      stats_(generateStats(HttpHeaderRewriteFilterConfig::statPrefix(proto_config), context.scope())) {
+  if (!proto_config.config().empty() || !proto_config.program_file().empty()) {
+    throw EnvoyException("invalid header rewrite config: rules_file can't be used with config or program_file");
+  }
+  proto_config_.clear_rules_file();
+  config_ = compile();
+  on_compiled_(config_);
+
+  current_ = ThreadLocal::TypedSlot<CurrentConfig>::makeUnique(tls_);
+  current_->set([config = config_](Event::Dispatcher&) {
+    auto current = std::make_shared<CurrentConfig>();
+    current->config = config;
+    return current;
+  });
+
+  // a file replaced by a rename is seen as MovedTo, one written in place as Modified
+  watcher_ = main_thread_dispatcher_.createFilesystemWatcher();
+  const absl::Status status =
+      watcher_->addWatch(path_, Filesystem::Watcher::Events::MovedTo | Filesystem::Watcher::Events::Modified,
+                         [this](uint32_t) {
+                           reload();
+                           return absl::OkStatus();
+                         });
+  if (!status.ok()) {
+    throw EnvoyException(absl::StrCat("invalid header rewrite rules_file ", path_, ": ", status.message()));
   }
+}
 
+RulesFileStats RulesFileConfig::generateStats(const std::string& prefix, Stats::Scope& scope) {
+  return RulesFileStats{ALL_RULES_FILE_STATS(POOL_COUNTER_PREFIX(scope, prefix))};
+}
+
+HttpHeaderRewriteFilterConfigSharedPtr RulesFileConfig::compile() {
+  const absl::StatusOr<std::string> rules = api_.fileSystem().fileReadToEnd(path_);
+  if (!rules.ok()) {
+    throw EnvoyException(absl::StrCat("invalid header rewrite rules_file ", path_, ": ", rules.status().message()));
+  }
+  proto_config_.set_config(*rules);
+  HttpHeaderRewriteFilterConfigSharedPtr config(
+      new HttpHeaderRewriteFilterConfig(proto_config_, scope_, time_source_, tls_, main_thread_dispatcher_, api_,
+                                        program_cache_),
+      [&main_thread_dispatcher = main_thread_dispatcher_](HttpHeaderRewriteFilterConfig* released) {
+        main_thread_dispatcher.post(
+            [released = std::shared_ptr<HttpHeaderRewriteFilterConfig>(released)]() mutable { released.reset(); });
+      });
+  config->logOptimization();
+  return config;
+}
+
+void RulesFileConfig::reload() {
+  HttpHeaderRewriteFilterConfigSharedPtr config;
+  try {
+    config = compile();
+  } catch (const EnvoyException& e) {
+    stats_.rules_file_errors_.inc();
+    ENVOY_LOG_MISC(error, "header rewrite rules_file {} failed to compile, keeping the previous rules -- {}", path_,
+                   e.what());
+    return;
+  }
+  stats_.rules_file_reloads_.inc();
+  on_compiled_(config);
+
+  // the previous config is released once no worker's slot or stream holds it, see compile()
+  config_ = std::move(config);
+  current_->runOnAllThreads([config = config_](OptRef<CurrentConfig> current) { current->config = config; });
+}
+
+HeaderRewriteRouteConfig::HeaderRewriteRouteConfig(
+    const envoy::extensions::filters::http::HeaderRewritePerRoute& proto_config,
+    Server::Configuration::ServerFactoryContext& context, RouteDirectionsSharedPtr directions,
+    OnCompiledCb on_compiled)
+    : main_thread_dispatcher_(context.mainThreadDispatcher()), directions_(std::move(directions)),
+      on_compiled_(std::move(on_compiled)) {
+  // without a prefix of its own, the route's rule counters and gauges would add into and overwrite
+  // those of the filter config and of every other route
+  if (proto_config.has_header_rewrite() && proto_config.header_rewrite().stat_prefix().empty()) {
+    throw EnvoyException("invalid header rewrite config: a route's header_rewrite needs a stat_prefix");
+  }
+  if (proto_config.has_header_rewrite() && proto_config.lazy_compile()) {
+    lazy_rules_ = std::make_unique<const LazyRouteRules>(proto_config.header_rewrite(), context, on_compiled_);
+    // the directions the rules need are only known once compiled
+    directions_->request_routes++;
+    directions_->response_routes++;
+  } else if (proto_config.has_header_rewrite()) {
+    rules_ = std::make_shared<HttpHeaderRewriteFilterConfig>(proto_config.header_rewrite(), context);
+    directions_->request_routes += rules_->needsRequestPhase() ? 1 : 0;
+    directions_->response_routes += rules_->needsResponsePhase() ? 1 : 0;
+    on_compiled_(rules_);
+  }
+}
+
+HeaderRewriteRouteConfig::~HeaderRewriteRouteConfig() {
+  if (lazy_rules_) {
+    directions_->request_routes--;
+    directions_->response_routes--;
+  } else if (rules_) {
+    directions_->request_routes -= rules_->needsRequestPhase() ? 1 : 0;
+    directions_->response_routes -= rules_->needsResponsePhase() ? 1 : 0;
+  }
+  // the registry held by on_compiled_ removes its admin handler if this was its last user
+  main_thread_dispatcher_.post([rules = std::move(rules_),
+                                lazy_rules = std::shared_ptr<const LazyRouteRules>(std::move(lazy_rules_)),
+                                on_compiled = on_compiled_]() mutable {
+    rules.reset();
+    lazy_rules.reset();
+    on_compiled = nullptr;
+  });
+}
+
+HttpHeaderRewriteFilter::HttpHeaderRewriteFilter(HttpHeaderRewriteFilterConfigSharedPtr config)
+    : config_(std::move(config)), rule_counts_(config_->ruleCounts()), programs_(config_->activePrograms()) {}
+
+const HttpHeaderRewriteFilterConfig* HttpHeaderRewriteFilter::activeConfig(const Http::StreamFilterCallbacks* callbacks) {
+  const auto* route_config = Http::Utility::resolveMostSpecificPerFilterConfig<HeaderRewriteRouteConfig>(callbacks);
+  const HttpHeaderRewriteFilterConfig* config = route_config ? route_config->config() : config_.get();
+  if (config == nullptr || !config->hasTenants()) {
+    return config;
+  }
+  // the response phase executes the tenant found for the request, unless the route changed
+  if (config != dispatched_from_) {
+    dispatched_from_ = config;
+    tenant_ = &config->tenantConfig(request_headers_ ? request_headers_->getHostValue() : absl::string_view());
+  }
+  return tenant_;
+}
+
+Http::FilterHeadersStatus HttpHeaderRewriteFilter::decodeHeaders(Http::RequestHeaderMap& headers, bool) {
+  request_headers_ = &headers;
+  const HttpHeaderRewriteFilterConfig* config = activeConfig(decoder_callbacks_);
+  if (config && config->hasRequestRules()) {
+    executePhase(*config, headers, &decoder_callbacks_->streamInfo(), true);
+  }
   return Http::FilterHeadersStatus::Continue;
 }
 
+Http::FilterHeadersStatus HttpHeaderRewriteFilter::encodeHeaders(Http::ResponseHeaderMap& headers, bool) {
+  const HttpHeaderRewriteFilterConfig* config = activeConfig(encoder_callbacks_);
+  if (config && config->hasResponseRules()) {
+    executePhase(*config, headers, &encoder_callbacks_->streamInfo(), false);
+  }
+  return Http::FilterHeadersStatus::Continue;
+}
+
+void HttpHeaderRewriteFilter::executePhase(const HttpHeaderRewriteFilterConfig& config,
+                                           Http::RequestOrResponseHeaderMap& headers,
+                                           Envoy::StreamInfo::StreamInfo* streamInfo, bool is_request) {
+  // the filter config's per-worker state is looked up once per stream, a route's once per phase
+  const bool own_config = &config == config_.get();
+  RuleCounts& rule_counts = own_config ? rule_counts_ : config.ruleCounts();
+  const ActivePrograms& programs = own_config ? programs_ : config.activePrograms();
+
+  const bool timed = rule_counts.sampleTiming();
+  const MonotonicTime start = timed ? rule_counts.timeSource().monotonicTime() : MonotonicTime();
+  ExecutionError error;
+  if (is_request) {
+    execution_context_.beginPhase(config.requestHeaderSlots(), headers, config.requestValueSlots(),
+                                  rule_counts.request(), rule_counts.requestBools());
+    error = programs.request->execute(headers, streamInfo, execution_context_);
+  } else {
+    execution_context_.beginPhase(config.responseHeaderSlots(), headers, config.responseValueSlots(),
+                                  rule_counts.response(), rule_counts.responseBools());
+    error = programs.response->execute(headers, streamInfo, execution_context_);
+  }
+  if (error != ExecutionError::None) {
+    config.onExecutionError(error, is_request);
+  }
+  if (timed) {
+    const uint64_t elapsed =
+        std::chrono::duration_cast<std::chrono::microseconds>(rule_counts.timeSource().monotonicTime() - start).count();
+    (is_request ? config.stats().request_phase_time_ : config.stats().response_phase_time_).recordValue(elapsed);
+  }
+}
+
 Http::FilterDataStatus HttpHeaderRewriteFilter::decodeData(Buffer::Instance&, bool) {
   return Http::FilterDataStatus::Continue;
 }
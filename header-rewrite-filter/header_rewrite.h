@@ -1,32 +1,397 @@
 #pragma once
 
+#include <atomic>
+#include <functional>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "header_processor.h"
+#include "program.h"
+#include "program_cache.h"
+#include "rule_optimizer.h"
+#include "rule_stats.h"
+#include "tenant_table.h"
 
 #include "source/extensions/filters/http/common/pass_through_filter.h"
+#include "envoy/api/api.h"
 #include "envoy/common/exception.h"
+#include "envoy/common/time.h"
+#include "envoy/event/timer.h"
+#include "envoy/filesystem/watcher.h"
+#include "envoy/router/router.h"
+#include "envoy/server/filter_config.h"
+#include "envoy/singleton/instance.h"
+#include "envoy/stats/scope.h"
+#include "envoy/stats/stats_macros.h"
+#include "envoy/thread_local/thread_local.h"
 #include "header-rewrite-filter/header_rewrite.pb.h"
 
+#include "absl/base/call_once.h"
+
 namespace Envoy {
 namespace Extensions {
 namespace HttpFilters {
 namespace HeaderRewriteFilter {
 
+/**
+ * All header rewrite filter stats. @see stats_macros.h
+ */
+#define ALL_HEADER_REWRITE_FILTER_STATS(COUNTER, GAUGE, HISTOGRAM)                                 \
+  COUNTER(request_errors)                                                                          \
+  COUNTER(response_errors)                                                                         \
+  COUNTER(hdr_position_errors)                                                                     \
+  COUNTER(urlp_errors)                                                                             \
+  COUNTER(metadata_errors)                                                                         \
+  COUNTER(invalid_function_errors)                                                                 \
+  COUNTER(condition_reorders)                                                                      \
+  GAUGE(request_rules, NeverImport)                                                                \
+  GAUGE(response_rules, NeverImport)                                                               \
+  GAUGE(program_bytes, NeverImport)                                                                \
+  GAUGE(compile_time_us, NeverImport)                                                              \
+  HISTOGRAM(request_phase_time, Microseconds)                                                      \
+  HISTOGRAM(response_phase_time, Microseconds)
+
+/**
+ * Struct definition for all header rewrite filter stats. @see stats_macros.h
+ */
+struct HeaderRewriteFilterStats {
+  ALL_HEADER_REWRITE_FILTER_STATS(GENERATE_COUNTER_STRUCT, GENERATE_GAUGE_STRUCT, GENERATE_HISTOGRAM_STRUCT)
+};
+
+/**
+ * Stats of the route rules compiled on first use. @see stats_macros.h
+ */
+#define ALL_LAZY_COMPILE_STATS(COUNTER, HISTOGRAM)                                                 \
+  COUNTER(lazy_compiles)                                                                           \
+  COUNTER(lazy_compile_errors)                                                                     \
+  HISTOGRAM(lazy_compile_time, Microseconds)
+
+/**
+ * Struct definition for the stats of the route rules compiled on first use. @see stats_macros.h
+ */
+struct LazyCompileStats {
+  ALL_LAZY_COMPILE_STATS(GENERATE_COUNTER_STRUCT, GENERATE_HISTOGRAM_STRUCT)
+};
+
+/**
+ * Stats of a config whose rules are read from a watched file. @see stats_macros.h
+ */
+#define ALL_RULES_FILE_STATS(COUNTER)                                                              \
+  COUNTER(rules_file_reloads)                                                                      \
+  COUNTER(rules_file_errors)
+
+/**
+ * Struct definition for the stats of a config whose rules are read from a watched file. @see
+ * stats_macros.h
+ */
+struct RulesFileStats {
+  ALL_RULES_FILE_STATS(GENERATE_COUNTER_STRUCT)
+};
+
+// Programs of a config executed by the streams of a worker. When conditions are reordered at
+// runtime, the new programs are posted to every worker, which swaps them between streams' events.
+struct ActivePrograms {
+  std::shared_ptr<const Program> request;
+  std::shared_ptr<const Program> response;
+};
+
+// The ActivePrograms of a config and of each of its tenants on a worker, the config's first and
+// then each tenant's, so that any number of tenants share one thread local slot.
+struct WorkerPrograms : public ThreadLocal::ThreadLocalObject {
+  std::vector<ActivePrograms> configs;
+};
+
+// Per-worker state of a config compiled on a worker, see LazyRouteRules. Its slot is allocated
+// when the route is loaded, and each worker fills it in the first time it executes the rules, as
+// a config compiled off the main thread can't allocate slots of its own.
+struct LazyWorkerState : public ThreadLocal::ThreadLocalObject {
+  explicit LazyWorkerState(Event::Dispatcher& dispatcher) : dispatcher(dispatcher) {}
+
+  Event::Dispatcher& dispatcher;
+  ActivePrograms programs;
+  std::unique_ptr<WorkerRuleCounts> rule_counts; // null until the worker first executes the rules
+};
+
+// Parsed rules of a filter config. Rules are parsed, optimized and compiled into a Program once
+// when the config is loaded and shared by every stream, and by every config with the same rules;
+// per-stream state lives in the filter's ExecutionContext. An invalid config throws
+// EnvoyException from the constructor, so that it is rejected when loaded and a filter never runs
+// without a program. Each tenant's rules are a config of their own, owned by this one, selected
+// per request by its :authority, and with its per-worker state in this config's slots.
 class HttpHeaderRewriteFilterConfig {
 public:
-  HttpHeaderRewriteFilterConfig(const envoy::extensions::filters::http::HeaderRewrite& proto_config);
+  HttpHeaderRewriteFilterConfig(const envoy::extensions::filters::http::HeaderRewrite& proto_config,
+                                Server::Configuration::FactoryContext& context);
+  // rules of a route or virtual host, see HeaderRewriteRouteConfig
+  HttpHeaderRewriteFilterConfig(const envoy::extensions::filters::http::HeaderRewrite& proto_config,
+                                Server::Configuration::ServerFactoryContext& context);
 
   const std::string& config() const { return config_; }
+  const InlineHeaderTableSharedPtr& inlineHeaders() const { return rules_->inline_headers; }
+  // the compiled rules, shared with the other configs with the same rules
+  const CompiledRulesSharedPtr& compiledRules() const { return rules_; }
+
+  const std::vector<HeaderProcessorUniquePtr>& requestHeaderProcessors() const { return rules_->request_header_processors; }
+  const std::vector<HeaderProcessorUniquePtr>& responseHeaderProcessors() const { return rules_->response_header_processors; }
+  const HeaderSlotTable& requestHeaderSlots() const { return rules_->request_header_slots; }
+  const HeaderSlotTable& responseHeaderSlots() const { return rules_->response_header_slots; }
+  size_t requestValueSlots() const { return rules_->request_value_slots; }
+  size_t responseValueSlots() const { return rules_->response_value_slots; }
+  // rules as last compiled, on the main thread; streams execute activePrograms()
+  const Program* requestProgram() const { return request_program_.get(); }
+  const Program* responseProgram() const { return response_program_.get(); }
+  // whether a direction has rules at all; a phase without rules is skipped
+  bool hasRequestRules() const { return has_request_rules_; }
+  bool hasResponseRules() const { return has_response_rules_; }
+  // whether a stream needs the request or response phase, for these rules or a tenant's; a request
+  // is dispatched to its tenant in the request phase
+  bool needsRequestPhase() const { return has_request_rules_ || !tenants_.empty(); }
+  bool needsResponsePhase() const { return needs_response_phase_; }
+
+  bool hasTenants() const { return !tenants_.empty(); }
+  // the rules executed on a request with this :authority: its tenant's, or these if none serves it
+  const HttpHeaderRewriteFilterConfig& tenantConfig(absl::string_view authority) const;
+
+  const HeaderRewriteFilterStats& stats() const { return stats_; }
+  // rule outcome counts and programs of the calling worker
+  RuleCounts& ruleCounts() const {
+    return lazy_worker_state_ ? lazyWorkerState().rule_counts->get(0)
+                              : worker_owner_->rule_counts_->get()->get(worker_index_);
+  }
+  ActivePrograms& activePrograms() const {
+    return lazy_worker_state_ ? lazyWorkerState().programs
+                              : worker_owner_->active_programs_->get()->configs[worker_index_];
+  }
+  // count a phase stopped by a failing rule, and log it if enabled
+  void onExecutionError(ExecutionError error, bool is_request) const;
+  // appends the compiled programs, with the source rules' counters as last flushed
+  void describe(std::string& out) const;
+  // recompiles the programs with the bool true rates observed since the last call, and posts them
+  // to the workers if their condition order changed; main thread only
+  void reorderConditions();
+
+  // compiles the rules of proto_config's config without loading it, e.g. to write a program file;
+  // throws EnvoyException if the rules are invalid
+  static CompiledRulesSharedPtr compileRules(const envoy::extensions::filters::http::HeaderRewrite& proto_config);
+  // parses the rules of config without optimizing or compiling them, into processors that execute
+  // the rules one by one as written: the reference interpreter the optimized and compiled rules
+  // must agree with, see DifferentialTest; throws EnvoyException if the rules are invalid
+  static CompiledRulesSharedPtr parseRules(const std::string& config);
+  // assigns the header slots read by the optimized rules of a direction, before they're compiled
+  static void assignHeaderSlots(std::vector<HeaderProcessorUniquePtr>& header_processors,
+                                const SetBoolProcessorMapSharedPtr& set_bool_processors,
+                                HeaderSlotTable& header_slot_table);
 
 private:
+  // lazy_worker_state is set for a config compiled off the main thread, which uses it instead of
+  // allocating thread local slots; parent is set for a tenant, whose state on the workers lives in
+  // its parent's slots
+  HttpHeaderRewriteFilterConfig(const envoy::extensions::filters::http::HeaderRewrite& proto_config, Stats::Scope& scope,
+                                TimeSource& time_source, ThreadLocal::SlotAllocator& tls,
+                                Event::Dispatcher& main_thread_dispatcher, Api::Api& api, ProgramCacheSharedPtr program_cache,
+                                ThreadLocal::TypedSlot<LazyWorkerState>* lazy_worker_state = nullptr,
+                                const HttpHeaderRewriteFilterConfig* parent = nullptr);
+
+  // the content of proto_config that the compiled rules depend on
+  static std::string programCacheKey(const envoy::extensions::filters::http::HeaderRewrite& proto_config);
+  CompiledRulesSharedPtr loadProgramFile(const std::string& path);
+  static absl::Status parseConfig(const std::string& config, CompiledRules& rules);
+  // splits a trimmed line of the config into its tokens, views of line
+  static void tokenizeRule(absl::string_view line, std::vector<absl::string_view>& tokens);
+  void loadTenants(const envoy::extensions::filters::http::HeaderRewrite& proto_config, Stats::Scope& scope,
+                   TimeSource& time_source, ThreadLocal::SlotAllocator& tls, Event::Dispatcher& main_thread_dispatcher,
+                   Api::Api& api);
+  // compiles a tenant's rules with the other fields of proto_config, and maps its authorities to it
+  void addTenant(const envoy::extensions::filters::http::HeaderRewrite& proto_config, const std::string& name,
+                 const std::string& config, const std::vector<std::string>& authorities, Stats::Scope& scope,
+                 TimeSource& time_source, ThreadLocal::SlotAllocator& tls, Event::Dispatcher& main_thread_dispatcher,
+                 Api::Api& api);
+  // logs what the optimizer did to the rules of this config and its tenants in one line, once
+  // per filter config rather than per tenant or lazily compiled route
+  void logOptimization() const;
+  static HeaderRewriteFilterStats generateStats(const std::string& prefix, Stats::Scope& scope);
+  static std::string statPrefix(const envoy::extensions::filters::http::HeaderRewrite& proto_config);
+  // returns true if the program was replaced
+  bool reorderConditions(const std::vector<HeaderProcessorUniquePtr>& header_processors,
+                         const SetBoolProcessorMapSharedPtr& set_bool_processors, BoolProfile& profile,
+                         BoolTrueRates& true_rates, std::shared_ptr<const Program>& program);
+  void describeProgram(const Program& program, const std::vector<uint32_t>& rule_positions, const RuleStats& rule_stats,
+                       std::string& out) const;
+  // the calling worker's state, filled on its first call on the worker
+  LazyWorkerState& lazyWorkerState() const;
+  RuleCounts::Targets ruleCountTargets() const {
+    return {request_rule_stats_, response_rule_stats_, request_profile_, response_profile_};
+  }
+
   const std::string config_;
+  const std::string stat_prefix_;
+  HeaderRewriteFilterStats stats_;
+  const bool log_errors_;
+
+  // held so that configs loaded later with the same rules share them
+  const ProgramCacheSharedPtr program_cache_;
+  CompiledRulesSharedPtr rules_;
+
+  // rules executed by the filter, the compiled rules' programs until conditions are reordered
+  std::shared_ptr<const Program> request_program_;
+  std::shared_ptr<const Program> response_program_;
+  ThreadLocal::TypedSlotPtr<WorkerPrograms> active_programs_;
+  bool has_request_rules_ = false;
+  bool has_response_rules_ = false;
+
+  const bool decision_dag_;
+
+  // runtime reordering of condition operands, if enabled
+  const std::chrono::milliseconds condition_reorder_interval_;
+  BoolProfileSharedPtr request_profile_;
+  BoolProfileSharedPtr response_profile_;
+  BoolTrueRates request_true_rates_;
+  BoolTrueRates response_true_rates_;
+  Event::TimerPtr reorder_timer_;
+
+  RuleStatsSharedPtr request_rule_stats_;
+  RuleStatsSharedPtr response_rule_stats_;
+  ThreadLocal::TypedSlotPtr<WorkerRuleCounts> rule_counts_;
+  const uint32_t timing_sample_rate_;
+  ThreadLocal::TypedSlot<LazyWorkerState>* const lazy_worker_state_;
+  // the config whose slots hold this one's per-worker state, at worker_index_: this config, index
+  // 0, or a tenant's parent
+  const HttpHeaderRewriteFilterConfig* const worker_owner_;
+  const uint32_t worker_index_;
+
+  // tenants by index, and the dispatch of authorities to them
+  std::vector<std::unique_ptr<const HttpHeaderRewriteFilterConfig>> tenants_;
+  TenantTable tenant_table_;
+  bool needs_response_phase_ = false;
+
+  friend class LazyRouteRules;
+  friend class RulesFileConfig;
 };
 
 using HttpHeaderRewriteFilterConfigSharedPtr = std::shared_ptr<HttpHeaderRewriteFilterConfig>;
-using HeaderProcessorUniquePtr = std::unique_ptr<HeaderProcessor>;
-using SetBoolProcessorSharedPtr = std::shared_ptr<SetBoolProcessor>;
-using SetBoolProcessorMapSharedPtr = std::shared_ptr<std::unordered_map<std::string, SetBoolProcessorSharedPtr>>;
+// called on the main thread with a config once compiled, e.g. to list it in the admin handler
+using OnCompiledCb = std::function<void(const HttpHeaderRewriteFilterConfigSharedPtr&)>;
+
+// Rules of a route compiled on the first request that the route serves, see
+// HeaderRewritePerRoute.lazy_compile. The first request to get() compiles the rules, on its
+// worker, while concurrent first requests on other workers wait for that one compilation; the
+// config is then published to every worker through an atomic flag, so later requests read it
+// without a lock.
+class LazyRouteRules {
+public:
+  // throws EnvoyException if proto_config can't be compiled lazily; on_compiled is posted to the
+  // main thread with the rules once compiled
+  LazyRouteRules(const envoy::extensions::filters::http::HeaderRewrite& proto_config,
+                 Server::Configuration::ServerFactoryContext& context, OnCompiledCb on_compiled);
+
+  // the compiled rules, compiling them on the first call; null if they failed to compile
+  const HttpHeaderRewriteFilterConfig* get() const {
+    return compiled_.load(std::memory_order_acquire) ? config_.get() : compile();
+  }
+
+private:
+  static LazyCompileStats generateStats(const std::string& prefix, Stats::Scope& scope);
+  const HttpHeaderRewriteFilterConfig* compile() const;
+
+  const envoy::extensions::filters::http::HeaderRewrite proto_config_;
+  Server::Configuration::ServerFactoryContext& context_;
+  LazyCompileStats stats_;
+  const ProgramCacheSharedPtr program_cache_;
+  const OnCompiledCb on_compiled_;
+  ThreadLocal::TypedSlotPtr<LazyWorkerState> worker_state_;
+
+  mutable absl::once_flag compile_once_;
+  mutable std::atomic<bool> compiled_{false};
+  // set once by compile_once_, before compiled_
+  mutable HttpHeaderRewriteFilterConfigSharedPtr config_;
+};
+
+// Filter config whose rules are read from HeaderRewrite.rules_file, and recompiled on the main
+// thread whenever the file changes. A stream starts on the config in its worker's slot and keeps it
+// to the end, and a reload replaces the config in every worker's slot, so the request path takes no
+// lock and a reload doesn't drain the listener: streams already started finish on the old rules.
+class RulesFileConfig {
+public:
+  // throws EnvoyException if the file can't be read or its rules compiled; on_compiled is called
+  // with every config compiled from the file
+  RulesFileConfig(const envoy::extensions::filters::http::HeaderRewrite& proto_config,
+                  Server::Configuration::FactoryContext& context, OnCompiledCb on_compiled);
+
+  // the config of the streams starting on the calling worker
+  const HttpHeaderRewriteFilterConfigSharedPtr& current() const { return current_->get().ref().config; }
+  const RulesFileStats& stats() const { return stats_; }
+
+private:
+  struct CurrentConfig : public ThreadLocal::ThreadLocalObject {
+    HttpHeaderRewriteFilterConfigSharedPtr config;
+  };
+
+  static RulesFileStats generateStats(const std::string& prefix, Stats::Scope& scope);
+  // throws EnvoyException; the config is destroyed on the main thread, where its slots were
+  // allocated, whichever thread releases it last: a worker replacing it in its slot, or its last
+  // stream
+  HttpHeaderRewriteFilterConfigSharedPtr compile();
+  void reload();
+
+  // the filter config, with the rules last read from the file as its config
+  envoy::extensions::filters::http::HeaderRewrite proto_config_;
+  const std::string path_;
+  Stats::Scope& scope_;
+  TimeSource& time_source_;
+  ThreadLocal::SlotAllocator& tls_;
+  Event::Dispatcher& main_thread_dispatcher_;
+  Api::Api& api_;
+  const ProgramCacheSharedPtr program_cache_;
+  const OnCompiledCb on_compiled_;
+  RulesFileStats stats_;
+
+  HttpHeaderRewriteFilterConfigSharedPtr config_;
+  ThreadLocal::TypedSlotPtr<CurrentConfig> current_;
+  Filesystem::WatcherPtr watcher_;
+};
+
+using RulesFileConfigSharedPtr = std::shared_ptr<RulesFileConfig>;
+
+// Route configs of a server with request and with response rules, shared through the singleton
+// manager. A filter chain installs the decoder or encoder half of the filter only if its own rules
+// or some route's need it. Route configs are counted on the main thread and may be released on a
+// worker; the counts are read when a stream's filter chain is created.
+struct RouteDirections : public Singleton::Instance {
+  std::atomic<uint32_t> request_routes{0};
+  std::atomic<uint32_t> response_routes{0};
+};
+
+using RouteDirectionsSharedPtr = std::shared_ptr<RouteDirections>;
+
+// Per-route or per-virtual-host override of the filter: either disables it, or replaces the rules
+// of the filter config with the route's own, compiled when the route configuration is loaded or,
+// with lazy_compile, when the route serves its first request. A route config may be released on a
+// worker, the last to finish a stream on the route; what must be destroyed on the main thread,
+// like the thread local slots and timers of the route's rules, or the worker state slot of its lazy
+// rules, is released there.
+class HeaderRewriteRouteConfig : public Router::RouteSpecificFilterConfig {
+public:
+  HeaderRewriteRouteConfig(const envoy::extensions::filters::http::HeaderRewritePerRoute& proto_config,
+                           Server::Configuration::ServerFactoryContext& context, RouteDirectionsSharedPtr directions,
+                           OnCompiledCb on_compiled);
+  ~HeaderRewriteRouteConfig() override;
+
+  // the route's rules if they are compiled when the route is loaded, null if the filter is disabled
+  // for the route or the rules are compiled lazily
+  const HttpHeaderRewriteFilterConfigSharedPtr& rules() const { return rules_; }
+  // the rules executed on the route, compiling them if lazily compiled; null if the filter is
+  // disabled for the route or its rules failed to compile
+  const HttpHeaderRewriteFilterConfig* config() const { return lazy_rules_ ? lazy_rules_->get() : rules_.get(); }
+
+private:
+  Event::Dispatcher& main_thread_dispatcher_;
+  HttpHeaderRewriteFilterConfigSharedPtr rules_;
+  std::unique_ptr<const LazyRouteRules> lazy_rules_;
+  const RouteDirectionsSharedPtr directions_;
+  // kept with the route, so that what it holds, like the admin handler's registry, lives as long
+  const OnCompiledCb on_compiled_;
+};
 
 class HttpHeaderRewriteFilter : public Http::PassThroughFilter {
 public:
@@ -41,20 +406,24 @@ public:
   Http::FilterDataStatus encodeData(Buffer::Instance&, bool) override;
 
 private:
-  const HttpHeaderRewriteFilterConfigSharedPtr config_;
-  bool error_ = false;
+  // the rules of the stream's route if it overrides them, else of the filter config, or of the
+  // request's tenant in either; null if the route disables the filter. Looked up for each phase,
+  // as the route may change in between.
+  const HttpHeaderRewriteFilterConfig* activeConfig(const Http::StreamFilterCallbacks* callbacks);
+  void executePhase(const HttpHeaderRewriteFilterConfig& config, Http::RequestOrResponseHeaderMap& headers,
+                    Envoy::StreamInfo::StreamInfo* streamInfo, bool is_request);
 
-  // header processors
-  std::vector<HeaderProcessorUniquePtr> request_header_processors_;
-  std::vector<HeaderProcessorUniquePtr> response_header_processors_;
-
-  // set_bool processors
-  SetBoolProcessorMapSharedPtr request_set_bool_processors_;
-  SetBoolProcessorMapSharedPtr response_set_bool_processors_;
-
-  const std::string headerConfig() const;
-  void setError() { error_ = true; }
-  bool getError() const { return error_; };
+  // The stream's only reference to the config shared by all workers, taken once when the filter is
+  // created. Rules execute through raw pointers and references into it, or into the route's config
+  // held by the route, so that streams on different workers never write the same reference count.
+  const HttpHeaderRewriteFilterConfigSharedPtr config_;
+  RuleCounts& rule_counts_; // of the worker the stream runs on
+  const ActivePrograms& programs_;
+  ExecutionContext execution_context_;
+  // the request's tenant, and the config whose tenants it was found in
+  const Http::RequestHeaderMap* request_headers_ = nullptr;
+  const HttpHeaderRewriteFilterConfig* dispatched_from_ = nullptr;
+  const HttpHeaderRewriteFilterConfig* tenant_ = nullptr;
 };
 
 } // namespace HeaderRewriteFilter
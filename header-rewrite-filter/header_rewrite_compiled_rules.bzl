@@ -0,0 +1,30 @@
+load("@envoy//bazel:envoy_build_system.bzl", "envoy_cc_library")
+
+def header_rewrite_compiled_rules(name, rules, inline_headers = []):
+    """Compiles header rewrite rules into C++ ahead of time.
+
+    Generates a library registering the rules under name, which the envoy.header_rewrite_compiled
+    filter selects with its rules field. Link it into the envoy binary with the
+    header_rewrite_compiled_config filter. inline_headers are those of the HeaderRewrite field of
+    the same name, and must be registered by the server as well.
+    """
+    generated = "aot_" + name + ".cc"
+    native.genrule(
+        name = name + "_codegen",
+        srcs = [rules],
+        outs = [generated],
+        cmd = "$(location //header-rewrite-filter:header_rewrite_codegen) --name={} {} $(location {}) $@".format(
+            name,
+            "--inline_headers=" + ",".join(inline_headers) if inline_headers else "",
+            rules,
+        ),
+        tools = ["//header-rewrite-filter:header_rewrite_codegen"],
+    )
+    envoy_cc_library(
+        name = name,
+        srcs = [generated],
+        repository = "@envoy",
+        # the rules are registered by a static initializer
+        alwayslink = 1,
+        deps = ["//header-rewrite-filter:header_rewrite_compiled_lib"],
+    )
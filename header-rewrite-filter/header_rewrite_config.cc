@@ -6,12 +6,17 @@
 #include "header-rewrite-filter/header_rewrite.pb.h"
 #include "header-rewrite-filter/header_rewrite.pb.validate.h"
 #include "header_rewrite.h"
-
+#include "program_registry.h"
 
 namespace Envoy {
 namespace Server {
 namespace Configuration {
 
+SINGLETON_MANAGER_REGISTRATION(header_rewrite_program_registry);
+SINGLETON_MANAGER_REGISTRATION(header_rewrite_route_directions);
+
+namespace HeaderRewrite = Extensions::HttpFilters::HeaderRewriteFilter;
+
 class HttpHeaderRewriteFilterConfigFactory : public NamedHttpFilterConfigFactory {
 public:
   Http::FilterFactoryCb createFilterFactoryFromProto(const Protobuf::Message& proto_config,
@@ -30,19 +35,78 @@ public:
     return ProtobufTypes::MessagePtr{new envoy::extensions::filters::http::HeaderRewrite()};
   }
 
+  ProtobufTypes::MessagePtr createEmptyRouteConfigProto() override {
+    return ProtobufTypes::MessagePtr{new envoy::extensions::filters::http::HeaderRewritePerRoute()};
+  }
+
+  Router::RouteSpecificFilterConfigConstSharedPtr
+  createRouteSpecificFilterConfig(const Protobuf::Message& proto_config, ServerFactoryContext& context,
+                                  ProtobufMessage::ValidationVisitor& validator) override {
+    // the route config keeps the registry, and its admin handler, alive
+    HeaderRewrite::ProgramRegistrySharedPtr registry = programRegistry(context.singletonManager(), context.admin());
+    return std::make_shared<const HeaderRewrite::HeaderRewriteRouteConfig>(
+        Envoy::MessageUtil::downcastAndValidate<const envoy::extensions::filters::http::HeaderRewritePerRoute&>(
+            proto_config, validator),
+        context, routeDirections(context.singletonManager()),
+        [registry](const HeaderRewrite::HttpHeaderRewriteFilterConfigSharedPtr& config) { registry->add(config); });
+  }
+
   std::string name() const override { return "envoy.header_rewrite"; }
 
 private:
-  Http::FilterFactoryCb createFilter(const envoy::extensions::filters::http::HeaderRewrite& proto_config, FactoryContext&) {
-    Extensions::HttpFilters::HeaderRewriteFilter::HttpHeaderRewriteFilterConfigSharedPtr config =
-        std::make_shared<Extensions::HttpFilters::HeaderRewriteFilter::HttpHeaderRewriteFilterConfig>(
-            Extensions::HttpFilters::HeaderRewriteFilter::HttpHeaderRewriteFilterConfig(proto_config));
-
-    return [config](Http::FilterChainFactoryCallbacks& callbacks) -> void {
-      auto filter = new Extensions::HttpFilters::HeaderRewriteFilter::HttpHeaderRewriteFilter(config);
-      callbacks.addStreamFilter(Http::StreamFilterSharedPtr{filter});
+  Http::FilterFactoryCb createFilter(const envoy::extensions::filters::http::HeaderRewrite& proto_config, FactoryContext& context) {
+    // the filter factories keep the registry, and its admin handler, alive
+    HeaderRewrite::ProgramRegistrySharedPtr registry = programRegistry(context.singletonManager(), context.admin());
+    HeaderRewrite::RouteDirectionsSharedPtr directions = routeDirections(context.singletonManager());
+
+    if (!proto_config.rules_file().empty()) {
+      // every stream takes the config current on its worker, replaced when the file changes
+      auto rules_file = std::make_shared<HeaderRewrite::RulesFileConfig>(
+          proto_config, context,
+          [registry](const HeaderRewrite::HttpHeaderRewriteFilterConfigSharedPtr& config) { registry->add(config); });
+      return [rules_file, registry, directions](Http::FilterChainFactoryCallbacks& callbacks) -> void {
+        addFilter(rules_file->current(), *directions, callbacks);
+      };
+    }
+
+    HeaderRewrite::HttpHeaderRewriteFilterConfigSharedPtr config =
+        std::make_shared<HeaderRewrite::HttpHeaderRewriteFilterConfig>(proto_config, context);
+    registry->add(config);
+    return [config, registry, directions](Http::FilterChainFactoryCallbacks& callbacks) -> void {
+      addFilter(config, *directions, callbacks);
     };
   }
+
+  static void addFilter(const HeaderRewrite::HttpHeaderRewriteFilterConfigSharedPtr& config,
+                        const HeaderRewrite::RouteDirections& directions, Http::FilterChainFactoryCallbacks& callbacks) {
+    // install only the halves that the filter config's rules, a tenant's or some route's need
+    const bool decode = config->needsRequestPhase() || directions.request_routes.load(std::memory_order_relaxed) > 0;
+    const bool encode = config->needsResponsePhase() || directions.response_routes.load(std::memory_order_relaxed) > 0;
+    if (!decode && !encode) {
+      return;
+    }
+    auto filter = std::make_shared<HeaderRewrite::HttpHeaderRewriteFilter>(config);
+    if (decode && encode) {
+      callbacks.addStreamFilter(filter);
+    } else if (decode) {
+      callbacks.addStreamDecoderFilter(filter);
+    } else {
+      callbacks.addStreamEncoderFilter(filter);
+    }
+  }
+
+  static HeaderRewrite::ProgramRegistrySharedPtr programRegistry(Singleton::Manager& singleton_manager,
+                                                                 OptRef<Server::Admin> admin) {
+    return singleton_manager.getTyped<HeaderRewrite::ProgramRegistry>(
+        SINGLETON_MANAGER_REGISTERED_NAME(header_rewrite_program_registry),
+        [admin] { return std::make_shared<HeaderRewrite::ProgramRegistry>(admin); });
+  }
+
+  static HeaderRewrite::RouteDirectionsSharedPtr routeDirections(Singleton::Manager& singleton_manager) {
+    return singleton_manager.getTyped<HeaderRewrite::RouteDirections>(
+        SINGLETON_MANAGER_REGISTERED_NAME(header_rewrite_route_directions),
+        [] { return std::make_shared<HeaderRewrite::RouteDirections>(); });
+  }
 };
 
 /**
@@ -0,0 +1,222 @@
+// Cost fuzzer: compiles the rules of each input and executes them on its headers, like the filter
+// does for a stream, and fails on inputs whose execution cost is out of proportion to their size
+// or grows superlinearly with it, rather than only on crashes. An input is text: rules, a line
+// "---", then one header per line as "name: value", pseudo-headers included, e.g.
+//
+//   http-request set-header x-first %[hdr(x-list,1000)]
+//   ---
+//   :path: /
+//   x-list: a,b,c,...
+//
+// The request headers are given to the request rules, and the headers without a colon prefix,
+// with a :status of 200, to the response rules.
+//
+// Cost is the wall time of executing both phases, the fastest of a few runs to discount noise.
+// An input fails when its cost exceeds budget_ns_per_byte for each byte of input plus a fixed
+// budget, or when doubling every header value, with each value joined to a copy of itself by a
+// comma so that lists double too, multiplies the cost by more than max_growth. Doubled values may
+// flip matches and so run other rules, hence a max_growth above 2 and a cost under which growth
+// isn't checked. Under libFuzzer, the cost also sets one of the extra counters, one per power of
+// two of nanoseconds, so that an input reaching a new order of cost is kept in the corpus like one
+// reaching new code, and the fuzzer works its way towards the costliest inputs.
+//
+// The budgets are set for instrumented fuzzing builds, and may be tightened with the environment
+// variables HEADER_REWRITE_FUZZ_NS_PER_BYTE, HEADER_REWRITE_FUZZ_FIXED_NS and
+// HEADER_REWRITE_FUZZ_MAX_GROWTH. They are enforced under libFuzzer, or when one of these is set:
+// wall time on a loaded machine says little, so the plain corpus replay only checks that each
+// input executes. The corpus, header_rewrite_cost_fuzz_corpus/, holds the worst cases found so
+// far, as a regression suite for the filter's cost, to replay with a budget set.
+//
+// Header names and values have the characters a header map rejects, NUL and CR, replaced.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "header_rewrite.h"
+#include "source/common/common/assert.h"
+#include "test/fuzz/fuzz_runner.h"
+#include "test/fuzz/utility.h"
+#include "test/mocks/server/factory_context.h"
+#include "test/mocks/stream_info/mocks.h"
+#include "test/test_common/utility.h"
+
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/strip.h"
+
+#if defined(__linux__)
+// libFuzzer's extra counters, cleared before each input and read after it as coverage; without
+// libFuzzer, nothing reads them
+__attribute__((used, section("__libfuzzer_extra_counters"))) static uint8_t cost_counters[64];
+#else
+static uint8_t cost_counters[64];
+#endif
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+namespace {
+
+// larger inputs mostly cost more to compile than to execute, and slow the fuzzer down
+constexpr size_t MaxInputSize = 64 * 1024;
+// runs per cost measure, of which the fastest is kept
+constexpr int CostRuns = 3;
+// below this, a cost is mostly noise, and isn't compared with the cost of the doubled headers
+constexpr uint64_t MinComparedCostNs = 100 * 1000;
+
+uint64_t envOrDefault(const char* name, uint64_t default_value) {
+  const char* value = std::getenv(name);
+  uint64_t parsed;
+  return value != nullptr && absl::SimpleAtoi(value, &parsed) ? parsed : default_value;
+}
+
+bool envSet(const char* name) { return std::getenv(name) != nullptr; }
+
+struct CostBudget {
+#ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
+  bool enforced = true;
+#else
+  bool enforced = envSet("HEADER_REWRITE_FUZZ_NS_PER_BYTE") || envSet("HEADER_REWRITE_FUZZ_FIXED_NS") ||
+                  envSet("HEADER_REWRITE_FUZZ_MAX_GROWTH");
+#endif
+  uint64_t ns_per_byte = envOrDefault("HEADER_REWRITE_FUZZ_NS_PER_BYTE", 2000);
+  uint64_t fixed_ns = envOrDefault("HEADER_REWRITE_FUZZ_FIXED_NS", 500 * 1000);
+  uint64_t max_growth = envOrDefault("HEADER_REWRITE_FUZZ_MAX_GROWTH", 3);
+};
+
+struct FuzzInput {
+  std::string rules;
+  std::vector<std::pair<std::string, std::string>> headers;
+};
+
+// splits input into its rules and headers; false if it has no header separator
+bool parseInput(absl::string_view input, FuzzInput& parsed) {
+  const size_t separator = input.find("\n---\n");
+  if (separator == absl::string_view::npos) {
+    return false;
+  }
+  parsed.rules = std::string(input.substr(0, separator));
+  for (absl::string_view line : absl::StrSplit(input.substr(separator + 5), '\n', absl::SkipEmpty())) {
+    // the name of a pseudo-header starts with the colon
+    const size_t colon = line.find(':', line.empty() || line[0] != ':' ? 0 : 1);
+    if (colon == absl::string_view::npos || colon == 0) {
+      continue;
+    }
+    parsed.headers.emplace_back(Fuzz::replaceInvalidCharacters(line.substr(0, colon)),
+                                Fuzz::replaceInvalidCharacters(
+                                    absl::StripLeadingAsciiWhitespace(line.substr(colon + 1))));
+  }
+  return true;
+}
+
+// the headers with every value joined to a copy of itself
+std::vector<std::pair<std::string, std::string>>
+doubledHeaders(const std::vector<std::pair<std::string, std::string>>& headers) {
+  std::vector<std::pair<std::string, std::string>> doubled = headers;
+  for (auto& header : doubled) {
+    header.second = absl::StrCat(header.second, ",", header.second);
+  }
+  return doubled;
+}
+
+// Executes the rules of config on headers, like the filter does for a stream, and returns the
+// wall time of the fastest of CostRuns runs. Header maps are rebuilt before each run, as rules
+// modify them, and outside of the time measured.
+uint64_t executionCostNs(const HttpHeaderRewriteFilterConfig& config,
+                         const std::vector<std::pair<std::string, std::string>>& headers) {
+  Http::TestRequestHeaderMapImpl request_headers_template;
+  Http::TestResponseHeaderMapImpl response_headers_template{{":status", "200"}};
+  for (const auto& header : headers) {
+    request_headers_template.addCopy(Http::LowerCaseString(header.first), header.second);
+    if (header.first[0] != ':') {
+      response_headers_template.addCopy(Http::LowerCaseString(header.first), header.second);
+    }
+  }
+
+  // dynamic metadata for set-metadata and metadata() to write and read
+  envoy::config::core::v3::Metadata metadata;
+  testing::NiceMock<StreamInfo::MockStreamInfo> stream_info;
+  ON_CALL(stream_info, dynamicMetadata()).WillByDefault(testing::ReturnRef(metadata));
+  ON_CALL(testing::Const(stream_info), dynamicMetadata()).WillByDefault(testing::ReturnRef(metadata));
+  ExecutionContext context;
+  uint64_t min_cost_ns = UINT64_MAX;
+  for (int run = 0; run < CostRuns; run++) {
+    Http::TestRequestHeaderMapImpl request_headers = request_headers_template;
+    Http::TestResponseHeaderMapImpl response_headers = response_headers_template;
+    metadata.Clear();
+    const auto start = std::chrono::steady_clock::now();
+    if (config.requestProgram() != nullptr) {
+      context.beginPhase(config.requestHeaderSlots(), request_headers, config.requestValueSlots());
+      config.requestProgram()->execute(request_headers, &stream_info, context);
+    }
+    if (config.responseProgram() != nullptr) {
+      context.beginPhase(config.responseHeaderSlots(), response_headers, config.responseValueSlots());
+      config.responseProgram()->execute(response_headers, &stream_info, context);
+    }
+    const uint64_t cost_ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    min_cost_ns = std::min(min_cost_ns, cost_ns);
+  }
+  return min_cost_ns;
+}
+
+// sets the extra counter of the order of magnitude of cost_ns
+void recordCost(uint64_t cost_ns) {
+  size_t bucket = 0;
+  while (cost_ns > 1 && bucket < sizeof(cost_counters) - 1) {
+    cost_ns >>= 1;
+    bucket++;
+  }
+  cost_counters[bucket] = 1;
+}
+
+} // namespace
+
+DEFINE_FUZZER(const uint8_t* buf, size_t len) {
+  static const CostBudget budget;
+  static testing::NiceMock<Server::Configuration::MockFactoryContext> factory_context;
+
+  if (len > MaxInputSize) {
+    return;
+  }
+  const absl::string_view input(reinterpret_cast<const char*>(buf), len);
+  FuzzInput parsed;
+  if (!parseInput(input, parsed)) {
+    return;
+  }
+
+  envoy::extensions::filters::http::HeaderRewrite proto_config;
+  proto_config.set_config(parsed.rules);
+  HttpHeaderRewriteFilterConfigSharedPtr config;
+  try {
+    config = std::make_shared<HttpHeaderRewriteFilterConfig>(proto_config, factory_context);
+  } catch (const EnvoyException&) {
+    // invalid rules are rejected at config time, and never executed
+    return;
+  }
+
+  const uint64_t cost_ns = executionCostNs(*config, parsed.headers);
+  recordCost(cost_ns);
+  if (!budget.enforced) {
+    return;
+  }
+  RELEASE_ASSERT(cost_ns <= budget.fixed_ns + budget.ns_per_byte * len,
+                 absl::StrCat("execution cost of ", cost_ns, "ns over the budget for an input of ", len, " bytes"));
+
+  if (cost_ns >= MinComparedCostNs) {
+    const uint64_t doubled_cost_ns = executionCostNs(*config, doubledHeaders(parsed.headers));
+    RELEASE_ASSERT(doubled_cost_ns <= cost_ns * budget.max_growth,
+                   absl::StrCat("execution cost grew from ", cost_ns, "ns to ", doubled_cost_ns,
+                                "ns with header values doubled"));
+  }
+}
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
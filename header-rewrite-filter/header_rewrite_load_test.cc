@@ -0,0 +1,248 @@
+// Load test of the filter in Envoy: drives concurrent HTTP/1 and HTTP/2 streams through a listener
+// with the filter configured from each file of load_test/, and without it as a baseline, against an
+// autonomous fake upstream on localhost. Each configuration reports requests per second and the
+// p50, p99 and p999 request latency, and the filter's latency as the difference with the baseline
+// of the same codec.
+//
+// It should be run alone, with --compilation_mode=opt, on a quiescent system:
+//
+//   bazel test --compilation_mode=opt //header-rewrite-filter:header_rewrite_load_test --test_output=streamed
+//
+// The environment variables HEADER_REWRITE_LOAD_TEST_REQUESTS and
+// HEADER_REWRITE_LOAD_TEST_CONCURRENCY set the requests measured and the streams kept in flight
+// per configuration. HEADER_REWRITE_LOAD_TEST_MAX_P99_OVERHEAD_US, if set, fails a configuration
+// whose p99 exceeds the baseline's by more than that many microseconds, to gate changes on it; it
+// also fails a configuration whose baseline wasn't measured before it in the same run.
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "test/integration/http_integration.h"
+#include "test/test_common/environment.h"
+#include "test/test_common/utility.h"
+
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+
+namespace Envoy {
+namespace {
+
+struct LoadResult {
+  double requests_per_second;
+  uint64_t p50_us;
+  uint64_t p99_us;
+  uint64_t p999_us;
+};
+
+// the filter configs measured, by their file in load_test/; empty is the baseline without the filter
+const std::vector<std::string>& loadTestConfigs() {
+  static const std::vector<std::string> configs = {"", "edge.yaml", "tenants.yaml", "gated.yaml"};
+  return configs;
+}
+
+uint64_t envOrDefault(const std::string& name, uint64_t default_value) {
+  const absl::optional<std::string> value = TestEnvironment::getOptionalEnvVar(name);
+  uint64_t parsed;
+  return value && absl::SimpleAtoi(*value, &parsed) ? parsed : default_value;
+}
+
+using LoadTestParams = std::tuple<Http::CodecClient::Type, std::string>;
+
+class HttpFilterHeaderRewriteLoadTest : public HttpIntegrationTest, public testing::TestWithParam<LoadTestParams> {
+public:
+  HttpFilterHeaderRewriteLoadTest()
+      : HttpIntegrationTest(std::get<0>(GetParam()), TestEnvironment::getIpVersionsForTest().front()) {}
+
+  static std::string paramName(const testing::TestParamInfo<LoadTestParams>& info) {
+    const std::string codec = std::get<0>(info.param) == Http::CodecClient::Type::HTTP1 ? "Http1" : "Http2";
+    const std::string& config = std::get<1>(info.param);
+    return absl::StrCat(codec, config.empty() ? "Baseline" : config.substr(0, config.find('.')));
+  }
+
+  void initialize() override {
+    // the upstream answers every request itself, so that the test only waits on Envoy
+    autonomous_upstream_ = true;
+    const std::string& config = std::get<1>(GetParam());
+    if (!config.empty()) {
+      config_helper_.prependFilter(TestEnvironment::readFileToStringForTest(
+          TestEnvironment::runfilesPath(absl::StrCat("header-rewrite-filter/load_test/", config),
+                                        "envoy_filter_example")));
+    }
+    HttpIntegrationTest::initialize();
+  }
+
+  // Keeps concurrency streams in flight, over one connection per stream with HTTP/1 and over
+  // a few multiplexed connections with HTTP/2, until requests have completed, and returns the
+  // latency of each from its start to the end of its response. Fails, returning the latencies
+  // measured so far, if no response completes within TestUtility::DefaultTimeout.
+  std::vector<uint64_t> runLoad(uint64_t requests, uint64_t concurrency) {
+    const bool http2 = std::get<0>(GetParam()) == Http::CodecClient::Type::HTTP2;
+    const uint64_t connection_count = http2 ? std::max<uint64_t>(1, concurrency / 16) : concurrency;
+    std::vector<IntegrationCodecClientPtr> connections;
+    for (uint64_t i = 0; i < connection_count; i++) {
+      connections.push_back(makeHttpConnection(lookupPort("http")));
+    }
+
+    struct InFlight {
+      IntegrationCodecClient* connection;
+      IntegrationStreamDecoderPtr response;
+      MonotonicTime start;
+    };
+    std::vector<InFlight> in_flight(concurrency);
+    uint64_t started = 0;
+    const auto start_request = [this, &started](InFlight& stream) {
+      stream.start = std::chrono::steady_clock::now();
+      stream.response = stream.connection->makeHeaderOnlyRequest(requestHeaders(started++));
+    };
+    for (uint64_t i = 0; i < concurrency; i++) {
+      in_flight[i].connection = connections[i % connection_count].get();
+      start_request(in_flight[i]);
+    }
+
+    // The test's dispatcher runs until a short timer exits it rather than until one response ends,
+    // so that it waits for events without spinning against the workers for a core, yet each
+    // response is timed within a tick of its end whichever stream it is on.
+    static constexpr std::chrono::microseconds Tick{20};
+    Event::TimerPtr tick = dispatcher_->createTimer([this]() { dispatcher_->exit(); });
+    MonotonicTime last_progress = std::chrono::steady_clock::now();
+    bool stalled = false;
+    std::vector<uint64_t> latencies_us;
+    latencies_us.reserve(requests);
+    while (latencies_us.size() < requests) {
+      tick->enableHRTimer(Tick);
+      dispatcher_->run(Event::Dispatcher::RunType::RunUntilExit);
+      const MonotonicTime now = std::chrono::steady_clock::now();
+      bool progressed = false;
+      for (InFlight& stream : in_flight) {
+        if (stream.response == nullptr || !stream.response->complete()) {
+          continue;
+        }
+        EXPECT_EQ("200", stream.response->headers().getStatusValue());
+        latencies_us.push_back(std::chrono::duration_cast<std::chrono::microseconds>(now - stream.start).count());
+        progressed = true;
+        stream.response.reset();
+        if (started < requests) {
+          start_request(stream);
+        }
+      }
+      if (progressed) {
+        last_progress = now;
+      } else if (now - last_progress > TestUtility::DefaultTimeout) {
+        ADD_FAILURE() << "no response completed in " << TestUtility::DefaultTimeout.count() << "ms, with "
+                      << latencies_us.size() << " of " << requests << " completed";
+        stalled = true;
+        break;
+      }
+    }
+    for (InFlight& stream : in_flight) {
+      if (stream.response != nullptr && !stalled) {
+        EXPECT_TRUE(stream.response->waitForEndStream());
+      }
+    }
+    for (IntegrationCodecClientPtr& connection : connections) {
+      connection->close();
+    }
+    return latencies_us;
+  }
+
+  // results of the configurations measured so far, by codec and config
+  static std::map<LoadTestParams, LoadResult>& results() {
+    static std::map<LoadTestParams, LoadResult> results;
+    return results;
+  }
+
+private:
+  // requests of a few kinds, which the configs classify differently
+  static Http::TestRequestHeaderMapImpl requestHeaders(uint64_t n) {
+    static const std::vector<std::string> authorities = {"api.example.com", "shop.example.com",
+                                                         "img.cdn.example.com", "www.example.org"};
+    Http::TestRequestHeaderMapImpl headers{{":method", "GET"},
+                                           {":path", n % 3 == 0 ? "/v1/items?version=2&page=1" : "/items/42"},
+                                           {":scheme", "http"},
+                                           {":authority", authorities[n % authorities.size()]},
+                                           {"user-agent", n % 2 == 0 ? "Mozilla/5.0 (iPhone) Mobile Safari" : "curl/8.0"},
+                                           {"accept", "application/json"},
+                                           {"x-forwarded-for", "10.0.0.1, 192.168.1.1"},
+                                           {"x-tenant", std::string("tenant-") + static_cast<char>('a' + n % 5)},
+                                           {"cookie", "session=abc123; cart=7"}};
+    if (n % 2 == 0) {
+      headers.addCopy(Http::LowerCaseString("x-api"), "1");
+    }
+    if (n % 10 == 0) {
+      headers.addCopy(Http::LowerCaseString("x-canary"), "true");
+    }
+    return headers;
+  }
+};
+
+INSTANTIATE_TEST_SUITE_P(CodecsAndConfigs, HttpFilterHeaderRewriteLoadTest,
+                         testing::Combine(testing::Values(Http::CodecClient::Type::HTTP1,
+                                                          Http::CodecClient::Type::HTTP2),
+                                          testing::ValuesIn(loadTestConfigs())),
+                         HttpFilterHeaderRewriteLoadTest::paramName);
+
+// The baseline of a codec is instantiated, and so measured, before the configs with the filter.
+TEST_P(HttpFilterHeaderRewriteLoadTest, ThroughputAndLatency) {
+  const uint64_t requests = envOrDefault("HEADER_REWRITE_LOAD_TEST_REQUESTS", 20000);
+  const uint64_t concurrency = envOrDefault("HEADER_REWRITE_LOAD_TEST_CONCURRENCY", 64);
+  initialize();
+
+  // warm up the connections to the upstream and the allocator before measuring
+  runLoad(std::min<uint64_t>(requests, 1000), concurrency);
+  const MonotonicTime start = std::chrono::steady_clock::now();
+  std::vector<uint64_t> latencies_us = runLoad(requests, concurrency);
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  if (HasFailure()) {
+    return; // a run that stalled or got errors measured nothing worth reporting
+  }
+
+  std::sort(latencies_us.begin(), latencies_us.end());
+  const auto percentile = [&latencies_us](double p) {
+    return latencies_us[std::min(latencies_us.size() - 1, static_cast<size_t>(latencies_us.size() * p))];
+  };
+  const LoadResult result{latencies_us.size() / seconds, percentile(0.5), percentile(0.99), percentile(0.999)};
+  results()[GetParam()] = result;
+
+  // one line per configuration, for scripts comparing runs
+  std::string line = absl::StrCat("header_rewrite_load_test ", paramName({GetParam(), 0}), " requests=",
+                                  latencies_us.size(), " concurrency=", concurrency,
+                                  " rps=", static_cast<uint64_t>(result.requests_per_second), " p50_us=",
+                                  result.p50_us, " p99_us=", result.p99_us, " p999_us=", result.p999_us);
+  const absl::optional<std::string> max_overhead =
+      TestEnvironment::getOptionalEnvVar("HEADER_REWRITE_LOAD_TEST_MAX_P99_OVERHEAD_US");
+  int64_t max_overhead_us = 0;
+  if (max_overhead && !absl::SimpleAtoi(*max_overhead, &max_overhead_us)) {
+    ADD_FAILURE() << "HEADER_REWRITE_LOAD_TEST_MAX_P99_OVERHEAD_US is not a number: " << *max_overhead;
+  }
+  const auto baseline = results().find({std::get<0>(GetParam()), ""});
+  if (!std::get<1>(GetParam()).empty() && baseline == results().end()) {
+    // e.g. a --gtest_filter or --gtest_shuffle left out or reordered the baseline of the codec: the
+    // overhead can't be measured, and the gate would otherwise pass without checking anything
+    if (max_overhead) {
+      ADD_FAILURE() << "no baseline measured before " << paramName({GetParam(), 0})
+                    << " to gate its p99 overhead on; run the codec's baseline in the same process, before it";
+    } else {
+      absl::StrAppend(&line, " (no baseline measured before, overhead not reported)");
+    }
+  } else if (!std::get<1>(GetParam()).empty()) {
+    const auto overhead = [](uint64_t us, uint64_t baseline_us) {
+      return static_cast<int64_t>(us) - static_cast<int64_t>(baseline_us);
+    };
+    const int64_t p99_overhead_us = overhead(result.p99_us, baseline->second.p99_us);
+    absl::StrAppend(&line, " rps_ratio=", result.requests_per_second / baseline->second.requests_per_second,
+                    " p50_overhead_us=", overhead(result.p50_us, baseline->second.p50_us),
+                    " p99_overhead_us=", p99_overhead_us,
+                    " p999_overhead_us=", overhead(result.p999_us, baseline->second.p999_us));
+    if (max_overhead) {
+      EXPECT_LE(p99_overhead_us, max_overhead_us) << line;
+    }
+  }
+  std::cout << line << std::endl;
+}
+
+} // namespace
+} // namespace Envoy
@@ -0,0 +1,133 @@
+#include "header_slots.h"
+
+#include <cstring>
+
+#include "absl/strings/match.h"
+#include "source/common/http/header_utility.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+uint32_t HeaderSlotTable::add(absl::string_view name) {
+  const int32_t existing_slot = find(name);
+  if (existing_slot != NoSlot) {
+    return existing_slot;
+  }
+
+  const uint32_t slot = names_.size();
+  names_.emplace_back(name);
+  if (slots_by_length_.size() <= name.size()) {
+    slots_by_length_.resize(name.size() + 1);
+  }
+  slots_by_length_[name.size()].push_back(slot);
+  return slot;
+}
+
+int32_t HeaderSlotTable::find(absl::string_view name) const {
+  if (name.size() >= slots_by_length_.size()) {
+    return NoSlot;
+  }
+  for (const uint32_t slot : slots_by_length_[name.size()]) {
+    if (std::memcmp(names_[slot].data(), name.data(), name.size()) == 0) {
+      return slot;
+    }
+  }
+  return NoSlot;
+}
+
+void HeaderSlots::gather(const HeaderSlotTable& table, const Http::HeaderMap& headers) {
+  table_ = &table;
+  slots_.clear();
+  slots_.resize(table.size());
+  write_count_ = 0;
+  path_written_at_ = 0;
+  unslotted_written_at_ = 0;
+  const bool track_presence = table.tracksPresence();
+  if (track_presence) {
+    presence_.clear();
+  } else {
+    presence_.setAll();
+    if (table.empty()) {
+      return;
+    }
+  }
+
+  headers.iterate([this, &table, track_presence](const Http::HeaderEntry& entry) -> Http::HeaderMap::Iterate {
+    const absl::string_view name = entry.key().getStringView();
+    if (track_presence) {
+      presence_.add(name);
+    }
+    const int32_t slot = table.find(name);
+    if (slot != HeaderSlotTable::NoSlot) {
+      addValue(slots_[slot], entry.value().getStringView());
+    }
+    return Http::HeaderMap::Iterate::Continue;
+  });
+}
+
+void HeaderSlots::addValue(Slot& slot, absl::string_view value) {
+  if (!slot.present) {
+    slot.present = true;
+    slot.value = value;
+    return;
+  }
+
+  // header with several entries, join them like getAllOfHeaderAsString
+  if (!slot.owned) {
+    slot.joined.assign(slot.value.data(), slot.value.size());
+    slot.owned = true;
+  }
+  slot.joined.push_back(',');
+  slot.joined.append(value.data(), value.size());
+}
+
+void HeaderSlots::set(absl::string_view name, absl::string_view value) {
+  presence_.add(name);
+  const int32_t slot = findSlot(name);
+  stampWrite(name, slot);
+  if (slot == HeaderSlotTable::NoSlot) {
+    return;
+  }
+
+  // the written value is copied since the rule's value string does not outlive the operation
+  Slot& header_slot = slots_[slot];
+  header_slot.present = true;
+  header_slot.owned = true;
+  header_slot.joined.assign(value.data(), value.size());
+}
+
+void HeaderSlots::refresh(const Http::HeaderMap& headers, absl::string_view name) {
+  presence_.add(name);
+  const int32_t slot = findSlot(name);
+  if (slot == HeaderSlotTable::NoSlot) {
+    stampWrite(name, slot);
+    return;
+  }
+
+  Slot& header_slot = slots_[slot];
+  header_slot = Slot();
+  stampWrite(name, slot);
+  const Http::HeaderMap::GetResult entries = headers.get(Http::LowerCaseString(name));
+  for (size_t i = 0; i < entries.size(); i++) {
+    addValue(header_slot, entries[i]->value().getStringView());
+  }
+}
+
+void HeaderSlots::stampWrite(absl::string_view name, int32_t slot) {
+  const uint64_t stamp = recordWrite();
+  if (slot == HeaderSlotTable::NoSlot) {
+    unslotted_written_at_ = stamp;
+  } else {
+    slots_[slot].written_at = stamp;
+  }
+  if (absl::EqualsIgnoreCase(name, ":path")) {
+    path_written_at_ = stamp;
+  }
+}
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
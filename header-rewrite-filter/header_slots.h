@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "absl/container/inlined_vector.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/optional.h"
+#include "envoy/http/header_map.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+// Bloom of the header names present in a header map, one bit per name fingerprint. A clear bit
+// proves that no header with a name of that fingerprint is present; a set bit may be a collision.
+class HeaderPresence {
+public:
+  // fingerprint of a header name, case insensitive so that config names needn't be lowercased
+  static uint64_t bit(absl::string_view name) {
+    if (name.empty()) {
+      return 1;
+    }
+    const uint64_t hash = name.size() * 7 + absl::ascii_tolower(name.front()) * 3 +
+                          absl::ascii_tolower(name[name.size() / 2]) * 5 + absl::ascii_tolower(name.back());
+    return uint64_t(1) << (hash & 63);
+  }
+
+  void clear() { mask_ = 0; }
+  // used when presence isn't tracked, every header may be present
+  void setAll() { mask_ = ~uint64_t(0); }
+  void add(absl::string_view name) { mask_ |= bit(name); }
+  // true if none of the headers in a mask of fingerprints can be present
+  bool noneOf(uint64_t mask) const { return (mask_ & mask) == 0; }
+
+private:
+  uint64_t mask_ = ~uint64_t(0);
+};
+
+// Header names read through hdr() by one direction's rules, each mapped to a slot index. Names are
+// bucketed by length, so matching a header map entry costs a bounds check plus a memcmp against
+// the (usually one) name of the same length.
+class HeaderSlotTable {
+public:
+  static constexpr int32_t NoSlot = -1;
+
+  // returns the slot of a lowercase header name, adding the name if it isn't in the table yet
+  uint32_t add(absl::string_view name);
+  // returns the slot of a lowercase header name, or NoSlot
+  int32_t find(absl::string_view name) const;
+
+  size_t size() const { return names_.size(); }
+  bool empty() const { return names_.empty(); }
+  const std::string& name(uint32_t slot) const { return names_[slot]; }
+
+  // gather the HeaderPresence of every phase, needed when a rule can be skipped by presence
+  void trackPresence() { track_presence_ = true; }
+  bool tracksPresence() const { return track_presence_; }
+
+private:
+  bool track_presence_ = false;
+  std::vector<std::string> names_; // indexed by slot
+  std::vector<std::vector<uint32_t>> slots_by_length_; // indexed by name length
+};
+
+// Per-stream values of the slotted headers for the phase being executed. All slots (and the
+// presence bloom, if tracked) are filled by a single HeaderMap::iterate pass; afterwards only
+// slots of headers written by the rules are refreshed. Values are views into the header map except when a header has several entries, in
+// which case the entries are joined with ',' (as HeaderUtility::getAllOfHeaderAsString does).
+class HeaderSlots {
+public:
+  void gather(const HeaderSlotTable& table, const Http::HeaderMap& headers);
+  // returns the value of a slot, or nullopt if the header is not present
+  absl::optional<absl::string_view> get(uint32_t slot) const {
+    const Slot& header_slot = slots_[slot];
+    if (!header_slot.present) {
+      return absl::nullopt;
+    }
+    return header_slot.owned ? absl::string_view(header_slot.joined) : header_slot.value;
+  }
+
+  const HeaderPresence& presence() const { return presence_; }
+
+  // record that a header was replaced with a single value (set-header)
+  void set(absl::string_view name, absl::string_view value);
+  // re-read a header that was modified in place (append-header, set-path)
+  void refresh(const Http::HeaderMap& headers, absl::string_view name);
+  // record that a header without a slot was written (inline headers)
+  void markPresent(absl::string_view name) {
+    presence_.add(name);
+    stampWrite(name, HeaderSlotTable::NoSlot);
+  }
+
+  // Write stamps, used to invalidate values computed from headers. Every write gets a new stamp
+  // from a counter that restarts with each phase; a value computed when the counter was at N
+  // is stale once the header it was read from has a stamp above N.
+  uint64_t writeCount() const { return write_count_; }
+  uint64_t recordWrite() { return ++write_count_; }
+  uint64_t slotWrittenAt(uint32_t slot) const { return slots_[slot].written_at; }
+  uint64_t pathWrittenAt() const { return path_written_at_; }
+  // last write to any header without a slot
+  uint64_t unslottedWrittenAt() const { return unslotted_written_at_; }
+
+private:
+  struct Slot {
+    bool present = false;
+    bool owned = false; // value lives in joined instead of the header map
+    absl::string_view value;
+    std::string joined;
+    uint64_t written_at = 0;
+  };
+
+  void addValue(Slot& slot, absl::string_view value);
+  void stampWrite(absl::string_view name, int32_t slot);
+  int32_t findSlot(absl::string_view name) const {
+    return table_ ? table_->find(name) : HeaderSlotTable::NoSlot;
+  }
+
+  const HeaderSlotTable* table_ = nullptr;
+  absl::InlinedVector<Slot, 8> slots_;
+  HeaderPresence presence_;
+  uint64_t write_count_ = 0;
+  uint64_t path_written_at_ = 0;
+  uint64_t unslotted_written_at_ = 0;
+};
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -0,0 +1,66 @@
+#include "inline_headers.h"
+
+#include "source/common/http/headers.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+const Http::HeaderEntry* InlineHeaderHandle::get(const Http::RequestOrResponseHeaderMap& headers) const {
+  if (request_handle_.has_value()) {
+    return static_cast<const Http::RequestHeaderMap&>(headers).getInline(request_handle_.value());
+  }
+  return static_cast<const Http::ResponseHeaderMap&>(headers).getInline(response_handle_.value());
+}
+
+void InlineHeaderHandle::set(Http::RequestOrResponseHeaderMap& headers, absl::string_view value) const {
+  if (request_handle_.has_value()) {
+    static_cast<Http::RequestHeaderMap&>(headers).setInline(request_handle_.value(), value);
+    return;
+  }
+  static_cast<Http::ResponseHeaderMap&>(headers).setInline(response_handle_.value(), value);
+}
+
+void InlineHeaderHandle::append(Http::RequestOrResponseHeaderMap& headers, absl::string_view value) const {
+  if (request_handle_.has_value()) {
+    static_cast<Http::RequestHeaderMap&>(headers).appendInline(request_handle_.value(), value, delimiter_);
+    return;
+  }
+  static_cast<Http::ResponseHeaderMap&>(headers).appendInline(response_handle_.value(), value, delimiter_);
+}
+
+absl::Status InlineHeaderTable::add(absl::string_view name) {
+  const Http::LowerCaseString header_name(name);
+  const auto request_handle = Http::CustomInlineHeaderRegistry::getInlineHeader<
+      Http::CustomInlineHeaderRegistry::Type::RequestHeaders>(header_name);
+  const auto response_handle = Http::CustomInlineHeaderRegistry::getInlineHeader<
+      Http::CustomInlineHeaderRegistry::Type::ResponseHeaders>(header_name);
+
+  if (!request_handle.has_value() && !response_handle.has_value()) {
+    return absl::InvalidArgumentError("inline header \"" + header_name.get() +
+                                      "\" is not registered, add it to the bootstrap inline_headers");
+  }
+
+  // same delimiters as HeaderMap::appendCopy, which append-header uses for non-inline headers
+  const absl::string_view delimiter = header_name == Http::Headers::get().Cookie ? "; " : ",";
+  // a header may only be registered for one direction, e.g. a custom request header
+  if (request_handle.has_value()) {
+    request_handles_.insert_or_assign(header_name.get(), InlineHeaderHandle(request_handle.value(), delimiter));
+  }
+  if (response_handle.has_value()) {
+    response_handles_.insert_or_assign(header_name.get(), InlineHeaderHandle(response_handle.value(), delimiter));
+  }
+  return absl::OkStatus();
+}
+
+const InlineHeaderHandle* InlineHeaderTable::find(absl::string_view name, bool is_request) const {
+  const auto& handles = is_request ? request_handles_ : response_handles_;
+  const auto it = handles.find(Http::LowerCaseString(name).get());
+  return it == handles.end() ? nullptr : &it->second;
+}
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
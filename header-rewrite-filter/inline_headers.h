@@ -0,0 +1,59 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/optional.h"
+#include "envoy/http/header_map.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+using RequestInlineHandle = Http::CustomInlineHeaderRegistry::Handle<Http::CustomInlineHeaderRegistry::Type::RequestHeaders>;
+using ResponseInlineHandle = Http::CustomInlineHeaderRegistry::Handle<Http::CustomInlineHeaderRegistry::Type::ResponseHeaders>;
+
+// O(1) access to one header through its custom inline header handle. A handle is bound to either
+// the request or the response header map type, matching the direction of the operation using it.
+class InlineHeaderHandle {
+public:
+  // delimiter joins appended values, as HeaderMap::appendCopy would for the header's name
+  InlineHeaderHandle(RequestInlineHandle handle, absl::string_view delimiter)
+      : request_handle_(handle), delimiter_(delimiter) {}
+  InlineHeaderHandle(ResponseInlineHandle handle, absl::string_view delimiter)
+      : response_handle_(handle), delimiter_(delimiter) {}
+
+  const Http::HeaderEntry* get(const Http::RequestOrResponseHeaderMap& headers) const;
+  void set(Http::RequestOrResponseHeaderMap& headers, absl::string_view value) const;
+  void append(Http::RequestOrResponseHeaderMap& headers, absl::string_view value) const;
+
+private:
+  absl::optional<RequestInlineHandle> request_handle_;
+  absl::optional<ResponseInlineHandle> response_handle_;
+  absl::string_view delimiter_;
+};
+
+// Inline handles for the header names listed in the filter's inline_headers config. Handles are
+// resolved once at config load; Envoy finalizes the inline header registry during bootstrap, so
+// every listed name must already be registered there.
+class InlineHeaderTable {
+public:
+  absl::Status add(absl::string_view name);
+  const InlineHeaderHandle* find(absl::string_view name, bool is_request) const;
+  bool empty() const { return request_handles_.empty() && response_handles_.empty(); }
+
+private:
+  absl::flat_hash_map<std::string, InlineHeaderHandle> request_handles_;
+  absl::flat_hash_map<std::string, InlineHeaderHandle> response_handles_;
+};
+
+using InlineHeaderTableSharedPtr = std::shared_ptr<const InlineHeaderTable>;
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
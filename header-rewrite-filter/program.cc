@@ -0,0 +1,1488 @@
+#include "program.h"
+
+#include <algorithm>
+#include <map>
+#include <tuple>
+
+#include "header_operations.h"
+
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+namespace {
+
+absl::string_view matchTypeName(Utility::MatchType match_type) {
+  switch (match_type) {
+    case Utility::MatchType::Exact:
+      return "str";
+    case Utility::MatchType::Prefix:
+      return "beg";
+    case Utility::MatchType::Substr:
+      return "sub";
+    case Utility::MatchType::Found:
+      return "found";
+    default:
+      return "invalid";
+  }
+}
+
+// Reduced ordered decision diagram whose leaves are sets of rules, built one rule condition at a
+// time: adding a rule splits the paths on the bools of its condition and adds the rule to the
+// leaves of the paths where the condition is true. Bools are tested in the order of their levels,
+// and a node whose children are the same is dropped. Identical nodes and leaves are shared, so
+// rules gated on the same bools share their tests.
+class DecisionDagBuilder {
+public:
+  static constexpr uint32_t LeafBit = 0x80000000;
+
+  // a level and the value of its bool that satisfies the literal
+  using Literal = std::pair<uint32_t, bool>;
+  // OR of AND groups of literals sorted by level; no group is false, a single empty group is true
+  using Condition = std::vector<std::vector<Literal>>;
+
+  struct Node {
+    uint32_t level;
+    uint32_t if_false; // node index, or leaf index with LeafBit
+    uint32_t if_true;
+  };
+
+  DecisionDagBuilder() : root_(leaf({})) {}
+
+  // adds a rule, after the rules added before it, unless the DAG would then have more than
+  // max_nodes nodes
+  bool addRule(uint32_t rule, const Condition& condition, size_t max_nodes) {
+    add_results_.clear();
+    with_rule_results_.clear();
+    const uint32_t root = add(root_, condition, rule);
+    if (nodeCount(root) > max_nodes) {
+      return false;
+    }
+    root_ = root;
+    return true;
+  }
+
+  uint32_t root() const { return root_; }
+  const Node& nodeAt(uint32_t id) const { return nodes_[id]; }
+  const std::vector<uint32_t>& leafAt(uint32_t id) const { return leaves_[id & ~LeafBit]; }
+
+  static Condition normalize(Condition condition) {
+    Condition normalized;
+    for (auto& group : condition) {
+      std::sort(group.begin(), group.end());
+      group.erase(std::unique(group.begin(), group.end()), group.end());
+      bool contradiction = false;
+      for (size_t i = 1; i < group.size(); i++) {
+        contradiction = contradiction || group[i].first == group[i - 1].first;
+      }
+      if (!contradiction) {
+        normalized.push_back(std::move(group));
+      }
+    }
+    std::sort(normalized.begin(), normalized.end());
+    normalized.erase(std::unique(normalized.begin(), normalized.end()), normalized.end());
+    return normalized;
+  }
+
+private:
+  static bool isTrue(const Condition& condition) { return condition.size() == 1 && condition[0].empty(); }
+
+  uint32_t level(uint32_t id) const { return (id & LeafBit) ? UINT32_MAX : nodes_[id].level; }
+
+  static uint32_t topLevel(const Condition& condition) {
+    uint32_t top = UINT32_MAX;
+    for (const auto& group : condition) {
+      top = std::min(top, group.front().first);
+    }
+    return top;
+  }
+
+  // the condition once the bool of a level is known
+  static Condition restrict(const Condition& condition, uint32_t level, bool value) {
+    Condition restricted;
+    for (const auto& group : condition) {
+      std::vector<Literal> rest;
+      bool falsified = false;
+      for (const Literal& literal : group) {
+        if (literal.first != level) {
+          rest.push_back(literal);
+        } else if (literal.second != value) {
+          falsified = true;
+        }
+      }
+      if (falsified) {
+        continue;
+      }
+      if (rest.empty()) {
+        return Condition(1);
+      }
+      restricted.push_back(std::move(rest));
+    }
+    std::sort(restricted.begin(), restricted.end());
+    restricted.erase(std::unique(restricted.begin(), restricted.end()), restricted.end());
+    return restricted;
+  }
+
+  uint32_t add(uint32_t id, const Condition& condition, uint32_t rule) {
+    if (condition.empty()) {
+      return id;
+    }
+    if (isTrue(condition)) {
+      return withRule(id, rule);
+    }
+    auto key = std::make_pair(id, condition);
+    const auto it = add_results_.find(key);
+    if (it != add_results_.end()) {
+      return it->second;
+    }
+    const uint32_t top = std::min(level(id), topLevel(condition));
+    const bool split = level(id) == top;
+    const uint32_t if_false = split ? nodes_[id].if_false : id;
+    const uint32_t if_true = split ? nodes_[id].if_true : id;
+    const uint32_t false_result = add(if_false, restrict(condition, top, false), rule);
+    const uint32_t true_result = add(if_true, restrict(condition, top, true), rule);
+    const uint32_t result = node(top, false_result, true_result);
+    add_results_.emplace(std::move(key), result);
+    return result;
+  }
+
+  uint32_t withRule(uint32_t id, uint32_t rule) {
+    const auto it = with_rule_results_.find(id);
+    if (it != with_rule_results_.end()) {
+      return it->second;
+    }
+    uint32_t result;
+    if (id & LeafBit) {
+      std::vector<uint32_t> rules = leaves_[id & ~LeafBit];
+      rules.push_back(rule);
+      result = leaf(std::move(rules));
+    } else {
+      const Node copy = nodes_[id];
+      result = node(copy.level, withRule(copy.if_false, rule), withRule(copy.if_true, rule));
+    }
+    with_rule_results_.emplace(id, result);
+    return result;
+  }
+
+  uint32_t node(uint32_t level, uint32_t if_false, uint32_t if_true) {
+    if (if_false == if_true) {
+      return if_false;
+    }
+    const auto key = std::make_tuple(level, if_false, if_true);
+    const auto it = unique_nodes_.find(key);
+    if (it != unique_nodes_.end()) {
+      return it->second;
+    }
+    const uint32_t id = nodes_.size();
+    nodes_.push_back({level, if_false, if_true});
+    unique_nodes_.emplace(key, id);
+    return id;
+  }
+
+  uint32_t leaf(std::vector<uint32_t> rules) {
+    const auto it = unique_leaves_.find(rules);
+    if (it != unique_leaves_.end()) {
+      return it->second;
+    }
+    const uint32_t id = leaves_.size() | LeafBit;
+    unique_leaves_.emplace(rules, id);
+    leaves_.push_back(std::move(rules));
+    return id;
+  }
+
+  size_t nodeCount(uint32_t root) const {
+    absl::flat_hash_set<uint32_t> visited;
+    std::vector<uint32_t> pending = {root};
+    while (!pending.empty()) {
+      const uint32_t id = pending.back();
+      pending.pop_back();
+      if ((id & LeafBit) || !visited.insert(id).second) {
+        continue;
+      }
+      pending.push_back(nodes_[id].if_false);
+      pending.push_back(nodes_[id].if_true);
+    }
+    return visited.size();
+  }
+
+  std::vector<Node> nodes_;
+  std::vector<std::vector<uint32_t>> leaves_;
+  absl::flat_hash_map<std::tuple<uint32_t, uint32_t, uint32_t>, uint32_t> unique_nodes_;
+  absl::flat_hash_map<std::vector<uint32_t>, uint32_t> unique_leaves_;
+  // results of the rule being added
+  std::map<std::pair<uint32_t, Condition>, uint32_t> add_results_;
+  absl::flat_hash_map<uint32_t, uint32_t> with_rule_results_;
+  uint32_t root_;
+};
+
+} // namespace
+
+// Builds a Program from processors, giving each distinct function and bool instance one entry so
+// that the value slots shared by the rule optimizer stay shared.
+class ProgramCompiler {
+public:
+  ProgramCompiler(Program& program, const SetBoolProcessorMap& set_bool_processors, const BoolTrueRates* true_rates)
+    : program_(program), set_bool_processors_(set_bool_processors), true_rates_(true_rates) {}
+
+  void addRule(HeaderProcessor& processor) {
+    // dispatched before the condition is added, so that a processor without a rule leaves no
+    // operands or rule indices behind
+    const auto* set_header = dynamic_cast<const SetHeaderProcessor*>(&processor);
+    const auto* append_header = dynamic_cast<const AppendHeaderProcessor*>(&processor);
+    const auto* set_path = dynamic_cast<const SetPathProcessor*>(&processor);
+    const auto* set_metadata = dynamic_cast<const SetDynamicMetadataProcessor*>(&processor);
+    const auto* batch = dynamic_cast<const ConstantBatchProcessor*>(&processor);
+    if (!set_header && !append_header && !set_path && !set_metadata && !batch) {
+      return; // the base HeaderProcessor does nothing
+    }
+
+    Program::Rule rule{};
+    rule.header_name = Program::NoIndex;
+    rule.inline_header = nullptr;
+    addCondition(processor, rule);
+    addRuleIndices(processor, rule);
+    rule.first_argument = program_.arguments_.size();
+
+    if (set_header) {
+      rule.operation = Program::Operation::SetHeader;
+      setKey(set_header->headerKey(), set_header->inlineHeader(), rule);
+      program_.arguments_.push_back(addFunction(set_header->headerValue()));
+    } else if (append_header) {
+      rule.operation = Program::Operation::AppendHeader;
+      setKey(append_header->headerKey(), append_header->inlineHeader(), rule);
+      for (const auto& header_val : append_header->headerValues()) {
+        program_.arguments_.push_back(addFunction(header_val));
+      }
+    } else if (set_path) {
+      rule.operation = Program::Operation::SetPath;
+      program_.arguments_.push_back(addFunction(set_path->requestPath()));
+    } else if (set_metadata) {
+      rule.operation = Program::Operation::SetMetadata;
+      program_.arguments_.push_back(addFunction(set_metadata->metadataKey()));
+      program_.arguments_.push_back(addFunction(set_metadata->metadataValue()));
+    } else {
+      rule.operation = Program::Operation::ConstantBatch;
+      rule.first_argument = program_.mutations_.size();
+      for (const auto& mutation : batch->mutations()) {
+        program_.mutations_.push_back({addHeaderName(mutation.key.get()), addString(mutation.value), mutation.append,
+                                       mutation.inline_header});
+      }
+      rule.argument_count = program_.mutations_.size() - rule.first_argument;
+      program_.rules_.push_back(rule);
+      return;
+    }
+    rule.argument_count = program_.arguments_.size() - rule.first_argument;
+    program_.rules_.push_back(rule);
+  }
+
+  // Merges the conditions of the rules whose bools read nothing that an earlier rule may write into
+  // a decision DAG. The functions of their bools that can fail are evaluated before the walk, once
+  // each, so that a phase where one fails falls back to evaluating conditions rule by rule before
+  // any rule was decided, and the DAG itself is free to skip bools. Bools are ordered by the number
+  // of rules testing them, so that the DAG branches on the bools shared by most rules first.
+  void buildDecisionDag() {
+    std::vector<uint32_t> candidates;
+    absl::flat_hash_set<std::string> written_headers; // ":path" for the path
+    bool written_any_header = false;
+    bool written_metadata = false;
+    std::vector<uint32_t> rule_counts(program_.bools_.size());
+    for (uint32_t r = 0; r < program_.rules_.size(); r++) {
+      const Program::Rule& rule = program_.rules_[r];
+      bool stable = rule.operand_count > 0;
+      for (uint32_t o = rule.first_operand; stable && o < rule.first_operand + rule.operand_count; o++) {
+        const Program::Bool& bool_value = program_.bools_[program_.operands_[o].bool_index];
+        for (const uint32_t function_index : {bool_value.source, bool_value.compare}) {
+          const Program::Function& function = program_.functions_[function_index];
+          if (function.type == Utility::FunctionType::GetHdr) {
+            stable = stable && !written_any_header &&
+                     !written_headers.contains(program_.header_names_[function.header_name].get());
+          } else if (function.type == Utility::FunctionType::Urlp) {
+            stable = stable && !written_any_header && !written_headers.contains(":path");
+          } else if (function.type == Utility::FunctionType::GetMetadata) {
+            stable = stable && !written_metadata;
+          }
+        }
+      }
+      if (stable) {
+        candidates.push_back(r);
+        absl::flat_hash_set<uint32_t> rule_bools;
+        for (uint32_t o = rule.first_operand; o < rule.first_operand + rule.operand_count; o++) {
+          rule_bools.insert(program_.operands_[o].bool_index);
+        }
+        for (const uint32_t bool_index : rule_bools) {
+          rule_counts[bool_index]++;
+        }
+      }
+
+      switch (rule.operation) {
+        case Program::Operation::SetHeader:
+        case Program::Operation::AppendHeader:
+          if (rule.header_name == Program::NoIndex) {
+            written_any_header = true;
+          } else {
+            written_headers.insert(program_.header_names_[rule.header_name].get());
+          }
+          break;
+        case Program::Operation::SetPath:
+          written_headers.insert(":path");
+          break;
+        case Program::Operation::SetMetadata:
+          written_metadata = true;
+          break;
+        case Program::Operation::ConstantBatch:
+          for (uint32_t m = rule.first_argument; m < rule.first_argument + rule.argument_count; m++) {
+            written_headers.insert(program_.header_names_[program_.mutations_[m].header_name].get());
+          }
+          break;
+      }
+    }
+    if (candidates.empty()) {
+      return;
+    }
+
+    std::vector<uint32_t> level_bools;
+    for (uint32_t b = 0; b < program_.bools_.size(); b++) {
+      if (rule_counts[b] > 0) {
+        level_bools.push_back(b);
+      }
+    }
+    std::stable_sort(level_bools.begin(), level_bools.end(),
+                     [&rule_counts](uint32_t a, uint32_t b) { return rule_counts[a] > rule_counts[b]; });
+    std::vector<uint32_t> bool_levels(program_.bools_.size());
+    for (uint32_t level = 0; level < level_bools.size(); level++) {
+      bool_levels[level_bools[level]] = level;
+    }
+
+    DecisionDagBuilder builder;
+    std::vector<uint32_t> decided;
+    for (const uint32_t r : candidates) {
+      const Program::Rule& rule = program_.rules_[r];
+      DecisionDagBuilder::Condition condition(1);
+      for (uint32_t o = rule.first_operand; o < rule.first_operand + rule.operand_count; o++) {
+        const Program::Operand& operand = program_.operands_[o];
+        condition.back().emplace_back(bool_levels[operand.bool_index], !operand.negate);
+        if (operand.last_in_group && o + 1 < rule.first_operand + rule.operand_count) {
+          condition.emplace_back();
+        }
+      }
+      if (builder.addRule(r, DecisionDagBuilder::normalize(std::move(condition)), MaxDagNodes)) {
+        decided.push_back(r);
+      }
+    }
+    if (decided.empty()) {
+      return;
+    }
+
+    // copy the nodes and leaves reachable from the root, the nodes ordered by level: a shared node
+    // then still comes after each of its parents, which are all on lower levels, as the program
+    // loader checks
+    absl::flat_hash_map<uint32_t, uint32_t> ids;
+    std::vector<uint32_t> nodes;
+    const std::function<void(uint32_t)> collect = [&](uint32_t id) {
+      if (!ids.emplace(id, 0).second) {
+        return;
+      }
+      if (id & DecisionDagBuilder::LeafBit) {
+        const std::vector<uint32_t>& rules = builder.leafAt(id);
+        ids[id] = program_.dag_leaves_.size() | Program::DagLeafBit;
+        program_.dag_leaves_.push_back({static_cast<uint32_t>(program_.dag_rules_.size()),
+                                        static_cast<uint32_t>(rules.size())});
+        program_.dag_rules_.insert(program_.dag_rules_.end(), rules.begin(), rules.end());
+        return;
+      }
+      nodes.push_back(id);
+      collect(builder.nodeAt(id).if_false);
+      collect(builder.nodeAt(id).if_true);
+    };
+    collect(builder.root());
+    std::stable_sort(nodes.begin(), nodes.end(), [&builder](uint32_t a, uint32_t b) {
+      return builder.nodeAt(a).level < builder.nodeAt(b).level;
+    });
+    for (const uint32_t id : nodes) {
+      ids[id] = program_.dag_nodes_.size();
+      program_.dag_nodes_.push_back({level_bools[builder.nodeAt(id).level], 0, 0});
+    }
+    for (const uint32_t id : nodes) {
+      Program::DagNode& node = program_.dag_nodes_[ids[id]];
+      node.if_false = ids[builder.nodeAt(id).if_false];
+      node.if_true = ids[builder.nodeAt(id).if_true];
+    }
+    program_.dag_root_ = ids[builder.root()];
+    absl::flat_hash_set<uint32_t> checked;
+    for (const uint32_t r : decided) {
+      Program::Rule& rule = program_.rules_[r];
+      rule.decided = true;
+      for (uint32_t o = rule.first_operand; o < rule.first_operand + rule.operand_count; o++) {
+        const Program::Bool& bool_value = program_.bools_[program_.operands_[o].bool_index];
+        for (const uint32_t function_index : {bool_value.source, bool_value.compare}) {
+          if (function_errors_.at(function_index) != 0 && checked.insert(function_index).second) {
+            program_.dag_checked_functions_.push_back(function_index);
+          }
+        }
+      }
+    }
+  }
+
+private:
+  // beyond this, the rules left are evaluated rule by rule
+  static constexpr size_t MaxDagNodes = 4096;
+
+  void addRuleIndices(const HeaderProcessor& processor, Program::Rule& rule) {
+    rule.first_rule_index = program_.rule_indices_.size();
+    if (const auto* batch = dynamic_cast<const ConstantBatchProcessor*>(&processor)) {
+      program_.rule_indices_.insert(program_.rule_indices_.end(), batch->ruleIndices().begin(), batch->ruleIndices().end());
+    } else {
+      program_.rule_indices_.push_back(processor.ruleIndex());
+    }
+    rule.rule_index_count = program_.rule_indices_.size() - rule.first_rule_index;
+  }
+
+  void addCondition(HeaderProcessor& processor, Program::Rule& rule) {
+    rule.first_operand = program_.operands_.size();
+    const ConditionProcessor* condition_processor = processor.getConditionProcessor().get();
+    if (!condition_processor) {
+      return;
+    }
+    rule.skippable = condition_processor->skippableByPresence();
+    rule.dependency_headers = condition_processor->dependencyHeaders();
+    const auto& operators = condition_processor->operators();
+    const auto& operands = condition_processor->operands();
+
+    // bools are added in the config's order, so that their indices don't depend on the operand order
+    std::vector<std::vector<Program::Operand>> groups(1);
+    for (size_t i = 0; i < operands.size(); i++) {
+      groups.back().push_back({addBool(set_bool_processors_.at(std::get<0>(operands[i]))), std::get<1>(operands[i]), false});
+      if ((i == operators.size() || operators[i] == Utility::BooleanOperatorType::Or) && i + 1 < operands.size()) {
+        groups.emplace_back();
+      }
+    }
+    orderOperands(groups);
+    for (auto& group : groups) {
+      group.back().last_in_group = true;
+      program_.operands_.insert(program_.operands_.end(), group.begin(), group.end());
+    }
+    rule.operand_count = operands.size();
+  }
+
+  // Sorts the operands of each AND group and the groups of the OR, cheapest per chance of deciding
+  // the result first: operands likely false within a group, groups likely true within the
+  // condition. An operand that can fail is evaluated even once the result is known, and the first
+  // one to fail decides the error. If the operands can fail with different errors, those that can
+  // fail and the groups holding them keep their places and the others are sorted around them.
+  void orderOperands(std::vector<std::vector<Program::Operand>>& groups) const {
+    uint32_t condition_errors = 0;
+    for (const auto& group : groups) {
+      for (const Program::Operand& operand : group) {
+        condition_errors |= bool_errors_[operand.bool_index];
+      }
+    }
+    const bool keep_failing_in_place = (condition_errors & (condition_errors - 1)) != 0;
+
+    std::vector<double> group_keys;
+    std::vector<bool> group_fixed;
+    for (auto& group : groups) {
+      std::vector<double> keys;
+      std::vector<bool> fixed;
+      double group_cost = 0;
+      double group_true_rate = 1;
+      for (const Program::Operand& operand : group) {
+        const double cost = program_.boolCost(operand.bool_index);
+        const double true_rate = trueRate(operand);
+        keys.push_back(cost / std::max(1 - true_rate, MinRate));
+        fixed.push_back(keep_failing_in_place && program_.bools_[operand.bool_index].may_fail);
+        group_cost += cost;
+        group_true_rate *= true_rate;
+      }
+      sortAround(group, keys, fixed);
+      group_keys.push_back(group_cost / std::max(group_true_rate, MinRate));
+      group_fixed.push_back(std::find(fixed.begin(), fixed.end(), true) != fixed.end());
+    }
+    sortAround(groups, group_keys, group_fixed);
+  }
+
+  // after negation, 0.5 without observed rates
+  double trueRate(const Program::Operand& operand) const {
+    const double rate = true_rates_ && operand.bool_index < true_rates_->size() ? (*true_rates_)[operand.bool_index] : 0.5;
+    return operand.negate ? 1 - rate : rate;
+  }
+
+  // stable sort by key of the items that aren't fixed, into the positions they occupy
+  template <class T>
+  static void sortAround(std::vector<T>& items, const std::vector<double>& keys, const std::vector<bool>& fixed) {
+    std::vector<size_t> positions;
+    for (size_t i = 0; i < items.size(); i++) {
+      if (!fixed[i]) {
+        positions.push_back(i);
+      }
+    }
+    std::vector<size_t> order = positions;
+    std::stable_sort(order.begin(), order.end(), [&keys](size_t a, size_t b) { return keys[a] < keys[b]; });
+    std::vector<T> sorted = items;
+    for (size_t i = 0; i < positions.size(); i++) {
+      sorted[positions[i]] = items[order[i]];
+    }
+    items = std::move(sorted);
+  }
+
+  void setKey(const DynamicFunctionProcessorSharedPtr& key, const InlineHeaderHandle* inline_header, Program::Rule& rule) {
+    program_.arguments_.push_back(addFunction(key));
+    if (key->functionType() == Utility::FunctionType::Static) {
+      rule.header_name = addHeaderName(key->functionArgument());
+      rule.inline_header = inline_header;
+    }
+  }
+
+  uint32_t addBool(const SetBoolProcessorSharedPtr& bool_processor) {
+    const auto it = bools_.find(bool_processor.get());
+    if (it != bools_.end()) {
+      return it->second;
+    }
+    const Program::Bool bool_value{addFunction(bool_processor->sourceProcessor()),
+                                   addFunction(bool_processor->stringToCompareProcessor()),
+                                   bool_processor->matchType(),
+                                   bool_processor->sourceProcessor()->mayFail() ||
+                                       bool_processor->stringToCompareProcessor()->mayFail(),
+                                   bool_processor->valueSlot()};
+    const uint32_t index = program_.bools_.size();
+    program_.bools_.push_back(bool_value);
+    bools_.emplace(bool_processor.get(), index);
+    const uint32_t source_errors = possibleErrors(*bool_processor->sourceProcessor(), bool_value.source);
+    const uint32_t compare_errors = possibleErrors(*bool_processor->stringToCompareProcessor(), bool_value.compare);
+    function_errors_.emplace(bool_value.source, source_errors);
+    function_errors_.emplace(bool_value.compare, compare_errors);
+    bool_errors_.push_back(source_errors | compare_errors);
+    return index;
+  }
+
+  // ExecutionErrors that a function can fail with, one bit each
+  uint32_t possibleErrors(const DynamicFunctionProcessor& function_processor, uint32_t function_index) const {
+    const Program::Function& function = program_.functions_[function_index];
+    switch (function.type) {
+      case Utility::FunctionType::Static:
+        return 0;
+      case Utility::FunctionType::GetHdr:
+        return errorBit(function.position_valid ? ExecutionError::HdrPositionOutOfRange
+                                                : ExecutionError::HdrPositionNotANumber);
+      case Utility::FunctionType::Urlp:
+        return function_processor.mayFailWithoutHeader() ? errorBit(ExecutionError::UrlpOnResponse) : 0;
+      case Utility::FunctionType::GetMetadata:
+        return errorBit(ExecutionError::StreamInfoMissing);
+      default:
+        return errorBit(ExecutionError::InvalidFunction);
+    }
+  }
+
+  static uint32_t errorBit(ExecutionError error) { return 1u << static_cast<uint32_t>(error); }
+
+  uint32_t addFunction(const DynamicFunctionProcessorSharedPtr& function_processor) {
+    const auto it = functions_.find(function_processor.get());
+    if (it != functions_.end()) {
+      return it->second;
+    }
+    Program::Function function{};
+    function.type = function_processor->functionType();
+    function.position_valid = true;
+    function.position = -1;
+    function.header_slot = function_processor->headerSlot();
+    function.value_slot = function_processor->valueSlot();
+    function.header_name = Program::NoIndex;
+    function.inline_header = function_processor->inlineHeader();
+
+    const std::string& argument = function_processor->functionArgument();
+    switch (function.type) {
+      case Utility::FunctionType::GetHdr:
+      {
+        const auto arguments = StringUtil::splitToken(argument, ",", false, true);
+        function.header_name = addHeaderName(arguments.at(0));
+        if (arguments.size() > 1) {
+          // a number, see DynamicFunctionProcessor::parseOperation; only a program file can carry
+          // a position that is not
+          function.position = std::stoi(std::string(arguments.at(1)));
+        }
+        break;
+      }
+      case Utility::FunctionType::Urlp:
+        function.argument = addString(StringUtil::splitToken(argument, ",", false, true).at(0));
+        break;
+      default: // static string or metadata key
+        function.argument = addString(argument);
+        break;
+    }
+
+    const uint32_t index = program_.functions_.size();
+    program_.functions_.push_back(function);
+    functions_.emplace(function_processor.get(), index);
+    return index;
+  }
+
+  uint32_t addHeaderName(absl::string_view name) {
+    Http::LowerCaseString header_name(name);
+    const auto it = header_names_.find(header_name.get());
+    if (it != header_names_.end()) {
+      return it->second;
+    }
+    const uint32_t index = program_.header_names_.size();
+    header_names_.emplace(header_name.get(), index);
+    program_.header_names_.push_back(std::move(header_name));
+    return index;
+  }
+
+  Program::StringRef addString(absl::string_view value) {
+    const Program::StringRef ref{static_cast<uint32_t>(program_.strings_.size()), static_cast<uint32_t>(value.size())};
+    program_.strings_.append(value.data(), value.size());
+    return ref;
+  }
+
+  static constexpr double MinRate = 0.01;
+
+  Program& program_;
+  const SetBoolProcessorMap& set_bool_processors_;
+  const BoolTrueRates* true_rates_;
+  absl::flat_hash_map<const DynamicFunctionProcessor*, uint32_t> functions_;
+  absl::flat_hash_map<const SetBoolProcessor*, uint32_t> bools_;
+  std::vector<uint32_t> bool_errors_; // possibleErrors of each bool, by bool index
+  absl::flat_hash_map<uint32_t, uint32_t> function_errors_; // possibleErrors of the functions of bools
+  absl::flat_hash_map<std::string, uint32_t> header_names_;
+};
+
+std::unique_ptr<const Program> Program::compile(const std::vector<HeaderProcessorUniquePtr>& header_processors,
+                                                const SetBoolProcessorMap& set_bool_processors,
+                                                const BoolTrueRates* true_rates, bool decision_dag) {
+  auto program = std::unique_ptr<Program>(new Program());
+  ProgramCompiler compiler(*program, set_bool_processors, true_rates);
+  for (const auto& processor : header_processors) {
+    compiler.addRule(*processor);
+  }
+  if (decision_dag) {
+    compiler.buildDecisionDag();
+  }
+  return program;
+}
+
+size_t Program::decidedRuleCount() const {
+  return std::count_if(rules_.begin(), rules_.end(), [](const Rule& rule) { return rule.decided; });
+}
+
+bool Program::sameConditionOrder(const Program& other) const {
+  return std::equal(operands_.begin(), operands_.end(), other.operands_.begin(), other.operands_.end(),
+                    [](const Operand& a, const Operand& b) {
+                      return a.bool_index == b.bool_index && a.negate == b.negate && a.last_in_group == b.last_in_group;
+                    });
+}
+
+size_t Program::byteSize() const {
+  size_t bytes = sizeof(Program) + rules_.capacity() * sizeof(Rule) + operands_.capacity() * sizeof(Operand) +
+                 bools_.capacity() * sizeof(Bool) + functions_.capacity() * sizeof(Function) +
+                 arguments_.capacity() * sizeof(uint32_t) + mutations_.capacity() * sizeof(Mutation) +
+                 rule_indices_.capacity() * sizeof(uint32_t) + dag_nodes_.capacity() * sizeof(DagNode) +
+                 dag_leaves_.capacity() * sizeof(DagLeaf) + dag_rules_.capacity() * sizeof(uint32_t) +
+                 dag_checked_functions_.capacity() * sizeof(uint32_t) +
+                 header_names_.capacity() * sizeof(Http::LowerCaseString) + strings_.capacity();
+  for (const auto& header_name : header_names_) {
+    bytes += header_name.get().capacity();
+  }
+  return bytes;
+}
+
+uint32_t Program::functionCost(uint32_t function_index) const {
+  const Function& function = functions_[function_index];
+  switch (function.type) {
+    case Utility::FunctionType::Static:
+      return 0;
+    case Utility::FunctionType::GetHdr:
+      // gathered slots and inline headers are direct lookups, other headers scan the header map
+      return (function.header_slot >= 0 || function.inline_header ? 1 : 4) + (function.position >= 0 ? 1 : 0);
+    case Utility::FunctionType::Urlp:
+      return 6; // parses the query string
+    case Utility::FunctionType::GetMetadata:
+      return 3;
+    default:
+      return 1;
+  }
+}
+
+uint32_t Program::boolCost(uint32_t bool_index) const {
+  const Bool& bool_value = bools_[bool_index];
+  return functionCost(bool_value.source) + functionCost(bool_value.compare) +
+         (bool_value.match_type == Utility::MatchType::Substr ? 2 : 1);
+}
+
+uint32_t Program::ruleCost(size_t rule_index) const {
+  const Rule& rule = rules_[rule_index];
+  uint32_t cost = 0;
+  for (uint32_t i = rule.first_operand; i < rule.first_operand + rule.operand_count; i++) {
+    cost += boolCost(operands_[i].bool_index);
+  }
+  if (rule.operation == Operation::ConstantBatch) {
+    return cost + 2 * rule.argument_count;
+  }
+  for (uint32_t i = rule.first_argument; i < rule.first_argument + rule.argument_count; i++) {
+    cost += functionCost(arguments_[i]);
+  }
+  return cost + 2; // the header map or metadata write
+}
+
+void Program::describeFunction(uint32_t function_index, std::string& out) const {
+  const Function& function = functions_[function_index];
+  switch (function.type) {
+    case Utility::FunctionType::Static:
+      absl::StrAppend(&out, "\"", string(function.argument), "\"");
+      return;
+    case Utility::FunctionType::GetHdr:
+      absl::StrAppend(&out, "hdr(", header_names_[function.header_name].get());
+      if (!function.position_valid) {
+        absl::StrAppend(&out, ",<not a number>");
+      } else if (function.position >= 0) {
+        absl::StrAppend(&out, ",", function.position);
+      }
+      absl::StrAppend(&out, ")");
+      if (function.header_slot >= 0) {
+        absl::StrAppend(&out, "[header slot ", function.header_slot, "]");
+      }
+      if (function.inline_header) {
+        absl::StrAppend(&out, "[inline]");
+      }
+      break;
+    case Utility::FunctionType::Urlp:
+      absl::StrAppend(&out, "urlp(", string(function.argument), ")");
+      break;
+    case Utility::FunctionType::GetMetadata:
+      absl::StrAppend(&out, "metadata(", string(function.argument), ")");
+      break;
+    default:
+      absl::StrAppend(&out, "<invalid function>");
+      break;
+  }
+  if (function.value_slot >= 0) {
+    absl::StrAppend(&out, "[value slot ", function.value_slot, "]");
+  }
+}
+
+void Program::describe(const std::function<void(uint32_t rule_index, std::string& out)>& describe_source,
+                       std::string& out) const {
+  static constexpr absl::string_view OperationNames[] = {"set-header", "append-header", "set-path", "set-metadata",
+                                                        "constant-batch"};
+  for (size_t i = 0; i < rules_.size(); i++) {
+    const Rule& rule = rules_[i];
+    absl::StrAppend(&out, "  ", i, ": ", OperationNames[static_cast<size_t>(rule.operation)]);
+    if (rule.operation == Operation::ConstantBatch) {
+      for (uint32_t m = rule.first_argument; m < rule.first_argument + rule.argument_count; m++) {
+        const Mutation& mutation = mutations_[m];
+        absl::StrAppend(&out, mutation.append ? " +" : " ", header_names_[mutation.header_name].get(), "=\"",
+                        string(mutation.value), "\"", mutation.inline_header ? "[inline]" : "");
+      }
+    } else {
+      for (uint32_t a = rule.first_argument; a < rule.first_argument + rule.argument_count; a++) {
+        absl::StrAppend(&out, " ");
+        describeFunction(arguments_[a], out);
+      }
+    }
+    if (rule.operand_count > 0) {
+      absl::StrAppend(&out, " if");
+      for (uint32_t o = rule.first_operand; o < rule.first_operand + rule.operand_count; o++) {
+        const Operand& operand = operands_[o];
+        absl::StrAppend(&out, operand.negate ? " not" : "", " bool", operand.bool_index);
+        if (o + 1 < rule.first_operand + rule.operand_count) {
+          absl::StrAppend(&out, operand.last_in_group ? " or" : " and");
+        }
+      }
+      if (rule.decided) {
+        absl::StrAppend(&out, " (decided by the dag)");
+      } else if (rule.skippable) {
+        absl::StrAppend(&out, " (skipped when its headers are absent)");
+      }
+    }
+    absl::StrAppend(&out, ", cost ", ruleCost(i), "\n");
+    for (uint32_t r = rule.first_rule_index; r < rule.first_rule_index + rule.rule_index_count; r++) {
+      absl::StrAppend(&out, "    ");
+      describe_source(rule_indices_[r], out);
+      absl::StrAppend(&out, "\n");
+    }
+  }
+  for (size_t i = 0; i < bools_.size(); i++) {
+    const Bool& bool_value = bools_[i];
+    absl::StrAppend(&out, "  bool", i, ": ");
+    describeFunction(bool_value.source, out);
+    absl::StrAppend(&out, " -m ", matchTypeName(bool_value.match_type));
+    if (bool_value.match_type != Utility::MatchType::Found) {
+      absl::StrAppend(&out, " ");
+      describeFunction(bool_value.compare, out);
+    }
+    if (bool_value.value_slot >= 0) {
+      absl::StrAppend(&out, " [value slot ", bool_value.value_slot, "]");
+    }
+    absl::StrAppend(&out, bool_value.may_fail ? ", may fail" : "", ", cost ", boolCost(i), "\n");
+  }
+  const auto describe_child = [](uint32_t id, std::string& out) {
+    absl::StrAppend(&out, (id & DagLeafBit) ? "leaf" : "node", id & ~DagLeafBit);
+  };
+  if (!dag_checked_functions_.empty()) {
+    absl::StrAppend(&out, "  dag checks");
+    for (const uint32_t function_index : dag_checked_functions_) {
+      absl::StrAppend(&out, " ");
+      describeFunction(function_index, out);
+    }
+    absl::StrAppend(&out, "\n");
+  }
+  for (size_t i = 0; i < dag_nodes_.size(); i++) {
+    const DagNode& node = dag_nodes_[i];
+    absl::StrAppend(&out, "  node", i, ": bool", node.bool_index, " ? ");
+    describe_child(node.if_true, out);
+    absl::StrAppend(&out, " : ");
+    describe_child(node.if_false, out);
+    absl::StrAppend(&out, "\n");
+  }
+  for (size_t i = 0; i < dag_leaves_.size(); i++) {
+    const DagLeaf& leaf = dag_leaves_[i];
+    absl::StrAppend(&out, "  leaf", i, ": true for");
+    for (uint32_t r = leaf.first_rule; r < leaf.first_rule + leaf.rule_count; r++) {
+      absl::StrAppend(&out, " ", dag_rules_[r]);
+    }
+    absl::StrAppend(&out, leaf.rule_count == 0 ? " none\n" : "\n");
+  }
+}
+
+void Program::serialize(ProgramWriter& out) const {
+  out.u32(rules_.size());
+  for (const Rule& rule : rules_) {
+    out.u8(static_cast<uint8_t>(rule.operation));
+    out.u8(rule.skippable);
+    out.u64(rule.dependency_headers);
+    out.u32(rule.first_operand);
+    out.u32(rule.operand_count);
+    out.u32(rule.first_argument);
+    out.u32(rule.argument_count);
+    out.u32(rule.header_name);
+    out.u8(rule.inline_header != nullptr);
+    out.u32(rule.first_rule_index);
+    out.u32(rule.rule_index_count);
+    out.u8(rule.decided);
+  }
+  out.u32(operands_.size());
+  for (const Operand& operand : operands_) {
+    out.u32(operand.bool_index);
+    out.u8(operand.negate);
+    out.u8(operand.last_in_group);
+  }
+  out.u32(bools_.size());
+  for (const Bool& bool_value : bools_) {
+    out.u32(bool_value.source);
+    out.u32(bool_value.compare);
+    out.u8(static_cast<uint8_t>(bool_value.match_type));
+    out.u8(bool_value.may_fail);
+    out.i32(bool_value.value_slot);
+  }
+  out.u32(functions_.size());
+  for (const Function& function : functions_) {
+    out.u8(static_cast<uint8_t>(function.type));
+    out.u8(function.position_valid);
+    out.i32(function.position);
+    out.i32(function.header_slot);
+    out.i32(function.value_slot);
+    out.u32(function.argument.offset);
+    out.u32(function.argument.size);
+    out.u32(function.header_name);
+    out.u8(function.inline_header != nullptr);
+  }
+  out.u32(mutations_.size());
+  for (const Mutation& mutation : mutations_) {
+    out.u32(mutation.header_name);
+    out.u32(mutation.value.offset);
+    out.u32(mutation.value.size);
+    out.u8(mutation.append);
+    out.u8(mutation.inline_header != nullptr);
+  }
+  out.u32(header_names_.size());
+  for (const Http::LowerCaseString& header_name : header_names_) {
+    out.string(header_name.get());
+  }
+  out.string(strings_);
+  out.u32(dag_root_);
+  out.u32(dag_nodes_.size());
+  for (const DagNode& node : dag_nodes_) {
+    out.u32(node.bool_index);
+    out.u32(node.if_false);
+    out.u32(node.if_true);
+  }
+  out.u32(dag_leaves_.size());
+  for (const DagLeaf& leaf : dag_leaves_) {
+    out.u32(leaf.first_rule);
+    out.u32(leaf.rule_count);
+  }
+  for (const std::vector<uint32_t>* indices : {&arguments_, &rule_indices_, &dag_rules_, &dag_checked_functions_}) {
+    out.u32(indices->size());
+    for (const uint32_t index : *indices) {
+      out.u32(index);
+    }
+  }
+}
+
+absl::Status Program::deserialize(ProgramReader& in, const InlineHeaderTable& inline_headers, bool is_request,
+                                  const Limits& limits, std::unique_ptr<const Program>& result) {
+  auto program = std::unique_ptr<Program>(new Program());
+  // whether each rule, function and mutation had an inline header, resolved once the names are read
+  std::vector<bool> rule_inline, function_inline, mutation_inline;
+
+  program->rules_.resize(in.count(39));
+  for (Rule& rule : program->rules_) {
+    rule.operation = static_cast<Operation>(in.u8());
+    rule.skippable = in.boolean();
+    rule.dependency_headers = in.u64();
+    rule.first_operand = in.u32();
+    rule.operand_count = in.u32();
+    rule.first_argument = in.u32();
+    rule.argument_count = in.u32();
+    rule.header_name = in.u32();
+    rule_inline.push_back(in.boolean());
+    rule.first_rule_index = in.u32();
+    rule.rule_index_count = in.u32();
+    rule.decided = in.boolean();
+  }
+  program->operands_.resize(in.count(6));
+  for (Operand& operand : program->operands_) {
+    operand.bool_index = in.u32();
+    operand.negate = in.boolean();
+    operand.last_in_group = in.boolean();
+  }
+  program->bools_.resize(in.count(14));
+  for (Bool& bool_value : program->bools_) {
+    bool_value.source = in.u32();
+    bool_value.compare = in.u32();
+    bool_value.match_type = static_cast<Utility::MatchType>(in.u8());
+    bool_value.may_fail = in.boolean();
+    bool_value.value_slot = in.i32();
+  }
+  program->functions_.resize(in.count(27));
+  for (Function& function : program->functions_) {
+    function.type = static_cast<Utility::FunctionType>(in.u8());
+    function.position_valid = in.boolean();
+    function.position = in.i32();
+    function.header_slot = in.i32();
+    function.value_slot = in.i32();
+    function.argument.offset = in.u32();
+    function.argument.size = in.u32();
+    function.header_name = in.u32();
+    function_inline.push_back(in.boolean());
+  }
+  program->mutations_.resize(in.count(14));
+  for (Mutation& mutation : program->mutations_) {
+    mutation.header_name = in.u32();
+    mutation.value.offset = in.u32();
+    mutation.value.size = in.u32();
+    mutation.append = in.boolean();
+    mutation_inline.push_back(in.boolean());
+  }
+  const uint32_t header_names = in.count(4);
+  for (uint32_t i = 0; i < header_names; i++) {
+    program->header_names_.emplace_back(std::string(in.string()));
+  }
+  program->strings_ = std::string(in.string());
+  program->dag_root_ = in.u32();
+  program->dag_nodes_.resize(in.count(12));
+  for (DagNode& node : program->dag_nodes_) {
+    node.bool_index = in.u32();
+    node.if_false = in.u32();
+    node.if_true = in.u32();
+  }
+  program->dag_leaves_.resize(in.count(8));
+  for (DagLeaf& leaf : program->dag_leaves_) {
+    leaf.first_rule = in.u32();
+    leaf.rule_count = in.u32();
+  }
+  for (std::vector<uint32_t>* indices : {&program->arguments_, &program->rule_indices_, &program->dag_rules_,
+                                         &program->dag_checked_functions_}) {
+    indices->resize(in.count(4));
+    for (uint32_t& index : *indices) {
+      index = in.u32();
+    }
+  }
+  if (!in.ok()) {
+    return absl::InvalidArgumentError("truncated program");
+  }
+
+  const auto within = [](uint64_t first, uint64_t count, size_t size) { return first + count <= size; };
+  const auto slot = [](int32_t slot, size_t slots) {
+    return slot == HeaderSlotTable::NoSlot || (slot >= 0 && static_cast<size_t>(slot) < slots);
+  };
+  const auto string = [&program, &within](StringRef ref) {
+    return within(ref.offset, ref.size, program->strings_.size());
+  };
+  const auto inline_header = [&program, &inline_headers, is_request](uint32_t header_name, bool has_inline,
+                                                                     const InlineHeaderHandle*& handle) {
+    handle = has_inline ? inline_headers.find(program->header_names_[header_name].get(), is_request) : nullptr;
+    return !has_inline || handle != nullptr;
+  };
+  const size_t names = program->header_names_.size();
+  // arguments read by each operation: the key and value, or the path
+  static constexpr uint32_t MinArguments[] = {2, 1, 1, 2, 0};
+
+  for (size_t r = 0; r < program->rules_.size(); r++) {
+    Rule& rule = program->rules_[r];
+    const bool batch = rule.operation == Operation::ConstantBatch;
+    if (static_cast<uint8_t>(rule.operation) > static_cast<uint8_t>(Operation::ConstantBatch) ||
+        rule.argument_count < MinArguments[static_cast<uint8_t>(rule.operation)] ||
+        !within(rule.first_operand, rule.operand_count, program->operands_.size()) ||
+        !within(rule.first_argument, rule.argument_count,
+                batch ? program->mutations_.size() : program->arguments_.size()) ||
+        !within(rule.first_rule_index, rule.rule_index_count, program->rule_indices_.size()) ||
+        (rule.header_name != NoIndex && rule.header_name >= names) ||
+        (rule_inline[r] && (rule.header_name == NoIndex || !inline_header(rule.header_name, true, rule.inline_header)))) {
+      return absl::InvalidArgumentError(absl::StrCat("invalid rule ", r));
+    }
+    // executing it would take the response headers for request headers
+    if (rule.operation == Operation::SetPath && !is_request) {
+      return absl::InvalidArgumentError(absl::StrCat("rule ", r, " sets the path in a response program"));
+    }
+  }
+  for (const Operand& operand : program->operands_) {
+    if (operand.bool_index >= program->bools_.size()) {
+      return absl::InvalidArgumentError("invalid condition operand");
+    }
+  }
+  for (const Bool& bool_value : program->bools_) {
+    if (bool_value.source >= program->functions_.size() || bool_value.compare >= program->functions_.size() ||
+        static_cast<uint8_t>(bool_value.match_type) >= static_cast<uint8_t>(Utility::MatchType::InvalidMatchType) ||
+        !slot(bool_value.value_slot, limits.value_slots)) {
+      return absl::InvalidArgumentError("invalid bool");
+    }
+  }
+  for (size_t f = 0; f < program->functions_.size(); f++) {
+    Function& function = program->functions_[f];
+    const bool hdr = function.type == Utility::FunctionType::GetHdr;
+    if (static_cast<uint8_t>(function.type) >= static_cast<uint8_t>(Utility::FunctionType::InvalidFunctionType) ||
+        !string(function.argument) || (hdr && function.header_name >= names) ||
+        !slot(function.header_slot, limits.header_slots) || !slot(function.value_slot, limits.value_slots) ||
+        (function_inline[f] && (!hdr || !inline_header(function.header_name, true, function.inline_header)))) {
+      return absl::InvalidArgumentError(absl::StrCat("invalid function ", f));
+    }
+  }
+  for (size_t m = 0; m < program->mutations_.size(); m++) {
+    Mutation& mutation = program->mutations_[m];
+    if (mutation.header_name >= names || !string(mutation.value) ||
+        !inline_header(mutation.header_name, mutation_inline[m], mutation.inline_header)) {
+      return absl::InvalidArgumentError(absl::StrCat("invalid mutation ", m));
+    }
+  }
+  for (const uint32_t argument : program->arguments_) {
+    if (argument >= program->functions_.size()) {
+      return absl::InvalidArgumentError("invalid rule argument");
+    }
+  }
+  for (const uint32_t rule_index : program->rule_indices_) {
+    if (rule_index >= limits.source_rules) {
+      return absl::InvalidArgumentError("invalid source rule");
+    }
+  }
+
+  // the root is the first node and children come after their parent, so that walking the DAG
+  // always reaches a leaf
+  const auto child = [&program](uint32_t parent, uint32_t id) {
+    return (id & DagLeafBit) ? (id & ~DagLeafBit) < program->dag_leaves_.size()
+                             : id > parent && id < program->dag_nodes_.size();
+  };
+  const uint32_t root = program->dag_root_;
+  if (root != NoIndex && !(root == 0 ? !program->dag_nodes_.empty() : child(0, root) && (root & DagLeafBit))) {
+    return absl::InvalidArgumentError("invalid decision dag root");
+  }
+  for (uint32_t n = 0; n < program->dag_nodes_.size(); n++) {
+    const DagNode& node = program->dag_nodes_[n];
+    if (node.bool_index >= program->bools_.size() || !child(n, node.if_false) || !child(n, node.if_true)) {
+      return absl::InvalidArgumentError("invalid decision dag node");
+    }
+  }
+  for (const DagLeaf& leaf : program->dag_leaves_) {
+    if (!within(leaf.first_rule, leaf.rule_count, program->dag_rules_.size()) ||
+        !std::is_sorted(program->dag_rules_.begin() + leaf.first_rule,
+                        program->dag_rules_.begin() + leaf.first_rule + leaf.rule_count)) {
+      return absl::InvalidArgumentError("invalid decision dag leaf");
+    }
+  }
+  for (const uint32_t rule : program->dag_rules_) {
+    if (rule >= program->rules_.size()) {
+      return absl::InvalidArgumentError("invalid decision dag rule");
+    }
+  }
+  for (const uint32_t function_index : program->dag_checked_functions_) {
+    if (function_index >= program->functions_.size()) {
+      return absl::InvalidArgumentError("invalid decision dag check");
+    }
+  }
+
+  result = std::move(program);
+  return absl::OkStatus();
+}
+
+ExecutionError Program::execute(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo,
+                                ExecutionContext& context) const {
+  // decided rules whose conditions are true, consumed in rule order
+  const uint32_t* next_true = nullptr;
+  const uint32_t* last_true = nullptr;
+  const bool decided = dag_root_ != NoIndex && walkDecisionDag(headers, streamInfo, context, next_true, last_true);
+  for (const Rule& rule : rules_) {
+    countRule(rule, RuleEvaluated, context);
+    bool condition = false;
+    ExecutionError error = ExecutionError::None;
+    if (decided && rule.decided) {
+      condition = next_true != last_true && *next_true == static_cast<uint32_t>(&rule - rules_.data());
+      next_true += condition ? 1 : 0;
+    } else {
+      error = evaluateCondition(rule, headers, streamInfo, context, condition);
+    }
+    if (error != ExecutionError::None) {
+      countRule(rule, RuleFailed, context);
+      return error;
+    }
+    if (rule.operand_count > 0) {
+      countRule(rule, condition ? RuleConditionTrue : RuleConditionFalse, context);
+    }
+    if (!condition) {
+      continue; // do nothing if the condition is false
+    }
+
+    switch (rule.operation) {
+      case Operation::SetHeader:
+        error = setHeader(rule, headers, streamInfo, context);
+        break;
+      case Operation::AppendHeader:
+        error = appendHeader(rule, headers, streamInfo, context);
+        break;
+      case Operation::SetPath:
+        error = setPath(rule, headers, streamInfo, context);
+        break;
+      case Operation::SetMetadata:
+        error = setMetadata(rule, headers, streamInfo, context);
+        break;
+      case Operation::ConstantBatch:
+        applyConstantBatch(rule, headers, context);
+        break;
+    }
+    if (error != ExecutionError::None) {
+      countRule(rule, RuleFailed, context);
+      return error;
+    }
+    countRule(rule, RuleApplied, context);
+  }
+  return ExecutionError::None;
+}
+
+void Program::countRule(const Rule& rule, RuleOutcome outcome, ExecutionContext& context) const {
+  if (!context.countingRules()) {
+    return;
+  }
+  for (uint32_t i = rule.first_rule_index; i < rule.first_rule_index + rule.rule_index_count; i++) {
+    context.countRule(rule_indices_[i], outcome);
+  }
+}
+
+bool Program::walkDecisionDag(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo,
+                              ExecutionContext& context, const uint32_t*& first_true, const uint32_t*& last_true) const {
+  for (const uint32_t function_index : dag_checked_functions_) {
+    absl::string_view value;
+    if (evaluateFunction(function_index, headers, streamInfo, context, context.scratch(SourceBuffer), value) !=
+        ExecutionError::None) {
+      return false;
+    }
+  }
+  uint32_t id = dag_root_;
+  while (!(id & DagLeafBit)) {
+    const DagNode& node = dag_nodes_[id];
+    bool value = false;
+    if (evaluateBool(node.bool_index, headers, streamInfo, context, value) != ExecutionError::None) {
+      return false;
+    }
+    if (context.countingBools()) {
+      context.countBool(node.bool_index, value);
+    }
+    id = value ? node.if_true : node.if_false;
+  }
+  const DagLeaf& leaf = dag_leaves_[id & ~DagLeafBit];
+  first_true = dag_rules_.data() + leaf.first_rule;
+  last_true = first_true + leaf.rule_count;
+  return true;
+}
+
+ExecutionError Program::evaluateFunction(uint32_t function_index, Http::RequestOrResponseHeaderMap& headers,
+                                         Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext& context,
+                                         std::string& buffer, absl::string_view& value) const {
+  const Function& function = functions_[function_index];
+  ExecutionContext::CachedValue* cached_value = context.cachedValue(function.value_slot);
+  if (!cached_value) {
+    return computeFunction(function, headers, streamInfo, context, buffer, value);
+  }
+
+  // shared function, reuse its value until its input is written
+  if (!context.isFresh(*cached_value, inputWrittenAt(function, context))) {
+    absl::string_view computed;
+    const ExecutionError error = computeFunction(function, headers, streamInfo, context, buffer, computed);
+    cached_value->value.assign(computed.data(), computed.size());
+    context.store(*cached_value, error);
+  }
+  value = cached_value->value;
+  return cached_value->error;
+}
+
+ExecutionError Program::computeFunction(const Function& function, Http::RequestOrResponseHeaderMap& headers,
+                                        Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext& context,
+                                        std::string& buffer, absl::string_view& value) const {
+  value = absl::string_view();
+  switch (function.type) {
+    case Utility::FunctionType::Static:
+      value = string(function.argument);
+      return ExecutionError::None;
+    case Utility::FunctionType::GetHdr:
+    {
+      if (!function.position_valid) {
+        return ExecutionError::HdrPositionNotANumber;
+      }
+      absl::optional<absl::string_view> header_value;
+      if (function.inline_header) {
+        const Http::HeaderEntry* entry = function.inline_header->get(headers);
+        if (entry) {
+          header_value = entry->value().getStringView();
+        }
+      } else if (function.header_slot != HeaderSlotTable::NoSlot) {
+        header_value = context.headerSlots().get(function.header_slot);
+      } else {
+        header_value = joinedHeaderValue(headers, header_names_[function.header_name], buffer);
+      }
+      if (!header_value.has_value()) { // header does not exist
+        return ExecutionError::None;
+      }
+      return valueAtPosition(header_value.value(), function.position, value);
+    }
+    case Utility::FunctionType::Urlp:
+      return queryParameter(headers, string(function.argument), buffer, value);
+    case Utility::FunctionType::GetMetadata:
+      return dynamicMetadataValue(streamInfo, string(function.argument), buffer, value);
+    default:
+      return ExecutionError::InvalidFunction;
+  }
+}
+
+ExecutionError Program::materializeFunction(uint32_t function_index, Http::RequestOrResponseHeaderMap& headers,
+                                            Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext& context,
+                                            std::string& buffer) const {
+  absl::string_view value;
+  const ExecutionError error = evaluateFunction(function_index, headers, streamInfo, context, buffer, value);
+  assignTo(buffer, value);
+  return error;
+}
+
+uint64_t Program::inputWrittenAt(const Function& function, ExecutionContext& context) const {
+  switch (function.type) {
+    case Utility::FunctionType::GetHdr:
+      return function.header_slot != HeaderSlotTable::NoSlot ? context.headerSlots().slotWrittenAt(function.header_slot)
+                                                             : context.headerSlots().unslottedWrittenAt();
+    case Utility::FunctionType::Urlp:
+      return context.headerSlots().pathWrittenAt();
+    case Utility::FunctionType::GetMetadata:
+      return context.metadataWrittenAt();
+    default:
+      return 0;
+  }
+}
+
+ExecutionError Program::evaluateBool(uint32_t bool_index, Http::RequestOrResponseHeaderMap& headers,
+                                     Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext& context, bool& result) const {
+  const Bool& bool_value = bools_[bool_index];
+  ExecutionContext::CachedValue* cached_value = context.cachedValue(bool_value.value_slot);
+  if (!cached_value) {
+    return computeBool(bool_value, headers, streamInfo, context, result);
+  }
+
+  // shared bool, reuse its result until one of its inputs is written
+  const uint64_t input_written_at = std::max(inputWrittenAt(functions_[bool_value.source], context),
+                                             inputWrittenAt(functions_[bool_value.compare], context));
+  if (!context.isFresh(*cached_value, input_written_at)) {
+    bool computed = false;
+    const ExecutionError error = computeBool(bool_value, headers, streamInfo, context, computed);
+    context.store(*cached_value, error);
+    cached_value->bool_value = computed;
+  }
+  result = cached_value->error == ExecutionError::None && cached_value->bool_value;
+  return cached_value->error;
+}
+
+ExecutionError Program::computeBool(const Bool& bool_value, Http::RequestOrResponseHeaderMap& headers,
+                                    Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext& context, bool& result) const {
+  result = false;
+  absl::string_view source;
+  const ExecutionError source_error =
+      evaluateFunction(bool_value.source, headers, streamInfo, context, context.scratch(SourceBuffer), source);
+  if (source_error != ExecutionError::None) {
+    return source_error;
+  }
+  absl::string_view string_to_compare;
+  const ExecutionError string_to_compare_error =
+      evaluateFunction(bool_value.compare, headers, streamInfo, context, context.scratch(CompareBuffer), string_to_compare);
+  if (string_to_compare_error != ExecutionError::None) {
+    return string_to_compare_error;
+  }
+
+  // every matcher requires a non-empty source, see SetBoolProcessor::parseOperation
+  if (source.empty()) {
+    return ExecutionError::None;
+  }
+  switch (bool_value.match_type) {
+    case Utility::MatchType::Exact:
+      result = source == string_to_compare;
+      break;
+    case Utility::MatchType::Prefix:
+      result = absl::StartsWith(source, string_to_compare);
+      break;
+    case Utility::MatchType::Substr:
+      result = absl::StrContains(source, string_to_compare);
+      break;
+    case Utility::MatchType::Found:
+      result = true;
+      break;
+    default:
+      break;
+  }
+  return ExecutionError::None;
+}
+
+ExecutionError Program::evaluateCondition(const Rule& rule, Http::RequestOrResponseHeaderMap& headers,
+                                          Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext& context, bool& result) const {
+  if (rule.operand_count == 0) {
+    result = true; // no condition present
+    return ExecutionError::None;
+  }
+  // skip evaluation when the headers the condition needs are absent
+  if (rule.skippable && context.headerSlots().presence().noneOf(rule.dependency_headers)) {
+    result = false;
+    return ExecutionError::None;
+  }
+
+  // OR of AND groups; once the result is known only the operands that can fail are evaluated
+  bool condition = false;
+  bool group = true;
+  for (uint32_t i = rule.first_operand; i < rule.first_operand + rule.operand_count; i++) {
+    const Operand& operand = operands_[i];
+    const bool needed = !condition && group;
+    if (needed || bools_[operand.bool_index].may_fail) {
+      bool value = false;
+      const ExecutionError error = evaluateBool(operand.bool_index, headers, streamInfo, context, value);
+      if (error != ExecutionError::None) {
+        return error;
+      }
+      if (context.countingBools()) {
+        context.countBool(operand.bool_index, value);
+      }
+      if (needed) {
+        group = operand.negate ? !value : value;
+      }
+    }
+    if (operand.last_in_group) {
+      condition = condition || group;
+      group = true;
+    }
+  }
+  result = condition;
+  return ExecutionError::None;
+}
+
+ExecutionError Program::setHeader(const Rule& rule, Http::RequestOrResponseHeaderMap& headers,
+                                  Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext& context) const {
+  std::string& key = context.scratch(KeyBuffer);
+  if (rule.header_name == NoIndex) {
+    const ExecutionError key_error = materializeFunction(arguments_[rule.first_argument], headers, streamInfo, context, key);
+    if (key_error != ExecutionError::None) {
+      return key_error;
+    }
+  }
+  std::string& value = context.scratch(ValueBuffer);
+  const ExecutionError value_error = materializeFunction(arguments_[rule.first_argument + 1], headers, streamInfo, context, value);
+  if (value_error != ExecutionError::None) {
+    return value_error;
+  }
+
+  if (rule.header_name == NoIndex) {
+    setHeaderValue(headers, context, Http::LowerCaseString(key), value, nullptr);
+    return ExecutionError::None;
+  }
+  setHeaderValue(headers, context, header_names_[rule.header_name], value, rule.inline_header);
+  return ExecutionError::None;
+}
+
+ExecutionError Program::appendHeader(const Rule& rule, Http::RequestOrResponseHeaderMap& headers,
+                                     Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext& context) const {
+  absl::optional<Http::LowerCaseString> dynamic_key;
+  if (rule.header_name == NoIndex) {
+    std::string& key = context.scratch(KeyBuffer);
+    const ExecutionError key_error = materializeFunction(arguments_[rule.first_argument], headers, streamInfo, context, key);
+    if (key_error != ExecutionError::None) {
+      return key_error;
+    }
+    dynamic_key.emplace(key);
+  }
+  const Http::LowerCaseString& header_key = dynamic_key.has_value() ? dynamic_key.value() : header_names_[rule.header_name];
+
+  std::string& value = context.scratch(ValueBuffer);
+  for (uint32_t i = rule.first_argument + 1; i < rule.first_argument + rule.argument_count; i++) {
+    const ExecutionError value_error = materializeFunction(arguments_[i], headers, streamInfo, context, value);
+    if (value_error != ExecutionError::None) {
+      return value_error;
+    }
+    appendHeaderValue(headers, context, header_key, value, rule.inline_header);
+  }
+  return ExecutionError::None;
+}
+
+ExecutionError Program::setPath(const Rule& rule, Http::RequestOrResponseHeaderMap& headers,
+                                Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext& context) const {
+  // like SetPathProcessor, a path that fails to evaluate is set as an empty path
+  std::string& new_path = context.scratch(ValueBuffer);
+  materializeFunction(arguments_[rule.first_argument], headers, streamInfo, context, new_path);
+  setPathKeepingQuery(headers, context, new_path);
+  return ExecutionError::None;
+}
+
+ExecutionError Program::setMetadata(const Rule& rule, Http::RequestOrResponseHeaderMap& headers,
+                                    Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext& context) const {
+  // get key and value to set
+  std::string& key = context.scratch(KeyBuffer);
+  const ExecutionError key_error = materializeFunction(arguments_[rule.first_argument], headers, streamInfo, context, key);
+  if (key_error != ExecutionError::None) {
+    return key_error;
+  }
+  if (key.empty()) {
+    return ExecutionError::MetadataKeyEmpty;
+  }
+  std::string& value = context.scratch(ValueBuffer);
+  const ExecutionError value_error = materializeFunction(arguments_[rule.first_argument + 1], headers, streamInfo, context, value);
+  if (value_error != ExecutionError::None) {
+    return value_error;
+  }
+  if (value.empty()) {
+    return ExecutionError::MetadataValueEmpty;
+  }
+  return setDynamicMetadata(streamInfo, context, key, value);
+}
+
+void Program::applyConstantBatch(const Rule& rule, Http::RequestOrResponseHeaderMap& headers, ExecutionContext& context) const {
+  for (uint32_t i = rule.first_argument; i < rule.first_argument + rule.argument_count; i++) {
+    const Mutation& mutation = mutations_[i];
+    if (mutation.append) {
+      appendHeaderValue(headers, context, header_names_[mutation.header_name], string(mutation.value),
+                        mutation.inline_header);
+    } else {
+      setHeaderValue(headers, context, header_names_[mutation.header_name], string(mutation.value),
+                     mutation.inline_header);
+    }
+  }
+}
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
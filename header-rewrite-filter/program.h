@@ -0,0 +1,230 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "header_processor.h"
+#include "inline_headers.h"
+#include "program_io.h"
+#include "rule_optimizer.h"
+
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+// Observed share of the evaluations of each bool of a program that were true, by bool index.
+using BoolTrueRates = std::vector<double>;
+
+// One direction's rules compiled into flat arrays: rules, condition operands, bools, functions and
+// arguments are plain structs referring to each other by index, and every string literal lives in
+// one pool. Executing a phase walks the rule array with a switch on the operation, without virtual
+// calls, shared_ptr copies or map lookups.
+//
+// The program is compiled from the processors after the rule optimizer and header slot assignment
+// have run, and produces the same header maps and metadata as executing those processors with an
+// ExecutionContext, and fails at the same rule. A condition stops evaluating once its result is
+// known, except for the operands that can fail, which are still evaluated so that their errors
+// abort the phase as before; operands are reordered around these, see compile(). Errors are
+// returned as ExecutionError codes: the runtime never throws and doesn't allocate to fail.
+class Program {
+public:
+  // The operands of conditions are ordered by estimated cost, and by true_rates if given, see
+  // ProgramCompiler::orderOperands. Bool indices only depend on the rules, so the rates observed
+  // executing a program can be used to compile the same rules again.
+  //
+  // With decision_dag, the conditions of the rules whose bools no earlier rule can change are
+  // merged into one decision DAG over their bools, see DecisionDagBuilder. Executing a phase then
+  // evaluates each of these bools at most once, walking from the root to a leaf that lists the
+  // rules whose conditions are true, so that the cost of deciding these rules grows with the depth
+  // of the DAG rather than with their number.
+  static std::unique_ptr<const Program> compile(const std::vector<HeaderProcessorUniquePtr>& header_processors,
+                                                const SetBoolProcessorMap& set_bool_processors,
+                                                const BoolTrueRates* true_rates = nullptr, bool decision_dag = false);
+
+  // executes the rules of a phase, stopping at the first rule that fails; context.beginPhase must
+  // have been called for the header map
+  ExecutionError execute(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo,
+                         ExecutionContext& context) const;
+
+  size_t ruleCount() const { return rules_.size(); }
+  size_t boolCount() const { return bools_.size(); }
+  // rules whose condition is decided by the decision DAG, 0 without one
+  size_t decidedRuleCount() const;
+  // true if both programs evaluate their condition operands in the same order
+  bool sameConditionOrder(const Program& other) const;
+  // memory held by the program's arrays and strings
+  size_t byteSize() const;
+  // estimated cost of executing a rule, evaluating every operand of its condition and applying it,
+  // in rough units of a header slot lookup
+  uint32_t ruleCost(size_t rule_index) const;
+
+  // appends a human readable listing of the rules, bools and their slots; describe_source appends
+  // a line about one of the source rules a compiled rule was built from, by rule index
+  void describe(const std::function<void(uint32_t rule_index, std::string& out)>& describe_source,
+                std::string& out) const;
+
+  // sizes of what a program indexes outside of itself: the source rules its outcomes are counted
+  // for, and the header and value slots of its phase
+  struct Limits {
+    size_t source_rules;
+    size_t header_slots;
+    size_t value_slots;
+  };
+
+  // appends the program in the binary program format, see ProgramFile
+  void serialize(ProgramWriter& out) const;
+  // reads a program written by serialize, checking that every index in it is within the program or
+  // limits, so that a corrupt program is rejected rather than executed, and resolving its inline
+  // headers for the direction, which must be in inline_headers
+  static absl::Status deserialize(ProgramReader& in, const InlineHeaderTable& inline_headers, bool is_request,
+                                  const Limits& limits, std::unique_ptr<const Program>& program);
+
+private:
+  static constexpr uint32_t NoIndex = UINT32_MAX;
+  // tags a DagNode child that is an index in dag_leaves_ rather than in dag_nodes_
+  static constexpr uint32_t DagLeafBit = 0x80000000;
+
+  // indices of the ExecutionContext scratch buffers
+  enum Scratch : size_t { SourceBuffer = 0, CompareBuffer = 1, KeyBuffer = 2, ValueBuffer = 3 };
+
+  enum class Operation : uint8_t { SetHeader, AppendHeader, SetPath, SetMetadata, ConstantBatch };
+
+  // string in strings_
+  struct StringRef {
+    uint32_t offset;
+    uint32_t size;
+  };
+
+  struct Function {
+    Utility::FunctionType type;
+    bool position_valid; // hdr() position argument is a number
+    int32_t position; // hdr() position, -1 (last value) if not specified
+    int32_t header_slot;
+    int32_t value_slot;
+    StringRef argument; // static string, urlp() parameter or metadata key
+    uint32_t header_name; // hdr() header in header_names_
+    const InlineHeaderHandle* inline_header;
+  };
+
+  struct Bool {
+    uint32_t source; // in functions_
+    uint32_t compare;
+    Utility::MatchType match_type;
+    bool may_fail;
+    int32_t value_slot;
+  };
+
+  struct Operand {
+    uint32_t bool_index;
+    bool negate;
+    bool last_in_group; // followed by an 'or' or the end of the condition
+  };
+
+  struct Rule {
+    Operation operation;
+    bool skippable; // the condition is false while none of dependency_headers is present
+    uint64_t dependency_headers;
+    uint32_t first_operand; // in operands_, operand_count 0 if there is no condition
+    uint32_t operand_count;
+    uint32_t first_argument; // in arguments_, or in mutations_ for a constant batch
+    uint32_t argument_count;
+    uint32_t header_name; // static set-header/append-header key in header_names_
+    const InlineHeaderHandle* inline_header;
+    uint32_t first_rule_index; // in rule_indices_, the source rules that the rule's outcomes are counted for
+    uint32_t rule_index_count;
+    bool decided; // the condition's value comes from the decision DAG leaf of the phase
+  };
+
+  // test of a bool, un-negated
+  struct DagNode {
+    uint32_t bool_index;
+    uint32_t if_false; // index in dag_nodes_, or in dag_leaves_ with DagLeafBit
+    uint32_t if_true;
+  };
+
+  // decided rules whose conditions are true, ascending in dag_rules_
+  struct DagLeaf {
+    uint32_t first_rule;
+    uint32_t rule_count;
+  };
+
+  struct Mutation {
+    uint32_t header_name;
+    StringRef value;
+    bool append;
+    const InlineHeaderHandle* inline_header;
+  };
+
+  absl::string_view string(StringRef ref) const { return absl::string_view(strings_.data() + ref.offset, ref.size); }
+
+  uint32_t functionCost(uint32_t function_index) const;
+  uint32_t boolCost(uint32_t bool_index) const;
+  void describeFunction(uint32_t function_index, std::string& out) const;
+
+  ExecutionError evaluateFunction(uint32_t function_index, Http::RequestOrResponseHeaderMap& headers,
+                                  Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext& context,
+                                  std::string& buffer, absl::string_view& value) const;
+  ExecutionError computeFunction(const Function& function, Http::RequestOrResponseHeaderMap& headers,
+                                 Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext& context,
+                                 std::string& buffer, absl::string_view& value) const;
+  // like evaluateFunction, but leaves the value in buffer so that it may be written to the header map it was read from
+  ExecutionError materializeFunction(uint32_t function_index, Http::RequestOrResponseHeaderMap& headers,
+                                     Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext& context,
+                                     std::string& buffer) const;
+  uint64_t inputWrittenAt(const Function& function, ExecutionContext& context) const;
+  // result before negation
+  ExecutionError evaluateBool(uint32_t bool_index, Http::RequestOrResponseHeaderMap& headers,
+                              Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext& context, bool& result) const;
+  ExecutionError computeBool(const Bool& bool_value, Http::RequestOrResponseHeaderMap& headers,
+                             Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext& context, bool& result) const;
+  // counts an outcome for the source rules of a rule, if the phase counts rules
+  void countRule(const Rule& rule, RuleOutcome outcome, ExecutionContext& context) const;
+  // walks the decision DAG to the decided rules whose conditions are true; false if a function of
+  // their bools fails, in which case every condition is evaluated rule by rule so that the same
+  // rule returns the error
+  bool walkDecisionDag(Http::RequestOrResponseHeaderMap& headers, Envoy::StreamInfo::StreamInfo* streamInfo,
+                       ExecutionContext& context, const uint32_t*& first_true, const uint32_t*& last_true) const;
+  ExecutionError evaluateCondition(const Rule& rule, Http::RequestOrResponseHeaderMap& headers,
+                                   Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext& context, bool& result) const;
+
+  ExecutionError setHeader(const Rule& rule, Http::RequestOrResponseHeaderMap& headers,
+                           Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext& context) const;
+  ExecutionError appendHeader(const Rule& rule, Http::RequestOrResponseHeaderMap& headers,
+                              Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext& context) const;
+  ExecutionError setPath(const Rule& rule, Http::RequestOrResponseHeaderMap& headers,
+                         Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext& context) const;
+  ExecutionError setMetadata(const Rule& rule, Http::RequestOrResponseHeaderMap& headers,
+                             Envoy::StreamInfo::StreamInfo* streamInfo, ExecutionContext& context) const;
+  void applyConstantBatch(const Rule& rule, Http::RequestOrResponseHeaderMap& headers, ExecutionContext& context) const;
+
+  std::vector<Rule> rules_;
+  std::vector<Operand> operands_;
+  std::vector<Bool> bools_;
+  std::vector<Function> functions_;
+  std::vector<uint32_t> arguments_; // function indices of the rules' keys and values
+  std::vector<Mutation> mutations_;
+  std::vector<uint32_t> rule_indices_;
+  std::vector<Http::LowerCaseString> header_names_;
+  std::string strings_;
+  uint32_t dag_root_ = NoIndex; // in dag_nodes_ or dag_leaves_, NoIndex without a decision DAG
+  std::vector<DagNode> dag_nodes_;
+  std::vector<DagLeaf> dag_leaves_;
+  std::vector<uint32_t> dag_rules_; // rule indices in rules_
+  // functions of the decided rules' bools that can fail, evaluated before walking the DAG
+  std::vector<uint32_t> dag_checked_functions_;
+
+  friend class ProgramCompiler;
+  friend class ProgramCodegen;
+};
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
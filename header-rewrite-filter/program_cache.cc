@@ -0,0 +1,60 @@
+#include "program_cache.h"
+
+#include "source/common/common/hash.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+CompiledRulesSharedPtr ProgramCache::getOrCompile(const std::string& key,
+                                                  const std::function<CompiledRulesSharedPtr()>& compile) {
+  const uint64_t hash = HashUtil::xxHash64(key);
+  bool colliding = false;
+  {
+    absl::MutexLock lock(&mutex_);
+    const auto entry = entries_.find(hash);
+    if (entry != entries_.end()) {
+      // locked once: the last config using the rules may release them on another thread
+      CompiledRulesSharedPtr rules = entry->second.rules.lock();
+      if (rules == nullptr) {
+        entries_.erase(entry);
+      } else if (entry->second.key == key) {
+        return rules;
+      } else {
+        colliding = true;
+      }
+    }
+  }
+
+  CompiledRulesSharedPtr rules = compile();
+  if (colliding) {
+    return rules;
+  }
+  absl::MutexLock lock(&mutex_);
+  // the same rules may have been compiled meanwhile on another thread, share the first
+  const auto [entry, inserted] = entries_.try_emplace(hash, Entry{key, rules});
+  if (inserted) {
+    return rules;
+  }
+  CompiledRulesSharedPtr cached = entry->second.rules.lock();
+  if (cached == nullptr) {
+    entry->second = Entry{key, rules};
+    return rules;
+  }
+  return entry->second.key == key ? cached : rules;
+}
+
+size_t ProgramCache::size() const {
+  absl::MutexLock lock(&mutex_);
+  size_t size = 0;
+  for (const auto& entry : entries_) {
+    size += entry.second.rules.expired() ? 0 : 1;
+  }
+  return size;
+}
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
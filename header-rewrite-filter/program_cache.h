@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "header_processor.h"
+#include "header_slots.h"
+#include "inline_headers.h"
+#include "program.h"
+#include "rule_optimizer.h"
+
+#include "envoy/singleton/instance.h"
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/synchronization/mutex.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+using SetBoolProcessorSharedPtr = std::shared_ptr<SetBoolProcessor>;
+using SetBoolProcessorMapSharedPtr = std::shared_ptr<std::unordered_map<std::string, SetBoolProcessorSharedPtr>>;
+
+// Rules of a config, parsed, optimized and compiled from its text. Immutable once compiled, and
+// shared by every config with the same rules through the ProgramCache.
+struct CompiledRules {
+  InlineHeaderTableSharedPtr inline_headers;
+
+  // header processors
+  std::vector<HeaderProcessorUniquePtr> request_header_processors;
+  std::vector<HeaderProcessorUniquePtr> response_header_processors;
+
+  // set_bool processors
+  SetBoolProcessorMapSharedPtr request_set_bool_processors;
+  SetBoolProcessorMapSharedPtr response_set_bool_processors;
+
+  // headers read through hdr() (and the presence of all headers, if a rule can be skipped by it),
+  // gathered in one pass per phase
+  HeaderSlotTable request_header_slots;
+  HeaderSlotTable response_header_slots;
+
+  // values of functions and bools shared by several rules, cached per stream
+  size_t request_value_slots = 0;
+  size_t response_value_slots = 0;
+
+  // what the optimizer did to the rules, all zero for rules loaded from a program file
+  RuleOptimizer::Result request_optimization{};
+  RuleOptimizer::Result response_optimization{};
+
+  // positions in the config of the header rules, by rule index
+  std::vector<uint32_t> request_rule_positions;
+  std::vector<uint32_t> response_rule_positions;
+
+  // programs compiled from the processors above, with the operands ordered by cost
+  std::shared_ptr<const Program> request_program;
+  std::shared_ptr<const Program> response_program;
+};
+
+using CompiledRulesSharedPtr = std::shared_ptr<const CompiledRules>;
+
+// Compiled rules by content, shared through the singleton manager by the configs of every listener,
+// route and tenant of a server, so that configs with the same rules compile them once and share
+// one copy. Entries are held weakly: the rules are freed with the last config using them, and the
+// entry is dropped or replaced when the same rules are looked up again. Thread-safe, as the rules of a lazily compiled route are
+// compiled on the worker that first serves the route; compile runs without the lock held, so
+// compilations of different rules don't wait for each other.
+class ProgramCache : public Singleton::Instance {
+public:
+  // the rules whose content is key, compiled by compile unless a live config already uses them;
+  // compile may throw, and nothing is cached then
+  CompiledRulesSharedPtr getOrCompile(const std::string& key, const std::function<CompiledRulesSharedPtr()>& compile);
+  // number of compiled rules in use
+  size_t size() const;
+
+private:
+  struct Entry {
+    std::string key;
+    std::weak_ptr<const CompiledRules> rules;
+  };
+
+  mutable absl::Mutex mutex_;
+  // by hash of the key; a colliding key is compiled without being cached
+  absl::flat_hash_map<uint64_t, Entry> entries_ ABSL_GUARDED_BY(mutex_);
+};
+
+using ProgramCacheSharedPtr = std::shared_ptr<ProgramCache>;
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -0,0 +1,537 @@
+#include "program_codegen.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "absl/strings/ascii.h"
+#include "absl/strings/escaping.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "absl/strings/str_replace.h"
+#include "absl/strings/str_split.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+namespace {
+
+std::string literal(absl::string_view value) { return absl::StrCat("\"", absl::CEscape(value), "\""); }
+
+// comments quote the rules, whose literals may hold any byte
+void appendComment(std::string& out, absl::string_view indent, absl::string_view text) {
+  for (const absl::string_view line : absl::StrSplit(text, '\n', absl::SkipEmpty())) {
+    std::string printable(absl::StripAsciiWhitespace(line));
+    for (char& c : printable) {
+      c = absl::ascii_isprint(c) ? c : '?';
+    }
+    // a comment line ending with a backslash would continue on the next line
+    absl::StrAppend(&out, indent, "// ", printable, absl::EndsWith(printable, "\\") ? " ." : "", "\n");
+  }
+}
+
+absl::string_view matchTypeEnum(Utility::MatchType match_type) {
+  switch (match_type) {
+    case Utility::MatchType::Exact:
+      return "Utility::MatchType::Exact";
+    case Utility::MatchType::Prefix:
+      return "Utility::MatchType::Prefix";
+    case Utility::MatchType::Substr:
+      return "Utility::MatchType::Substr";
+    default:
+      return "Utility::MatchType::Found";
+  }
+}
+
+std::string literalList(const std::vector<std::string>& values) {
+  std::vector<std::string> literals;
+  for (const std::string& value : values) {
+    literals.push_back(literal(value));
+  }
+  return absl::StrCat("{", absl::StrJoin(literals, ", "), "}");
+}
+
+// statements that return the error of the call if it fails
+std::string returnOnError(absl::string_view call, absl::string_view indent) {
+  return absl::StrCat(indent, "error = ", call, ";\n", indent, "if (error != ExecutionError::None) {\n", indent,
+                      "  return error;\n", indent, "}\n");
+}
+
+} // namespace
+
+absl::Status ProgramCodegen::generate(const CompiledRules& rules, absl::string_view name, absl::string_view source,
+                                      std::string& out) {
+  if (name.empty() || !std::all_of(name.begin(), name.end(), [](char c) {
+        return absl::ascii_isalnum(c) || c == '_' || c == '-' || c == '.';
+      })) {
+    return absl::InvalidArgumentError(absl::StrCat("invalid compiled rules name \"", name, "\""));
+  }
+  if (rules.request_program->dag_root_ != Program::NoIndex || rules.response_program->dag_root_ != Program::NoIndex) {
+    return absl::InvalidArgumentError("generated code can't execute a decision DAG");
+  }
+
+  absl::StrAppend(&out, "// Generated by header_rewrite_codegen, do not edit.\n\n"
+                        "#include \"compiled_rules.h\"\n\n"
+                        "namespace Envoy {\n"
+                        "namespace Extensions {\n"
+                        "namespace HttpFilters {\n"
+                        "namespace HeaderRewriteFilter {\n"
+                        "namespace {\n");
+  ProgramCodegen request(*rules.request_program, rules.request_rule_positions, "request");
+  request.generateDirection(out);
+  ProgramCodegen response(*rules.response_program, rules.response_rule_positions, "response");
+  response.generateDirection(out);
+
+  // the source as one literal per line
+  const std::vector<absl::string_view> lines = absl::StrSplit(source, '\n');
+  std::vector<std::string> source_lines;
+  for (size_t i = 0; i < lines.size(); i++) {
+    if (i + 1 < lines.size()) {
+      source_lines.push_back(literal(absl::StrCat(lines[i], "\n")));
+    } else if (!lines[i].empty() || source_lines.empty()) {
+      source_lines.push_back(literal(lines[i]));
+    }
+  }
+  absl::StrAppend(&out, "\nclass Rules {\npublic:\n  static constexpr absl::string_view Name = ", literal(name),
+                  ";\n  static constexpr absl::string_view Source =\n      ",
+                  absl::StrJoin(source_lines, "\n      "), ";\n\n");
+  absl::StrAppend(&out, "  static CompiledDirection requestDirection() {\n    return ");
+  request.generateDirectionInfo(rules.request_header_slots, rules.request_value_slots, out);
+  absl::StrAppend(&out, ";\n  }\n  static CompiledDirection responseDirection() {\n    return ");
+  response.generateDirectionInfo(rules.response_header_slots, rules.response_value_slots, out);
+  absl::StrAppend(&out, ";\n  }\n\n"
+                        "  static ExecutionError request(CompiledPhase& phase) { return executeRequest(phase); }\n"
+                        "  static ExecutionError response(CompiledPhase& phase) { return executeResponse(phase); }\n"
+                        "};\n\n"
+                        "} // namespace\n\n"
+                        "static Registry::RegisterFactory<CompiledRulesFactoryImpl<Rules>, CompiledRulesFactory> register_;\n\n"
+                        "} // namespace HeaderRewriteFilter\n"
+                        "} // namespace HttpFilters\n"
+                        "} // namespace Extensions\n"
+                        "} // namespace Envoy\n");
+  return absl::OkStatus();
+}
+
+void ProgramCodegen::generateDirection(std::string& out) {
+  program_.describe(
+      [this](uint32_t source_rule, std::string& source) {
+        absl::StrAppend(&source, "from rule ", rule_positions_[source_rule]);
+      },
+      listing_);
+
+  // what the rules use: the generated declarations are all referenced
+  std::vector<bool> used_functions(program_.functions_.size(), false);
+  std::vector<bool> used_bools(program_.bools_.size(), false);
+  std::vector<bool> used_header_names(program_.header_names_.size(), false);
+  const auto use_function = [this, &used_functions, &used_header_names](uint32_t function_index) {
+    const Program::Function& function = program_.functions_[function_index];
+    used_functions[function_index] = function.type != Utility::FunctionType::Static;
+    if (function.type == Utility::FunctionType::GetHdr && function.position_valid && !function.inline_header &&
+        function.header_slot == HeaderSlotTable::NoSlot) {
+      used_header_names[function.header_name] = true;
+    }
+  };
+  for (const Program::Rule& rule : program_.rules_) {
+    for (uint32_t o = rule.first_operand; o < rule.first_operand + rule.operand_count; o++) {
+      const Program::Bool& bool_value = program_.bools_[program_.operands_[o].bool_index];
+      used_bools[program_.operands_[o].bool_index] = true;
+      use_function(bool_value.source);
+      use_function(bool_value.compare);
+    }
+    if (rule.operation == Program::Operation::ConstantBatch) {
+      for (uint32_t m = rule.first_argument; m < rule.first_argument + rule.argument_count; m++) {
+        used_header_names[program_.mutations_[m].header_name] = true;
+      }
+      continue;
+    }
+    if (rule.header_name != Program::NoIndex) {
+      used_header_names[rule.header_name] = true;
+    }
+    for (uint32_t a = rule.first_argument; a < rule.first_argument + rule.argument_count; a++) {
+      if (a > rule.first_argument || rule.header_name == Program::NoIndex ||
+          (rule.operation != Program::Operation::SetHeader && rule.operation != Program::Operation::AppendHeader)) {
+        use_function(program_.arguments_[a]);
+      }
+    }
+  }
+
+  absl::StrAppend(&out, "\n");
+  for (uint32_t n = 0; n < program_.header_names_.size(); n++) {
+    if (used_header_names[n]) {
+      absl::StrAppend(&out, "const Http::LowerCaseString ", headerName(n), "(",
+                      literal(program_.header_names_[n].get()), ");\n");
+    }
+  }
+  for (uint32_t f = 0; f < program_.functions_.size(); f++) {
+    if (used_functions[f]) {
+      generateFunction(f, out);
+    }
+  }
+  for (uint32_t b = 0; b < program_.bools_.size(); b++) {
+    if (used_bools[b]) {
+      generateBool(b, out);
+    }
+  }
+
+  const std::string execute = absl::StrCat("execute", absl::AsciiStrToUpper(prefix_.substr(0, 1)), prefix_.substr(1));
+  if (program_.rules_.empty()) {
+    absl::StrAppend(&out, "\nExecutionError ", execute, "(CompiledPhase&) { return ExecutionError::None; }\n");
+    return;
+  }
+  std::string body;
+  for (uint32_t r = 0; r < program_.rules_.size(); r++) {
+    generateRule(r, body);
+  }
+  absl::StrAppend(&out, "\nExecutionError ", execute, "(CompiledPhase& phase) {\n");
+  if (absl::StrContains(body, "error = ")) {
+    absl::StrAppend(&out, "  ExecutionError error = ExecutionError::None;\n");
+  }
+  absl::StrAppend(&out, body, "  return ExecutionError::None;\n}\n");
+}
+
+void ProgramCodegen::generateDirectionInfo(const HeaderSlotTable& header_slots, size_t value_slots,
+                                           std::string& out) const {
+  std::vector<std::string> names;
+  for (size_t slot = 0; slot < header_slots.size(); slot++) {
+    names.push_back(header_slots.name(slot));
+  }
+  absl::StrAppend(&out, "CompiledDirection{", literalList(names), ", ", header_slots.tracksPresence() ? "true" : "false",
+                  ", ", literalList(inline_headers_), ", ", value_slots, ", ", program_.rules_.size(), "}");
+}
+
+void ProgramCodegen::generateFunction(uint32_t function_index, std::string& out) {
+  const Program::Function& function = program_.functions_[function_index];
+  std::string description;
+  program_.describeFunction(function_index, description);
+  absl::StrAppend(&out, "\n");
+  appendComment(out, "", description);
+
+  // the statement computing the value into value_name, using buffer_name if it copies it
+  bool uses_buffer = true;
+  bool uses_phase = true;
+  std::string compute;
+  const bool cached = function.value_slot >= 0;
+  const absl::string_view buffer_name = cached ? "computed_buffer" : "buffer";
+  const absl::string_view value_name = cached ? "computed" : "value";
+  switch (function.type) {
+    case Utility::FunctionType::GetHdr:
+    {
+      if (!function.position_valid) {
+        uses_buffer = uses_phase = false;
+        compute = absl::StrCat(value_name, " = absl::string_view();\n  return ExecutionError::HdrPositionNotANumber;");
+        break;
+      }
+      std::string values;
+      if (function.inline_header) {
+        uses_buffer = false;
+        values = absl::StrCat("inlineHeaderValue(*", inlineHandle(function.header_name, function.inline_header),
+                              ", phase.headers)");
+      } else if (function.header_slot != HeaderSlotTable::NoSlot) {
+        uses_buffer = false;
+        values = absl::StrCat("phase.context.headerSlots().get(", function.header_slot, ")");
+      } else {
+        values = absl::StrCat("joinedHeaderValue(phase.headers, ", headerName(function.header_name), ", ",
+                              buffer_name, ")");
+      }
+      compute = absl::StrCat("return headerValueAt(", values, ", ", function.position, ", ", value_name, ");");
+      break;
+    }
+    case Utility::FunctionType::Urlp:
+      compute = absl::StrCat("return queryParameter(phase.headers, ", literal(program_.string(function.argument)),
+                             ", ", buffer_name, ", ", value_name, ");");
+      break;
+    case Utility::FunctionType::GetMetadata:
+      compute = absl::StrCat("return dynamicMetadataValue(phase.stream_info, ",
+                             literal(program_.string(function.argument)), ", ", buffer_name, ", ", value_name, ");");
+      break;
+    default:
+      uses_buffer = uses_phase = false;
+      compute = absl::StrCat(value_name, " = absl::string_view();\n  return ExecutionError::InvalidFunction;");
+      break;
+  }
+
+  if (!cached) {
+    absl::StrAppend(&out, "ExecutionError ", functionName(function_index), "(CompiledPhase&",
+                    uses_phase ? " phase" : "", ", std::string&", uses_buffer ? " buffer" : "",
+                    ", absl::string_view& value) {\n  ", compute, "\n}\n");
+    return;
+  }
+  // shared with other rules, reuse its value until its input is written
+  absl::StrAppend(&out, "ExecutionError ", functionName(function_index),
+                  "(CompiledPhase& phase, std::string& buffer, absl::string_view& value) {\n"
+                  "  return cachedValue(phase, ", function.value_slot, ", ", inputWrittenAt(function),
+                  ", buffer, value,\n"
+                  "                     [", uses_phase ? "&phase" : "", "](std::string&",
+                  uses_buffer ? " computed_buffer" : "", ", absl::string_view& computed) {\n    ",
+                  absl::StrReplaceAll(compute, {{"\n", "\n  "}}), "\n  });\n}\n");
+}
+
+void ProgramCodegen::generateBool(uint32_t bool_index, std::string& out) {
+  const Program::Bool& bool_value = program_.bools_[bool_index];
+  const Program::Function& source = program_.functions_[bool_value.source];
+  const Program::Function& compare = program_.functions_[bool_value.compare];
+  const bool cached = bool_value.value_slot >= 0;
+  const absl::string_view result = cached ? "computed" : "result";
+  const absl::string_view indent = cached ? "    " : "  ";
+
+  std::string body = absl::StrCat(indent, result, " = false;\n", indent, "absl::string_view source;\n");
+  evaluate(bool_value.source, "phase.context.scratch(0)", "source", indent, body);
+  std::string compare_value;
+  if (compare.type == Utility::FunctionType::Static) {
+    compare_value = literal(program_.string(compare.argument));
+  } else {
+    compare_value = "compare";
+    absl::StrAppend(&body, indent, "absl::string_view compare;\n");
+    evaluate(bool_value.compare, "phase.context.scratch(1)", "compare", indent, body);
+  }
+  absl::StrAppend(&body, indent, result, " = matches<", matchTypeEnum(bool_value.match_type), ">(source, ",
+                  compare_value, ");\n", indent, "return ExecutionError::None;\n");
+  if (absl::StrContains(body, "error = ")) {
+    body = absl::StrCat(indent, "ExecutionError error = ExecutionError::None;\n", body);
+  }
+  const bool uses_phase = absl::StrContains(body, "phase");
+
+  absl::StrAppend(&out, "\n");
+  appendComment(out, "", listingEntry(absl::StrCat("bool", bool_index)));
+  if (!cached) {
+    absl::StrAppend(&out, "ExecutionError ", boolName(bool_index), "(CompiledPhase&", uses_phase ? " phase" : "",
+                    ", bool& result) {\n", body, "}\n");
+    return;
+  }
+  // shared with other rules, reuse its result until one of its inputs is written
+  std::string written_at = inputWrittenAt(source);
+  const std::string compare_written_at = inputWrittenAt(compare);
+  if (written_at == "0") {
+    written_at = compare_written_at;
+  } else if (compare_written_at != "0" && compare_written_at != written_at) {
+    written_at = absl::StrCat("std::max(", written_at, ", ", compare_written_at, ")");
+  }
+  absl::StrAppend(&out, "ExecutionError ", boolName(bool_index), "(CompiledPhase& phase, bool& result) {\n",
+                  "  return cachedBool(phase, ", bool_value.value_slot, ", ", written_at, ", result, [",
+                  uses_phase ? "&phase" : "", "](bool& computed) {\n", body, "  });\n}\n");
+}
+
+void ProgramCodegen::generateRule(uint32_t rule_index, std::string& out) {
+  const Program::Rule& rule = program_.rules_[rule_index];
+  absl::StrAppend(&out, rule_index > 0 ? "\n" : "");
+  appendComment(out, "  ", listingEntry(absl::StrCat(rule_index)));
+  absl::StrAppend(&out, "  {\n");
+  if (rule.operand_count == 0) {
+    generateAction(rule, out);
+  } else {
+    generateCondition(rule, out);
+  }
+  absl::StrAppend(&out, "  }\n");
+}
+
+void ProgramCodegen::generateCondition(const Program::Rule& rule, std::string& out) {
+  absl::StrAppend(&out, "    bool condition = false;\n    bool group = true;\n    bool value = false;\n");
+  std::string indent = "    ";
+  if (rule.skippable) {
+    // skip evaluation when the headers the condition needs are absent
+    absl::StrAppend(&out, "    if (!phase.context.headerSlots().presence().noneOf(0x",
+                    absl::Hex(rule.dependency_headers, absl::kZeroPad16), "ULL)) {\n");
+    indent = "      ";
+  }
+  // OR of AND groups; once the result is known only the operands that can fail are evaluated
+  const uint32_t last = rule.first_operand + rule.operand_count - 1;
+  for (uint32_t o = rule.first_operand; o <= last; o++) {
+    const Program::Operand& operand = program_.operands_[o];
+    const std::string call = absl::StrCat(boolName(operand.bool_index), "(phase, value)");
+    const std::string assign = absl::StrCat("group = ", operand.negate ? "!value" : "value", ";\n");
+    if (o == rule.first_operand) {
+      absl::StrAppend(&out, returnOnError(call, indent), indent, assign);
+    } else if (program_.bools_[operand.bool_index].may_fail) {
+      absl::StrAppend(&out, returnOnError(call, indent), indent, "if (!condition && group) {\n", indent, "  ",
+                      assign, indent, "}\n");
+    } else {
+      absl::StrAppend(&out, indent, "if (!condition && group) {\n", returnOnError(call, absl::StrCat(indent, "  ")),
+                      indent, "  ", assign, indent, "}\n");
+    }
+    if (operand.last_in_group) {
+      absl::StrAppend(&out, indent, "condition = condition || group;\n");
+      if (o < last) {
+        absl::StrAppend(&out, indent, "group = true;\n");
+      }
+    }
+  }
+  if (rule.skippable) {
+    absl::StrAppend(&out, "    }\n");
+  }
+  absl::StrAppend(&out, "    if (condition) {\n");
+  std::string action;
+  generateAction(rule, action);
+  absl::StrAppend(&out, absl::StrReplaceAll(action, {{"\n    ", "\n      "}}).insert(0, "  "), "    }\n");
+}
+
+void ProgramCodegen::generateAction(const Program::Rule& rule, std::string& out) {
+  const absl::string_view indent = "    ";
+  const uint32_t first = rule.first_argument;
+  const auto static_value = [this](uint32_t function_index) -> absl::optional<std::string> {
+    const Program::Function& function = program_.functions_[function_index];
+    if (function.type != Utility::FunctionType::Static) {
+      return absl::nullopt;
+    }
+    return literal(program_.string(function.argument));
+  };
+
+  switch (rule.operation) {
+    case Program::Operation::SetHeader:
+    case Program::Operation::AppendHeader:
+    {
+      const bool set = rule.operation == Program::Operation::SetHeader;
+      std::string key;
+      if (rule.header_name == Program::NoIndex) {
+        absl::StrAppend(&out, indent, "std::string& key = phase.context.scratch(2);\n");
+        materialize(program_.arguments_[first], "key", indent, false, out);
+        if (set) {
+          key = "Http::LowerCaseString(key)";
+        } else {
+          absl::StrAppend(&out, indent, "const Http::LowerCaseString header_key(key);\n");
+          key = "header_key";
+        }
+      } else {
+        key = headerName(rule.header_name);
+      }
+      const std::string handle =
+          rule.header_name == Program::NoIndex ? "nullptr" : inlineHandle(rule.header_name, rule.inline_header);
+      bool declared_value = false;
+      for (uint32_t a = first + 1; a < first + rule.argument_count; a++) {
+        const absl::optional<std::string> literal_value = static_value(program_.arguments_[a]);
+        std::string value;
+        if (literal_value.has_value()) {
+          value = literal_value.value();
+        } else {
+          if (!declared_value) {
+            absl::StrAppend(&out, indent, "std::string& value_buffer = phase.context.scratch(3);\n");
+            declared_value = true;
+          }
+          materialize(program_.arguments_[a], "value_buffer", indent, false, out);
+          value = "value_buffer";
+        }
+        absl::StrAppend(&out, indent, set ? "setHeaderValue" : "appendHeaderValue", "(phase.headers, phase.context, ",
+                        key, ", ", value, ", ", handle, ");\n");
+      }
+      break;
+    }
+    case Program::Operation::SetPath:
+      // like SetPathProcessor, a path that fails to evaluate is set as an empty path
+      absl::StrAppend(&out, indent, "std::string& new_path = phase.context.scratch(3);\n");
+      materialize(program_.arguments_[first], "new_path", indent, true, out);
+      absl::StrAppend(&out, indent, "setPathKeepingQuery(phase.headers, phase.context, new_path);\n");
+      break;
+    case Program::Operation::SetMetadata:
+      absl::StrAppend(&out, indent, "std::string& key = phase.context.scratch(2);\n");
+      materialize(program_.arguments_[first], "key", indent, false, out);
+      absl::StrAppend(&out, indent, "if (key.empty()) {\n", indent, "  return ExecutionError::MetadataKeyEmpty;\n", indent,
+                      "}\n", indent, "std::string& value_buffer = phase.context.scratch(3);\n");
+      materialize(program_.arguments_[first + 1], "value_buffer", indent, false, out);
+      absl::StrAppend(&out, indent, "if (value_buffer.empty()) {\n", indent,
+                      "  return ExecutionError::MetadataValueEmpty;\n", indent, "}\n",
+                      returnOnError("setDynamicMetadata(phase.stream_info, phase.context, key, value_buffer)", indent));
+      break;
+    case Program::Operation::ConstantBatch:
+      for (uint32_t m = first; m < first + rule.argument_count; m++) {
+        const Program::Mutation& mutation = program_.mutations_[m];
+        absl::StrAppend(&out, indent, mutation.append ? "appendHeaderValue" : "setHeaderValue",
+                        "(phase.headers, phase.context, ", headerName(mutation.header_name), ", ",
+                        literal(program_.string(mutation.value)), ", ",
+                        inlineHandle(mutation.header_name, mutation.inline_header), ");\n");
+      }
+      break;
+  }
+}
+
+void ProgramCodegen::evaluate(uint32_t function_index, absl::string_view buffer, absl::string_view variable,
+                              absl::string_view indent, std::string& out) {
+  const Program::Function& function = program_.functions_[function_index];
+  if (function.type == Utility::FunctionType::Static) {
+    absl::StrAppend(&out, indent, variable, " = ", literal(program_.string(function.argument)), ";\n");
+    return;
+  }
+  absl::StrAppend(&out, returnOnError(absl::StrCat(functionName(function_index), "(phase, ", buffer, ", ", variable, ")"),
+                                      indent));
+}
+
+void ProgramCodegen::materialize(uint32_t function_index, absl::string_view buffer, absl::string_view indent,
+                                 bool ignore_error, std::string& out) {
+  const Program::Function& function = program_.functions_[function_index];
+  if (function.type == Utility::FunctionType::Static) {
+    absl::StrAppend(&out, indent, buffer, ".assign(", literal(program_.string(function.argument)), ");\n");
+    return;
+  }
+  const std::string call = absl::StrCat(functionName(function_index), "(phase, ", buffer, ", computed)");
+  absl::StrAppend(&out, indent, "{\n", indent, "  absl::string_view computed;\n");
+  if (ignore_error) {
+    absl::StrAppend(&out, indent, "  ", call, ";\n", indent, "  assignTo(", buffer, ", computed);\n");
+  } else {
+    absl::StrAppend(&out, indent, "  error = ", call, ";\n", indent, "  assignTo(", buffer, ", computed);\n", indent,
+                    "  if (error != ExecutionError::None) {\n", indent, "    return error;\n", indent, "  }\n");
+  }
+  absl::StrAppend(&out, indent, "}\n");
+}
+
+std::string ProgramCodegen::listingEntry(absl::string_view label) const {
+  const std::string first_line = absl::StrCat("  ", label, ": ");
+  std::string entry;
+  bool in_entry = false;
+  for (const absl::string_view line : absl::StrSplit(listing_, '\n', absl::SkipEmpty())) {
+    if (in_entry && !absl::StartsWith(line, "    ")) {
+      break;
+    }
+    if (in_entry) {
+      absl::StrAppend(&entry, line, "\n");
+    } else if (absl::StartsWith(line, first_line)) {
+      absl::StrAppend(&entry, line.substr(first_line.size()), "\n");
+      in_entry = true;
+    }
+  }
+  return entry;
+}
+
+std::string ProgramCodegen::inputWrittenAt(const Program::Function& function) const {
+  switch (function.type) {
+    case Utility::FunctionType::GetHdr:
+      return function.header_slot != HeaderSlotTable::NoSlot
+                 ? absl::StrCat("phase.context.headerSlots().slotWrittenAt(", function.header_slot, ")")
+                 : "phase.context.headerSlots().unslottedWrittenAt()";
+    case Utility::FunctionType::Urlp:
+      return "phase.context.headerSlots().pathWrittenAt()";
+    case Utility::FunctionType::GetMetadata:
+      return "phase.context.metadataWrittenAt()";
+    default:
+      return "0";
+  }
+}
+
+std::string ProgramCodegen::inlineHandle(uint32_t header_name, const InlineHeaderHandle* inline_header) {
+  if (!inline_header) {
+    return "nullptr";
+  }
+  const std::string& name = program_.header_names_[header_name].get();
+  const auto it = std::find(inline_headers_.begin(), inline_headers_.end(), name);
+  const size_t index = it - inline_headers_.begin();
+  if (it == inline_headers_.end()) {
+    inline_headers_.push_back(name);
+  }
+  return absl::StrCat("phase.inline_headers[", index, "]");
+}
+
+std::string ProgramCodegen::headerName(uint32_t header_name) const {
+  return absl::StrCat(prefix_, "Header", header_name);
+}
+
+std::string ProgramCodegen::functionName(uint32_t function_index) const {
+  return absl::StrCat(prefix_, "Function", function_index);
+}
+
+std::string ProgramCodegen::boolName(uint32_t bool_index) const {
+  return absl::StrCat(prefix_, "Bool", bool_index);
+}
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
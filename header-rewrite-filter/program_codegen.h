@@ -0,0 +1,71 @@
+#pragma once
+
+#include <string>
+
+#include "program.h"
+#include "program_cache.h"
+
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+// Generates the C++ of compiled rules for header_rewrite_codegen: a translation unit that
+// registers the rules under a name as a CompiledRulesFactory, see compiled_rules.h. Each direction
+// becomes one function executing the optimized program's rules in order, with a function per
+// dynamic function and bool of the program. Conditions are unrolled in the order of their operands,
+// evaluating the operands that can fail as Program::evaluateCondition does, so that the generated
+// code applies the same rules and fails at the same rule with the same error.
+class ProgramCodegen {
+public:
+  // rules must be compiled without a decision DAG; name may have letters, digits,
+  // '_', '-' and '.'
+  static absl::Status generate(const CompiledRules& rules, absl::string_view name, absl::string_view source,
+                               std::string& out);
+
+private:
+  ProgramCodegen(const Program& program, const std::vector<uint32_t>& rule_positions, absl::string_view prefix)
+      : program_(program), rule_positions_(rule_positions), prefix_(prefix) {}
+
+  // appends the declarations of a direction and the function executing its rules
+  void generateDirection(std::string& out);
+  // appends the CompiledDirection of the direction's requestDirection() or responseDirection()
+  void generateDirectionInfo(const HeaderSlotTable& header_slots, size_t value_slots, std::string& out) const;
+
+  void generateFunction(uint32_t function_index, std::string& out);
+  void generateBool(uint32_t bool_index, std::string& out);
+  void generateRule(uint32_t rule_index, std::string& out);
+  void generateCondition(const Program::Rule& rule, std::string& out);
+  void generateAction(const Program::Rule& rule, std::string& out);
+
+  // statements evaluating a function into a string_view variable, returning its error if it fails
+  void evaluate(uint32_t function_index, absl::string_view buffer, absl::string_view variable,
+                absl::string_view indent, std::string& out);
+  // statements evaluating a function into a std::string buffer, like Program::materializeFunction;
+  // returning its error if it fails unless ignore_error
+  void materialize(uint32_t function_index, absl::string_view buffer, absl::string_view indent, bool ignore_error,
+                   std::string& out);
+  // the lines of Program::describe about a rule or a bool, without their label
+  std::string listingEntry(absl::string_view label) const;
+  // expression of the write stamp of a function's input, see Program::inputWrittenAt
+  std::string inputWrittenAt(const Program::Function& function) const;
+  // expression of the inline handle of a header name, nullptr if not inline
+  std::string inlineHandle(uint32_t header_name, const InlineHeaderHandle* inline_header);
+  std::string headerName(uint32_t header_name) const;
+  std::string functionName(uint32_t function_index) const;
+  std::string boolName(uint32_t bool_index) const;
+
+  const Program& program_;
+  const std::vector<uint32_t>& rule_positions_;
+  const std::string prefix_;
+  std::string listing_; // Program::describe of the direction, commented in the generated code
+  std::vector<std::string> inline_headers_; // by phase.inline_headers index
+};
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
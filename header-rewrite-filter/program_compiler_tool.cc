@@ -0,0 +1,147 @@
+// Compiles header rewrite rules into a binary program file, which the filter loads with
+// program_file instead of compiling its config, and prints the compiled programs with the
+// estimated cost of each rule and diagnostics about the source rules.
+//
+// usage: header_rewrite_compiler [--inline_headers=<name>,...] [--decision_dag] [--max_rule_cost=<cost>]
+//                                <rules file> <program file>
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "header_rewrite.h"
+#include "program_file.h"
+
+#include "envoy/common/exception.h"
+#include "envoy/http/header_map.h"
+
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+namespace {
+
+constexpr absl::string_view Usage =
+    "usage: header_rewrite_compiler [--inline_headers=<name>,...] [--decision_dag] [--max_rule_cost=<cost>] "
+    "<rules file> <program file>\n";
+
+// prints a direction's program, and warns about source rules the optimizer removed and rules
+// costing more than max_rule_cost; returns the number of warnings
+size_t describeDirection(absl::string_view direction, const Program& program,
+                         const std::vector<uint32_t>& rule_positions, uint32_t max_rule_cost,
+                         const std::string& rules_path) {
+  std::vector<bool> compiled(rule_positions.size(), false);
+  std::string out;
+  program.describe(
+      [&rule_positions, &compiled](uint32_t rule_index, std::string& source) {
+        compiled[rule_index] = true;
+        absl::StrAppend(&source, "rule ", rule_positions[rule_index]);
+      },
+      out);
+
+  uint32_t total_cost = 0;
+  size_t warnings = 0;
+  for (size_t i = 0; i < program.ruleCount(); i++) {
+    total_cost += program.ruleCost(i);
+    if (max_rule_cost > 0 && program.ruleCost(i) > max_rule_cost) {
+      std::cerr << rules_path << ": warning: " << direction << " compiled rule " << i << " costs "
+                << program.ruleCost(i) << ", above " << max_rule_cost << "\n";
+      warnings++;
+    }
+  }
+  for (size_t i = 0; i < compiled.size(); i++) {
+    if (!compiled[i]) {
+      std::cerr << rules_path << ": warning: rule " << rule_positions[i]
+                << " was removed by the optimizer, it never applies or is always overwritten\n";
+      warnings++;
+    }
+  }
+  std::cout << direction << ": " << rule_positions.size() << " source rules compiled to " << program.ruleCount()
+            << " rules (" << program.decidedRuleCount() << " decided by the dag), " << program.boolCount()
+            << " bools, total cost " << total_cost << ", " << program.byteSize() << " bytes\n"
+            << out;
+  return warnings;
+}
+
+int compile(int argc, char** argv) {
+  envoy::extensions::filters::http::HeaderRewrite proto_config;
+  uint32_t max_rule_cost = 0;
+  std::vector<std::string> paths;
+  for (int i = 1; i < argc; i++) {
+    absl::string_view arg = argv[i];
+    if (absl::ConsumePrefix(&arg, "--inline_headers=")) {
+      for (const absl::string_view name : absl::StrSplit(arg, ',', absl::SkipEmpty())) {
+        proto_config.add_inline_headers(std::string(name));
+      }
+    } else if (arg == "--decision_dag") {
+      proto_config.set_decision_dag(true);
+    } else if (absl::ConsumePrefix(&arg, "--max_rule_cost=")) {
+      if (!absl::SimpleAtoi(arg, &max_rule_cost)) {
+        std::cerr << Usage;
+        return EXIT_FAILURE;
+      }
+    } else if (absl::StartsWith(arg, "--")) {
+      std::cerr << Usage;
+      return EXIT_FAILURE;
+    } else {
+      paths.emplace_back(arg);
+    }
+  }
+  if (paths.size() != 2) {
+    std::cerr << Usage;
+    return EXIT_FAILURE;
+  }
+
+  std::ifstream rules_file(paths[0]);
+  if (!rules_file) {
+    std::cerr << paths[0] << ": error: unable to read the rules\n";
+    return EXIT_FAILURE;
+  }
+  std::stringstream rules_text;
+  rules_text << rules_file.rdbuf();
+  proto_config.set_config(rules_text.str());
+
+  // the registry of a server is finalized during bootstrap; built-in and statically registered
+  // inline headers are known here, headers registered through the bootstrap are not
+  Http::CustomInlineHeaderRegistry::finalize<Http::CustomInlineHeaderRegistry::Type::RequestHeaders>();
+  Http::CustomInlineHeaderRegistry::finalize<Http::CustomInlineHeaderRegistry::Type::ResponseHeaders>();
+
+  CompiledRulesSharedPtr rules;
+  try {
+    rules = HttpHeaderRewriteFilterConfig::compileRules(proto_config);
+  } catch (const EnvoyException& e) {
+    std::cerr << paths[0] << ": error: " << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
+
+  size_t warnings = describeDirection("http-request", *rules->request_program, rules->request_rule_positions,
+                                      max_rule_cost, paths[0]);
+  warnings += describeDirection("http-response", *rules->response_program, rules->response_rule_positions,
+                                max_rule_cost, paths[0]);
+
+  const std::string content = ProgramFile::write(
+      *rules, {proto_config.inline_headers().begin(), proto_config.inline_headers().end()});
+  std::ofstream program_file(paths[1], std::ios::binary | std::ios::trunc);
+  if (!program_file.write(content.data(), content.size())) {
+    std::cerr << paths[1] << ": error: unable to write the program\n";
+    return EXIT_FAILURE;
+  }
+  std::cout << "wrote " << content.size() << " bytes to " << paths[1] << ", " << warnings << " warnings\n";
+  return EXIT_SUCCESS;
+}
+
+} // namespace
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
+
+int main(int argc, char** argv) { return Envoy::Extensions::HttpFilters::HeaderRewriteFilter::compile(argc, argv); }
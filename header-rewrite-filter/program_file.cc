@@ -0,0 +1,171 @@
+#include "program_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "program_io.h"
+
+#include "source/common/common/hash.h"
+
+#include "absl/strings/str_cat.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+namespace {
+
+void writeDirection(const std::vector<uint32_t>& rule_positions, const HeaderSlotTable& header_slots,
+                    size_t value_slots, const Program& program, ProgramWriter& out) {
+  out.u32(rule_positions.size());
+  for (const uint32_t position : rule_positions) {
+    out.u32(position);
+  }
+  out.u32(header_slots.size());
+  for (size_t slot = 0; slot < header_slots.size(); slot++) {
+    out.string(header_slots.name(slot));
+  }
+  out.u8(header_slots.tracksPresence());
+  out.u32(value_slots);
+  program.serialize(out);
+}
+
+absl::Status readDirection(ProgramReader& in, const InlineHeaderTable& inline_headers, bool is_request,
+                           std::vector<uint32_t>& rule_positions, HeaderSlotTable& header_slots, size_t& value_slots,
+                           std::shared_ptr<const Program>& program) {
+  rule_positions.resize(in.count(4));
+  for (uint32_t& position : rule_positions) {
+    position = in.u32();
+  }
+  const uint32_t header_slot_count = in.count(4);
+  for (uint32_t slot = 0; slot < header_slot_count; slot++) {
+    if (header_slots.add(in.string()) != slot) {
+      return absl::InvalidArgumentError("duplicate header slot");
+    }
+  }
+  if (in.boolean()) {
+    header_slots.trackPresence();
+  }
+  value_slots = in.u32();
+  if (!in.ok()) {
+    return absl::InvalidArgumentError("truncated program");
+  }
+
+  std::unique_ptr<const Program> read;
+  const absl::Status status = Program::deserialize(
+      in, inline_headers, is_request, Program::Limits{rule_positions.size(), header_slots.size(), value_slots}, read);
+  program = std::move(read);
+  return status;
+}
+
+} // namespace
+
+ProgramFile::~ProgramFile() { munmap(mapping_, size_); }
+
+std::string ProgramFile::write(const CompiledRules& rules, const std::vector<std::string>& inline_header_names) {
+  ProgramWriter payload;
+  payload.u32(inline_header_names.size());
+  for (const std::string& name : inline_header_names) {
+    payload.string(name);
+  }
+  writeDirection(rules.request_rule_positions, rules.request_header_slots, rules.request_value_slots,
+                 *rules.request_program, payload);
+  writeDirection(rules.response_rule_positions, rules.response_header_slots, rules.response_value_slots,
+                 *rules.response_program, payload);
+
+  ProgramWriter file;
+  file.u32(Magic);
+  file.u32(Version);
+  file.u64(payload.data().size());
+  file.u64(HashUtil::xxHash64(payload.data()));
+  return file.release() + payload.data();
+}
+
+absl::Status ProgramFile::open(const std::string& path, std::unique_ptr<ProgramFile>& file) {
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return absl::InvalidArgumentError(absl::StrCat("unable to open program file ", path));
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || file_stat.st_size < static_cast<off_t>(HeaderSize)) {
+    ::close(fd);
+    return absl::InvalidArgumentError(absl::StrCat("program file ", path, " is too short"));
+  }
+  const size_t size = file_stat.st_size;
+  void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapping == MAP_FAILED) {
+    return absl::InvalidArgumentError(absl::StrCat("unable to map program file ", path));
+  }
+
+  std::unique_ptr<ProgramFile> mapped(new ProgramFile(mapping, size));
+  const absl::Status status = check(absl::string_view(static_cast<const char*>(mapping), size), mapped->payload_);
+  if (!status.ok()) {
+    return absl::InvalidArgumentError(absl::StrCat("program file ", path, ": ", status.message()));
+  }
+  file = std::move(mapped);
+  return absl::OkStatus();
+}
+
+absl::Status ProgramFile::check(absl::string_view content, absl::string_view& payload) {
+  ProgramReader header(content);
+  if (header.u32() != Magic) {
+    return absl::InvalidArgumentError("not a header rewrite program");
+  }
+  const uint32_t version = header.u32();
+  if (version != Version) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("program format version ", version, " is not supported, recompile it for version ", Version));
+  }
+  const uint64_t size = header.u64();
+  const uint64_t checksum = header.u64();
+  if (!header.ok() || size != content.size() - HeaderSize) {
+    return absl::InvalidArgumentError("truncated program");
+  }
+  payload = content.substr(HeaderSize);
+  if (HashUtil::xxHash64(payload) != checksum) {
+    return absl::InvalidArgumentError("checksum mismatch");
+  }
+  return absl::OkStatus();
+}
+
+absl::Status ProgramFile::read(absl::string_view payload, CompiledRulesSharedPtr& result) {
+  ProgramReader in(payload);
+  // not make_shared, see HttpHeaderRewriteFilterConfig::compileRules
+  std::shared_ptr<CompiledRules> rules(new CompiledRules());
+  auto inline_headers = std::make_shared<InlineHeaderTable>();
+  const uint32_t inline_header_count = in.count(4);
+  for (uint32_t i = 0; i < inline_header_count; i++) {
+    const absl::string_view name = in.string();
+    const absl::Status status = in.ok() ? inline_headers->add(name) : absl::InvalidArgumentError("truncated program");
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  rules->inline_headers = inline_headers;
+  rules->request_set_bool_processors = std::make_shared<std::unordered_map<std::string, SetBoolProcessorSharedPtr>>();
+  rules->response_set_bool_processors = std::make_shared<std::unordered_map<std::string, SetBoolProcessorSharedPtr>>();
+
+  absl::Status status = readDirection(in, *inline_headers, true, rules->request_rule_positions,
+                                      rules->request_header_slots, rules->request_value_slots, rules->request_program);
+  if (status.ok()) {
+    status = readDirection(in, *inline_headers, false, rules->response_rule_positions, rules->response_header_slots,
+                           rules->response_value_slots, rules->response_program);
+  }
+  if (status.ok() && !in.atEnd()) {
+    status = absl::InvalidArgumentError("trailing data after the programs");
+  }
+  if (!status.ok()) {
+    return status;
+  }
+  result = std::move(rules);
+  return absl::OkStatus();
+}
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
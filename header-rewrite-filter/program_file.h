@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "program_cache.h"
+
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+// Binary program file, written by the header_rewrite_compiler tool and loaded by the filter with
+// program_file instead of compiling the rules of its config. A file is a header:
+//
+//   magic "HRWP", format version (u32), payload size (u64), xxHash64 of the payload (u64)
+//
+// followed by the payload: the inline header names the rules were compiled with, then for the
+// request and the response the positions of the source rules, the header slot names, whether
+// presence is tracked, the number of value slots and the program, see Program::serialize.
+// Integers are little endian and programs refer to their parts by index, so that every index can
+// be checked when a file is read; the programs are copied out of the mapping, which is only held
+// while the file is read.
+class ProgramFile {
+public:
+  static constexpr uint32_t Magic = 0x50575248; // "HRWP" in little endian
+  static constexpr uint32_t Version = 1;
+  static constexpr size_t HeaderSize = 24;
+
+  ~ProgramFile();
+
+  // returns the content of a program file holding compiled rules
+  static std::string write(const CompiledRules& rules, const std::vector<std::string>& inline_header_names);
+  // maps a program file read-only, and checks its header and checksum
+  static absl::Status open(const std::string& path, std::unique_ptr<ProgramFile>& file);
+  // checks the header and checksum of the content of a program file, and returns its payload
+  static absl::Status check(absl::string_view content, absl::string_view& payload);
+  // compiled rules from a checked payload; the inline headers must be registered in Envoy
+  static absl::Status read(absl::string_view payload, CompiledRulesSharedPtr& rules);
+
+  // valid while the file is mapped
+  absl::string_view payload() const { return payload_; }
+
+private:
+  ProgramFile(void* mapping, size_t size) : mapping_(mapping), size_(size) {}
+
+  void* const mapping_;
+  const size_t size_;
+  absl::string_view payload_;
+};
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
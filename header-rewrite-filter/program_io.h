@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "absl/strings/string_view.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+// Appends fixed size little endian integers and length prefixed strings, for the binary program
+// format. Nothing written depends on where the program or the file is in memory: programs refer
+// to their parts by index, and inline header handles are written as flags and resolved by name
+// when read.
+class ProgramWriter {
+public:
+  void u8(uint8_t value) { out_.push_back(static_cast<char>(value)); }
+  void u32(uint32_t value) { fixed(value, 4); }
+  void i32(int32_t value) { fixed(static_cast<uint32_t>(value), 4); }
+  void u64(uint64_t value) { fixed(value, 8); }
+  void string(absl::string_view value) {
+    u32(value.size());
+    out_.append(value.data(), value.size());
+  }
+
+  const std::string& data() const { return out_; }
+  std::string release() { return std::move(out_); }
+
+private:
+  void fixed(uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; i++) {
+      out_.push_back(static_cast<char>((value >> (i * 8)) & 0xff));
+    }
+  }
+
+  std::string out_;
+};
+
+// Reads what ProgramWriter wrote. Reading past the end fails the reader, which then returns zeros,
+// so that a truncated program is reported once after reading it rather than at each read.
+class ProgramReader {
+public:
+  explicit ProgramReader(absl::string_view data) : data_(data) {}
+
+  uint8_t u8() { return fixed(1); }
+  uint32_t u32() { return fixed(4); }
+  int32_t i32() { return static_cast<int32_t>(static_cast<uint32_t>(fixed(4))); }
+  uint64_t u64() { return fixed(8); }
+  bool boolean() { return u8() != 0; }
+  absl::string_view string() {
+    const uint32_t size = u32();
+    if (!ok_ || size > data_.size()) {
+      ok_ = false;
+      return {};
+    }
+    const absl::string_view value = data_.substr(0, size);
+    data_.remove_prefix(size);
+    return value;
+  }
+  // reads a count of items that take at least min_item_bytes each, failing if the rest of the data
+  // can't hold them, so that a corrupt count doesn't reserve memory for it
+  uint32_t count(size_t min_item_bytes) {
+    const uint32_t value = u32();
+    if (ok_ && static_cast<uint64_t>(value) * min_item_bytes > data_.size()) {
+      ok_ = false;
+      return 0;
+    }
+    return value;
+  }
+
+  bool ok() const { return ok_; }
+  bool atEnd() const { return data_.empty(); }
+
+private:
+  uint64_t fixed(size_t bytes) {
+    if (!ok_ || data_.size() < bytes) {
+      ok_ = false;
+      return 0;
+    }
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; i++) {
+      value |= static_cast<uint64_t>(static_cast<uint8_t>(data_[i])) << (i * 8);
+    }
+    data_.remove_prefix(bytes);
+    return value;
+  }
+
+  absl::string_view data_;
+  bool ok_ = true;
+};
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
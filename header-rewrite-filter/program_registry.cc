@@ -0,0 +1,65 @@
+#include "program_registry.h"
+
+#include <algorithm>
+
+#include "source/common/common/logger.h"
+
+#include "absl/strings/str_cat.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+ProgramRegistry::ProgramRegistry(OptRef<Server::Admin> admin) : admin_(admin) {
+  if (admin_) {
+    handler_added_ = admin_->addHandler(
+        std::string(AdminPath), "print the compiled header rewrite programs and rule counters",
+        [this](Http::ResponseHeaderMap& response_headers, Buffer::Instance& response,
+               Server::AdminStream& admin_stream) { return handleProgram(response_headers, response, admin_stream); },
+        true, false);
+    if (!handler_added_) {
+      ENVOY_LOG_MISC(error, "header rewrite admin handler {} could not be added, is the path taken?", AdminPath);
+    }
+  }
+}
+
+ProgramRegistry::~ProgramRegistry() {
+  if (handler_added_) {
+    admin_->removeHandler(std::string(AdminPath));
+  }
+}
+
+void ProgramRegistry::add(const HttpHeaderRewriteFilterConfigSharedPtr& config) {
+  configs_.erase(std::remove_if(configs_.begin(), configs_.end(),
+                                [](const auto& weak_config) { return weak_config.expired(); }),
+                 configs_.end());
+  configs_.push_back(config);
+}
+
+void ProgramRegistry::describe(std::string& out) {
+  size_t count = 0;
+  for (const auto& weak_config : configs_) {
+    const auto config = weak_config.lock();
+    if (!config) {
+      continue;
+    }
+    absl::StrAppend(&out, count++ == 0 ? "" : "\n");
+    config->describe(out);
+  }
+  if (count == 0) {
+    absl::StrAppend(&out, "no header rewrite filter configs\n");
+  }
+}
+
+Http::Code ProgramRegistry::handleProgram(Http::ResponseHeaderMap&, Buffer::Instance& response, Server::AdminStream&) {
+  std::string out;
+  describe(out);
+  response.add(out);
+  return Http::Code::OK;
+}
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "header_rewrite.h"
+
+#include "envoy/buffer/buffer.h"
+#include "envoy/http/codes.h"
+#include "envoy/server/admin.h"
+#include "envoy/singleton/instance.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+// Filter configs of the server, listed by the /header_rewrite/program admin handler with their
+// compiled programs and rule counters. One registry is shared through the singleton manager and
+// holds the configs weakly, so it never keeps a config alive or adds work to streams. Used on the
+// main thread only, where filter configs are created and admin requests are handled.
+class ProgramRegistry : public Singleton::Instance {
+public:
+  static constexpr absl::string_view AdminPath = "/header_rewrite/program";
+
+  explicit ProgramRegistry(OptRef<Server::Admin> admin);
+  ~ProgramRegistry() override;
+
+  void add(const HttpHeaderRewriteFilterConfigSharedPtr& config);
+  // appends the description of every live config
+  void describe(std::string& out);
+
+private:
+  Http::Code handleProgram(Http::ResponseHeaderMap& response_headers, Buffer::Instance& response,
+                           Server::AdminStream& admin_stream);
+
+  OptRef<Server::Admin> admin_;
+  bool handler_added_ = false;
+  std::vector<std::weak_ptr<const HttpHeaderRewriteFilterConfig>> configs_;
+};
+
+using ProgramRegistrySharedPtr = std::shared_ptr<ProgramRegistry>;
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -0,0 +1,211 @@
+// Note: this should be run with --compilation_mode=opt, and would benefit from a
+// quiescent system with disabled cstate power management.
+
+#include <string>
+#include <thread>
+
+#include "benchmark/benchmark.h"
+#include "compiled_rules.h"
+#include "header_rewrite.h"
+#include "test/benchmark/main.h"
+#include "test/mocks/server/factory_context.h"
+#include "test/mocks/stream_info/mocks.h"
+#include "test/test_common/utility.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+namespace {
+
+using testing::_;
+using testing::Const;
+using testing::Invoke;
+using testing::NiceMock;
+using testing::ReturnRef;
+
+// one config shared by every benchmark thread, like the workers of a listener share theirs
+const HttpHeaderRewriteFilterConfig& sharedConfig() {
+  static const HttpHeaderRewriteFilterConfigSharedPtr config = [] {
+    std::string rules;
+    for (int i = 0; i < 16; i++) {
+      const std::string n = std::to_string(i);
+      rules += "http-request set-bool tenant_" + n + " %[hdr(x-tenant)] -m str tenant-" + n + "\n";
+      rules += "http-request set-header x-route-" + n + " %[hdr(x-tenant)] if tenant_" + n + " or is_canary\n";
+    }
+    rules = "http-request set-bool is_canary %[hdr(x-canary)] -m found\n" + rules;
+    rules += "http-request set-bool has_version %[urlp(version)] -m found\n";
+    rules += "http-request append-header x-version %[urlp(version)] if has_version\n";
+    rules += "http-request set-header x-static static-value\n";
+    envoy::extensions::filters::http::HeaderRewrite proto_config;
+    proto_config.set_config(rules);
+    static NiceMock<Server::Configuration::MockFactoryContext> context;
+    return std::make_shared<HttpHeaderRewriteFilterConfig>(proto_config, context);
+  }();
+  return *config;
+}
+
+// Executes the request rules on every thread against one shared config, each thread with its own
+// ExecutionContext like a stream. Without shared writes, items per second grow linearly with the
+// number of threads up to the number of cores.
+void bmSharedProgramExecute(benchmark::State& state) {
+  const HttpHeaderRewriteFilterConfig& config = sharedConfig();
+  const Program& program = *config.requestProgram();
+  ExecutionContext context;
+  const Http::TestRequestHeaderMapImpl request_headers{{":method", "GET"},
+                                                       {":path", "/api?version=2"},
+                                                       {":authority", "host"},
+                                                       {"x-tenant", "tenant-7"}};
+  for (auto _ : state) { // NOLINT
+    Http::TestRequestHeaderMapImpl headers = request_headers;
+    context.beginPhase(config.requestHeaderSlots(), headers, config.requestValueSlots());
+    benchmark::DoNotOptimize(program.execute(headers, nullptr, context));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(bmSharedProgramExecute)->ThreadRange(1, std::max(1u, std::thread::hardware_concurrency()))->UseRealTime();
+
+// Hundreds of rules gated on a few shared bools, the shape a decision DAG is meant for
+HttpHeaderRewriteFilterConfigSharedPtr gatedRulesConfig(bool decision_dag) {
+  std::string rules = "http-request set-bool is_api %[hdr(x-api)] -m found\n"
+                      "http-request set-bool is_canary %[hdr(x-canary)] -m found\n";
+  for (int i = 0; i < 64; i++) {
+    const std::string n = std::to_string(i);
+    rules += "http-request set-bool tenant_" + n + " %[hdr(x-tenant)] -m str tenant-" + n + "\n";
+    rules += "http-request set-header x-api-" + n + " a if is_api and tenant_" + n + "\n";
+    rules += "http-request set-header x-web-" + n + " w if not is_api and tenant_" + n + "\n";
+    rules += "http-request set-header x-canary-" + n + " c if is_api and is_canary and tenant_" + n + "\n";
+  }
+  envoy::extensions::filters::http::HeaderRewrite proto_config;
+  proto_config.set_config(rules);
+  proto_config.set_decision_dag(decision_dag);
+  static NiceMock<Server::Configuration::MockFactoryContext> context;
+  return std::make_shared<HttpHeaderRewriteFilterConfig>(proto_config, context);
+}
+
+// Executes the gated rules rule by rule (0) or through the decision DAG (1).
+void bmGatedRules(benchmark::State& state) {
+  const HttpHeaderRewriteFilterConfigSharedPtr config = gatedRulesConfig(state.range(0) != 0);
+  const Program& program = *config->requestProgram();
+  ExecutionContext context;
+  const Http::TestRequestHeaderMapImpl request_headers{
+      {":method", "GET"}, {":path", "/api"}, {":authority", "host"}, {"x-api", "1"}, {"x-tenant", "tenant-42"}};
+  for (auto _ : state) { // NOLINT
+    Http::TestRequestHeaderMapImpl headers = request_headers;
+    context.beginPhase(config->requestHeaderSlots(), headers, config->requestValueSlots());
+    benchmark::DoNotOptimize(program.execute(headers, nullptr, context));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(bmGatedRules)->Arg(0)->Arg(1);
+
+// compiled_rules_example, generated from compiled_rules_example.txt and linked into the benchmark
+const CompiledRulesFactory& exampleRules() {
+  static const CompiledRulesFactory* factory = Registry::FactoryRegistry<CompiledRulesFactory>::getFactory("example");
+  return *factory;
+}
+
+const Http::TestRequestHeaderMapImpl& exampleRequestHeaders() {
+  static const Http::TestRequestHeaderMapImpl headers{{":method", "GET"},
+                                                     {":path", "/v1/items?version=2"},
+                                                     {":authority", "host"},
+                                                     {"user-agent", "Mobile Safari"},
+                                                     {"x-forwarded-for", "10.0.0.1, 10.0.0.2"},
+                                                     {"x-api", "1"},
+                                                     {"x-tenant", "tenant-7"}};
+  return headers;
+}
+
+// Executes the example rules with the interpreter (0) or the code generated from them (1). Both
+// apply the same rules to the same headers, so the difference is the cost of interpreting them.
+void bmCompiledRules(benchmark::State& state) {
+  const CompiledRulesFactory& rules = exampleRules();
+  NiceMock<Server::Configuration::MockFactoryContext> context;
+  envoy::extensions::filters::http::HeaderRewrite proto_config;
+  proto_config.add_inline_headers("user-agent");
+  proto_config.set_config(std::string(rules.source()));
+  const HttpHeaderRewriteFilterConfig interpreted_config(proto_config, context);
+  envoy::extensions::filters::http::HeaderRewriteCompiled compiled_proto_config;
+  compiled_proto_config.set_rules(rules.name());
+  const CompiledRulesFilterConfig compiled_config(compiled_proto_config, context.scope());
+  const CompiledRulesFilterConfig::Direction& direction = compiled_config.request();
+  ExecutionContext execution_context;
+
+  // set-metadata and metadata() need a stream's dynamic metadata, cleared for each request
+  envoy::config::core::v3::Metadata dynamic_metadata;
+  NiceMock<StreamInfo::MockStreamInfo> stream_info;
+  ON_CALL(stream_info, dynamicMetadata()).WillByDefault(ReturnRef(dynamic_metadata));
+  ON_CALL(Const(stream_info), dynamicMetadata()).WillByDefault(ReturnRef(dynamic_metadata));
+  ON_CALL(stream_info, setDynamicMetadata(_, _))
+      .WillByDefault(Invoke([&dynamic_metadata](const std::string& name, const ProtobufWkt::Struct& value) {
+        (*dynamic_metadata.mutable_filter_metadata())[name].MergeFrom(value);
+      }));
+  const auto execute = [&](Http::TestRequestHeaderMapImpl& headers) {
+    dynamic_metadata.Clear();
+    if (state.range(0) == 0) {
+      execution_context.beginPhase(interpreted_config.requestHeaderSlots(), headers,
+                                   interpreted_config.requestValueSlots());
+      return interpreted_config.requestProgram()->execute(headers, &stream_info, execution_context);
+    }
+    execution_context.beginPhase(direction.header_slots, headers, direction.value_slots);
+    CompiledPhase phase{headers, &stream_info, execution_context, direction.inline_headers.data()};
+    return rules.executeRequest(phase);
+  };
+
+  // a failing rule would stop the phase early and leave the last rules unmeasured
+  Http::TestRequestHeaderMapImpl checked_headers = exampleRequestHeaders();
+  if (execute(checked_headers) != ExecutionError::None) {
+    state.SkipWithError("the example rules failed");
+    return;
+  }
+  for (auto _ : state) { // NOLINT
+    Http::TestRequestHeaderMapImpl headers = exampleRequestHeaders();
+    benchmark::DoNotOptimize(execute(headers));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(bmCompiledRules)->Arg(0)->Arg(1);
+
+// A config of about line_count lines: tenants with a bool and three rules each, conditions
+// reading shared bools, and constant response rules that are batched together
+std::string largeConfig(int64_t line_count) {
+  std::string rules = "http-request set-bool is_api %[hdr(x-api)] -m found\n"
+                      "http-request set-bool is_canary %[hdr(x-canary)] -m str true\n";
+  for (int64_t i = 0; i * 4 + 2 < line_count; i++) {
+    const std::string n = std::to_string(i);
+    rules += "http-request set-bool tenant_" + n + " %[hdr(x-tenant)] -m str tenant-" + n + "\n";
+    rules += "http-request set-header x-route-" + n + " %[hdr(x-a,1)] if tenant_" + n + " and is_api or not is_canary\n";
+    rules += "http-request append-header x-via-" + n + " a %[urlp(v)] if tenant_" + n + "\n";
+    rules += "http-response set-header x-resp-" + n + " v" + n + "\n";
+  }
+  return rules;
+}
+
+// Startup cost of a config of line_count lines: parsing its rules (0), or parsing, optimizing
+// and compiling them (1), as a listener does before serving with a new config. Both should grow
+// linearly with the lines; 100k lines should load in well under a second.
+void bmConfigStartup(benchmark::State& state) {
+  if (benchmark::skipExpensiveBenchmarks() && state.range(0) > 1000) {
+    state.SkipWithError("Skipping expensive benchmark");
+    return;
+  }
+
+  envoy::extensions::filters::http::HeaderRewrite proto_config;
+  proto_config.set_config(largeConfig(state.range(0)));
+  state.SetLabel(state.range(1) == 0 ? "parse" : "compile");
+  for (auto _ : state) { // NOLINT
+    if (state.range(1) == 0) {
+      benchmark::DoNotOptimize(HttpHeaderRewriteFilterConfig::parseRules(proto_config.config()));
+    } else {
+      benchmark::DoNotOptimize(HttpHeaderRewriteFilterConfig::compileRules(proto_config));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(bmConfigStartup)->ArgsProduct({{1000, 10000, 100000}, {0, 1}})->Unit(benchmark::kMillisecond);
+
+} // namespace
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -0,0 +1,293 @@
+#include "rule_optimizer.h"
+
+#include <algorithm>
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+namespace {
+
+bool isStatic(const DynamicFunctionProcessorSharedPtr& function_processor) {
+  return function_processor->functionType() == Utility::FunctionType::Static;
+}
+
+bool isNonEmptyStatic(const DynamicFunctionProcessorSharedPtr& function_processor) {
+  return isStatic(function_processor) && !function_processor->functionArgument().empty();
+}
+
+} // namespace
+
+RuleOptimizer::Result RuleOptimizer::optimize(std::vector<HeaderProcessorUniquePtr>& header_processors,
+                                              SetBoolProcessorMap& set_bool_processors, bool is_request,
+                                              InlineHeaderTableSharedPtr inline_headers) {
+  Result result;
+  result.rules_before = header_processors.size();
+  result.bools_before = set_bool_processors.size();
+
+  foldConditions(header_processors, set_bool_processors);
+  eliminateDeadStores(header_processors, set_bool_processors);
+  batchConstants(header_processors, set_bool_processors, is_request, inline_headers);
+  removeUnreferencedBools(header_processors, set_bool_processors);
+  result.value_slots = shareCommonSubexpressions(header_processors, set_bool_processors);
+
+  result.rules_after = header_processors.size();
+  result.bools_after = set_bool_processors.size();
+  return result;
+}
+
+RuleOptimizer::RuleEffects RuleOptimizer::analyze(HeaderProcessor& processor, const SetBoolProcessorMap& set_bool_processors) {
+  RuleEffects effects;
+  const auto add_function = [&effects](const DynamicFunctionProcessorSharedPtr& function_processor) {
+    effects.may_fail = effects.may_fail || function_processor->mayFail();
+    const absl::optional<std::string> input_header = function_processor->inputHeader();
+    if (input_header.has_value()) {
+      effects.reads.insert(input_header.value());
+    }
+  };
+
+  const ConditionProcessorSharedPtr condition_processor = processor.getConditionProcessor();
+  if (condition_processor) {
+    effects.conditional = true;
+    for (const auto& operand : condition_processor->operands()) {
+      const SetBoolProcessorSharedPtr& bool_processor = set_bool_processors.at(std::get<0>(operand));
+      add_function(bool_processor->sourceProcessor());
+      add_function(bool_processor->stringToCompareProcessor());
+    }
+  }
+  processor.forEachDynamicFunction([&add_function](DynamicFunctionProcessorSharedPtr& function_processor) {
+    add_function(function_processor);
+  });
+
+  if (const auto* set_header = dynamic_cast<const SetHeaderProcessor*>(&processor)) {
+    if (isStatic(set_header->headerKey())) {
+      effects.written_header = Http::LowerCaseString(set_header->headerKey()->functionArgument()).get();
+      effects.constant = !effects.conditional && isNonEmptyStatic(set_header->headerValue());
+    } else {
+      effects.writes_other = true;
+    }
+  } else if (const auto* append_header = dynamic_cast<const AppendHeaderProcessor*>(&processor)) {
+    if (isStatic(append_header->headerKey())) {
+      effects.written_header = Http::LowerCaseString(append_header->headerKey()->functionArgument()).get();
+      effects.reads.insert(effects.written_header.value()); // the appended header keeps its value
+      effects.constant = !effects.conditional &&
+                         std::all_of(append_header->headerValues().begin(), append_header->headerValues().end(), isNonEmptyStatic);
+    } else {
+      effects.writes_other = true;
+    }
+  } else if (dynamic_cast<const SetPathProcessor*>(&processor)) {
+    effects.written_header = ":path";
+    effects.reads.insert(":path"); // the query string is preserved
+  } else {
+    // set-metadata fails on empty keys or values, and any other processor is left untouched
+    effects.may_fail = true;
+    effects.writes_other = true;
+  }
+  return effects;
+}
+
+absl::optional<bool> RuleOptimizer::constantCondition(const ConditionProcessor& condition_processor,
+                                                      const SetBoolProcessorMap& set_bool_processors) {
+  // the condition is an OR of AND groups, evaluated the same way as executeOperationRecursively
+  const auto& operators = condition_processor.operators();
+  const auto& operands = condition_processor.operands();
+  bool result = false;
+  bool group_result = true;
+  for (size_t i = 0; i < operands.size(); i++) {
+    const absl::optional<bool> bool_value = set_bool_processors.at(std::get<0>(operands[i]))->constantValue();
+    if (!bool_value.has_value()) {
+      return absl::nullopt;
+    }
+    group_result = group_result && (std::get<1>(operands[i]) ? !bool_value.value() : bool_value.value());
+    if (i == operators.size() || operators[i] == Utility::BooleanOperatorType::Or) {
+      result = result || group_result;
+      group_result = true;
+    }
+  }
+  return result;
+}
+
+void RuleOptimizer::foldConditions(std::vector<HeaderProcessorUniquePtr>& header_processors,
+                                   const SetBoolProcessorMap& set_bool_processors) {
+  std::vector<HeaderProcessorUniquePtr> folded;
+  for (auto& processor : header_processors) {
+    const ConditionProcessorSharedPtr condition_processor = processor->getConditionProcessor();
+    const absl::optional<bool> condition =
+        condition_processor ? constantCondition(*condition_processor, set_bool_processors) : absl::nullopt;
+    if (condition.has_value() && condition.value()) {
+      processor->setConditionProcessor(nullptr);
+    } else if (condition.has_value()) {
+      // set-path evaluates its path even when the condition is false, keep it if that can fail
+      if (!dynamic_cast<SetPathProcessor*>(processor.get()) || !analyze(*processor, set_bool_processors).may_fail) {
+        continue;
+      }
+    }
+    folded.push_back(std::move(processor));
+  }
+  header_processors = std::move(folded);
+}
+
+void RuleOptimizer::eliminateDeadStores(std::vector<HeaderProcessorUniquePtr>& header_processors,
+                                        const SetBoolProcessorMap& set_bool_processors) {
+  // walk backwards, tracking the headers that a later rule overwrites before anything reads them
+  absl::flat_hash_set<std::string> overwritten;
+  std::vector<HeaderProcessorUniquePtr> live;
+  for (auto it = header_processors.rbegin(); it != header_processors.rend(); ++it) {
+    const RuleEffects effects = analyze(**it, set_bool_processors);
+    if (!effects.may_fail && !effects.writes_other && effects.written_header.has_value() &&
+        overwritten.contains(effects.written_header.value())) {
+      continue;
+    }
+
+    if (effects.may_fail) {
+      overwritten.clear(); // the phase may stop here, leaving earlier writes visible
+    }
+    for (const auto& header : effects.reads) {
+      overwritten.erase(header);
+    }
+    if (!effects.may_fail && !effects.conditional && effects.written_header.has_value() &&
+        dynamic_cast<SetHeaderProcessor*>(it->get())) {
+      overwritten.insert(effects.written_header.value());
+    }
+    live.push_back(std::move(*it));
+  }
+  std::reverse(live.begin(), live.end());
+  header_processors = std::move(live);
+}
+
+void RuleOptimizer::batchConstants(std::vector<HeaderProcessorUniquePtr>& header_processors,
+                                   const SetBoolProcessorMap& set_bool_processors, bool is_request,
+                                   InlineHeaderTableSharedPtr inline_headers) {
+  std::vector<HeaderProcessorUniquePtr> batched;
+  ConstantBatchProcessor* batch = nullptr; // batch that constant rules can still move up into
+  absl::flat_hash_set<std::string> touched; // headers read or written since the batch
+  bool touched_all = false;
+
+  for (auto& processor : header_processors) {
+    const RuleEffects effects = analyze(*processor, set_bool_processors);
+    if (!effects.constant) {
+      batched.push_back(std::move(processor));
+      if (!batch) {
+        continue;
+      }
+      if (effects.may_fail) {
+        batch = nullptr; // moving a write above a failing rule would make it visible
+        continue;
+      }
+      touched.insert(effects.reads.begin(), effects.reads.end());
+      if (effects.written_header.has_value()) {
+        touched.insert(effects.written_header.value());
+      }
+      touched_all = touched_all || effects.writes_other;
+      continue;
+    }
+
+    const std::string& header = effects.written_header.value();
+    if (!batch || touched_all || touched.contains(header)) {
+      auto new_batch = std::make_unique<ConstantBatchProcessor>(is_request, inline_headers);
+      batch = new_batch.get();
+      batched.push_back(std::move(new_batch));
+      touched.clear();
+      touched_all = false;
+    }
+    if (const auto* set_header = dynamic_cast<const SetHeaderProcessor*>(processor.get())) {
+      batch->addMutation(header, set_header->headerValue()->functionArgument(), false);
+    } else if (const auto* append_header = dynamic_cast<const AppendHeaderProcessor*>(processor.get())) {
+      for (const auto& header_val : append_header->headerValues()) {
+        batch->addMutation(header, header_val->functionArgument(), true);
+      }
+    }
+    batch->addRuleIndex(processor->ruleIndex());
+  }
+  header_processors = std::move(batched);
+}
+
+void RuleOptimizer::removeUnreferencedBools(std::vector<HeaderProcessorUniquePtr>& header_processors,
+                                            SetBoolProcessorMap& set_bool_processors) {
+  absl::flat_hash_set<std::string> referenced;
+  for (const auto& processor : header_processors) {
+    const ConditionProcessorSharedPtr condition_processor = processor->getConditionProcessor();
+    if (!condition_processor) {
+      continue;
+    }
+    for (const auto& operand : condition_processor->operands()) {
+      referenced.insert(std::get<0>(operand));
+    }
+  }
+
+  for (auto it = set_bool_processors.begin(); it != set_bool_processors.end();) {
+    if (referenced.contains(it->first)) {
+      ++it;
+    } else {
+      it = set_bool_processors.erase(it);
+    }
+  }
+}
+
+size_t RuleOptimizer::shareCommonSubexpressions(std::vector<HeaderProcessorUniquePtr>& header_processors,
+                                                SetBoolProcessorMap& set_bool_processors) {
+  // functions are identified by type and argument, all rules of a direction share is_request
+  absl::flat_hash_map<std::pair<Utility::FunctionType, std::string>, DynamicFunctionProcessorSharedPtr> functions;
+  const auto share_function = [&functions](DynamicFunctionProcessorSharedPtr& function_processor) {
+    auto result = functions.try_emplace(std::make_pair(function_processor->functionType(), function_processor->functionArgument()),
+                                        function_processor);
+    function_processor = result.first->second;
+  };
+  for (auto& processor : header_processors) {
+    processor->forEachDynamicFunction(share_function);
+  }
+  for (auto& set_bool_processor : set_bool_processors) {
+    set_bool_processor.second->forEachDynamicFunction(share_function);
+  }
+
+  // with shared functions, bools with the same definition have the same function instances
+  absl::flat_hash_map<std::tuple<const DynamicFunctionProcessor*, const DynamicFunctionProcessor*, Utility::MatchType>,
+                      SetBoolProcessorSharedPtr> bools;
+  for (auto& set_bool_processor : set_bool_processors) {
+    SetBoolProcessorSharedPtr& bool_processor = set_bool_processor.second;
+    auto result = bools.try_emplace(std::make_tuple(bool_processor->sourceProcessor().get(),
+                                                    bool_processor->stringToCompareProcessor().get(),
+                                                    bool_processor->matchType()),
+                                    bool_processor);
+    bool_processor = result.first->second;
+  }
+
+  // count uses, a value used once gains nothing from the cache
+  absl::flat_hash_map<const void*, size_t> uses;
+  const auto count_function = [&uses](DynamicFunctionProcessorSharedPtr& function_processor) {
+    if (function_processor->functionType() != Utility::FunctionType::Static) {
+      uses[function_processor.get()]++;
+    }
+  };
+  for (auto& processor : header_processors) {
+    processor->forEachDynamicFunction(count_function);
+    const ConditionProcessorSharedPtr condition_processor = processor->getConditionProcessor();
+    if (condition_processor) {
+      for (const auto& operand : condition_processor->operands()) {
+        uses[set_bool_processors.at(std::get<0>(operand)).get()]++;
+      }
+    }
+  }
+  for (const auto& bool_entry : bools) {
+    bool_entry.second->forEachDynamicFunction(count_function);
+  }
+
+  int32_t value_slots = 0;
+  for (const auto& function_entry : functions) {
+    if (uses[function_entry.second.get()] > 1) {
+      function_entry.second->setValueSlot(value_slots++);
+    }
+  }
+  for (const auto& bool_entry : bools) {
+    if (uses[bool_entry.second.get()] > 1) {
+      bool_entry.second->setValueSlot(value_slots++);
+    }
+  }
+  return value_slots;
+}
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "header_processor.h"
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/types/optional.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+using SetBoolProcessorMap = std::unordered_map<std::string, SetBoolProcessorSharedPtr>;
+
+// Config load pass over one direction's parsed rules. The rewritten rules leave every header with
+// the same values as the original ones, and fail at the same rule: a rule that can fail is never
+// removed, and no rule is moved or removed across one. Headers of different names may end up in
+// another order in the header map, as constant writes move above rules writing other headers.
+class RuleOptimizer {
+public:
+  struct Result {
+    size_t rules_before;
+    size_t rules_after;
+    size_t bools_before;
+    size_t bools_after;
+    size_t value_slots; // per-stream value cache size, see ExecutionContext::beginPhase
+  };
+
+  static Result optimize(std::vector<HeaderProcessorUniquePtr>& header_processors, SetBoolProcessorMap& set_bool_processors,
+                         bool is_request, InlineHeaderTableSharedPtr inline_headers);
+
+private:
+  // what executing a rule may do, as far as reordering and removing rules is concerned
+  struct RuleEffects {
+    bool may_fail = false; // the rule or its condition can return an error
+    bool conditional = false;
+    absl::flat_hash_set<std::string> reads; // lowercase names of the headers read
+    absl::optional<std::string> written_header; // lowercase name of the only header written
+    bool writes_other = false; // writes a header with a dynamic name, or metadata
+    bool constant = false; // unconditional set-header/append-header of static, non-empty strings
+  };
+
+  static RuleEffects analyze(HeaderProcessor& processor, const SetBoolProcessorMap& set_bool_processors);
+  static absl::optional<bool> constantCondition(const ConditionProcessor& condition_processor, const SetBoolProcessorMap& set_bool_processors);
+
+  // drop conditions that are always true and rules whose conditions are always false
+  static void foldConditions(std::vector<HeaderProcessorUniquePtr>& header_processors, const SetBoolProcessorMap& set_bool_processors);
+  // drop writes that are overwritten before anything reads them
+  static void eliminateDeadStores(std::vector<HeaderProcessorUniquePtr>& header_processors, const SetBoolProcessorMap& set_bool_processors);
+  // merge constant rules into ConstantBatchProcessors, moving them up past rules that don't touch their
+  // header; a header added by a moved rule then comes before the headers those rules add
+  static void batchConstants(std::vector<HeaderProcessorUniquePtr>& header_processors, const SetBoolProcessorMap& set_bool_processors,
+                             bool is_request, InlineHeaderTableSharedPtr inline_headers);
+  // drop bools that no remaining condition references
+  static void removeUnreferencedBools(std::vector<HeaderProcessorUniquePtr>& header_processors, SetBoolProcessorMap& set_bool_processors);
+  // replace identical dynamic functions and bool definitions by one shared instance, and give the
+  // ones used more than once a per-stream value slot; returns the number of slots
+  static size_t shareCommonSubexpressions(std::vector<HeaderProcessorUniquePtr>& header_processors, SetBoolProcessorMap& set_bool_processors);
+};
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -0,0 +1,127 @@
+#include "rule_stats.h"
+
+#include "absl/strings/str_cat.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+namespace {
+
+void addCounts(const HeaderRewriteRuleStats& stats, const uint64_t* counts) {
+  const std::pair<Stats::Counter*, RuleOutcome> counters[] = {
+      {&stats.evaluated_, RuleEvaluated}, {&stats.condition_true_, RuleConditionTrue},
+      {&stats.condition_false_, RuleConditionFalse}, {&stats.applied_, RuleApplied}, {&stats.errors_, RuleFailed}};
+  for (const auto& counter : counters) {
+    if (counts[counter.second] > 0) {
+      counter.first->add(counts[counter.second]);
+    }
+  }
+}
+
+} // namespace
+
+RuleStats::RuleStats(Stats::Scope& scope, const std::string& prefix, const std::vector<uint32_t>& rule_positions)
+    : total_{ALL_HEADER_REWRITE_RULE_STATS(POOL_COUNTER_PREFIX(scope, prefix))} {
+  rules_.reserve(rule_positions.size());
+  for (const uint32_t position : rule_positions) {
+    const std::string rule_prefix = absl::StrCat(prefix, "rule.", position, ".");
+    rules_.push_back(HeaderRewriteRuleStats{ALL_HEADER_REWRITE_RULE_STATS(POOL_COUNTER_PREFIX(scope, rule_prefix))});
+  }
+}
+
+void RuleStats::flush(std::vector<uint64_t>& counts) const {
+  uint64_t totals[RuleOutcomes] = {};
+  for (size_t i = 0; i < rules_.size(); i++) {
+    uint64_t* rule_counts = &counts[i * RuleOutcomes];
+    addCounts(rules_[i], rule_counts);
+    for (size_t outcome = 0; outcome < RuleOutcomes; outcome++) {
+      totals[outcome] += rule_counts[outcome];
+      rule_counts[outcome] = 0;
+    }
+  }
+  addCounts(total_, totals);
+}
+
+void BoolProfile::add(std::vector<uint64_t>& counts) {
+  for (size_t i = 0; i < counts_.size(); i++) {
+    if (counts[i] > 0) {
+      counts_[i].fetch_add(counts[i], std::memory_order_relaxed);
+      counts[i] = 0;
+    }
+  }
+}
+
+std::vector<double> BoolProfile::takeTrueRates(const std::vector<double>& previous, uint64_t min_evaluations) {
+  std::vector<double> rates(size(), 0.5);
+  for (size_t i = 0; i < size(); i++) {
+    if (i < previous.size()) {
+      rates[i] = previous[i];
+    }
+    const uint64_t true_count = counts_[i * 2].exchange(0, std::memory_order_relaxed);
+    const uint64_t false_count = counts_[i * 2 + 1].exchange(0, std::memory_order_relaxed);
+    if (true_count + false_count >= min_evaluations && true_count + false_count > 0) {
+      rates[i] = static_cast<double>(true_count) / (true_count + false_count);
+    }
+  }
+  return rates;
+}
+
+RuleCounts::RuleCounts(Event::Timer& flush_timer, TimeSource& time_source, const Targets& targets,
+                       uint32_t timing_sample_rate)
+    : request_stats_(targets.request_stats), response_stats_(targets.response_stats),
+      request_profile_(targets.request_profile), response_profile_(targets.response_profile),
+      request_counts_(request_stats_->size() * RuleOutcomes), response_counts_(response_stats_->size() * RuleOutcomes),
+      request_bool_counts_(request_profile_ ? request_profile_->size() * 2 : 0),
+      response_bool_counts_(response_profile_ ? response_profile_->size() * 2 : 0), flush_timer_(flush_timer),
+      time_source_(time_source), timing_sample_rate_(timing_sample_rate), phases_until_sample_(timing_sample_rate) {}
+
+RuleCounts::~RuleCounts() { flush(); }
+
+uint64_t* RuleCounts::pending(std::vector<uint64_t>& counts) {
+  if (!flush_timer_.enabled()) {
+    flush_timer_.enableTimer(FlushInterval);
+  }
+  return counts.data();
+}
+
+bool RuleCounts::sampleTiming() {
+  if (timing_sample_rate_ == 0 || --phases_until_sample_ > 0) {
+    return false;
+  }
+  phases_until_sample_ = timing_sample_rate_;
+  return true;
+}
+
+void RuleCounts::flush() {
+  request_stats_->flush(request_counts_);
+  response_stats_->flush(response_counts_);
+  if (request_profile_) {
+    request_profile_->add(request_bool_counts_);
+  }
+  if (response_profile_) {
+    response_profile_->add(response_bool_counts_);
+  }
+}
+
+WorkerRuleCounts::WorkerRuleCounts(Event::Dispatcher& dispatcher, const std::vector<RuleCounts::Targets>& targets,
+                                   uint32_t timing_sample_rate)
+    : flush_timer_(dispatcher.createTimer([this]() { flush(); })) {
+  counts_.reserve(targets.size());
+  for (const RuleCounts::Targets& config_targets : targets) {
+    counts_.push_back(
+        std::make_unique<RuleCounts>(*flush_timer_, dispatcher.timeSource(), config_targets, timing_sample_rate));
+  }
+}
+
+void WorkerRuleCounts::flush() {
+  for (const auto& counts : counts_) {
+    counts->flush();
+  }
+}
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
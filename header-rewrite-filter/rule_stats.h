@@ -0,0 +1,148 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "execution_context.h"
+
+#include "envoy/common/time.h"
+#include "envoy/event/dispatcher.h"
+#include "envoy/event/timer.h"
+#include "envoy/stats/scope.h"
+#include "envoy/stats/stats_macros.h"
+#include "envoy/thread_local/thread_local.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+/**
+ * Stats of each header rewrite rule, in RuleOutcome order. @see stats_macros.h
+ */
+#define ALL_HEADER_REWRITE_RULE_STATS(COUNTER)                                                     \
+  COUNTER(evaluated)                                                                               \
+  COUNTER(condition_true)                                                                          \
+  COUNTER(condition_false)                                                                         \
+  COUNTER(applied)                                                                                 \
+  COUNTER(errors)
+
+/**
+ * Struct definition for the stats of a rule. @see stats_macros.h
+ */
+struct HeaderRewriteRuleStats {
+  ALL_HEADER_REWRITE_RULE_STATS(GENERATE_COUNTER_STRUCT)
+};
+
+// Counters of the header rules of one direction: their totals, named e.g. <prefix>request.applied,
+// and each rule's by rule index, named after the rule's position in the config counting from 1,
+// e.g. <prefix>request.rule.3.applied.
+class RuleStats {
+public:
+  // prefix includes the direction
+  RuleStats(Stats::Scope& scope, const std::string& prefix, const std::vector<uint32_t>& rule_positions);
+
+  size_t size() const { return rules_.size(); }
+  const HeaderRewriteRuleStats& rule(size_t rule_index) const { return rules_[rule_index]; }
+  // adds counts laid out as RuleOutcomes counters per rule index, and clears them
+  void flush(std::vector<uint64_t>& counts) const;
+
+private:
+  HeaderRewriteRuleStats total_;
+  std::vector<HeaderRewriteRuleStats> rules_;
+};
+
+using RuleStatsSharedPtr = std::shared_ptr<const RuleStats>;
+
+// True and false evaluations of the bools of a direction's program, added by every worker's
+// RuleCounts and taken by the config when it reorders condition operands.
+class BoolProfile {
+public:
+  explicit BoolProfile(size_t bools) : counts_(bools * 2) {}
+
+  size_t size() const { return counts_.size() / 2; }
+  // adds counts laid out as true and false counters per bool index, and clears them
+  void add(std::vector<uint64_t>& counts);
+  // share of true evaluations of each bool since the last call; a bool evaluated fewer than
+  // min_evaluations times keeps its previous rate, or 0.5
+  std::vector<double> takeTrueRates(const std::vector<double>& previous, uint64_t min_evaluations);
+
+private:
+  std::vector<std::atomic<uint64_t>> counts_;
+};
+
+using BoolProfileSharedPtr = std::shared_ptr<BoolProfile>;
+
+// Rule outcomes of a config counted by the streams of one worker, added to the shared counters by a
+// timer on the worker's dispatcher at most once per flush interval, so that executing a phase
+// increments plain integers instead of counters written by every worker. Also decides which phases
+// are timed.
+class RuleCounts {
+public:
+  static constexpr std::chrono::milliseconds FlushInterval{1000};
+
+  // what the counts of a config are added to; the profiles are null unless conditions are
+  // reordered at runtime
+  struct Targets {
+    RuleStatsSharedPtr request_stats;
+    RuleStatsSharedPtr response_stats;
+    BoolProfileSharedPtr request_profile;
+    BoolProfileSharedPtr response_profile;
+  };
+
+  // flush_timer flushes every RuleCounts of the worker, see WorkerRuleCounts
+  RuleCounts(Event::Timer& flush_timer, TimeSource& time_source, const Targets& targets, uint32_t timing_sample_rate);
+  ~RuleCounts();
+
+  // counts for a phase of each direction, to pass to ExecutionContext::beginPhase
+  uint64_t* request() { return pending(request_counts_); }
+  uint64_t* response() { return pending(response_counts_); }
+  // bool counts for a phase of each direction, null without a profile
+  uint64_t* requestBools() { return request_profile_ ? request_bool_counts_.data() : nullptr; }
+  uint64_t* responseBools() { return response_profile_ ? response_bool_counts_.data() : nullptr; }
+  // true for one phase in timing_sample_rate, never if it is 0
+  bool sampleTiming();
+  TimeSource& timeSource() { return time_source_; }
+
+  void flush();
+
+private:
+  uint64_t* pending(std::vector<uint64_t>& counts);
+
+  const RuleStatsSharedPtr request_stats_;
+  const RuleStatsSharedPtr response_stats_;
+  const BoolProfileSharedPtr request_profile_;
+  const BoolProfileSharedPtr response_profile_;
+  std::vector<uint64_t> request_counts_;
+  std::vector<uint64_t> response_counts_;
+  std::vector<uint64_t> request_bool_counts_;
+  std::vector<uint64_t> response_bool_counts_;
+  Event::Timer& flush_timer_;
+  TimeSource& time_source_;
+  const uint32_t timing_sample_rate_;
+  uint32_t phases_until_sample_;
+};
+
+// The RuleCounts of a config and of each of its tenants on one worker, by the index of their
+// Targets, so that any number of tenants share a thread local slot and a flush timer.
+class WorkerRuleCounts : public ThreadLocal::ThreadLocalObject {
+public:
+  WorkerRuleCounts(Event::Dispatcher& dispatcher, const std::vector<RuleCounts::Targets>& targets,
+                   uint32_t timing_sample_rate);
+
+  RuleCounts& get(size_t index) { return *counts_[index]; }
+  void flush();
+
+private:
+  const Event::TimerPtr flush_timer_;
+  // destroyed, and so flushed, before the timer they reference
+  std::vector<std::unique_ptr<RuleCounts>> counts_;
+};
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -0,0 +1,99 @@
+// Generates C++ from header rewrite rules, so that a fixed rule set is compiled into Envoy rather
+// than interpreted. The generated file registers the rules under a name, which the
+// envoy.header_rewrite_compiled filter selects with its rules field; build it with the
+// header_rewrite_compiled_rules() macro rather than running this directly.
+//
+// usage: header_rewrite_codegen --name=<name> [--inline_headers=<name>,...] <rules file> <output file>
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "header_rewrite.h"
+#include "program_codegen.h"
+
+#include "envoy/common/exception.h"
+#include "envoy/http/header_map.h"
+
+#include "absl/strings/match.h"
+#include "absl/strings/str_split.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+namespace {
+
+constexpr absl::string_view Usage =
+    "usage: header_rewrite_codegen --name=<name> [--inline_headers=<name>,...] <rules file> <output file>\n";
+
+int generate(int argc, char** argv) {
+  envoy::extensions::filters::http::HeaderRewrite proto_config;
+  std::string name;
+  std::vector<std::string> paths;
+  for (int i = 1; i < argc; i++) {
+    absl::string_view arg = argv[i];
+    if (absl::ConsumePrefix(&arg, "--inline_headers=")) {
+      for (const absl::string_view header : absl::StrSplit(arg, ',', absl::SkipEmpty())) {
+        proto_config.add_inline_headers(std::string(header));
+      }
+    } else if (absl::ConsumePrefix(&arg, "--name=")) {
+      name = std::string(arg);
+    } else if (absl::StartsWith(arg, "--")) {
+      std::cerr << Usage;
+      return EXIT_FAILURE;
+    } else {
+      paths.emplace_back(arg);
+    }
+  }
+  if (name.empty() || paths.size() != 2) {
+    std::cerr << Usage;
+    return EXIT_FAILURE;
+  }
+
+  std::ifstream rules_file(paths[0]);
+  if (!rules_file) {
+    std::cerr << paths[0] << ": error: unable to read the rules\n";
+    return EXIT_FAILURE;
+  }
+  std::stringstream rules_text;
+  rules_text << rules_file.rdbuf();
+  proto_config.set_config(rules_text.str());
+
+  // as in header_rewrite_compiler, only built-in and statically registered inline headers are
+  // known here; the filter checks that the generated code's are registered when it's loaded
+  Http::CustomInlineHeaderRegistry::finalize<Http::CustomInlineHeaderRegistry::Type::RequestHeaders>();
+  Http::CustomInlineHeaderRegistry::finalize<Http::CustomInlineHeaderRegistry::Type::ResponseHeaders>();
+
+  CompiledRulesSharedPtr rules;
+  try {
+    rules = HttpHeaderRewriteFilterConfig::compileRules(proto_config);
+  } catch (const EnvoyException& e) {
+    std::cerr << paths[0] << ": error: " << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
+
+  std::string content;
+  const absl::Status status = ProgramCodegen::generate(*rules, name, proto_config.config(), content);
+  if (!status.ok()) {
+    std::cerr << paths[0] << ": error: " << status.message() << "\n";
+    return EXIT_FAILURE;
+  }
+  std::ofstream output_file(paths[1], std::ios::trunc);
+  if (!output_file.write(content.data(), content.size())) {
+    std::cerr << paths[1] << ": error: unable to write the generated code\n";
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+} // namespace
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
+
+int main(int argc, char** argv) { return Envoy::Extensions::HttpFilters::HeaderRewriteFilter::generate(argc, argv); }
@@ -0,0 +1,81 @@
+#include "tenant_table.h"
+
+#include <algorithm>
+#include <functional>
+
+#include "absl/strings/ascii.h"
+#include "absl/strings/str_cat.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+namespace {
+
+// the host of an authority, without its port; an IPv6 address keeps its brackets
+absl::string_view hostOf(absl::string_view authority) {
+  if (!authority.empty() && authority.front() == '[') {
+    const size_t end = authority.find(']');
+    return end == absl::string_view::npos ? authority : authority.substr(0, end + 1);
+  }
+  return authority.substr(0, authority.find(':'));
+}
+
+} // namespace
+
+absl::Status TenantTable::add(absl::string_view pattern, uint32_t tenant) {
+  const std::string host = absl::AsciiStrToLower(pattern);
+  if (host.empty() || host.find('*', 1) != std::string::npos || hostOf(host) != host) {
+    return absl::InvalidArgumentError(absl::StrCat("invalid tenant authority: ", pattern));
+  }
+
+  bool added;
+  if (host == "*") {
+    added = !any_.has_value();
+    any_ = added ? tenant : *any_;
+  } else if (host.front() == '*') {
+    const std::string suffix = host.substr(1);
+    added = suffixes_.emplace(suffix, tenant).second;
+    if (added && std::find(suffix_lengths_.begin(), suffix_lengths_.end(), suffix.size()) == suffix_lengths_.end()) {
+      suffix_lengths_.push_back(suffix.size());
+      std::sort(suffix_lengths_.begin(), suffix_lengths_.end(), std::greater<size_t>());
+    }
+  } else {
+    added = exact_.emplace(host, tenant).second;
+  }
+  if (!added) {
+    return absl::InvalidArgumentError(absl::StrCat("duplicate tenant authority: ", pattern));
+  }
+  return absl::OkStatus();
+}
+
+absl::optional<uint32_t> TenantTable::find(absl::string_view authority) const {
+  const absl::string_view host = hostOf(authority);
+  // clients send lowercase hosts, so the common case doesn't copy
+  if (std::any_of(host.begin(), host.end(), absl::ascii_isupper)) {
+    return findHost(absl::AsciiStrToLower(host));
+  }
+  return findHost(host);
+}
+
+absl::optional<uint32_t> TenantTable::findHost(absl::string_view host) const {
+  if (const auto exact = exact_.find(host); exact != exact_.end()) {
+    return exact->second;
+  }
+  for (const size_t length : suffix_lengths_) {
+    // the * matches at least one character
+    if (length >= host.size()) {
+      continue;
+    }
+    if (const auto suffix = suffixes_.find(host.substr(host.size() - length)); suffix != suffixes_.end()) {
+      return suffix->second;
+    }
+  }
+  return any_;
+}
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/optional.h"
+
+namespace Envoy {
+namespace Extensions {
+namespace HttpFilters {
+namespace HeaderRewriteFilter {
+
+// Dispatch of requests to tenants by their :authority. An authority pattern is either an exact host,
+// or a wildcard whose leading * matches one or more characters, e.g. *.example.com, or * alone,
+// which matches any host. Hosts are matched ignoring their port and case; an exact pattern wins
+// over a wildcard, and a longer wildcard over a shorter one. Finding a tenant is one hash lookup
+// for the exact hosts and one per distinct wildcard suffix length, so it doesn't grow with the
+// number of tenants.
+class TenantTable {
+public:
+  // returns an error if the pattern is invalid or already added
+  absl::Status add(absl::string_view pattern, uint32_t tenant);
+  // the tenant serving an authority, if any
+  absl::optional<uint32_t> find(absl::string_view authority) const;
+  bool empty() const { return exact_.empty() && suffixes_.empty() && !any_.has_value(); }
+
+private:
+  absl::optional<uint32_t> findHost(absl::string_view host) const;
+
+  absl::flat_hash_map<std::string, uint32_t> exact_;
+  // wildcards by the suffix following their *
+  absl::flat_hash_map<std::string, uint32_t> suffixes_;
+  // distinct lengths of the wildcard suffixes, longest first
+  std::vector<size_t> suffix_lengths_;
+  absl::optional<uint32_t> any_;
+};
+
+} // namespace HeaderRewriteFilter
+} // namespace HttpFilters
+} // namespace Extensions
+} // namespace Envoy